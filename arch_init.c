@@ -109,8 +109,20 @@ int graphic_depth = 32;
 const uint32_t arch_type = QEMU_ARCH;
 static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
+static int mig_throttle_percentage;
 static void check_guest_throttling(void);
 
+/* Auto-converge throttling: the vcpus are put to sleep for a percentage of
+ * every MIG_THROTTLE_PERIOD_MS.  The percentage starts at
+ * MIG_THROTTLE_INITIAL (30ms out of 40ms, as before the throttle became
+ * adaptive) and grows by MIG_THROTTLE_INCREMENT for as long as the guest
+ * keeps dirtying memory faster than we can send it.
+ */
+#define MIG_THROTTLE_PERIOD_MS  40
+#define MIG_THROTTLE_INITIAL    75
+#define MIG_THROTTLE_INCREMENT  5
+#define MIG_THROTTLE_MAX        95
+
 static uint64_t bitmap_sync_count;
 
 /***********************************************************/
@@ -175,6 +187,8 @@ static struct {
 /* buffer used for XBZRLE decoding */
 static uint8_t *xbzrle_decoded_buf;
 
+static void xbzrle_cache_retire(const PageCache *cache);
+
 static void XBZRLE_cache_lock(void)
 {
     if (migrate_use_xbzrle())
@@ -216,6 +230,7 @@ int64_t xbzrle_cache_resize(int64_t new_size)
             goto out;
         }
 
+        xbzrle_cache_retire(XBZRLE.cache);
         cache_fini(XBZRLE.cache);
         XBZRLE.cache = new_cache;
     }
@@ -238,6 +253,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    /* Counts of the caches that were freed since the migration started */
+    PageCacheStats xbzrle_cache_stats;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -302,6 +319,40 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+static void xbzrle_cache_stats_add(PageCacheStats *stats,
+                                   const PageCache *cache)
+{
+    PageCacheStats cur;
+
+    cache_get_stats(cache, &cur);
+    stats->hits += cur.hits;
+    stats->misses += cur.misses;
+    stats->evictions += cur.evictions;
+}
+
+/* Keeps the counts of a cache that is about to be freed */
+static void xbzrle_cache_retire(const PageCache *cache)
+{
+    xbzrle_cache_stats_add(&acct_info.xbzrle_cache_stats, cache);
+}
+
+/* Hits, misses and evictions of the page cache since migration started */
+void xbzrle_mig_cache_stats(PageCacheStats *stats)
+{
+    *stats = acct_info.xbzrle_cache_stats;
+
+    XBZRLE_cache_lock();
+    if (XBZRLE.cache) {
+        xbzrle_cache_stats_add(stats, XBZRLE.cache);
+    }
+    XBZRLE_cache_unlock();
+}
+
+int mig_throttle_get_percentage(void)
+{
+    return mig_throttle_on ? mig_throttle_percentage : 0;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -434,52 +485,10 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
-{
-    bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
-
-    ret = test_and_set_bit(nr, migration_bitmap);
-
-    if (!ret) {
-        migration_dirty_pages++;
-    }
-    return ret;
-}
-
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
-
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long new_dirty;
-                new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
-                migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
-            }
-        }
-    } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(start + addr,
-                                              TARGET_PAGE_SIZE,
-                                              DIRTY_MEMORY_MIGRATION)) {
-                cpu_physical_memory_reset_dirty(start + addr,
-                                                TARGET_PAGE_SIZE,
-                                                DIRTY_MEMORY_MIGRATION);
-                migration_bitmap_set_dirty(start + addr);
-            }
-        }
-    }
+    migration_dirty_pages +=
+        cpu_physical_memory_sync_dirty_bitmap(migration_bitmap, start, length);
 }
 
 
@@ -532,7 +541,14 @@ static void migration_bitmap_sync(void)
                (num_dirty_pages_period * TARGET_PAGE_SIZE >
                    (bytes_xfer_now - bytes_xfer_prev)/2) &&
                (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
+                    if (!mig_throttle_on) {
+                        mig_throttle_percentage = MIG_THROTTLE_INITIAL;
+                    } else {
+                        mig_throttle_percentage =
+                            MIN(mig_throttle_percentage +
+                                MIG_THROTTLE_INCREMENT, MIG_THROTTLE_MAX);
+                    }
+                    trace_migration_throttle(mig_throttle_percentage);
                     mig_throttle_on = true;
                     dirty_rate_high_cnt = 0;
              }
@@ -730,6 +746,8 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    mig_throttle_on = false;
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
@@ -738,6 +756,7 @@ static void migration_end(void)
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
+        xbzrle_cache_retire(XBZRLE.cache);
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
@@ -771,6 +790,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
     mig_throttle_on = false;
+    mig_throttle_percentage = 0;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
 
@@ -1371,22 +1391,27 @@ TargetInfo *qmp_query_target(Error **errp)
    VM to run inside qemu via async_run_on_cpu()*/
 static void mig_sleep_cpu(void *opq)
 {
+    int64_t sleep_us = (intptr_t)opq;
+
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep(sleep_us);
     qemu_mutex_lock_iothread();
 }
 
 /* To reduce the dirty rate explicitly disallow the VCPUs from spending
    much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
+   Workload will experience a performance drop, which grows with
+   mig_throttle_percentage until the migration converges.
 */
 static void mig_throttle_guest_down(void)
 {
     CPUState *cpu;
+    intptr_t sleep_us = MIG_THROTTLE_PERIOD_MS * 1000 *
+                        mig_throttle_percentage / 100;
 
     qemu_mutex_lock_iothread();
     CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
+        async_run_on_cpu(cpu, mig_sleep_cpu, (void *)sleep_us);
     }
     qemu_mutex_unlock_iothread();
 }
@@ -1407,10 +1432,10 @@ static void check_guest_throttling(void)
 
     t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
+    /* If it has been more than MIG_THROTTLE_PERIOD_MS since the last time
+     * the guest was throttled then do it again.
      */
-    if (40 < (t1-t0)/1000000) {
+    if (MIG_THROTTLE_PERIOD_MS < (t1-t0)/1000000) {
         mig_throttle_guest_down();
         t0 = t1;
     }
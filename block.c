@@ -331,6 +331,15 @@ void bdrv_register(BlockDriver *bdrv)
     QLIST_INSERT_HEAD(&bdrv_drivers, bdrv, list);
 }
 
+/* Source of BlockDriverState.write_gen values */
+static uint64_t bdrv_write_gen_counter;
+
+void bdrv_bump_write_gen(BlockDriverState *bs)
+{
+    /* Devices in different AioContexts may write at the same time */
+    bs->write_gen = atomic_fetch_add(&bdrv_write_gen_counter, 1) + 1;
+}
+
 /* create a new block device (by default it is empty) */
 BlockDriverState *bdrv_new(const char *device_name, Error **errp)
 {
@@ -359,6 +368,8 @@ BlockDriverState *bdrv_new(const char *device_name, Error **errp)
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
     bs->refcnt = 1;
+    bs->aio_context = qemu_get_aio_context();
+    bdrv_bump_write_gen(bs);
 
     return bs;
 }
@@ -1847,17 +1858,6 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     return false;
 }
 
-static bool bdrv_requests_pending_all(void)
-{
-    BlockDriverState *bs;
-    QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
-        if (bdrv_requests_pending(bs)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 /*
  * Wait for pending requests to complete across all BlockDriverStates
  *
@@ -1877,12 +1877,28 @@ void bdrv_drain_all(void)
     BlockDriverState *bs;
 
     while (busy) {
+        bool main_busy = false;
+
+        busy = false;
         QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
+            AioContext *aio_context = bdrv_get_aio_context(bs);
+            bool bs_busy;
+
+            aio_context_acquire(aio_context);
             bdrv_start_throttled_reqs(bs);
+            bs_busy = bdrv_requests_pending(bs);
+            if (aio_context != qemu_get_aio_context()) {
+                /* Devices moved to an IOThread complete their requests there */
+                bs_busy |= aio_poll(aio_context, bs_busy);
+            } else {
+                main_busy |= bs_busy;
+            }
+            aio_context_release(aio_context);
+
+            busy |= bs_busy;
         }
 
-        busy = bdrv_requests_pending_all();
-        busy |= aio_poll(qemu_get_aio_context(), busy);
+        busy |= aio_poll(qemu_get_aio_context(), main_busy);
     }
 }
 
@@ -2724,6 +2740,7 @@ static int bdrv_prwv_co(BlockDriverState *bs, int64_t offset,
                         BdrvRequestFlags flags)
 {
     Coroutine *co;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
     RwCo rwco = {
         .bs = bs,
         .offset = offset,
@@ -2751,7 +2768,7 @@ static int bdrv_prwv_co(BlockDriverState *bs, int64_t offset,
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
     return rwco.ret;
@@ -3314,6 +3331,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_bump_write_gen(bs);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -3497,6 +3515,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     if (bdrv_in_use(bs))
         return -EBUSY;
     ret = drv->bdrv_truncate(bs, offset);
+    bdrv_bump_write_gen(bs);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dev_resize_cb(bs);
@@ -3985,6 +4004,7 @@ int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
                               int nb_sectors, int *pnum)
 {
     Coroutine *co;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
     BdrvCoGetBlockStatusData data = {
         .bs = bs,
         .sector_num = sector_num,
@@ -4000,7 +4020,7 @@ int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
         co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
         qemu_coroutine_enter(co, &data);
         while (!data.done) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
     return data.ret;
@@ -4083,10 +4103,41 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+    BlockDriverState *bs = wco->bs;
+
+    wco->ret = bs->drv->bdrv_write_compressed(bs, wco->sector_num, wco->buf,
+                                              wco->nb_sectors);
+}
+
+/*
+ * Drivers are always called in coroutine context, so that callers like
+ * qemu-img convert can have several compressed writes in flight.
+ */
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_write_compressed)
@@ -4095,8 +4146,19 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+    bdrv_bump_write_gen(bs);
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return wco.ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -4119,6 +4181,39 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+/*
+ * Requests submitted between bdrv_io_plug() and bdrv_io_unplug() may be
+ * held back by the driver and submitted together on unplug.  Calls nest.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
                       int64_t pos, int size)
 {
@@ -4593,7 +4688,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -4635,10 +4730,11 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
     BlockDriverAIOCBCoroutine *acb =
         container_of(blockacb, BlockDriverAIOCBCoroutine, common);
     bool done = false;
+    AioContext *aio_context = bdrv_get_aio_context(blockacb->bs);
 
     acb->done = &done;
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
 }
 
@@ -4675,7 +4771,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, acb->req.flags);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4711,7 +4807,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4738,7 +4834,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4931,6 +5027,7 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
     } else if (bs->file) {
         bdrv_invalidate_cache(bs->file, &local_err);
     }
+    bdrv_bump_write_gen(bs);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
@@ -4969,6 +5066,7 @@ void bdrv_clear_incoming_migration_all(void)
 int bdrv_flush(BlockDriverState *bs)
 {
     Coroutine *co;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
     RwCo rwco = {
         .bs = bs,
         .ret = NOT_DONE,
@@ -4981,7 +5079,7 @@ int bdrv_flush(BlockDriverState *bs)
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
 
@@ -5020,6 +5118,7 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     }
 
     bdrv_reset_dirty(bs, sector_num, nb_sectors);
+    bdrv_bump_write_gen(bs);
 
     /* Do nothing if disabled.  */
     if (!(bs->open_flags & BDRV_O_UNMAP)) {
@@ -5080,6 +5179,7 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
 {
     Coroutine *co;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
     DiscardCo rwco = {
         .bs = bs,
         .sector_num = sector_num,
@@ -5094,7 +5194,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
 
@@ -5546,8 +5646,91 @@ out:
 
 AioContext *bdrv_get_aio_context(BlockDriverState *bs)
 {
-    /* Currently BlockDriverState always uses the main loop AioContext */
-    return qemu_get_aio_context();
+    return bs->aio_context;
+}
+
+/*
+ * Checks whether bs and all images below it can be used outside the main
+ * loop AioContext.  I/O throttling relies on main loop timers and is not
+ * supported.
+ */
+bool bdrv_aio_context_supported(BlockDriverState *bs, Error **errp)
+{
+    if (!bs) {
+        return true;
+    }
+
+    if (bs->drv && !bs->drv->supports_aio_context) {
+        error_setg(errp, "Block format '%s' cannot be used in an IOThread",
+                   bs->drv->format_name);
+        return false;
+    }
+    if (bs->io_limits_enabled) {
+        error_setg(errp, "I/O throttling cannot be used in an IOThread");
+        return false;
+    }
+
+    return bdrv_aio_context_supported(bs->file, errp) &&
+           bdrv_aio_context_supported(bs->backing_hd, errp);
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+
+    bs->aio_context = NULL;
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    bs->aio_context = new_context;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+}
+
+/*
+ * Moves bs and all images below it to new_context.  Requests are drained
+ * first; the caller must hold the AioContext that bs currently uses, and
+ * must have checked bdrv_aio_context_supported() unless new_context is the
+ * main loop AioContext.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    bdrv_drain_all();
+
+    bdrv_detach_aio_context(bs);
+
+    /* This function executes in the old AioContext so acquire the new one in
+     * case it runs in a different thread.
+     */
+    aio_context_acquire(new_context);
+    bdrv_attach_aio_context(bs, new_context);
+    aio_context_release(new_context);
 }
 
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
 
 #include <libaio.h>
 
@@ -19,12 +20,14 @@
  * Queue size (per-device).
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ *      tunable by the guest.  Requests beyond what the kernel ring holds
+ *      wait in the submission queue until earlier ones complete.
  */
 #define MAX_EVENTS 128
 
+/* Maximum number of requests batched into a single io_submit() call */
+#define MAX_QUEUED_IO 128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -33,14 +36,39 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    bool queued;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
+/*
+ * Requests are not submitted right away but collected until the next
+ * iteration of the event loop, so that a burst of requests from the guest
+ * costs a single io_submit() system call.  Requests that don't fit into the
+ * kernel ring stay queued until completions make room (blocked is set).
+ */
+typedef struct {
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+    unsigned int n;
+    int plugged;
+    bool blocked;
+    QEMUBH *bh;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
+    LaioQueue io_q;
+
+    /* Requests submitted to the kernel that haven't completed yet */
+    int in_flight;
+
+    /* Statistics */
+    uint64_t submit_calls;
+    uint64_t submitted_requests;
 };
 
+static void ioq_submit(struct qemu_laio_state *s);
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -83,18 +111,29 @@ static void qemu_laio_completion_cb(EventNotifier *e)
         struct timespec ts = { 0 };
         int nevents, i;
 
+        /* The ring can hold more than MAX_EVENTS completions */
         do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+            do {
+                nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS,
+                                       events, &ts);
+            } while (nevents == -EINTR);
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
-        }
+                s->in_flight--;
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_process_completion(s, laiocb);
+            }
+        } while (nevents == MAX_EVENTS);
+    }
+
+    /* Requests that didn't fit into the ring before may go now */
+    s->io_q.blocked = false;
+    if (!QSIMPLEQ_EMPTY(&s->io_q.pending) && !s->io_q.plugged) {
+        ioq_submit(s);
     }
 }
 
@@ -107,6 +146,18 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Requests that haven't been submitted yet are simply dropped */
+    if (laiocb->queued) {
+        LaioQueue *q = &laiocb->ctx->io_q;
+
+        QSIMPLEQ_REMOVE(&q->pending, laiocb, qemu_laiocb, next);
+        q->n--;
+        laiocb->queued = false;
+        laiocb->ret = -ECANCELED;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -114,6 +165,7 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
      */
     ret = io_cancel(laiocb->ctx->ctx, &laiocb->iocb, &event);
     if (ret == 0) {
+        laiocb->ctx->in_flight--;
         laiocb->ret = -ECANCELED;
         return;
     }
@@ -135,6 +187,94 @@ static const AIOCBInfo laio_aiocb_info = {
     .cancel             = laio_cancel,
 };
 
+/*
+ * Submits the queued requests, at most MAX_QUEUED_IO per io_submit() call.
+ * If the kernel ring is full, the remaining requests stay queued and
+ * qemu_laio_completion_cb() retries once completions have made room.  With
+ * nothing in flight no completion would come, so -EAGAIN then fails the
+ * queued requests like any other error.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    LaioQueue *q = &s->io_q;
+    struct qemu_laiocb *laiocb;
+    int ret, len, i;
+
+    while (!QSIMPLEQ_EMPTY(&q->pending)) {
+        struct iocb *iocbs[MAX_QUEUED_IO];
+
+        len = 0;
+        QSIMPLEQ_FOREACH(laiocb, &q->pending, next) {
+            iocbs[len++] = &laiocb->iocb;
+            if (len == MAX_QUEUED_IO) {
+                break;
+            }
+        }
+
+        do {
+            ret = io_submit(s->ctx, len, iocbs);
+        } while (ret == -EINTR);
+
+        if (ret == -EAGAIN && s->in_flight > 0) {
+            q->blocked = true;
+            return;
+        }
+
+        if (ret < 0) {
+            /* Callbacks may queue new requests, so empty the queue first */
+            QSIMPLEQ_HEAD(, qemu_laiocb) failed =
+                QSIMPLEQ_HEAD_INITIALIZER(failed);
+
+            QSIMPLEQ_CONCAT(&failed, &q->pending);
+            q->n = 0;
+            QSIMPLEQ_FOREACH(laiocb, &failed, next) {
+                laiocb->queued = false;
+            }
+            while (!QSIMPLEQ_EMPTY(&failed)) {
+                laiocb = QSIMPLEQ_FIRST(&failed);
+                QSIMPLEQ_REMOVE_HEAD(&failed, next);
+                laiocb->ret = ret;
+                qemu_laio_process_completion(s, laiocb);
+            }
+            return;
+        }
+
+        for (i = 0; i < ret; i++) {
+            laiocb = QSIMPLEQ_FIRST(&q->pending);
+            QSIMPLEQ_REMOVE_HEAD(&q->pending, next);
+            laiocb->queued = false;
+        }
+        q->n -= ret;
+        s->in_flight += ret;
+        s->submit_calls++;
+        s->submitted_requests += ret;
+    }
+}
+
+static void ioq_submit_bh(void *opaque)
+{
+    ioq_submit(opaque);
+}
+
+static void ioq_enqueue(struct qemu_laio_state *s, struct qemu_laiocb *laiocb)
+{
+    LaioQueue *q = &s->io_q;
+
+    /* While plugged, the queue is submitted on unplug */
+    if (QSIMPLEQ_EMPTY(&q->pending) && !q->plugged && !q->blocked) {
+        qemu_bh_schedule(q->bh);
+    }
+
+    laiocb->queued = true;
+    QSIMPLEQ_INSERT_TAIL(&q->pending, laiocb, next);
+    q->n++;
+
+    /* Don't let a full batch wait for the bottom half */
+    if (q->n >= MAX_QUEUED_IO && !q->blocked) {
+        ioq_submit(s);
+    }
+}
+
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -168,8 +308,7 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     }
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_free_aiocb;
+    ioq_enqueue(s, laiocb);
     return &laiocb->common;
 
 out_free_aiocb:
@@ -177,6 +316,51 @@ out_free_aiocb:
     return NULL;
 }
 
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && !QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+        !s->io_q.blocked) {
+        ioq_submit(s);
+    }
+}
+
+void laio_get_stats(void *aio_ctx, uint64_t *submit_calls,
+                    uint64_t *submitted_requests)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    *submit_calls = s->submit_calls;
+    *submitted_requests = s->submitted_requests;
+}
+
+void laio_detach_aio_context(void *aio_ctx, AioContext *old_context)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(QSIMPLEQ_EMPTY(&s->io_q.pending));
+    aio_set_event_notifier(old_context, &s->e, NULL);
+    qemu_bh_delete(s->io_q.bh);
+    s->io_q.bh = NULL;
+}
+
+void laio_attach_aio_context(void *aio_ctx, AioContext *new_context)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.bh = aio_bh_new(new_context, ioq_submit_bh, s);
+    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -190,6 +374,8 @@ void *laio_init(void)
         goto out_close_efd;
     }
 
+    QSIMPLEQ_INIT(&s->io_q.pending);
+    s->io_q.bh = qemu_bh_new(ioq_submit_bh, s);
     qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb);
 
     return s;
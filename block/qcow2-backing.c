@@ -0,0 +1,289 @@
+/*
+ * Backing chain map for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "block/block_int.h"
+#include "qemu-common.h"
+#include "qcow2.h"
+
+/* Chunks are never smaller than this, to bound the size of the map */
+#define BACKING_MAP_MIN_CHUNK_SIZE 65536
+
+void qcow2_backing_map_free(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BackingMap *map = s->backing_map;
+
+    if (!map) {
+        return;
+    }
+
+    g_free(map->owner);
+    g_free(map->layers);
+    g_free(map->layer_gens);
+    g_free(map);
+    s->backing_map = NULL;
+}
+
+/*
+ * Returns the backing map of bs, or NULL if reads must walk the backing chain
+ * as usual.  The map is created on first use and discarded whenever the
+ * backing chain, the size of bs or the contents of any backing file may have
+ * changed.  Doesn't yield.
+ */
+static Qcow2BackingMap *backing_map_get(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BackingMap *map = s->backing_map;
+    BlockDriverState *layer;
+    bool valid;
+    int depth, i;
+
+    depth = 0;
+    for (layer = bs->backing_hd; layer; layer = layer->backing_hd) {
+        /* Reading a lower layer directly would skip populating this one */
+        if (layer->copy_on_read || ++depth > QCOW2_BACKING_MAX_DEPTH) {
+            return NULL;
+        }
+    }
+    if (depth == 0) {
+        return NULL;
+    }
+
+    if (!map) {
+        map = s->backing_map = g_new0(Qcow2BackingMap, 1);
+        map->chunk_sectors = MAX(s->cluster_size, BACKING_MAP_MIN_CHUNK_SIZE)
+                             >> BDRV_SECTOR_BITS;
+        map->total_sectors = -1;
+    }
+
+    valid = map->total_sectors == bs->total_sectors && map->depth == depth;
+    for (i = 0, layer = bs->backing_hd; valid && layer;
+         i++, layer = layer->backing_hd)
+    {
+        valid = map->layers[i] == layer &&
+                map->layer_gens[i] == layer->write_gen;
+    }
+    if (valid) {
+        return map;
+    }
+
+    if (map->total_sectors != -1) {
+        map->invalidations++;
+    }
+    map->generation++;
+
+    if (map->total_sectors != bs->total_sectors) {
+        map->total_sectors = bs->total_sectors;
+        map->nb_chunks = DIV_ROUND_UP(bs->total_sectors, map->chunk_sectors);
+        g_free(map->owner);
+        map->owner = g_malloc(map->nb_chunks);
+    }
+    memset(map->owner, QCOW2_BACKING_UNKNOWN, map->nb_chunks);
+
+    if (map->depth != depth) {
+        map->depth = depth;
+        map->layers = g_renew(BlockDriverState *, map->layers, depth);
+        map->layer_gens = g_renew(uint64_t, map->layer_gens, depth);
+    }
+    for (i = 0, layer = bs->backing_hd; layer; i++, layer = layer->backing_hd) {
+        map->layers[i] = layer;
+        map->layer_gens[i] = layer->write_gen;
+    }
+
+    return map;
+}
+
+/*
+ * Finds the image in the backing chain of bs that contains the data for the
+ * nb_sectors sectors at sector_num, which are unallocated in bs itself.
+ */
+static int coroutine_fn backing_map_resolve(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors)
+{
+    BlockDriverState *layer;
+    int depth, pnum, ret;
+
+    depth = 1;
+    for (layer = bs->backing_hd; layer; layer = layer->backing_hd, depth++) {
+        /* The image above reads zeroes beyond the end of its backing file */
+        if (sector_num >= layer->total_sectors) {
+            return QCOW2_BACKING_ZERO;
+        } else if (sector_num + nb_sectors > layer->total_sectors) {
+            return QCOW2_BACKING_MIXED;
+        }
+
+        ret = bdrv_is_allocated(layer, sector_num, nb_sectors, &pnum);
+        if (ret < 0 || pnum < nb_sectors) {
+            return QCOW2_BACKING_MIXED;
+        } else if (ret) {
+            return depth;
+        }
+    }
+
+    return QCOW2_BACKING_ZERO;
+}
+
+/*
+ * Returns the owner of the given chunk, resolving it if it isn't known yet.
+ * May yield; the result is only meaningful if map->generation hasn't changed
+ * meanwhile.
+ */
+static int coroutine_fn backing_map_lookup(BlockDriverState *bs,
+                                           Qcow2BackingMap *map, int64_t chunk)
+{
+    int64_t sector_num = chunk * map->chunk_sectors;
+    uint64_t generation = map->generation;
+    int owner = map->owner[chunk];
+
+    if (owner == QCOW2_BACKING_UNKNOWN) {
+        map->misses++;
+        owner = backing_map_resolve(bs, sector_num,
+                                    MIN(map->chunk_sectors,
+                                        map->total_sectors - sector_num));
+        if (map->generation != generation) {
+            return QCOW2_BACKING_MIXED;
+        }
+        map->owner[chunk] = owner;
+    }
+
+    return owner;
+}
+
+/*
+ * Reads nb_sectors sectors at sector_num, which are unallocated in bs, from
+ * the backing chain of bs.  Areas whose data is known to be in one image of
+ * the chain are read directly from that image.
+ *
+ * Must be called without s->lock held.
+ */
+int coroutine_fn qcow2_co_read_backing(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BackingMap *map;
+    QEMUIOVector local_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    if (!s->use_backing_map) {
+        return bdrv_co_readv(bs->backing_hd, sector_num, nb_sectors, qiov);
+    }
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+
+    while (nb_sectors > 0) {
+        BlockDriverState *layer;
+        uint64_t generation;
+        int64_t chunk, chunk_end;
+        int owner, n, i;
+
+        /* The chain may have changed while the previous part was read */
+        map = backing_map_get(bs);
+        if (!map) {
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, bytes_done,
+                              nb_sectors * BDRV_SECTOR_SIZE);
+            ret = bdrv_co_readv(bs->backing_hd, sector_num, nb_sectors,
+                                &local_qiov);
+            break;
+        }
+
+        generation = map->generation;
+        chunk = sector_num / map->chunk_sectors;
+        chunk_end = (chunk + 1) * map->chunk_sectors;
+
+        /* Chunks with the same owner are read in one request */
+        owner = backing_map_lookup(bs, map, chunk);
+        while (chunk_end < sector_num + nb_sectors &&
+               map->generation == generation &&
+               backing_map_lookup(bs, map, ++chunk) == owner)
+        {
+            chunk_end += map->chunk_sectors;
+        }
+        if (map->generation != generation) {
+            owner = QCOW2_BACKING_MIXED;
+        }
+        n = MIN(nb_sectors, chunk_end - sector_num);
+
+        map->lookups++;
+        if (owner == QCOW2_BACKING_ZERO) {
+            map->zero_lookups++;
+        } else if (owner == QCOW2_BACKING_MIXED) {
+            map->mixed_lookups++;
+        } else {
+            map->total_depth += owner;
+        }
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done,
+                          n * BDRV_SECTOR_SIZE);
+
+        switch (owner) {
+        case QCOW2_BACKING_ZERO:
+            qemu_iovec_memset(&local_qiov, 0, 0, n * BDRV_SECTOR_SIZE);
+            break;
+        case QCOW2_BACKING_MIXED:
+            ret = bdrv_co_readv(bs->backing_hd, sector_num, n, &local_qiov);
+            break;
+        default:
+            layer = bs->backing_hd;
+            for (i = 1; i < owner; i++) {
+                layer = layer->backing_hd;
+            }
+            ret = bdrv_co_readv(layer, sector_num, n, &local_qiov);
+            break;
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+Qcow2BackingMapStats *qcow2_backing_map_get_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BackingMap *map = s->backing_map;
+    Qcow2BackingMapStats *stats;
+
+    if (!map) {
+        return NULL;
+    }
+
+    stats = g_new0(Qcow2BackingMapStats, 1);
+    stats->chain_depth = map->depth;
+    stats->lookups = map->lookups;
+    stats->misses = map->misses;
+    stats->zero_lookups = map->zero_lookups;
+    stats->mixed_lookups = map->mixed_lookups;
+    stats->total_depth = map->total_depth;
+    stats->invalidations = map->invalidations;
+
+    return stats;
+}
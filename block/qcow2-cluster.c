@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -356,23 +357,21 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
     }
 }
 
-static int coroutine_fn copy_sectors(BlockDriverState *bs,
-                                     uint64_t start_sect,
-                                     uint64_t cluster_offset,
-                                     int n_start, int n_end)
+/*
+ * Reads n guest sectors starting at start_sect + n_start into buf, encrypted
+ * for writing them to the image file if the image is encrypted.
+ */
+static int coroutine_fn read_cow_sectors(BlockDriverState *bs,
+                                         uint64_t start_sect,
+                                         int n_start, int n, void *buf)
 {
     BDRVQcowState *s = bs->opaque;
     QEMUIOVector qiov;
     struct iovec iov;
-    int n, ret;
-
-    n = n_end - n_start;
-    if (n <= 0) {
-        return 0;
-    }
+    int ret;
 
     iov.iov_len = n * BDRV_SECTOR_SIZE;
-    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    iov.iov_base = buf;
 
     qemu_iovec_init_external(&qiov, &iov, 1);
 
@@ -388,15 +387,42 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
      */
     ret = bs->drv->bdrv_co_readv(bs, start_sect + n_start, n, &qiov);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
     if (s->crypt_method) {
         qcow2_encrypt_sectors(s, start_sect + n_start,
-                        iov.iov_base, iov.iov_base, n, 1,
+                        buf, buf, n, 1,
                         &s->aes_encrypt_key);
     }
 
+    return 0;
+}
+
+static int coroutine_fn copy_sectors(BlockDriverState *bs,
+                                     uint64_t start_sect,
+                                     uint64_t cluster_offset,
+                                     int n_start, int n_end)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    n = n_end - n_start;
+    if (n <= 0) {
+        return 0;
+    }
+
+    iov.iov_len = n * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = read_cow_sectors(bs, start_sect, n_start, n, iov.iov_base);
+    if (ret < 0) {
+        goto out;
+    }
+
     ret = qcow2_pre_write_overlap_check(bs, 0,
             cluster_offset + n_start * BDRV_SECTOR_SIZE, n * BDRV_SECTOR_SIZE);
     if (ret < 0) {
@@ -662,19 +688,44 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     return cluster_offset;
 }
 
+/*
+ * Writes the COW region r of the allocation m to the new cluster, either by
+ * copying the guest data or, if it is known to be zero, by zeroing the area.
+ */
+static int coroutine_fn do_cow(BlockDriverState *bs, QCowL2Meta *m,
+                               Qcow2COWRegion *r)
+{
+    uint64_t offset = m->alloc_offset + r->offset;
+    int ret;
+
+    if (!r->zero) {
+        return copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
+                            r->offset / BDRV_SECTOR_SIZE,
+                            r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                        r->nb_sectors * BDRV_SECTOR_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+    return bdrv_co_write_zeroes(bs->file, offset >> BDRV_SECTOR_BITS,
+                                r->nb_sectors, 0);
+}
+
 static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
 {
     BDRVQcowState *s = bs->opaque;
     int ret;
 
-    if (r->nb_sectors == 0) {
+    if (r->nb_sectors == 0 || r->done || r->skip) {
         return 0;
     }
 
     qemu_co_mutex_unlock(&s->lock);
-    ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
-                       r->offset / BDRV_SECTOR_SIZE,
-                       r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
+    ret = do_cow(bs, m, r);
     qemu_co_mutex_lock(&s->lock);
 
     if (ret < 0) {
@@ -691,6 +742,319 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+typedef struct Qcow2CowCo {
+    BlockDriverState *bs;
+    QCowL2Meta *m;
+    Qcow2COWRegion *r;
+} Qcow2CowCo;
+
+static void coroutine_fn qcow2_cow_entry(void *opaque)
+{
+    Qcow2CowCo *cow = opaque;
+    BDRVQcowState *s = cow->bs->opaque;
+    QCowL2Meta *m = cow->m;
+    Qcow2COWRegion *r = cow->r;
+
+    r->ret = do_cow(cow->bs, m, r);
+    r->done = r->ret >= 0;
+    r->in_flight = false;
+    s->cow_in_flight--;
+    g_free(cow);
+
+    if (r->waiter) {
+        qemu_coroutine_enter(r->waiter, NULL);
+    }
+}
+
+/*
+ * Returns true if the guest data in the COW region r of the allocation m is
+ * known to read as zeroes, so it doesn't have to be read for the copy.
+ */
+static bool cow_region_is_zero(BlockDriverState *bs, QCowL2Meta *m,
+                               Qcow2COWRegion *r)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = m->offset + r->offset;
+    uint64_t cluster_offset;
+    int nb_sectors = r->nb_sectors;
+    int ret;
+
+    /* Encrypted zeroes aren't zeroes in the image file */
+    if (s->crypt_method) {
+        return false;
+    }
+
+    ret = qcow2_get_cluster_offset(bs, offset, &nb_sectors, &cluster_offset);
+    if (ret < 0 || nb_sectors < r->nb_sectors) {
+        return false;
+    }
+
+    switch (ret) {
+    case QCOW2_CLUSTER_ZERO:
+        return true;
+    case QCOW2_CLUSTER_UNALLOCATED:
+        return !bs->backing_hd ||
+               offset >> BDRV_SECTOR_BITS >= bs->backing_hd->total_sectors;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Decides how the COW regions of the allocations in m are written after the
+ * guest data has been placed at host offset data_offset:
+ *
+ * - Regions that read as zeroes and start beyond the end of the image file
+ *   aren't written at all, the file reads as zeroes there anyway
+ * - Regions directly before or after the guest data are written together
+ *   with it in one request by qcow2_co_writev_cow()
+ * - All other regions are copied separately; if they are zero, the area is
+ *   zeroed instead of copied
+ *
+ * Must be called with s->lock held.
+ */
+void qcow2_cow_prepare(BlockDriverState *bs, QCowL2Meta *m,
+                       uint64_t data_offset, int nb_sectors)
+{
+    uint64_t data_end = data_offset + nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t file_length = -1;
+
+    for (; m != NULL; m = m->next) {
+        Qcow2COWRegion *regions[] = { &m->cow_start, &m->cow_end };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(regions); i++) {
+            Qcow2COWRegion *r = regions[i];
+            uint64_t start = m->alloc_offset + r->offset;
+            uint64_t end = start + r->nb_sectors * BDRV_SECTOR_SIZE;
+
+            if (r->nb_sectors == 0) {
+                continue;
+            }
+
+            r->zero = cow_region_is_zero(bs, m, r);
+            if (r->zero) {
+                if (file_length < 0) {
+                    file_length = bdrv_getlength(bs->file);
+                }
+                if (file_length >= 0 && start >= file_length) {
+                    r->skip = true;
+                    continue;
+                }
+            }
+
+            r->merge = end == data_offset || start == data_end;
+        }
+    }
+}
+
+/*
+ * Fills buf with the data of the COW region r of the allocation m.  Must be
+ * called without holding s->lock.
+ */
+static int coroutine_fn read_cow_region(BlockDriverState *bs, QCowL2Meta *m,
+                                        Qcow2COWRegion *r, void *buf)
+{
+    if (r->zero) {
+        /* Nothing to read, but keep the event for blkdebug breakpoints */
+        BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
+        if (!bs->drv) {
+            return -ENOMEDIUM;
+        }
+        memset(buf, 0, r->nb_sectors * BDRV_SECTOR_SIZE);
+        return 0;
+    }
+
+    return read_cow_sectors(bs, m->offset / BDRV_SECTOR_SIZE,
+                            r->offset / BDRV_SECTOR_SIZE, r->nb_sectors, buf);
+}
+
+/*
+ * Writes the guest data in qiov to host offset data_offset in the image file.
+ * The COW regions of the allocations in m that qcow2_cow_prepare() found to
+ * be adjacent to the guest data are written in the same request, so that a
+ * small write into a new cluster usually takes a single write to the image
+ * file.  Must be called without holding s->lock.
+ */
+int coroutine_fn qcow2_co_writev_cow(BlockDriverState *bs, QCowL2Meta *m,
+                                     uint64_t data_offset, int nb_sectors,
+                                     QEMUIOVector *qiov)
+{
+    QCowL2Meta *head_m = NULL, *tail_m = NULL;
+    Qcow2COWRegion *head = NULL, *tail = NULL;
+    void *head_buf = NULL, *tail_buf = NULL;
+    QEMUIOVector merged_qiov;
+    int ret;
+
+    for (; m != NULL; m = m->next) {
+        Qcow2COWRegion *regions[] = { &m->cow_start, &m->cow_end };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(regions); i++) {
+            Qcow2COWRegion *r = regions[i];
+
+            if (!r->merge) {
+                continue;
+            }
+            if (m->alloc_offset + r->offset < data_offset) {
+                head_m = m;
+                head = r;
+            } else {
+                tail_m = m;
+                tail = r;
+            }
+        }
+    }
+
+    /* Regions that aren't written here are copied when linking the L2 table */
+    if ((!head && !tail) || qiov->niov > IOV_MAX - 2) {
+        return bdrv_co_writev(bs->file, data_offset >> BDRV_SECTOR_BITS,
+                              nb_sectors, qiov);
+    }
+
+    qemu_iovec_init(&merged_qiov, qiov->niov + 2);
+
+    if (head) {
+        head_buf = qemu_blockalign(bs, head->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = read_cow_region(bs, head_m, head, head_buf);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = qcow2_pre_write_overlap_check(bs, 0,
+                head_m->alloc_offset + head->offset,
+                head->nb_sectors * BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            goto out;
+        }
+        qemu_iovec_add(&merged_qiov, head_buf,
+                       head->nb_sectors * BDRV_SECTOR_SIZE);
+        data_offset -= head->nb_sectors * BDRV_SECTOR_SIZE;
+        nb_sectors += head->nb_sectors;
+    }
+
+    qemu_iovec_concat(&merged_qiov, qiov, 0, qiov->size);
+
+    if (tail) {
+        tail_buf = qemu_blockalign(bs, tail->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = read_cow_region(bs, tail_m, tail, tail_buf);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = qcow2_pre_write_overlap_check(bs, 0,
+                tail_m->alloc_offset + tail->offset,
+                tail->nb_sectors * BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            goto out;
+        }
+        qemu_iovec_add(&merged_qiov, tail_buf,
+                       tail->nb_sectors * BDRV_SECTOR_SIZE);
+        nb_sectors += tail->nb_sectors;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+    ret = bdrv_co_writev(bs->file, data_offset >> BDRV_SECTOR_BITS,
+                         nb_sectors, &merged_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (head) {
+        head->done = true;
+    }
+    if (tail) {
+        tail->done = true;
+    }
+    ret = 0;
+
+out:
+    qemu_iovec_destroy(&merged_qiov);
+    qemu_vfree(head_buf);
+    qemu_vfree(tail_buf);
+    return ret;
+}
+
+/*
+ * Starts the copy on write for all COW regions of the allocations in m.
+ *
+ * The regions don't overlap with the area the guest writes to, so the copies
+ * can run in parallel with the guest data write instead of only after it.
+ * The caller must wait for them with qcow2_cow_wait() without holding
+ * s->lock before linking the clusters into the L2 table.
+ *
+ * At most MAX_CONCURRENT_COW copies are started; regions that are left out
+ * are copied by qcow2_alloc_cluster_link_l2() as usual.
+ */
+void qcow2_cow_start(BlockDriverState *bs, QCowL2Meta *m)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    for (; m != NULL; m = m->next) {
+        Qcow2COWRegion *regions[] = { &m->cow_start, &m->cow_end };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(regions); i++) {
+            Qcow2COWRegion *r = regions[i];
+            Qcow2CowCo *cow;
+            Coroutine *co;
+
+            if (r->nb_sectors == 0 || r->done || r->in_flight ||
+                r->skip || r->merge) {
+                continue;
+            }
+            if (s->cow_in_flight >= MAX_CONCURRENT_COW) {
+                return;
+            }
+
+            cow = g_new(Qcow2CowCo, 1);
+            *cow = (Qcow2CowCo) {
+                .bs = bs,
+                .m  = m,
+                .r  = r,
+            };
+            r->in_flight = true;
+            s->cow_in_flight++;
+            r->waiter = NULL;
+            r->ret = 0;
+            co = qemu_coroutine_create(qcow2_cow_entry);
+            qemu_coroutine_enter(co, cow);
+        }
+    }
+}
+
+/*
+ * Waits for the copies started by qcow2_cow_start() for the allocation m
+ * (not the whole list) and returns the first error.  Must be called without
+ * holding s->lock.
+ */
+int qcow2_cow_wait(BlockDriverState *bs, QCowL2Meta *m)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2COWRegion *regions[] = { &m->cow_start, &m->cow_end };
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(regions); i++) {
+        Qcow2COWRegion *r = regions[i];
+
+        if (r->in_flight) {
+            r->waiter = qemu_coroutine_self();
+            qemu_coroutine_yield();
+            r->waiter = NULL;
+            assert(!r->in_flight);
+        }
+
+        if (r->ret < 0 && ret == 0) {
+            ret = r->ret;
+        }
+        if (r->done) {
+            /* See perform_cow() */
+            qcow2_cache_depends_on_flush(s->l2_table_cache);
+        }
+    }
+
+    return ret;
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1319,28 +1683,212 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+void qcow2_compressed_cache_create(BlockDriverState *bs, int num_clusters)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
+    int i;
+
+    s->compressed_cache = g_new0(Qcow2CompressedCluster, num_clusters);
+    s->compressed_cache_size = num_clusters;
+    for (i = 0; i < num_clusters; i++) {
+        s->compressed_cache[i].offset = -1;
+        qemu_co_queue_init(&s->compressed_cache[i].waiters);
+    }
+    qemu_co_queue_init(&s->compressed_cache_queue);
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    if (!s->compressed_cache) {
+        return;
+    }
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        assert(!s->compressed_cache[i].in_flight);
+        g_free(s->compressed_cache[i].data);
+    }
+    g_free(s->compressed_cache);
+    s->compressed_cache = NULL;
+}
+
+/*
+ * Forgets the cached decompressed data of the compressed cluster at host
+ * offset coffset.  Must be called when the cluster is freed and before new
+ * compressed data is written there.
+ */
+void qcow2_compressed_cache_drop(BlockDriverState *bs, uint64_t coffset)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        if (s->compressed_cache[i].offset == coffset) {
+            s->compressed_cache[i].offset = -1;
+        }
+    }
+}
+
+Qcow2CacheStats *qcow2_compressed_cache_get_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheStats *stats = g_new0(Qcow2CacheStats, 1);
+
+    stats->size = (int64_t) s->compressed_cache_size * s->cluster_size;
+    stats->hits = s->compressed_cache_hits;
+    stats->misses = s->compressed_cache_misses;
+    stats->evictions = s->compressed_cache_evictions;
+
+    return stats;
+}
+
+/*
+ * Returns the entry to fill with a newly decompressed cluster: an unused one
+ * if there is any, the least recently used one otherwise.  Entries that are
+ * being filled can't be replaced; NULL is returned if all of them are.
+ */
+static Qcow2CompressedCluster *compressed_cache_victim(BDRVQcowState *s)
+{
+    Qcow2CompressedCluster *victim = NULL;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        Qcow2CompressedCluster *c = &s->compressed_cache[i];
+
+        if (c->in_flight) {
+            continue;
+        }
+        if (c->offset == -1) {
+            return c;
+        }
+        if (!victim || c->lru_counter < victim->lru_counter) {
+            victim = c;
+        }
+    }
+
+    return victim;
+}
+
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+static int decompress_worker(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    if (decompress_buffer(data->out_buf, data->out_buf_size,
+                          data->buf, data->buf_size) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Reads qiov->size bytes starting at offset_in_cluster from the compressed
+ * cluster described by the L2 entry cluster_offset.
+ *
+ * Decompressed clusters are kept in an LRU cache.  On a miss, s->lock is
+ * dropped while the compressed data is read and inflated in the thread pool,
+ * so that several clusters can be decompressed in parallel.  A concurrent
+ * request for the same cluster waits for the first one instead of
+ * decompressing it again.
+ *
+ * Must be called with s->lock held.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCluster *c;
+    Qcow2DecompressData data;
+    QEMUIOVector file_qiov;
+    struct iovec iov;
+    ThreadPool *pool;
     uint64_t coffset;
+    int ret, nb_csectors, sector_offset, i;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
+
+again:
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        c = &s->compressed_cache[i];
+        if (c->offset != coffset) {
+            continue;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+        if (c->in_flight) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&c->waiters);
+            qemu_co_mutex_lock(&s->lock);
+            goto again;
         }
-        s->cluster_cache_offset = coffset;
+        s->compressed_cache_hits++;
+        goto done;
+    }
+
+    c = compressed_cache_victim(s);
+    if (!c) {
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_wait(&s->compressed_cache_queue);
+        qemu_co_mutex_lock(&s->lock);
+        goto again;
     }
+
+    s->compressed_cache_misses++;
+    if (c->offset != -1) {
+        s->compressed_cache_evictions++;
+    }
+    if (!c->data) {
+        c->data = g_malloc(s->cluster_size);
+    }
+    c->offset = coffset;
+    c->in_flight = true;
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    iov.iov_len = nb_csectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&file_qiov, &iov, 1);
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_readv(bs->file, coffset >> BDRV_SECTOR_BITS, nb_csectors,
+                        &file_qiov);
+    if (ret >= 0) {
+        data = (Qcow2DecompressData) {
+            .out_buf        = c->data,
+            .out_buf_size   = s->cluster_size,
+            .buf            = (uint8_t *) iov.iov_base + sector_offset,
+            .buf_size       = iov.iov_len - sector_offset,
+        };
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        ret = thread_pool_submit_co(pool, decompress_worker, &data);
+    }
+    qemu_vfree(iov.iov_base);
+
+    qemu_co_mutex_lock(&s->lock);
+
+    /* The entry may have been dropped meanwhile; its data is still what was
+     * requested, but it won't be found by other requests any more */
+    c->in_flight = false;
+    qemu_co_queue_restart_all(&c->waiters);
+    qemu_co_queue_restart_all(&s->compressed_cache_queue);
+    if (ret < 0) {
+        c->offset = -1;
+        return ret;
+    }
+
+done:
+    c->lru_counter = ++s->compressed_cache_lru_counter;
+    qemu_iovec_from_buf(qiov, 0, c->data + offset_in_cluster, qiov->size);
     return 0;
 }
 
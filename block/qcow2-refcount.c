@@ -26,6 +26,7 @@
 #include "block/block_int.h"
 #include "block/qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 #include "qapi/qmp/types.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
@@ -64,6 +65,8 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     g_free(s->refcount_table);
+    g_free(s->used_clusters);
+    s->used_clusters = NULL;
 }
 
 
@@ -122,6 +125,149 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     return refcount;
 }
 
+/*
+ * Builds the bitmap of used clusters from the refcount blocks, so that cluster
+ * allocation can find free clusters without loading each refcount block they
+ * are described in. If the refcount structures can't be read, no bitmap is
+ * used and allocations fall back to looking at the refcount blocks.
+ */
+int qcow2_build_used_clusters(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t refcount_block_clusters = 1 << (s->cluster_bits - REFCOUNT_SHIFT);
+    uint64_t nb_clusters, i, j;
+    unsigned long *used_clusters;
+    uint16_t *refcount_block;
+    int ret;
+
+    g_free(s->used_clusters);
+    s->used_clusters = NULL;
+
+    /* Only cover the refcount blocks that exist, the table is usually larger
+     * than needed */
+    for (i = s->refcount_table_size; i > 0; i--) {
+        if (s->refcount_table[i - 1] & REFT_OFFSET_MASK) {
+            break;
+        }
+    }
+    nb_clusters = MAX(i, 1) * refcount_block_clusters;
+    if (nb_clusters > LONG_MAX) {
+        return -EFBIG;
+    }
+
+    used_clusters = bitmap_new(nb_clusters);
+    for (i = 0; i < nb_clusters / refcount_block_clusters; i++) {
+        uint64_t refcount_block_offset =
+            s->refcount_table[i] & REFT_OFFSET_MASK;
+
+        if (!refcount_block_offset) {
+            continue;
+        }
+        if (offset_into_cluster(s, refcount_block_offset)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        ret = load_refcount_block(bs, refcount_block_offset,
+                                  (void**) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        for (j = 0; j < refcount_block_clusters; j++) {
+            if (refcount_block[j]) {
+                set_bit(i * refcount_block_clusters + j, used_clusters);
+            }
+        }
+
+        ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                              (void**) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    s->used_clusters = used_clusters;
+    s->used_clusters_size = nb_clusters;
+    return 0;
+
+fail:
+    g_free(used_clusters);
+    return ret;
+}
+
+/*
+ * Updates the bitmap of used clusters after the refcount of nb_clusters
+ * clusters starting at cluster_index has become non-zero (used = true) or zero
+ * (used = false).
+ */
+static void set_clusters_used(BDRVQcowState *s, uint64_t cluster_index,
+                              uint64_t nb_clusters, bool used)
+{
+    uint64_t refcount_block_clusters = 1 << (s->cluster_bits - REFCOUNT_SHIFT);
+    uint64_t end = cluster_index + nb_clusters;
+
+    if (!s->used_clusters || nb_clusters == 0) {
+        return;
+    }
+
+    if (end > s->used_clusters_size) {
+        if (!used) {
+            end = s->used_clusters_size;
+            if (cluster_index >= end) {
+                return;
+            }
+        } else {
+            uint64_t new_size = ROUND_UP(end, refcount_block_clusters);
+            s->used_clusters = bitmap_zero_extend(s->used_clusters,
+                                                  s->used_clusters_size,
+                                                  new_size);
+            s->used_clusters_size = new_size;
+        }
+    }
+
+    if (used) {
+        bitmap_set(s->used_clusters, cluster_index, end - cluster_index);
+    } else {
+        bitmap_clear(s->used_clusters, cluster_index, end - cluster_index);
+    }
+}
+
+/*
+ * Returns the index of the first cluster at or after cluster_index that has a
+ * refcount of zero according to the bitmap of used clusters.
+ */
+static uint64_t next_free_cluster(BDRVQcowState *s, uint64_t cluster_index)
+{
+    if (cluster_index >= s->used_clusters_size) {
+        return cluster_index;
+    }
+    return find_next_zero_bit(s->used_clusters, s->used_clusters_size,
+                              cluster_index);
+}
+
+/*
+ * Returns how many of the nb_clusters clusters starting at cluster_index are
+ * free according to the bitmap of used clusters, stopping at the first used
+ * one.
+ */
+static uint64_t count_free_clusters(BDRVQcowState *s, uint64_t cluster_index,
+                                    uint64_t nb_clusters)
+{
+    uint64_t next_used;
+
+    if (cluster_index >= s->used_clusters_size) {
+        return nb_clusters;
+    }
+    next_used = find_next_bit(s->used_clusters, s->used_clusters_size,
+                              cluster_index);
+    if (next_used >= s->used_clusters_size) {
+        /* Everything after the bitmap is free */
+        return nb_clusters;
+    }
+    return MIN(next_used - cluster_index, nb_clusters);
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -283,6 +429,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         }
 
         s->refcount_table[refcount_table_index] = new_block;
+        set_clusters_used(s, new_block >> s->cluster_bits, 1, true);
 
         /* The new refcount block may be where the caller intended to put its
          * data, so let it restart the search. */
@@ -408,6 +555,10 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
+    set_clusters_used(s, new_block >> s->cluster_bits, 1, true);
+    set_clusters_used(s, meta_offset >> s->cluster_bits,
+                      table_clusters + blocks_clusters, true);
+
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
                         QCOW2_DISCARD_OTHER);
@@ -567,6 +718,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         refcount_block[block_index] = cpu_to_be16(refcount);
+        set_clusters_used(s, cluster_index, 1, refcount != 0);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
@@ -642,15 +794,24 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
     int refcount;
 
     nb_clusters = size_to_clusters(s, size);
+    if (s->used_clusters) {
+        /* Skip over used clusters until a large enough free area is found */
+        do {
+            s->free_cluster_index = next_free_cluster(s, s->free_cluster_index);
+            i = count_free_clusters(s, s->free_cluster_index, nb_clusters);
+            s->free_cluster_index += i;
+        } while (i < nb_clusters);
+    } else {
 retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        refcount = get_refcount(bs, next_cluster_index);
+        for(i = 0; i < nb_clusters; i++) {
+            uint64_t next_cluster_index = s->free_cluster_index++;
+            refcount = get_refcount(bs, next_cluster_index);
 
-        if (refcount < 0) {
-            return refcount;
-        } else if (refcount != 0) {
-            goto retry;
+            if (refcount < 0) {
+                return refcount;
+            } else if (refcount != 0) {
+                goto retry;
+            }
         }
     }
 
@@ -708,13 +869,17 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
-        for(i = 0; i < nb_clusters; i++) {
-            refcount = get_refcount(bs, cluster_index++);
+        if (s->used_clusters) {
+            i = count_free_clusters(s, cluster_index, nb_clusters);
+        } else {
+            for(i = 0; i < nb_clusters; i++) {
+                refcount = get_refcount(bs, cluster_index++);
 
-            if (refcount < 0) {
-                return refcount;
-            } else if (refcount != 0) {
-                break;
+                if (refcount < 0) {
+                    return refcount;
+                } else if (refcount != 0) {
+                    break;
+                }
             }
         }
 
@@ -815,6 +980,7 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
             int nb_csectors;
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
+            qcow2_compressed_cache_drop(bs, l2_entry & s->cluster_offset_mask);
             qcow2_free_clusters(bs,
                 (l2_entry & s->cluster_offset_mask) & ~511,
                 nb_csectors * 512, type);
@@ -1651,6 +1817,16 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         goto fail;
     }
 
+    /* Unused space inside the image file, which new allocations will reuse */
+    for (i = 0; i < highest_cluster; i++) {
+        if (refcount_table[i] == 0) {
+            res->bfi.free_clusters++;
+            if (i == 0 || refcount_table[i - 1] != 0) {
+                res->bfi.free_extents++;
+            }
+        }
+    }
+
     res->image_end_offset = (highest_cluster + 1) * s->cluster_size;
     ret = 0;
 
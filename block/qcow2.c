@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
@@ -318,11 +319,18 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
+    BDRVQcowState *s = bs->opaque;
     int ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
 
+    if (fix && s->used_clusters) {
+        /* Start over from the repaired refcounts; if that fails, allocations
+         * just go back to using the refcount blocks */
+        qcow2_build_used_clusters(bs);
+    }
+
     if (fix && result->check_errors == 0 && result->corruptions == 0) {
         ret = qcow2_mark_clean(bs);
         if (ret < 0) {
@@ -430,6 +438,32 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into an inactive L2 table",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_L2_CACHE_COVERAGE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size the L2 table cache to map this much of the disk",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed cluster cache",
+        },
+        {
+            .name = QCOW2_OPT_BACKING_MAP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Read unallocated areas directly from the backing file "
+                    "that contains their data",
+        },
         { /* end of list */ }
     },
 };
@@ -445,6 +479,62 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
+/*
+ * Translates the cache size options (in bytes) into a number of tables.
+ * Each cached table is one cluster; the L2 cache may alternatively be sized
+ * by the amount of guest disk its tables should map.  The decompressed
+ * cluster cache is sized in clusters as well.
+ */
+static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
+                             int *l2_cache_size, int *refcount_cache_size,
+                             int *compressed_cache_size, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t bytes_per_l2 = (uint64_t)s->cluster_size *
+                            (s->cluster_size / sizeof(uint64_t));
+    bool has_size = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
+    bool has_coverage = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_COVERAGE);
+    uint64_t l2_tables, refcount_tables, compressed_clusters;
+
+    if (has_size && has_coverage) {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_SIZE " and "
+                   QCOW2_OPT_L2_CACHE_COVERAGE " may not be set at the same "
+                   "time");
+        return;
+    }
+
+    if (has_size) {
+        l2_tables = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0) /
+                    s->cluster_size;
+    } else if (has_coverage) {
+        l2_tables = DIV_ROUND_UP(qemu_opt_get_size(opts,
+                                     QCOW2_OPT_L2_CACHE_COVERAGE, 0),
+                                 bytes_per_l2);
+    } else {
+        l2_tables = L2_CACHE_SIZE;
+    }
+
+    refcount_tables = qemu_opt_get_size(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+                                        (uint64_t)REFCOUNT_CACHE_SIZE *
+                                        s->cluster_size) / s->cluster_size;
+    compressed_clusters = qemu_opt_get_size(opts,
+                                            QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                                            (uint64_t)COMPRESSED_CACHE_SIZE *
+                                            s->cluster_size) / s->cluster_size;
+
+    /* There is no point in caching more L2 tables than the image can have */
+    l2_tables = MIN(l2_tables, MAX(s->l1_size, L2_CACHE_SIZE));
+    l2_tables = MAX(l2_tables, MIN_L2_CACHE_SIZE);
+    refcount_tables = MIN(refcount_tables, MAX_REFCOUNT_CACHE_SIZE);
+    refcount_tables = MAX(refcount_tables, REFCOUNT_CACHE_SIZE);
+    compressed_clusters = MIN(compressed_clusters, MAX_COMPRESSED_CACHE_SIZE);
+    compressed_clusters = MAX(compressed_clusters, 1);
+
+    *l2_cache_size = l2_tables;
+    *refcount_cache_size = refcount_tables;
+    *compressed_cache_size = compressed_clusters;
+}
+
 static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
@@ -458,6 +548,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check;
     int overlap_check_template = 0;
+    int l2_cache_size = 0, refcount_cache_size = 0, compressed_cache_size = 0;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -689,15 +780,73 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* Enable lazy_refcounts according to image and command line options */
+    opts = qemu_opts_create(&qcow2_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size,
+                     &compressed_cache_size, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
+        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
+    s->use_backing_map = qemu_opt_get_bool(opts, QCOW2_OPT_BACKING_MAP, true);
+
+    s->discard_passthrough[QCOW2_DISCARD_NEVER] = false;
+    s->discard_passthrough[QCOW2_DISCARD_ALWAYS] = true;
+    s->discard_passthrough[QCOW2_DISCARD_REQUEST] =
+        qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_REQUEST,
+                          flags & BDRV_O_UNMAP);
+    s->discard_passthrough[QCOW2_DISCARD_SNAPSHOT] =
+        qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_SNAPSHOT, true);
+    s->discard_passthrough[QCOW2_DISCARD_OTHER] =
+        qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
+
+    opt_overlap_check = qemu_opt_get(opts, "overlap-check") ?: "cached";
+    if (!strcmp(opt_overlap_check, "none")) {
+        overlap_check_template = 0;
+    } else if (!strcmp(opt_overlap_check, "constant")) {
+        overlap_check_template = QCOW2_OL_CONSTANT;
+    } else if (!strcmp(opt_overlap_check, "cached")) {
+        overlap_check_template = QCOW2_OL_CACHED;
+    } else if (!strcmp(opt_overlap_check, "all")) {
+        overlap_check_template = QCOW2_OL_ALL;
+    } else {
+        error_setg(errp, "Unsupported value '%s' for qcow2 option "
+                   "'overlap-check'. Allowed are either of the following: "
+                   "none, constant, cached, all", opt_overlap_check);
+        qemu_opts_del(opts);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->overlap_check = 0;
+    for (i = 0; i < QCOW2_OL_MAX_BITNR; i++) {
+        /* overlap-check defines a template bitmask, but every flag may be
+         * overwritten through the associated boolean option */
+        s->overlap_check |=
+            qemu_opt_get_bool(opts, overlap_bool_option_names[i],
+                              overlap_check_template & (1 << i)) << i;
+    }
+
+    qemu_opts_del(opts);
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
-
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+
+    qcow2_compressed_cache_create(bs, compressed_cache_size);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -769,57 +918,12 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
-    /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create(&qcow2_runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto fail;
+    /* Track used clusters in memory for allocations. This is only an
+     * optimisation, so failing to build the bitmap isn't fatal. */
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING)) {
+        qcow2_build_used_clusters(bs);
     }
 
-    s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
-        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
-
-    s->discard_passthrough[QCOW2_DISCARD_NEVER] = false;
-    s->discard_passthrough[QCOW2_DISCARD_ALWAYS] = true;
-    s->discard_passthrough[QCOW2_DISCARD_REQUEST] =
-        qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_REQUEST,
-                          flags & BDRV_O_UNMAP);
-    s->discard_passthrough[QCOW2_DISCARD_SNAPSHOT] =
-        qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_SNAPSHOT, true);
-    s->discard_passthrough[QCOW2_DISCARD_OTHER] =
-        qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
-
-    opt_overlap_check = qemu_opt_get(opts, "overlap-check") ?: "cached";
-    if (!strcmp(opt_overlap_check, "none")) {
-        overlap_check_template = 0;
-    } else if (!strcmp(opt_overlap_check, "constant")) {
-        overlap_check_template = QCOW2_OL_CONSTANT;
-    } else if (!strcmp(opt_overlap_check, "cached")) {
-        overlap_check_template = QCOW2_OL_CACHED;
-    } else if (!strcmp(opt_overlap_check, "all")) {
-        overlap_check_template = QCOW2_OL_ALL;
-    } else {
-        error_setg(errp, "Unsupported value '%s' for qcow2 option "
-                   "'overlap-check'. Allowed are either of the following: "
-                   "none, constant, cached, all", opt_overlap_check);
-        qemu_opts_del(opts);
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    s->overlap_check = 0;
-    for (i = 0; i < QCOW2_OL_MAX_BITNR; i++) {
-        /* overlap-check defines a template bitmask, but every flag may be
-         * overwritten through the associated boolean option */
-        s->overlap_check |=
-            qemu_opt_get_bool(opts, overlap_bool_option_names[i],
-                              overlap_check_template & (1 << i)) << i;
-    }
-
-    qemu_opts_del(opts);
-
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         error_setg(errp, "Lazy refcounts require a qcow2 image with at least "
                    "qemu 1.1 compatibility level");
@@ -849,8 +953,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
     return ret;
 }
 
@@ -1021,8 +1124,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 if (n1 > 0) {
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
                     qemu_co_mutex_unlock(&s->lock);
-                    ret = bdrv_co_readv(bs->backing_hd, sector_num,
-                                        n1, &hd_qiov);
+                    ret = qcow2_co_read_backing(bs, sector_num, n1, &hd_qiov);
                     qemu_co_mutex_lock(&s->lock);
                     if (ret < 0) {
                         goto fail;
@@ -1039,15 +1141,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_read_compressed(bs, cluster_offset,
+                                           index_in_cluster * 512, &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1125,14 +1223,13 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    QCowL2Meta *next_l2meta;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -1186,13 +1283,32 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
+        /* COW next to the guest data is written along with it, the rest
+         * doesn't touch the area written here, so let it run concurrently
+         * with the guest data write */
+        qcow2_cow_prepare(bs, l2meta,
+                          cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
+                          cur_nr_sectors);
+        qcow2_cow_start(bs, l2meta);
+
         qemu_co_mutex_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
-        ret = bdrv_co_writev(bs->file,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
+        ret = qcow2_co_writev_cow(bs, l2meta,
+                                  cluster_offset +
+                                  index_in_cluster * BDRV_SECTOR_SIZE,
+                                  cur_nr_sectors, &hd_qiov);
+
+        /* Even on failure, the copies must be finished before the L2Metas
+         * can be freed */
+        for (next_l2meta = l2meta; next_l2meta != NULL;
+             next_l2meta = next_l2meta->next) {
+            int cow_ret = qcow2_cow_wait(bs, next_l2meta);
+            if (ret >= 0 && cow_ret < 0) {
+                ret = cow_ret;
+            }
+        }
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
@@ -1268,8 +1384,8 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
+    qcow2_backing_map_free(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1914,12 +2030,65 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+typedef struct Qcow2CompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+    int out_len;
+} Qcow2CompressData;
+
+/*
+ * Deflates data->buf into data->out_buf.  Returns -ENOSPC if the data doesn't
+ * compress to less than data->out_buf_size bytes.
+ */
+static int compress_worker(void *opaque)
 {
-    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData *data = opaque;
     z_stream strm;
-    int ret, out_len;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->buf_size;
+    strm.next_in = (uint8_t *)data->buf;
+    strm.avail_out = data->out_buf_size;
+    strm.next_out = data->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    data->out_len = strm.next_out - data->out_buf;
+    deflateEnd(&strm);
+
+    if (ret == Z_STREAM_END) {
+        return 0;
+    } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+        return -ENOSPC;
+    }
+    return -EINVAL;
+}
+
+/*
+ * The cluster is compressed in the thread pool without holding s->lock, so
+ * that several coroutines (e.g. the ones of qemu-img convert -c) compress
+ * clusters in parallel.  Only the allocation of the compressed cluster is
+ * serialised.
+ */
+static int coroutine_fn qcow2_write_compressed(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               const uint8_t *buf,
+                                               int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData data;
+    ThreadPool *pool;
+    int ret;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1950,53 +2119,44 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    data = (Qcow2CompressData) {
+        .out_buf        = out_buf,
+        .out_buf_size   = s->cluster_size,
+        .buf            = buf,
+        .buf_size       = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ret = thread_pool_submit_co(pool, compress_worker, &data);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (ret == -ENOSPC || (ret == 0 && data.out_len >= s->cluster_size)) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (ret < 0) {
+        goto fail;
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
+            sector_num << 9, data.out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
+        qcow2_compressed_cache_drop(bs, cluster_offset);
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset,
+                                            data.out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, data.out_len);
         if (ret < 0) {
             goto fail;
         }
@@ -2069,6 +2229,28 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .kind  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        {
+            .qcow2 = g_new(BlockStatsSpecificQCow2, 1),
+        },
+    };
+    *stats->qcow2 = (BlockStatsSpecificQCow2){
+        .l2_cache       = qcow2_cache_get_stats(s->l2_table_cache),
+        .refcount_cache = qcow2_cache_get_stats(s->refcount_block_cache),
+        .compressed_cache = qcow2_compressed_cache_get_stats(bs),
+        .backing_map    = qcow2_backing_map_get_stats(bs),
+    };
+    stats->qcow2->has_backing_map = stats->qcow2->backing_map != NULL;
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2398,6 +2580,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -2406,6 +2589,7 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
+    .supports_aio_context       = true,
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
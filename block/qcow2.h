@@ -64,10 +64,21 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default and minimum number of cached L2 tables */
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
+#define MAX_REFCOUNT_CACHE_SIZE 1024
+
+/* Default and maximum number of cached decompressed clusters */
+#define COMPRESSED_CACHE_SIZE 16
+#define MAX_COMPRESSED_CACHE_SIZE 1024
+
+/* Maximum number of COW copies running in parallel with guest data writes;
+ * any further COW is done after the data write, as before */
+#define MAX_CONCURRENT_COW 64
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
@@ -85,6 +96,11 @@
 #define QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE "overlap-check.snapshot-table"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_COVERAGE "l2-cache-coverage"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+#define QCOW2_OPT_BACKING_MAP "backing-map"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -205,6 +221,57 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+typedef struct Qcow2CompressedCluster {
+    /* Host offset of the compressed data, -1 if the entry is unused */
+    uint64_t offset;
+    /* Decompressed cluster, allocated on first use */
+    uint8_t *data;
+    uint64_t lru_counter;
+    /* Set while the cluster is read and decompressed; requests for the same
+     * cluster wait in waiters meanwhile */
+    bool in_flight;
+    CoQueue waiters;
+} Qcow2CompressedCluster;
+
+/* Values of Qcow2BackingMap.owner other than the depth of the owning layer */
+enum {
+    QCOW2_BACKING_UNKNOWN   = 0,
+    QCOW2_BACKING_MAX_DEPTH = 253,
+    QCOW2_BACKING_ZERO      = 254, /* no layer has data, reads as zeroes */
+    QCOW2_BACKING_MIXED     = 255, /* parts belong to different layers */
+};
+
+/*
+ * Records for each chunk of the guest disk which image in the backing chain
+ * contains its data, so that reads of areas unallocated in this image can go
+ * directly to that image instead of walking down the chain.
+ */
+typedef struct Qcow2BackingMap {
+    int chunk_sectors;
+    int64_t total_sectors;
+    int64_t nb_chunks;
+
+    /* One entry per chunk: the depth of the owning image (1 is backing_hd)
+     * or one of the special QCOW2_BACKING_* values */
+    uint8_t *owner;
+
+    /* The backing chain the map was built for, with each image's write_gen
+     * at that time; the map is discarded if any of them changes */
+    int depth;
+    BlockDriverState **layers;
+    uint64_t *layer_gens;
+
+    /* Incremented whenever the map is discarded */
+    uint64_t generation;
+
+    uint64_t lookups;
+    uint64_t misses;
+    uint64_t zero_lookups;
+    uint64_t mixed_lookups;
+    uint64_t total_depth;
+    uint64_t invalidations;
+} Qcow2BackingMap;
+
 typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
@@ -222,9 +289,18 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2CompressedCluster *compressed_cache;
+    int compressed_cache_size;
+    uint64_t compressed_cache_lru_counter;
+    uint64_t compressed_cache_hits;
+    uint64_t compressed_cache_misses;
+    uint64_t compressed_cache_evictions;
+    /* Requests waiting because all entries are being filled */
+    CoQueue compressed_cache_queue;
+
+    bool use_backing_map;
+    Qcow2BackingMap *backing_map;
+
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -233,6 +309,11 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* One bit per host cluster, set if the cluster's refcount is non-zero.
+     * NULL if allocations have to look at the refcount blocks instead. */
+    unsigned long *used_clusters;
+    uint64_t used_clusters_size;
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -262,6 +343,8 @@ typedef struct BDRVQcowState {
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
     QTAILQ_HEAD (, Qcow2DiscardRegion) discards;
     bool cache_discards;
+
+    int cow_in_flight;
 } BDRVQcowState;
 
 /* XXX: use std qcow open function ? */
@@ -286,6 +369,30 @@ typedef struct Qcow2COWRegion {
 
     /** Number of sectors to copy */
     int         nb_sectors;
+
+    /** Set if the guest data of the region is known to read as zeroes */
+    bool        zero;
+
+    /**
+     * Set if nothing needs to be written because the region is zero and lies
+     * beyond the end of the image file
+     */
+    bool        skip;
+
+    /** Set if the region is written in one request with the guest data */
+    bool        merge;
+
+    /** Set while the copy runs in a coroutine started by qcow2_cow_start() */
+    bool        in_flight;
+
+    /** Set once the copy has completed successfully */
+    bool        done;
+
+    /** Result of a copy started by qcow2_cow_start() */
+    int         ret;
+
+    /** Coroutine waiting in qcow2_cow_wait() for the copy to complete */
+    Coroutine   *waiter;
 } Qcow2COWRegion;
 
 /**
@@ -471,6 +578,7 @@ int qcow2_update_header(BlockDriverState *bs);
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+int qcow2_build_used_clusters(BlockDriverState *bs);
 
 int qcow2_update_cluster_refcount(BlockDriverState *bs, int64_t cluster_index,
                                   int addend, enum qcow2_discard_type type);
@@ -503,7 +611,12 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int qcow2_co_read_compressed(BlockDriverState *bs, uint64_t cluster_offset,
+                             int offset_in_cluster, QEMUIOVector *qiov);
+void qcow2_compressed_cache_create(BlockDriverState *bs, int num_clusters);
+void qcow2_compressed_cache_destroy(BlockDriverState *bs);
+void qcow2_compressed_cache_drop(BlockDriverState *bs, uint64_t coffset);
+Qcow2CacheStats *qcow2_compressed_cache_get_stats(BlockDriverState *bs);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -517,6 +630,13 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
 
+void qcow2_cow_prepare(BlockDriverState *bs, QCowL2Meta *m,
+                       uint64_t data_offset, int nb_sectors);
+int qcow2_co_writev_cow(BlockDriverState *bs, QCowL2Meta *m,
+                        uint64_t data_offset, int nb_sectors,
+                        QEMUIOVector *qiov);
+void qcow2_cow_start(BlockDriverState *bs, QCowL2Meta *m);
+int qcow2_cow_wait(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type);
@@ -540,6 +660,12 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-backing.c functions */
+int qcow2_co_read_backing(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, QEMUIOVector *qiov);
+void qcow2_backing_map_free(BlockDriverState *bs);
+Qcow2BackingMapStats *qcow2_backing_map_get_stats(BlockDriverState *bs);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -557,5 +683,6 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c);
 
 #endif
@@ -37,6 +37,12 @@ void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
+void laio_get_stats(void *aio_ctx, uint64_t *submit_calls,
+                    uint64_t *submitted_requests);
+void laio_detach_aio_context(void *aio_ctx, AioContext *old_context);
+void laio_attach_aio_context(void *aio_ctx, AioContext *new_context);
 #endif
 
 #ifdef _WIN32
@@ -845,6 +845,7 @@ static BlockDriver bdrv_vdi = {
 #endif
 
     .bdrv_get_info = vdi_get_info,
+    .supports_aio_context = true,
 
     .create_options = vdi_create_options,
     .bdrv_check = vdi_check,
@@ -1930,6 +1930,7 @@ static BlockDriver bdrv_vhdx = {
     .bdrv_create            = vhdx_create,
     .bdrv_get_info          = vhdx_get_info,
     .bdrv_check             = vhdx_check,
+    .supports_aio_context   = true,
 
     .create_options         = vhdx_create_options,
 };
@@ -1496,14 +1496,19 @@ static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-static int vmdk_write_compressed(BlockDriverState *bs,
-                                 int64_t sector_num,
-                                 const uint8_t *buf,
-                                 int nb_sectors)
+static int coroutine_fn vmdk_write_compressed(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              const uint8_t *buf,
+                                              int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
+    int ret;
+
     if (s->num_extents == 1 && s->extents[0].compressed) {
-        return vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        qemu_co_mutex_lock(&s->lock);
+        ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
     } else {
         return -ENOTSUP;
     }
@@ -2153,6 +2158,7 @@ static BlockDriver bdrv_vmdk = {
     .bdrv_get_specific_info       = vmdk_get_specific_info,
     .bdrv_refresh_limits          = vmdk_refresh_limits,
     .bdrv_get_info                = vmdk_get_info,
+    .supports_aio_context         = true,
 
     .create_options               = vmdk_create_options,
 };
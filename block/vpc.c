@@ -896,6 +896,7 @@ static BlockDriver bdrv_vpc = {
     .bdrv_write             = vpc_co_write,
 
     .bdrv_get_info          = vpc_get_info,
+    .supports_aio_context   = true,
 
     .create_options         = vpc_create_options,
     .bdrv_has_zero_init     = vpc_has_zero_init,
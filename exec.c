@@ -789,6 +789,36 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
     }
 }
 
+/* Note: start and end must be within the same ram block.
+ *
+ * This works a word at a time whatever the alignment of @start, using
+ * atomic operations so that vcpu threads can keep setting dirty bits
+ * while the migration thread harvests them.  tests/bitmap-sync-bench
+ * measures it against the RAM size.
+ */
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+                                               ram_addr_t start,
+                                               ram_addr_t length)
+{
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    uint64_t num_dirty;
+    bool cleared;
+
+    num_dirty = bitmap_sync_and_clear_atomic(dest, src, page, end - page,
+                                             &cleared);
+
+    /* TCG must go through the notdirty slow path again for pages whose
+     * migration dirty bit we just cleared.
+     */
+    if (cleared && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, length);
+    }
+
+    return num_dirty;
+}
+
 static void cpu_physical_memory_set_dirty_tracking(bool enable)
 {
     in_migration = enable;
@@ -1074,7 +1104,8 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    area = mmap(0, memory, PROT_READ | PROT_WRITE,
+                mem_share ? MAP_SHARED : MAP_PRIVATE, fd, 0);
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
@@ -1411,9 +1442,9 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
                 if (block->fd >= 0) {
 #ifdef MAP_POPULATE
                     flags |= mem_prealloc ? MAP_POPULATE | MAP_SHARED :
-                        MAP_PRIVATE;
+                        mem_share ? MAP_SHARED : MAP_PRIVATE;
 #else
-                    flags |= MAP_PRIVATE;
+                    flags |= mem_share ? MAP_SHARED : MAP_PRIVATE;
 #endif
                     area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
                                 flags, block->fd, offset);
@@ -1496,6 +1527,17 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
     }
 }
 
+/* Returns the file descriptor backing the RAM block at addr, or -1 if the
+ * block isn't file backed.  *offset is set to the offset of addr in the file.
+ */
+int qemu_get_ram_fd(ram_addr_t addr, ram_addr_t *offset)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    *offset = addr - block->offset;
+    return block->fd;
+}
+
 /* Some of the softmmu routines need to translate from a host pointer
    (typically a TLB entry) back to a ram offset.  */
 MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
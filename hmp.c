@@ -170,6 +170,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -219,6 +223,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
     }
 
     qapi_free_MigrationInfo(info);
@@ -17,7 +17,6 @@
 #include "qemu/thread.h"
 #include "qemu/error-report.h"
 #include "hw/virtio/dataplane/vring.h"
-#include "ioq.h"
 #include "block/block.h"
 #include "hw/virtio/virtio-blk.h"
 #include "virtio-blk.h"
@@ -25,91 +24,68 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
-enum {
-    SEG_MAX = 126,                  /* maximum number of I/O segments */
-    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
-    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
-                                     * is VRING_MAX / 2 with traditional and
-                                     * VRING_MAX with indirect descriptors */
-};
+typedef struct VirtIOBlockDataPlaneQueue VirtIOBlockDataPlaneQueue;
 
 typedef struct {
-    struct iocb iocb;               /* Linux AIO control block */
-    QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
+    VirtIOBlockDataPlaneQueue *q;   /* virtqueue the request came from */
     VirtQueueElement *elem;         /* saved data from the virtqueue */
-    struct iovec *bounce_iov;       /* used if guest buffers are unaligned */
-    QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
+    QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
+    QEMUIOVector qiov;              /* guest buffers for reads and writes */
+    BlockAcctCookie acct;
 } VirtIOBlockRequest;
 
+struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    int index;                      /* virtqueue number */
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Note that this EventNotifier is assigned by value.  This is fine as
+     * long as you do not call event_notifier_cleanup on it (because you don't
+     * own the file descriptor or handle; you just use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+};
+
 struct VirtIOBlockDataPlane {
     bool started;
     bool starting;
     bool stopping;
 
     VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
+    BlockDriverState *bs;
 
     VirtIODevice *vdev;
-    Vring vring;                    /* virtqueue vring */
-    EventNotifier *guest_notifier;  /* irq */
+    int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
 
-    /* Note that these EventNotifiers are assigned by value.  This is
-     * fine as long as you do not call event_notifier_cleanup on them
-     * (because you don't own the file descriptor or handle; you just
-     * use it).
+    /* All virtqueues of the device are processed in the same IOThread,
+     * because a BlockDriverState can only be used from one AioContext.
      */
     IOThread *iothread;
     IOThread internal_iothread_obj;
     AioContext *ctx;
-    EventNotifier io_notifier;      /* Linux AIO completion */
-    EventNotifier host_notifier;    /* doorbell */
-
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       IOThread) */
-    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
-                                             queue */
-
-    unsigned int num_reqs;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
-static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
-{
-    VirtIOBlockDataPlane *s = opaque;
-    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
-    struct virtio_blk_inhdr hdr;
-    int len;
-
-    if (likely(ret >= 0)) {
-        hdr.status = VIRTIO_BLK_S_OK;
-        len = ret;
-    } else {
-        hdr.status = VIRTIO_BLK_S_IOERR;
-        len = 0;
-    }
-
-    trace_virtio_blk_data_plane_complete_request(s, req->elem->index, ret);
+static void handle_notify(EventNotifier *e);
 
-    if (req->read_qiov) {
-        assert(req->bounce_iov);
-        qemu_iovec_from_buf(req->read_qiov, 0, req->bounce_iov->iov_base, len);
-        qemu_iovec_destroy(req->read_qiov);
-        g_slice_free(QEMUIOVector, req->read_qiov);
-    }
-
-    if (req->bounce_iov) {
-        qemu_vfree(req->bounce_iov->iov_base);
-        g_slice_free(struct iovec, req->bounce_iov);
-    }
+static void complete_request(VirtIOBlockRequest *req, unsigned char status,
+                             int len)
+{
+    VirtIOBlockDataPlaneQueue *q = req->q;
+    struct virtio_blk_inhdr hdr = {
+        .status = status,
+    };
 
     qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
     qemu_iovec_destroy(req->inhdr);
@@ -119,90 +95,88 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * written to, but for virtio-blk it seems to be the number of bytes
      * transferred plus the status bytes.
      */
-    vring_push(&s->vring, req->elem, len + sizeof(hdr));
-    req->elem = NULL;
-    s->num_reqs--;
+    vring_push(&q->vring, req->elem, len + sizeof(hdr));
+    notify_guest(q);
+    g_slice_free(VirtIOBlockRequest, req);
 }
 
-static void complete_request_early(VirtIOBlockDataPlane *s, VirtQueueElement *elem,
-                                   QEMUIOVector *inhdr, unsigned char status)
+static void complete_rdwr(void *opaque, int ret)
 {
-    struct virtio_blk_inhdr hdr = {
-        .status = status,
-    };
+    VirtIOBlockRequest *req = opaque;
+    VirtIOBlockDataPlaneQueue *q = req->q;
 
-    qemu_iovec_from_buf(inhdr, 0, &hdr, sizeof(hdr));
-    qemu_iovec_destroy(inhdr);
-    g_slice_free(QEMUIOVector, inhdr);
+    trace_virtio_blk_data_plane_complete_request(q->s, req->elem->index, ret);
 
-    vring_push(&s->vring, elem, sizeof(hdr));
-    notify_guest(s);
+    bdrv_acct_done(q->s->bs, &req->acct);
+    if (likely(ret == 0)) {
+        complete_request(req, VIRTIO_BLK_S_OK, req->qiov.size);
+    } else {
+        complete_request(req, VIRTIO_BLK_S_IOERR, 0);
+    }
+
+    /* Requests that didn't fit into the vring iovecs may still be waiting */
+    if (unlikely(vring_more_avail(&q->vring))) {
+        handle_notify(&q->host_notifier);
+    }
 }
 
 /* Get disk serial number */
-static void do_get_id_cmd(VirtIOBlockDataPlane *s,
-                          struct iovec *iov, unsigned int iov_cnt,
-                          VirtQueueElement *elem, QEMUIOVector *inhdr)
+static void do_get_id_cmd(VirtIOBlockRequest *req,
+                          struct iovec *iov, unsigned int iov_cnt)
 {
+    VirtIOBlockDataPlane *s = req->q->s;
     char id[VIRTIO_BLK_ID_BYTES];
 
     /* Serial number not NUL-terminated when longer than buffer */
     strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
     iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
-    complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_OK);
+    complete_request(req, VIRTIO_BLK_S_OK, 0);
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
-                       struct iovec *iov, unsigned iov_cnt,
-                       long long offset, VirtQueueElement *elem,
-                       QEMUIOVector *inhdr)
+static void do_rdwr_cmd(VirtIOBlockRequest *req, bool read,
+                        struct iovec *iov, unsigned iov_cnt,
+                        int64_t sector_num)
 {
-    struct iocb *iocb;
-    QEMUIOVector qiov;
-    struct iovec *bounce_iov = NULL;
-    QEMUIOVector *read_qiov = NULL;
-
-    qemu_iovec_init_external(&qiov, iov, iov_cnt);
-    if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
-        void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
-
-        if (read) {
-            /* Need to copy back from bounce buffer on completion */
-            read_qiov = g_slice_new(QEMUIOVector);
-            qemu_iovec_init(read_qiov, iov_cnt);
-            qemu_iovec_concat_iov(read_qiov, iov, iov_cnt, 0, qiov.size);
-        } else {
-            qemu_iovec_to_buf(&qiov, 0, bounce_buffer, qiov.size);
-        }
+    VirtIOBlockDataPlane *s = req->q->s;
+    int nb_sectors;
 
-        /* Redirect I/O to aligned bounce buffer */
-        bounce_iov = g_slice_new(struct iovec);
-        bounce_iov->iov_base = bounce_buffer;
-        bounce_iov->iov_len = qiov.size;
-        iov = bounce_iov;
-        iov_cnt = 1;
+    qemu_iovec_init_external(&req->qiov, iov, iov_cnt);
+    nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+
+    if (req->qiov.size % s->blk->conf.logical_block_size) {
+        complete_request(req, VIRTIO_BLK_S_IOERR, 0);
+        return;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    if (read) {
+        bdrv_acct_start(s->bs, &req->acct, req->qiov.size, BDRV_ACCT_READ);
+        bdrv_aio_readv(s->bs, sector_num, &req->qiov, nb_sectors,
+                       complete_rdwr, req);
+    } else {
+        bdrv_acct_start(s->bs, &req->acct, req->qiov.size, BDRV_ACCT_WRITE);
+        bdrv_aio_writev(s->bs, sector_num, &req->qiov, nb_sectors,
+                        complete_rdwr, req);
+    }
+}
 
-    /* Fill in virtio block metadata needed for completion */
-    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
-    req->elem = elem;
-    req->inhdr = inhdr;
-    req->bounce_iov = bounce_iov;
-    req->read_qiov = read_qiov;
-    return 0;
+static void do_flush_cmd(VirtIOBlockRequest *req)
+{
+    VirtIOBlockDataPlane *s = req->q->s;
+
+    qemu_iovec_init_external(&req->qiov, NULL, 0);
+    bdrv_acct_start(s->bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+    bdrv_aio_flush(s->bs, complete_rdwr, req);
 }
 
-static int process_request(IOQueue *ioq, VirtQueueElement *elem)
+static int process_request(VirtIOBlockDataPlaneQueue *q,
+                           VirtQueueElement *elem)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
     struct iovec *iov = elem->out_sg;
     struct iovec *in_iov = elem->in_sg;
     unsigned out_num = elem->out_num;
     unsigned in_num = elem->in_num;
     struct virtio_blk_outhdr outhdr;
-    QEMUIOVector *inhdr;
+    VirtIOBlockRequest *req;
     size_t in_size;
 
     /* Copy in outhdr */
@@ -219,9 +193,13 @@ static int process_request(IOQueue *ioq, VirtQueueElement *elem)
         error_report("virtio_blk request inhdr too short");
         return -EFAULT;
     }
-    inhdr = g_slice_new(QEMUIOVector);
-    qemu_iovec_init(inhdr, 1);
-    qemu_iovec_concat_iov(inhdr, in_iov, in_num,
+
+    req = g_slice_new(VirtIOBlockRequest);
+    req->q = q;
+    req->elem = elem;
+    req->inhdr = g_slice_new(QEMUIOVector);
+    qemu_iovec_init(req->inhdr, 1);
+    qemu_iovec_concat_iov(req->inhdr, in_iov, in_num,
             in_size - sizeof(struct virtio_blk_inhdr),
             sizeof(struct virtio_blk_inhdr));
     iov_discard_back(in_iov, &in_num, sizeof(struct virtio_blk_inhdr));
@@ -231,55 +209,51 @@ static int process_request(IOQueue *ioq, VirtQueueElement *elem)
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, elem, inhdr);
+        do_rdwr_cmd(req, true, in_iov, in_num, outhdr.sector);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, elem, inhdr);
+        do_rdwr_cmd(req, false, iov, out_num, outhdr.sector);
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
         /* TODO support SCSI commands */
-        complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_UNSUPP);
+        complete_request(req, VIRTIO_BLK_S_UNSUPP, 0);
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
-        /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
-        if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_IOERR);
-        } else {
-            complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_OK);
-        }
+        do_flush_cmd(req);
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
-        do_get_id_cmd(s, in_iov, in_num, elem, inhdr);
+        do_get_id_cmd(req, in_iov, in_num);
         return 0;
 
     default:
         error_report("virtio-blk unsupported request type %#x", outhdr.type);
-        qemu_iovec_destroy(inhdr);
-        g_slice_free(QEMUIOVector, inhdr);
+        qemu_iovec_destroy(req->inhdr);
+        g_slice_free(QEMUIOVector, req->inhdr);
+        g_slice_free(VirtIOBlockRequest, req);
         return -EFAULT;
     }
 }
 
 static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
-
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
     VirtQueueElement *elem;
     int ret;
-    unsigned int num_queued;
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    event_notifier_test_and_clear(&q->host_notifier);
+    bdrv_io_plug(s->bs);
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &q->vring);
 
         for (;;) {
-            ret = vring_pop(s->vdev, &s->vring, &elem);
+            ret = vring_pop(s->vdev, &q->vring, &elem);
             if (ret < 0) {
                 assert(elem == NULL);
                 break; /* no more requests */
@@ -288,8 +262,8 @@ static void handle_notify(EventNotifier *e)
             trace_virtio_blk_data_plane_process_request(s, elem->out_num,
                                                         elem->in_num, elem->index);
 
-            if (process_request(&s->ioqueue, elem) < 0) {
-                vring_set_broken(&s->vring);
+            if (process_request(q, elem) < 0) {
+                vring_set_broken(&q->vring);
                 vring_free_element(elem);
                 ret = -EFAULT;
                 break;
@@ -300,7 +274,7 @@ static void handle_notify(EventNotifier *e)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(s->vdev, &q->vring)) {
                 break;
             }
         } else { /* ret == -ENOBUFS or fatal error, iovecs[] is depleted */
@@ -311,36 +285,7 @@ static void handle_notify(EventNotifier *e)
             break;
         }
     }
-
-    num_queued = ioq_num_queued(&s->ioqueue);
-    if (num_queued > 0) {
-        s->num_reqs += num_queued;
-
-        int rc = ioq_submit(&s->ioqueue);
-        if (unlikely(rc < 0)) {
-            fprintf(stderr, "ioq_submit failed %d\n", rc);
-            exit(1);
-        }
-    }
-}
-
-static void handle_io(EventNotifier *e)
-{
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
-
-    event_notifier_test_and_clear(&s->io_notifier);
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
-    }
-
-    /* If there were more requests than iovecs, the vring will not be empty yet
-     * so check again.  There should now be enough resources to process more
-     * requests.
-     */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->host_notifier);
-    }
+    bdrv_io_unplug(s->bs);
 }
 
 /* Context: QEMU global mutex held */
@@ -349,7 +294,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                                   Error **errp)
 {
     VirtIOBlockDataPlane *s;
-    int fd;
+    Error *local_err = NULL;
+    int i;
 
     *dataplane = NULL;
 
@@ -378,17 +324,24 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return;
     }
 
-    fd = raw_get_aio_fd(blk->conf.bs);
-    if (fd < 0) {
-        error_setg(errp, "drive is incompatible with x-data-plane, "
-                         "use format=raw,cache=none,aio=native");
+    if (!bdrv_aio_context_supported(blk->conf.bs, &local_err)) {
+        error_setg(errp, "drive is incompatible with x-data-plane: %s",
+                   error_get_pretty(local_err));
+        error_free(local_err);
         return;
     }
 
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
-    s->fd = fd;
     s->blk = blk;
+    s->bs = blk->conf.bs;
+
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].s = s;
+        s->queues[i].index = i;
+    }
 
     if (blk->iothread) {
         s->iothread = blk->iothread;
@@ -422,6 +375,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     bdrv_set_in_use(s->blk->conf.bs, 0);
     object_unref(OBJECT(s->iothread));
+    g_free(s->queues);
     g_free(s);
 }
 
@@ -430,7 +384,6 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
-    VirtQueue *vq;
     int i;
 
     if (s->started) {
@@ -443,45 +396,51 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        s->starting = false;
-        return;
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            while (--i >= 0) {
+                vring_teardown(&s->queues[i].vring, s->vdev, i);
+            }
+            s->starting = false;
+            return;
+        }
     }
 
     /* Set up guest notifier (irq) */
-    if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
     /* Set up virtqueue notify */
-    if (k->set_host_notifier(qbus->parent, 0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
-    }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+        s->queues[i].guest_notifier = virtio_queue_get_guest_notifier(vq);
+        if (k->set_host_notifier(qbus->parent, i, true) != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier\n");
+            exit(1);
+        }
+        s->queues[i].host_notifier = *virtio_queue_get_host_notifier(vq);
     }
-    s->io_notifier = *ioq_get_notifier(&s->ioqueue);
 
     s->starting = false;
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
-
-    /* Get this show started by hooking up our callbacks */
+    /* Requests are now submitted and completed in the IOThread */
     aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
-    aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io);
+    bdrv_set_aio_context(s->bs, s->ctx);
+
+    /* Get this show started by hooking up our callbacks and kicking right
+     * away to begin processing requests already in the vrings.
+     */
+    for (i = 0; i < s->num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->queues[i].host_notifier,
+                               handle_notify);
+        event_notifier_set(&s->queues[i].host_notifier);
+    }
     aio_context_release(s->ctx);
 }
 
@@ -490,6 +449,8 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
     if (!s->started || s->stopping) {
         return;
     }
@@ -499,28 +460,25 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     aio_context_acquire(s->ctx);
 
     /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
-
-    /* Complete pending requests */
-    while (s->num_reqs > 0) {
-        aio_poll(s->ctx, true);
+    for (i = 0; i < s->num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->queues[i].host_notifier, NULL);
     }
 
-    /* Stop ioq callbacks (there are no pending requests left) */
-    aio_set_event_notifier(s->ctx, &s->io_notifier, NULL);
+    /* Complete pending requests and hand the drive back to the main loop */
+    bdrv_set_aio_context(s->bs, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
     /* Sync vring state back to virtqueue so that non-dataplane request
      * processing can continue when we disable the host notifier below.
      */
-    vring_teardown(&s->vring, s->vdev, 0);
-
-    ioq_cleanup(&s->ioqueue);
-    k->set_host_notifier(qbus->parent, 0, false);
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
     /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
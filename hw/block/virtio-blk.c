@@ -30,6 +30,7 @@
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
@@ -47,8 +48,8 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(vdev, s->vq);
+    virtqueue_push(req->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtio_notify(vdev, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -102,21 +103,22 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     g_free(req);
 }
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = g_malloc(sizeof(*req));
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->next = NULL;
     return req;
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
     if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
+        if (!virtqueue_pop(vq, &req->elem)) {
             g_free(req);
             return NULL;
         }
@@ -409,11 +411,13 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
+    bdrv_io_plug(s->bs);
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -514,6 +518,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = bdrv_enable_write_cache(s->bs);
+    stw_raw(&blkcfg.num_queues, s->blk.num_queues);
     memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
 }
 
@@ -539,12 +544,22 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (s->blk.config_wce) {
         features |= (1 << VIRTIO_BLK_F_CONFIG_WCE);
     }
+    if (s->blk.num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCE);
 
     if (bdrv_is_read_only(s->bs))
         features |= 1 << VIRTIO_BLK_F_RO;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* The dataplane vring code only handles the split layout */
+    if (s->dataplane) {
+        features &= ~(1U << VIRTIO_RING_F_PACKED);
+    }
+#endif
+
     return features;
 }
 
@@ -597,6 +612,10 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     while (req) {
         qemu_put_sbyte(f, 1);
         qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        /* Single queue devices keep the old stream format */
+        if (s->blk.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -617,8 +636,21 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned nvq = 0;
+        VirtIOBlockReq *req;
+
+        req = virtio_blk_alloc_request(s, NULL);
         qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        if (s->blk.num_queues > 1) {
+            nvq = qemu_get_be32(f);
+            if (nvq >= s->blk.num_queues) {
+                error_report("Invalid virtqueue %u in virtio-blk request",
+                             nvq);
+                g_free(req);
+                return -EINVAL;
+            }
+        }
+        req->vq = virtio_get_queue(vdev, nvq);
         req->next = s->rq;
         s->rq = req;
 
@@ -690,6 +722,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     Error *err = NULL;
 #endif
     static int virtio_blk_id;
+    int i;
 
     if (!blk->conf.bs) {
         error_setg(errp, "drive property not set");
@@ -706,6 +739,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "Error setting geometry");
         return;
     }
+    if (blk->num_queues < 1 || blk->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_setg(errp, "num-queues must be between 1 and %d",
+                   VIRTIO_PCI_QUEUE_MAX);
+        return;
+    }
 
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
                 sizeof(struct virtio_blk_config));
@@ -715,7 +753,9 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < blk->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     virtio_blk_data_plane_create(vdev, blk, &s->dataplane, &err);
     if (err != NULL) {
@@ -0,0 +1,607 @@
+/*
+ * Dedicated threads for virtio-net queue pairs
+ *
+ * Copyright 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/virtio-bus.h"
+#include "virtio-net.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "net/vhost_net.h"
+#include "block/aio.h"
+#include "sysemu/iothread.h"
+#include "qom/object_interfaces.h"
+
+typedef struct {
+    int index;                      /* virtqueue number */
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Signalled instead of the guest notifier while the guest has the MSI-X
+     * vector masked, see virtio_net_data_plane_mask().
+     */
+    EventNotifier masked_notifier;
+    EventNotifier *call;            /* one of the two above */
+
+    /* Note that this EventNotifier is assigned by value.  This is fine as
+     * long as you do not call event_notifier_cleanup on it (because you don't
+     * own the file descriptor or handle; you just use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+} VirtIONetDataPlaneVq;
+
+typedef struct {
+    VirtIONetDataPlane *s;
+    NetClientState *nc;             /* the NIC's subqueue */
+    VirtIONetDataPlaneVq rx;
+    VirtIONetDataPlaneVq tx;
+
+    /* Packets are passed to the peer in batches of VIRTIO_NET_TX_BATCH */
+    VirtQueueElement *tx_elems[VIRTIO_NET_TX_BATCH];
+    struct iovec (*tx_sg)[VIRTQUEUE_MAX_SIZE];
+    VirtQueueElement *async_tx;     /* queued by the peer */
+
+    /* Each queue pair and its peer run in a thread of their own */
+    IOThread iothread;
+    AioContext *ctx;
+} VirtIONetDataPlaneQueue;
+
+struct VirtIONetDataPlane {
+    bool started;
+    VirtIONet *n;
+    int num_queues;                 /* queue pairs in use while started */
+    VirtIONetDataPlaneQueue *queues;    /* n->max_queues of them */
+};
+
+static VirtIONetDataPlaneVq *get_vq(VirtIONetDataPlane *s, int idx)
+{
+    VirtIONetDataPlaneQueue *q = &s->queues[idx / 2];
+
+    return idx % 2 ? &q->tx : &q->rx;
+}
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIONetDataPlane *s, VirtIONetDataPlaneVq *vq)
+{
+    if (!vring_should_notify(VIRTIO_DEVICE(s->n), &vq->vring)) {
+        return;
+    }
+
+    event_notifier_set(vq->call);
+}
+
+/* RX */
+
+/*
+ * Copies one packet into as many receive buffers as it takes.  Returns 1 if
+ * the packet was put into the ring, 0 if there were not enough buffers and
+ * -1 if the packet has to be dropped.  Buffers are only taken from the ring
+ * if the whole packet fits.
+ */
+static int fill_rx(VirtIONetDataPlaneQueue *q, const uint8_t *buf,
+                   size_t size)
+{
+    VirtIONet *n = q->s->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *first = NULL;
+    size_t offset = 0, first_len = 0;
+    unsigned int num = 0;
+    int ret;
+
+    while (offset < size) {
+        VirtQueueElement *elem;
+        size_t guest_offset, total = 0, len;
+
+        ret = vring_pop(vdev, &q->rx.vring, &elem);
+        if (ret < 0) {
+            ret = ret == -EAGAIN ? 0 : -1;
+            goto out;
+        }
+
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            vring_set_broken(&q->rx.vring);
+            vring_free_element(elem);
+            ret = -1;
+            goto out;
+        }
+
+        if (num == 0) {
+            virtio_net_receive_header(n, elem->in_sg, elem->in_num,
+                                      buf, size);
+            offset = n->host_hdr_len;
+            total = n->guest_hdr_len;
+            guest_offset = n->guest_hdr_len;
+        } else {
+            guest_offset = 0;
+        }
+
+        len = iov_from_buf(elem->in_sg, elem->in_num, guest_offset,
+                           buf + offset, size - offset);
+        total += len;
+        offset += len;
+        num++;
+
+        /* The first buffer waits for num_buffers below, the others can be
+         * put into the used ring right away; it is only published by
+         * vring_flush().
+         */
+        if (num == 1) {
+            first = elem;
+            first_len = total;
+        } else {
+            vring_fill(&q->rx.vring, elem, total, num - 1);
+        }
+
+        if (!n->mergeable_rx_bufs && offset < size) {
+            ret = -1;           /* truncated, drop it */
+            goto out;
+        }
+    }
+
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        stw_p(&num_buffers, num);
+        iov_from_buf(first->in_sg, first->in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+    vring_fill(&q->rx.vring, first, first_len, 0);
+    vring_flush(&q->rx.vring, num);
+    return 1;
+
+out:
+    /* Hand the buffers back, the guest never saw them used */
+    if (first) {
+        vring_free_element(first);
+    }
+    vring_rewind(&q->rx.vring, num);
+    return ret;
+}
+
+/* Context: the queue pair's AioContext held */
+ssize_t virtio_net_data_plane_receive(VirtIONetDataPlane *s, int queue_index,
+                                      const uint8_t *buf, size_t size,
+                                      bool *filled)
+{
+    VirtIONetDataPlaneQueue *q = &s->queues[queue_index];
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->n);
+    int ret;
+
+    ret = fill_rx(q, buf, size);
+    if (ret == 0) {
+        /* Wait for the guest to add buffers.  Those it added before it could
+         * see the notification enabled are found by trying once more.
+         */
+        vring_enable_notification(vdev, &q->rx.vring);
+        ret = fill_rx(q, buf, size);
+        if (ret == 0) {
+            return 0;
+        }
+        vring_disable_notification(vdev, &q->rx.vring);
+    }
+
+    if (ret > 0) {
+        *filled = true;
+    }
+    return size;
+}
+
+/* Context: the queue pair's AioContext held */
+void virtio_net_data_plane_notify_rx(VirtIONetDataPlane *s, int queue_index)
+{
+    notify_guest(s, &s->queues[queue_index].rx);
+}
+
+static void handle_rx(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              rx.host_notifier);
+
+    event_notifier_test_and_clear(e);
+    qemu_flush_queued_packets(q->nc);
+}
+
+/* TX */
+
+static void tx_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetDataPlaneQueue *q = &n->dataplane->queues[nc->queue_index];
+
+    vring_push(&q->tx.vring, q->async_tx, 0);
+    q->async_tx = NULL;
+    notify_guest(q->s, &q->tx);
+
+    /* Pick up where flush_tx() stopped */
+    event_notifier_set(&q->tx.host_notifier);
+}
+
+static int flush_tx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONet *n = q->s->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    NetBatchPacket pkts[VIRTIO_NET_TX_BATCH];
+    int num_packets = 0;
+
+    if (q->async_tx) {
+        return -EBUSY;
+    }
+
+    while (num_packets < n->tx_burst) {
+        int count = 0, sent, i;
+
+        while (count < VIRTIO_NET_TX_BATCH &&
+               num_packets + count < n->tx_burst) {
+            VirtQueueElement *elem;
+            unsigned int out_num;
+            struct iovec *out_sg;
+
+            if (vring_pop(vdev, &q->tx.vring, &elem) < 0) {
+                break;
+            }
+
+            if (elem->out_num < 1) {
+                error_report("virtio-net header not in first element");
+                vring_set_broken(&q->tx.vring);
+                vring_free_element(elem);
+                break;
+            }
+
+            out_num = elem->out_num;
+            out_sg = elem->out_sg;
+            if (n->host_hdr_len != n->guest_hdr_len) {
+                struct iovec *sg;
+
+                if (!q->tx_sg) {
+                    q->tx_sg = g_malloc(VIRTIO_NET_TX_BATCH *
+                                        sizeof(*q->tx_sg));
+                }
+                sg = q->tx_sg[count];
+                out_num = iov_copy(sg, VIRTQUEUE_MAX_SIZE,
+                                   elem->out_sg, elem->out_num,
+                                   0, n->host_hdr_len);
+                out_num += iov_copy(sg + out_num, VIRTQUEUE_MAX_SIZE - out_num,
+                                    elem->out_sg, elem->out_num,
+                                    n->guest_hdr_len, -1);
+                out_sg = sg;
+            }
+
+            q->tx_elems[count] = elem;
+            pkts[count].iov = out_sg;
+            pkts[count].iovcnt = out_num;
+            count++;
+        }
+
+        if (count == 0) {
+            break;
+        }
+
+        sent = qemu_send_batch_async(q->nc, pkts, count, tx_complete);
+
+        for (i = 0; i < sent; i++) {
+            vring_fill(&q->tx.vring, q->tx_elems[i], 0, i);
+        }
+        if (sent) {
+            vring_flush(&q->tx.vring, sent);
+            notify_guest(q->s, &q->tx);
+        }
+        num_packets += sent;
+
+        if (sent < count) {
+            /* The peer queued one packet, the rest goes back to the ring */
+            for (i = sent + 1; i < count; i++) {
+                vring_free_element(q->tx_elems[i]);
+            }
+            vring_rewind(&q->tx.vring, count - sent - 1);
+            q->async_tx = q->tx_elems[sent];
+            return -EBUSY;
+        }
+    }
+    return num_packets;
+}
+
+static void handle_tx(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              tx.host_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->s->n);
+    int ret;
+
+    event_notifier_test_and_clear(e);
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &q->tx.vring);
+
+        ret = flush_tx(q);
+        if (ret == -EBUSY) {
+            return;     /* tx_complete() kicks us again */
+        }
+        if (ret >= q->s->n->tx_burst) {
+            /* Let the rx side and the peer have a go before the rest */
+            event_notifier_set(e);
+            return;
+        }
+
+        /* But if the guest has snuck in more descriptors, keep processing */
+        if (vring_enable_notification(vdev, &q->tx.vring)) {
+            return;
+        }
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp)
+{
+    VirtIONetDataPlane *s;
+    int i;
+
+    *dataplane = NULL;
+
+    if (!n->net_conf.data_plane) {
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!peer || !peer->info->set_aio_context) {
+            error_setg(errp, "x-data-plane needs a tap or user netdev "
+                       "for every queue");
+            return;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "x-data-plane cannot be used with vhost");
+            return;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->n = n;
+    s->queues = g_new0(VirtIONetDataPlaneQueue, n->max_queues);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->nc = qemu_get_subqueue(n->nic, i);
+        event_notifier_init(&q->rx.masked_notifier, 0);
+        event_notifier_init(&q->tx.masked_notifier, 0);
+
+        object_initialize(&q->iothread, sizeof(q->iothread), TYPE_IOTHREAD);
+        user_creatable_complete(OBJECT(&q->iothread), &error_abort);
+        q->ctx = iothread_get_aio_context(&q->iothread);
+    }
+
+    *dataplane = s;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    for (i = 0; i < s->n->max_queues; i++) {
+        VirtIONetDataPlaneQueue *q = &s->queues[i];
+
+        object_unref(OBJECT(&q->iothread));
+        event_notifier_cleanup(&q->rx.masked_notifier);
+        event_notifier_cleanup(&q->tx.masked_notifier);
+        g_free(q->tx_sg);
+    }
+    g_free(s->queues);
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held */
+int virtio_net_data_plane_start(VirtIONetDataPlane *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i, nvqs, r;
+
+    if (s->started) {
+        return 0;
+    }
+
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_report("virtio-net: binding does not support host notifiers");
+        return -ENOSYS;
+    }
+
+    s->num_queues = s->n->multiqueue ? s->n->max_queues : 1;
+    nvqs = s->num_queues * 2;
+
+    for (i = 0; i < nvqs; i++) {
+        VirtIONetDataPlaneVq *vq = get_vq(s, i);
+
+        if (!vring_setup(&vq->vring, vdev, i)) {
+            r = -EFAULT;
+            goto fail_vrings;
+        }
+        vq->index = i;
+        vq->guest_notifier =
+            virtio_queue_get_guest_notifier(virtio_get_queue(vdev, i));
+        vq->call = vq->guest_notifier;
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r < 0) {
+        error_report("virtio-net: failed to set guest notifiers (%d), "
+                     "ensure -enable-kvm is set", -r);
+        goto fail_vrings;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        VirtIONetDataPlaneVq *vq = get_vq(s, i);
+
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r < 0) {
+            error_report("virtio-net: failed to set host notifier (%d)", -r);
+            while (--i >= 0) {
+                k->set_host_notifier(qbus->parent, i, false);
+            }
+            k->set_guest_notifiers(qbus->parent, nvqs, false);
+            i = nvqs;
+            goto fail_vrings;
+        }
+        vq->host_notifier =
+            *virtio_queue_get_host_notifier(virtio_get_queue(vdev, i));
+    }
+
+    s->started = true;
+
+    /* virtio-net hands received packets to us from now on */
+    s->n->dataplane_started = true;
+
+    /* Move each peer next to its queue pair and get the show started by
+     * kicking right away to process what is already in the vrings.
+     */
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIONetDataPlaneQueue *q = &s->queues[i];
+
+        aio_context_acquire(q->ctx);
+        r = qemu_net_set_aio_context(q->nc->peer, q->ctx);
+        if (r < 0) {
+            aio_context_release(q->ctx);
+            error_report("virtio-net: cannot move netdev of queue %d "
+                         "to its IOThread (%d)", i, -r);
+            virtio_net_data_plane_stop(s);
+            return r;
+        }
+        aio_set_event_notifier(q->ctx, &q->rx.host_notifier, handle_rx);
+        aio_set_event_notifier(q->ctx, &q->tx.host_notifier, handle_tx);
+        event_notifier_set(&q->rx.host_notifier);
+        event_notifier_set(&q->tx.host_notifier);
+        aio_context_release(q->ctx);
+    }
+    return 0;
+
+fail_vrings:
+    while (--i >= 0) {
+        vring_teardown(&get_vq(s, i)->vring, vdev, i);
+    }
+    return r;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i, nvqs = s->num_queues * 2;
+
+    if (!s->started) {
+        return;
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIONetDataPlaneQueue *q = &s->queues[i];
+
+        aio_context_acquire(q->ctx);
+
+        /* Stop notifications for new packets from guest */
+        aio_set_event_notifier(q->ctx, &q->rx.host_notifier, NULL);
+        aio_set_event_notifier(q->ctx, &q->tx.host_notifier, NULL);
+
+        /* Hand the peer back to the main loop; this is a no-op for one
+         * that a failed start never moved.
+         */
+        qemu_net_set_aio_context(q->nc->peer, NULL);
+
+        /* The packet the peer queued would complete into a stopped
+         * dataplane, drop it instead.
+         */
+        if (q->async_tx) {
+            qemu_purge_queued_packets(q->nc);
+            vring_push(&q->tx.vring, q->async_tx, 0);
+            q->async_tx = NULL;
+        }
+
+        aio_context_release(q->ctx);
+    }
+
+    /* Before the vrings go: disabling the host notifiers below processes
+     * pending kicks, and the rx ones deliver queued packets.
+     */
+    s->n->dataplane_started = false;
+
+    /* Sync vring state back to virtqueue so that non-dataplane packet
+     * processing can continue when we disable the host notifier below.
+     */
+    for (i = 0; i < nvqs; i++) {
+        vring_teardown(&get_vq(s, i)->vring, vdev, i);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+
+    s->started = false;
+}
+
+/* Takes the AioContexts of all queue pairs, for changes to state that the
+ * IOThreads use, like the receive filter.
+ *
+ * Context: QEMU global mutex held
+ */
+void virtio_net_data_plane_acquire(VirtIONetDataPlane *s)
+{
+    int i;
+
+    for (i = 0; i < s->n->max_queues; i++) {
+        aio_context_acquire(s->queues[i].ctx);
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_release(VirtIONetDataPlane *s)
+{
+    int i;
+
+    for (i = s->n->max_queues - 1; i >= 0; i--) {
+        aio_context_release(s->queues[i].ctx);
+    }
+}
+
+/* Called by the transport for virtqueue @idx whose MSI-X vector the guest
+ * masks or unmasks.  The irqfd stays set up, so interrupts are redirected
+ * to a notifier of our own while masked.
+ *
+ * Context: QEMU global mutex held
+ */
+void virtio_net_data_plane_mask(VirtIONetDataPlane *s, int idx, bool mask)
+{
+    VirtIONetDataPlaneQueue *q = &s->queues[idx / 2];
+    VirtIONetDataPlaneVq *vq = get_vq(s, idx);
+
+    aio_context_acquire(q->ctx);
+    vq->call = mask ? &vq->masked_notifier : vq->guest_notifier;
+    aio_context_release(q->ctx);
+}
+
+/* Context: QEMU global mutex held */
+bool virtio_net_data_plane_pending(VirtIONetDataPlane *s, int idx)
+{
+    return event_notifier_test_and_clear(&get_vq(s, idx)->masked_notifier);
+}
@@ -0,0 +1,33 @@
+/*
+ * Dedicated threads for virtio-net queue pairs
+ *
+ * Copyright 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio-net.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+void virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+int virtio_net_data_plane_start(VirtIONetDataPlane *s);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+void virtio_net_data_plane_acquire(VirtIONetDataPlane *s);
+void virtio_net_data_plane_release(VirtIONetDataPlane *s);
+void virtio_net_data_plane_mask(VirtIONetDataPlane *s, int idx, bool mask);
+bool virtio_net_data_plane_pending(VirtIONetDataPlane *s, int idx);
+ssize_t virtio_net_data_plane_receive(VirtIONetDataPlane *s, int queue_index,
+                                      const uint8_t *buf, size_t size,
+                                      bool *filled);
+void virtio_net_data_plane_notify_rx(VirtIONetDataPlane *s, int queue_index);
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
@@ -59,6 +59,7 @@
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "qemu/iov.h"
+#include "net/checksum.h"
 
 /* debug RTL8139 card */
 //#define DEBUG_RTL8139 1
@@ -1923,32 +1924,10 @@ typedef struct ip_pseudo_header
 #define TCP_FLAG_FIN  0x01
 #define TCP_FLAG_PUSH 0x08
 
-/* produces ones' complement sum of data */
-static uint16_t ones_complement_sum(uint8_t *data, size_t len)
-{
-    uint32_t result = 0;
-
-    for (; len > 1; data+=2, len-=2)
-    {
-        result += *(uint16_t*)data;
-    }
-
-    /* add the remainder byte */
-    if (len)
-    {
-        uint8_t odd[2] = {*data, 0};
-        result += *(uint16_t*)odd;
-    }
-
-    while (result>>16)
-        result = (result & 0xffff) + (result >> 16);
-
-    return result;
-}
-
+/* returns the checksum in network byte order */
 static uint16_t ip_checksum(void *data, size_t len)
 {
-    return ~ones_complement_sum((uint8_t*)data, len);
+    return cpu_to_be16(net_raw_checksum(data, len));
 }
 
 static int rtl8139_cplus_transmit_one(RTL8139State *s)
@@ -2254,6 +2233,8 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
                     for (tcp_send_offset = 0; tcp_send_offset < tcp_data_len; tcp_send_offset += tcp_chunk_size)
                     {
                         uint16_t chunk_size = tcp_chunk_size;
+                        uint8_t *chunk = (uint8_t *)p_tcp_hdr + tcp_hlen;
+                        uint32_t chunk_sum;
 
                         /* check if this is the last frame */
                         if (tcp_send_offset + tcp_chunk_size >= tcp_data_len)
@@ -2273,9 +2254,15 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
                             "packet with %d bytes data\n", tcp_hlen +
                             chunk_size);
 
+                        /* the payload is summed up while it is moved */
                         if (tcp_send_offset)
                         {
-                            memcpy((uint8_t*)p_tcp_hdr + tcp_hlen, (uint8_t*)p_tcp_hdr + tcp_hlen + tcp_send_offset, chunk_size);
+                            chunk_sum = net_checksum_copy(chunk_size, chunk,
+                                                          chunk + tcp_send_offset);
+                        }
+                        else
+                        {
+                            chunk_sum = net_checksum_add(chunk_size, chunk);
                         }
 
                         /* keep PUSH and FIN flags only for the last frame */
@@ -2292,7 +2279,8 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
 
                         p_tcp_hdr->th_sum = 0;
 
-                        int tcp_checksum = ip_checksum(data_to_checksum, tcp_hlen + chunk_size + 12);
+                        chunk_sum += net_checksum_add(tcp_hlen + 12, data_to_checksum);
+                        int tcp_checksum = cpu_to_be16(net_checksum_finish(chunk_sum));
                         DPRINTF("+++ C+ mode TSO TCP checksum %04x\n",
                             tcp_checksum);
 
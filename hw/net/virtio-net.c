@@ -23,6 +23,10 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
 #include "monitor/monitor.h"
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+# include "dataplane/virtio-net.h"
+# include "migration/migration.h"
+#endif
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -105,14 +109,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     NetClientState *nc = qemu_get_queue(n->nic);
     int queues = n->multiqueue ? n->max_queues : 1;
 
-    if (!nc->peer) {
-        return;
-    }
-    if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
-
-    if (!tap_get_vhost_net(nc->peer)) {
+    if (!get_vhost_net(nc->peer)) {
         return;
     }
 
@@ -122,7 +119,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(nc->peer), vdev)) {
+        if (!vhost_net_query(get_vhost_net(nc->peer), vdev)) {
             return;
         }
         n->vhost_started = 1;
@@ -138,6 +135,30 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_data_plane_status(VirtIONet *n, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    NetClientState *nc = qemu_get_queue(n->nic);
+
+    if (!n->dataplane || n->vhost_started) {
+        return;
+    }
+
+    if (n->dataplane_started ==
+        (virtio_net_started(n, status) && nc->peer && !nc->peer->link_down)) {
+        return;
+    }
+    if (!n->dataplane_started) {
+        if (virtio_net_data_plane_start(n->dataplane) < 0) {
+            error_report("unable to start virtio-net dataplane: "
+                         "falling back on userspace virtio");
+        }
+    } else {
+        virtio_net_data_plane_stop(n->dataplane);
+    }
+#endif
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -146,6 +167,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_data_plane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -160,7 +182,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             continue;
         }
 
-        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+        if (virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !n->dataplane_started) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
@@ -452,13 +475,17 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return features;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    /* The dataplane vring code only handles the split layout */
+    if (n->dataplane) {
+        features &= ~(1U << VIRTIO_RING_F_PACKED);
     }
-    if (!tap_get_vhost_net(nc->peer)) {
+#endif
+
+    if (!get_vhost_net(nc->peer)) {
         return features;
     }
-    return vhost_net_get_features(tap_get_vhost_net(nc->peer), features);
+    return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -522,13 +549,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
-        if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+        if (!get_vhost_net(nc->peer)) {
             continue;
         }
-        if (!tap_get_vhost_net(nc->peer)) {
-            continue;
-        }
-        vhost_net_ack_features(tap_get_vhost_net(nc->peer), features);
+        vhost_net_ack_features(get_vhost_net(nc->peer), features);
     }
 
     if ((1 << VIRTIO_NET_F_CTRL_VLAN) & features) {
@@ -765,6 +789,25 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
 
     return VIRTIO_NET_OK;
 }
+
+static void virtio_net_lock(VirtIONet *n)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane) {
+        virtio_net_data_plane_acquire(n->dataplane);
+    }
+#endif
+}
+
+static void virtio_net_unlock(VirtIONet *n)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane) {
+        virtio_net_data_plane_release(n->dataplane);
+    }
+#endif
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -786,6 +829,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov_cnt = elem.out_num;
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
+
+        /* The IOThreads use the receive filter and the offloads */
+        virtio_net_lock(n);
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
@@ -799,6 +845,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
+        virtio_net_unlock(n);
 
         s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
@@ -890,8 +937,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
     }
 }
 
-static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+void virtio_net_receive_header(VirtIONet *n, const struct iovec *iov,
+                               int iov_cnt, const void *buf, size_t size)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -959,7 +1006,12 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/*
+ * Like virtio_net_receive(), but leaves notifying the guest to the caller;
+ * *filled is set if the packet was put into the receive ring.
+ */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size, bool *filled)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -973,6 +1025,16 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return -1;
     }
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_started) {
+        if (!receive_filter(n, buf, size)) {
+            return size;
+        }
+        return virtio_net_data_plane_receive(n->dataplane, nc->queue_index,
+                                             buf, size, filled);
+    }
+#endif
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1015,7 +1077,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            virtio_net_receive_header(n, sg, elem.in_num, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1054,11 +1116,74 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    *filled = true;
 
     return size;
 }
 
+static void virtio_net_notify_rx(VirtIONet *n, VirtIONetQueue *q)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_started) {
+        virtio_net_data_plane_notify_rx(n->dataplane, q - n->vqs);
+        return;
+    }
+#endif
+    virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool filled = false;
+    ssize_t ret;
+
+    ret = virtio_net_do_receive(nc, buf, size, &filled);
+    if (filled) {
+        virtio_net_notify_rx(n, q);
+    }
+    return ret;
+}
+
+/* Fills the receive ring with a whole batch and notifies the guest once */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetBatchPacket *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    uint8_t *flat = NULL;
+    bool filled = false;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const struct iovec *iov = pkts[i].iov;
+
+        if (pkts[i].iovcnt == 1) {
+            ret = virtio_net_do_receive(nc, iov->iov_base, iov->iov_len,
+                                        &filled);
+        } else {
+            size_t size;
+
+            if (!flat) {
+                flat = g_malloc(NET_BUFSIZE);
+            }
+            size = iov_to_buf(iov, pkts[i].iovcnt, 0, flat, NET_BUFSIZE);
+            ret = virtio_net_do_receive(nc, flat, size, &filled);
+        }
+        if (ret == 0) {
+            break;
+        }
+    }
+
+    if (filled) {
+        virtio_net_notify_rx(n, q);
+    }
+    g_free(flat);
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1081,7 +1206,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    NetBatchPacket pkts[VIRTIO_NET_TX_BATCH];
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1095,52 +1220,80 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
-        ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    if (!q->tx_elems) {
+        q->tx_elems = g_new(VirtQueueElement, VIRTIO_NET_TX_BATCH);
+    }
 
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
+    while (num_packets < n->tx_burst) {
+        int count = 0, sent, i;
 
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
+        while (count < VIRTIO_NET_TX_BATCH &&
+               num_packets + count < n->tx_burst &&
+               virtqueue_pop(q->tx_vq, &q->tx_elems[count])) {
+            VirtQueueElement *elem = &q->tx_elems[count];
+            unsigned int out_num = elem->out_num;
+            struct iovec *out_sg = &elem->out_sg[0];
 
-        len = n->guest_hdr_len;
+            if (out_num < 1) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            q->async_tx.len  = len;
-            return -EBUSY;
+            /*
+             * If host wants to see the guest header as is, we can
+             * pass it on unchanged. Otherwise, copy just the parts
+             * that host is interested in.
+             */
+            assert(n->host_hdr_len <= n->guest_hdr_len);
+            if (n->host_hdr_len != n->guest_hdr_len) {
+                struct iovec *sg;
+                unsigned sg_num;
+
+                if (!q->tx_sg) {
+                    q->tx_sg = g_malloc(VIRTIO_NET_TX_BATCH *
+                                        sizeof(*q->tx_sg));
+                }
+                sg = q->tx_sg[count];
+                sg_num = iov_copy(sg, VIRTQUEUE_MAX_SIZE,
+                                  out_sg, out_num,
+                                  0, n->host_hdr_len);
+                sg_num += iov_copy(sg + sg_num, VIRTQUEUE_MAX_SIZE - sg_num,
+                                   out_sg, out_num,
+                                   n->guest_hdr_len, -1);
+                out_num = sg_num;
+                out_sg = sg;
+            }
+
+            pkts[count].iov = out_sg;
+            pkts[count].iovcnt = out_num;
+            count++;
         }
 
-        len += ret;
+        if (count == 0) {
+            break;
+        }
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        sent = qemu_send_batch_async(qemu_get_subqueue(n->nic, queue_index),
+                                     pkts, count, virtio_net_tx_complete);
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+        for (i = 0; i < sent; i++) {
+            virtqueue_fill(q->tx_vq, &q->tx_elems[i], 0, i);
+        }
+        if (sent) {
+            virtqueue_flush(q->tx_vq, sent);
+            virtio_notify(vdev, q->tx_vq);
+        }
+        num_packets += sent;
+
+        if (sent < count) {
+            /* The peer queued one packet, the rest goes back to the ring */
+            for (i = count - 1; i > sent; i--) {
+                virtqueue_discard(q->tx_vq, &q->tx_elems[i], 0);
+            }
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = q->tx_elems[sent];
+            q->async_tx.len  = n->guest_hdr_len;
+            return -EBUSY;
         }
     }
     return num_packets;
@@ -1151,6 +1304,11 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    /* Without ioeventfd, kicks for a vhost-user backend still come here */
+    if (n->vhost_started) {
+        return;
+    }
+
     /* This happens when device was stopped but VCPU wasn't. */
     if (!vdev->vm_running) {
         q->tx_waiting = 1;
@@ -1175,7 +1333,8 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
-    if (unlikely(q->tx_waiting)) {
+    /* Without ioeventfd, kicks for a vhost-user backend still come here */
+    if (n->vhost_started || unlikely(q->tx_waiting)) {
         return;
     }
     q->tx_waiting = 1;
@@ -1466,6 +1625,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
@@ -1475,8 +1635,13 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (!n->vhost_started && n->dataplane) {
+        return virtio_net_data_plane_pending(n->dataplane, idx);
+    }
+#endif
     assert(n->vhost_started);
-    return vhost_net_virtqueue_pending(tap_get_vhost_net(nc->peer), idx);
+    return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
 
 static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
@@ -1484,8 +1649,14 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (!n->vhost_started && n->dataplane) {
+        virtio_net_data_plane_mask(n->dataplane, idx, mask);
+        return;
+    }
+#endif
     assert(n->vhost_started);
-    vhost_net_virtqueue_mask(tap_get_vhost_net(nc->peer),
+    vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
 }
 
@@ -1524,11 +1695,49 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+/* Disable dataplane threads during live migration since they do not
+ * update the dirty memory bitmap.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet,
+                                migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+    Error *err = NULL;
+
+    if (migration_in_setup(mig)) {
+        if (!n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_status(n, 0);
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_create(n, &n->dataplane, &err);
+        if (err != NULL) {
+            error_report("%s", error_get_pretty(err));
+            error_free(err);
+            return;
+        }
+        virtio_net_set_status(vdev, vdev->status);
+    }
+}
+#endif /* CONFIG_VIRTIO_NET_DATA_PLANE */
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    Error *err = NULL;
+#endif
     int i;
 
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
@@ -1586,6 +1795,25 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->nic_conf.macaddr.a);
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    virtio_net_data_plane_create(n, &n->dataplane, &err);
+    if (err != NULL) {
+        error_propagate(errp, err);
+        if (n->vqs[0].tx_timer) {
+            timer_del(n->vqs[0].tx_timer);
+            timer_free(n->vqs[0].tx_timer);
+        } else {
+            qemu_bh_delete(n->vqs[0].tx_bh);
+        }
+        g_free(n->vqs);
+        qemu_del_nic(n->nic);
+        virtio_cleanup(vdev);
+        return;
+    }
+    n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+    add_migration_state_change_notifier(&n->migration_state_notifier);
+#endif
+
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
     virtio_net_set_mrg_rx_bufs(n, 0);
@@ -1614,6 +1842,12 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    remove_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
+#endif
+
     unregister_savevm(dev, "virtio-net", n);
 
     if (n->netclient_name) {
@@ -1640,6 +1874,8 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         } else if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
+        g_free(q->tx_elems);
+        g_free(q->tx_sg);
     }
 
     g_free(n->vqs);
@@ -1664,6 +1900,9 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONet, net_conf.data_plane, 0, false),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
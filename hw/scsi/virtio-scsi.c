@@ -25,6 +25,7 @@ typedef struct VirtIOSCSIReq {
     VirtQueueElement elem;
     QEMUSGList qsgl;
     SCSIRequest *sreq;
+    QTAILQ_ENTRY(VirtIOSCSIReq) next;
     union {
         char                  *buf;
         VirtIOSCSICmdReq      *cmd;
@@ -368,7 +369,8 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSICommon *vs = &s->parent_obj;
 
-    VirtIOSCSIReq *req;
+    VirtIOSCSIReq *req, *next;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
     int n;
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
@@ -412,10 +414,25 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
             }
         }
 
+        /* Submit the requests only after the whole queue has been parsed,
+         * so that the block layer can batch them */
+        if (d->conf.bs) {
+            bdrv_io_plug(d->conf.bs);
+        }
+        QTAILQ_INSERT_TAIL(&reqs, req, next);
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        BlockDriverState *bs = req->sreq->dev->conf.bs;
+
+        QTAILQ_REMOVE(&reqs, req, next);
         n = scsi_req_enqueue(req->sreq);
         if (n) {
             scsi_req_continue(req->sreq);
         }
+        if (bs) {
+            bdrv_io_unplug(bs);
+        }
     }
 }
 
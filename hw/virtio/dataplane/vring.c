@@ -412,11 +412,13 @@ out:
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+/* Fill the used ring entry @idx slots past the last flushed one, without
+ * making it visible to the guest yet.  Frees @elem. */
+void vring_fill(Vring *vring, VirtQueueElement *elem, int len,
+                unsigned int idx)
 {
     struct vring_used_elem *used;
     unsigned int head = elem->index;
-    uint16_t new;
 
     vring_free_element(elem);
 
@@ -427,15 +429,34 @@ void vring_push(Vring *vring, VirtQueueElement *elem, int len)
 
     /* The virtqueue contains a ring of used buffers.  Get a pointer to the
      * next entry in that used ring. */
-    used = &vring->vr.used->ring[vring->last_used_idx % vring->vr.num];
+    used = &vring->vr.used->ring[(vring->last_used_idx + idx) %
+                                 vring->vr.num];
     used->id = head;
     used->len = len;
+}
+
+/* Publish @count used ring entries written with vring_fill() */
+void vring_flush(Vring *vring, unsigned int count)
+{
+    uint16_t old, new;
+
+    if (vring->broken) {
+        return;
+    }
 
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
-    new = vring->vr.used->idx = ++vring->last_used_idx;
-    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+    old = vring->last_used_idx;
+    new = vring->vr.used->idx = vring->last_used_idx = old + count;
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - old))) {
         vring->signalled_used_valid = false;
     }
 }
+
+void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+{
+    vring_fill(vring, elem, len, 0);
+    vring_flush(vring, 1);
+}
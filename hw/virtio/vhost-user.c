@@ -0,0 +1,327 @@
+/*
+ * vhost backend: vhost-user
+ *
+ * Forwards vhost requests over a unix domain socket to a vhost
+ * implementation in another process.  Guest memory and the virtqueue
+ * eventfds are passed along as file descriptors.  The protocol is
+ * described in docs/specs/vhost-user.txt.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-backend.h"
+#include "hw/virtio/vhost-user.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "sysemu/kvm.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    switch (request) {
+    case VHOST_GET_FEATURES:
+        return VHOST_USER_GET_FEATURES;
+    case VHOST_SET_FEATURES:
+        return VHOST_USER_SET_FEATURES;
+    case VHOST_SET_OWNER:
+        return VHOST_USER_SET_OWNER;
+    case VHOST_RESET_OWNER:
+        return VHOST_USER_RESET_OWNER;
+    case VHOST_SET_MEM_TABLE:
+        return VHOST_USER_SET_MEM_TABLE;
+    case VHOST_SET_VRING_NUM:
+        return VHOST_USER_SET_VRING_NUM;
+    case VHOST_SET_VRING_ADDR:
+        return VHOST_USER_SET_VRING_ADDR;
+    case VHOST_SET_VRING_BASE:
+        return VHOST_USER_SET_VRING_BASE;
+    case VHOST_GET_VRING_BASE:
+        return VHOST_USER_GET_VRING_BASE;
+    case VHOST_SET_VRING_KICK:
+        return VHOST_USER_SET_VRING_KICK;
+    case VHOST_SET_VRING_CALL:
+        return VHOST_USER_SET_VRING_CALL;
+    case VHOST_SET_VRING_ERR:
+        return VHOST_USER_SET_VRING_ERR;
+    default:
+        return VHOST_USER_NONE;
+    }
+}
+
+/*
+ * Without ioeventfd the guest's kicks are handled inside QEMU and can't be
+ * forwarded, so the slave is told to poll the avail ring instead.
+ */
+static bool vhost_user_kick_fd_enabled(void)
+{
+    return kvm_enabled();
+}
+
+static int vhost_user_write(int fd, VhostUserMsg *msg, int *fds, int fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = size,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    assert(fd_num <= VHOST_MEMORY_MAX_NREGIONS);
+    if (fd_num) {
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_num * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_num * sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_num * sizeof(int));
+    }
+
+    do {
+        r = sendmsg(fd, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        return -1;
+    }
+
+    /* The fds went with the first byte, the rest is plain data */
+    if (r < size && send_all(fd, (uint8_t *)msg + r, size - r) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_read(int fd, VhostUserMsg *msg)
+{
+    ssize_t r;
+
+    r = qemu_recv_full(fd, msg, VHOST_USER_HDR_SIZE, 0);
+    if (r != VHOST_USER_HDR_SIZE) {
+        error_report("vhost-user: failed to read reply header");
+        goto fail;
+    }
+
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+        error_report("vhost-user: bad reply flags 0x%x", msg->flags);
+        goto fail;
+    }
+
+    if (msg->size > sizeof(*msg) - VHOST_USER_HDR_SIZE) {
+        error_report("vhost-user: reply payload too large (%u bytes)",
+                     msg->size);
+        goto fail;
+    }
+
+    if (msg->size) {
+        r = qemu_recv_full(fd, &msg->u64, msg->size, 0);
+        if (r != msg->size) {
+            error_report("vhost-user: failed to read reply payload");
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    errno = EIO;
+    return -1;
+}
+
+/* Adds the regions of the vhost memory table that can be passed by fd */
+static int vhost_user_fill_mem_table(struct vhost_dev *dev, VhostUserMsg *msg,
+                                     int *fds)
+{
+    int i, fd_num = 0;
+
+    for (i = 0; i < dev->mem->nregions; i++) {
+        struct vhost_memory_region *reg = dev->mem->regions + i;
+        ram_addr_t ram_addr, offset;
+        int fd;
+
+        if (!qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                                     &ram_addr)) {
+            continue;
+        }
+        /* Small blocks, like ROMs, may not be file backed; skip them */
+        fd = qemu_get_ram_fd(ram_addr, &offset);
+        if (fd < 0) {
+            continue;
+        }
+
+        if (fd_num == VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user: guest memory has too many regions");
+            errno = E2BIG;
+            return -1;
+        }
+
+        msg->memory.regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
+        msg->memory.regions[fd_num].memory_size = reg->memory_size;
+        msg->memory.regions[fd_num].userspace_addr = reg->userspace_addr;
+        msg->memory.regions[fd_num].mmap_offset = offset;
+        fds[fd_num++] = fd;
+    }
+
+    if (!fd_num) {
+        error_report("vhost-user: guest memory is not shareable, "
+                     "use -mem-path together with -mem-share");
+        errno = EINVAL;
+        return -1;
+    }
+
+    msg->memory.nregions = fd_num;
+    msg->size = offsetof(VhostUserMemory, regions) +
+                fd_num * sizeof(VhostUserMemoryRegion);
+    return fd_num;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    int fd = (uintptr_t) dev->opaque;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    struct vhost_vring_file *file;
+    bool need_reply = false;
+    int fd_num = 0;
+    VhostUserMsg msg;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    memset(&msg, 0, VHOST_USER_HDR_SIZE);
+    msg.request = vhost_user_request_translate(request);
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+        msg.u64 = *(uint64_t *)arg;
+        msg.size = sizeof(msg.u64);
+        break;
+
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        fd_num = vhost_user_fill_mem_table(dev, &msg, fds);
+        if (fd_num < 0) {
+            return -1;
+        }
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        need_reply = true;
+        /* fall through */
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.state);
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        memcpy(&msg.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(msg.addr);
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        file = arg;
+        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.u64);
+        if (file->fd >= 0 && (msg.request != VHOST_USER_SET_VRING_KICK ||
+                              vhost_user_kick_fd_enabled())) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        /* Dirty logging is not supported, see vhost_dev_init() */
+        error_report("vhost-user: unsupported request 0x%lx", request);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (vhost_user_write(fd, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (need_reply) {
+        uint32_t sent_request = msg.request;
+
+        if (vhost_user_read(fd, &msg) < 0) {
+            return -1;
+        }
+        if (msg.request != sent_request) {
+            error_report("vhost-user: reply to request %u, expected %u",
+                         msg.request, sent_request);
+            errno = EIO;
+            return -1;
+        }
+
+        switch (msg.request) {
+        case VHOST_USER_GET_FEATURES:
+            if (msg.size != sizeof(msg.u64)) {
+                goto bad_size;
+            }
+            *(uint64_t *)arg = msg.u64;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            if (msg.size != sizeof(msg.state)) {
+                goto bad_size;
+            }
+            memcpy(arg, &msg.state, sizeof(struct vhost_vring_state));
+            break;
+        default:
+            abort();
+        }
+    }
+
+    return 0;
+
+bad_size:
+    error_report("vhost-user: bad reply size %u for request %u",
+                 msg.size, msg.request);
+    errno = EIO;
+    return -1;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    dev->opaque = opaque;
+
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    int fd = (uintptr_t) dev->opaque;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    dev->opaque = NULL;
+    return close(fd);
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup,
+};
@@ -369,12 +369,19 @@ static void virtio_mmio_realizefn(DeviceState *d, Error **errp)
     sysbus_init_mmio(sbd, &proxy->iomem);
 }
 
+static Property virtio_mmio_properties[] = {
+    DEFINE_PROP_BIT("x-packed-ring", VirtIOMMIOProxy, host_features,
+                    VIRTIO_RING_F_PACKED, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void virtio_mmio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = virtio_mmio_realizefn;
     dc->reset = virtio_mmio_reset;
+    dc->props = virtio_mmio_properties;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
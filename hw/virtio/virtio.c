@@ -18,7 +18,10 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/xen/xen.h"
+#include "qmp-commands.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -27,6 +30,21 @@
  */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
+/*
+ * Interrupt coalescing.  The completion rate of each queue is sampled over
+ * windows of VIRTIO_COALESCE_WINDOW_NS.  Below VIRTIO_COALESCE_RATE_LOW
+ * completions per second every notification injects an interrupt right
+ * away; above it interrupts are held back until enough completions have
+ * accumulated to keep the interrupt rate near VIRTIO_COALESCE_IRQ_RATE,
+ * bounded by the device's coalesce_max_frames and coalesce_max_usecs.
+ */
+#define VIRTIO_COALESCE_WINDOW_NS      (1 * SCALE_MS)
+#define VIRTIO_COALESCE_RATE_LOW       20000
+#define VIRTIO_COALESCE_IRQ_RATE       20000
+
+static QTAILQ_HEAD(, VirtIODevice) virtio_devices =
+    QTAILQ_HEAD_INITIALIZER(virtio_devices);
+
 typedef struct VRingDesc
 {
     uint64_t addr;
@@ -55,6 +73,32 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/*
+ * Packed layout: the descriptor ring is followed by the driver event
+ * suppression structure (kept in vring.avail) and, aligned like the used
+ * ring of the split layout, by the device's (kept in vring.used).
+ */
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A used entry of the packed layout that virtqueue_flush() hasn't written */
+typedef struct VirtQueueUsedElem
+{
+    uint16_t id;
+    uint32_t len;
+} VirtQueueUsedElem;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -69,6 +113,16 @@ struct VirtQueue
     VRing vring;
     hwaddr pa;
     uint16_t last_avail_idx;
+
+    /* Packed layout, see virtqueue_packed_pop() */
+    bool packed;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    uint16_t used_idx;
+    uint16_t used_count;            /* free running, for the event index */
+    uint16_t *packed_ndescs;        /* ring slots of each buffer id */
+    VirtQueueUsedElem *used_elems;  /* filled, not yet flushed */
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -87,67 +141,285 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+
+    /* Host mapping of the ring, see vring_ptr() */
+    uint8_t *ring_ptr;
+    MemoryRegion *ring_mr;
+    unsigned int ring_map_gen;
+
+    /* Interrupt coalescing, see virtqueue_coalesce() */
+    QEMUTimer *coalesce_timer;
+    bool coalesce_pending;
+    uint32_t coalesce_completions;  /* since the last interrupt */
+    uint32_t coalesce_frames;
+    uint32_t coalesce_usecs;
+    int64_t rate_window_start;
+    uint32_t rate_window_completions;
+    uint64_t completion_rate;       /* per second, smoothed */
+
+    /* Statistics, see query-virtio */
+    uint64_t kicks;
+    uint64_t completions;
+    uint64_t notifications;
+    uint64_t interrupts;
+    uint64_t suppressed;
+    uint64_t coalesced;
 };
 
 /* virt queue functions */
+static void virtqueue_unmap_ring(VirtQueue *vq);
+
+static void virtqueue_packed_alloc(VirtQueue *vq)
+{
+    vq->packed_ndescs = g_renew(uint16_t, vq->packed_ndescs, vq->vring.num);
+    vq->used_elems = g_renew(VirtQueueUsedElem, vq->used_elems,
+                             vq->vring.num);
+}
+
 static void virtqueue_init(VirtQueue *vq)
 {
     hwaddr pa = vq->pa;
 
+    vq->packed = !!(vq->vdev->guest_features & (1U << VIRTIO_RING_F_PACKED));
     vq->vring.desc = pa;
-    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
-    vq->vring.used = vring_align(vq->vring.avail +
-                                 offsetof(VRingAvail, ring[vq->vring.num]),
-                                 vq->vring.align);
+    if (vq->packed) {
+        virtqueue_packed_alloc(vq);
+        vq->vring.avail = pa + vq->vring.num * sizeof(VRingPackedDesc);
+        vq->vring.used = vring_align(vq->vring.avail +
+                                     sizeof(VRingPackedDescEvent),
+                                     vq->vring.align);
+    } else {
+        vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
+        vq->vring.used = vring_align(vq->vring.avail +
+                                     offsetof(VRingAvail, ring[vq->vring.num]),
+                                     vq->vring.align);
+    }
+    virtqueue_unmap_ring(vq);
+}
+
+/*
+ * Host mapping of the rings, so that the ring accessors below don't go
+ * through the memory API for every field.  A mapping is dropped when the
+ * ring is moved and whenever the memory map changes; it is made again on
+ * the next access.  Regions with dirty logging are not mapped, and neither
+ * is anything while migration tracks dirty memory, because stores through
+ * the mapping would not be seen.  Without a mapping the accessors fall back
+ * to ld*_phys/st*_phys.
+ */
+static unsigned int virtio_ring_map_gen = 1;
+static bool virtio_ring_map_disabled;
+
+static void virtio_memory_commit(MemoryListener *listener)
+{
+    virtio_ring_map_gen++;
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+static void virtio_memory_log_global_start(MemoryListener *listener)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(&address_space_memory, pa);
+    virtio_ring_map_disabled = true;
+    virtio_ring_map_gen++;
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static void virtio_memory_log_global_stop(MemoryListener *listener)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(&address_space_memory, pa);
+    virtio_ring_map_disabled = false;
+    virtio_ring_map_gen++;
+}
+
+static MemoryListener virtio_memory_listener = {
+    .commit = virtio_memory_commit,
+    .log_global_start = virtio_memory_log_global_start,
+    .log_global_stop = virtio_memory_log_global_stop,
+};
+
+static void virtqueue_unmap_ring(VirtQueue *vq)
+{
+    if (vq->ring_mr) {
+        memory_region_unref(vq->ring_mr);
+        vq->ring_mr = NULL;
+    }
+    vq->ring_ptr = NULL;
+    vq->ring_map_gen = 0;
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static void virtqueue_map_ring(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(&address_space_memory, pa);
+    MemoryRegionSection section;
+    hwaddr size;
+
+    virtqueue_unmap_ring(vq);
+    vq->ring_map_gen = virtio_ring_map_gen;
+
+    if (!vq->vring.desc || virtio_ring_map_disabled || xen_enabled()) {
+        return;
+    }
+
+    if (vq->packed) {
+        size = vq->vring.used + sizeof(VRingPackedDescEvent) - vq->vring.desc;
+    } else {
+        /* Everything up to and including the avail event index */
+        size = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]) +
+               sizeof(uint16_t) - vq->vring.desc;
+    }
+    section = memory_region_find(get_system_memory(), vq->vring.desc, size);
+    if (!section.mr) {
+        return;
+    }
+    if (int128_get64(section.size) < size || section.readonly ||
+        !memory_region_is_ram(section.mr) ||
+        memory_region_is_logging(section.mr)) {
+        memory_region_unref(section.mr);
+        return;
+    }
+
+    vq->ring_mr = section.mr;
+    vq->ring_ptr = (uint8_t *)memory_region_get_ram_ptr(section.mr) +
+                   section.offset_within_region;
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+/* Returns the host address of the ring field at @pa, or NULL */
+static inline uint8_t *vring_ptr(VirtQueue *vq, hwaddr pa)
 {
+    if (unlikely(vq->ring_map_gen != virtio_ring_map_gen)) {
+        virtqueue_map_ring(vq);
+    }
+    return vq->ring_ptr ? vq->ring_ptr + (pa - vq->vring.desc) : NULL;
+}
+
+static inline uint16_t vring_lduw(VirtQueue *vq, hwaddr pa)
+{
+    uint8_t *ptr = vring_ptr(vq, pa);
+
+    return ptr ? lduw_p(ptr) : lduw_phys(&address_space_memory, pa);
+}
+
+static inline void vring_stw(VirtQueue *vq, hwaddr pa, uint16_t val)
+{
+    uint8_t *ptr = vring_ptr(vq, pa);
+
+    if (ptr) {
+        stw_p(ptr, val);
+    } else {
+        stw_phys(&address_space_memory, pa, val);
+    }
+}
+
+static inline void vring_stl(VirtQueue *vq, hwaddr pa, uint32_t val)
+{
+    uint8_t *ptr = vring_ptr(vq, pa);
+
+    if (ptr) {
+        stl_p(ptr, val);
+    } else {
+        stl_phys(&address_space_memory, pa, val);
+    }
+}
+
+/*
+ * A descriptor table: the ring's own, or an indirect one.  Indirect tables
+ * are mapped once for the whole chain if possible.
+ */
+typedef struct VRingDescTable {
+    VirtQueue *vq;
     hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(&address_space_memory, pa);
+    uint8_t *ptr;           /* host address of an indirect table */
+    hwaddr len;
+} VRingDescTable;
+
+static void vring_desc_table_init(VRingDescTable *table, VirtQueue *vq)
+{
+    table->vq = vq;
+    table->pa = vq->vring.desc;
+    table->ptr = NULL;
+    table->len = vq->vring.num * sizeof(VRingDesc);
+}
+
+static void vring_desc_table_map_indirect(VRingDescTable *table, hwaddr pa,
+                                          hwaddr len)
+{
+    hwaddr mapped = len;
+
+    table->vq = NULL;
+    table->pa = pa;
+    table->len = len;
+    table->ptr = cpu_physical_memory_map(pa, &mapped, 0);
+    if (table->ptr && mapped != len) {
+        cpu_physical_memory_unmap(table->ptr, mapped, 0, 0);
+        table->ptr = NULL;
+    }
+}
+
+static void vring_desc_table_unmap(VRingDescTable *table)
+{
+    if (table->ptr) {
+        cpu_physical_memory_unmap(table->ptr, table->len, 0, 0);
+        table->ptr = NULL;
+    }
+}
+
+/*
+ * Returns descriptor @i, read in one go because the guest may change it
+ * meanwhile.  Both layouts use 16 byte descriptors; @buf is used when the
+ * table isn't mapped.
+ */
+static const uint8_t *vring_desc_fetch(VRingDescTable *table, unsigned int i,
+                                       uint8_t *buf)
+{
+    hwaddr pa = table->pa + i * sizeof(VRingDesc);
+    uint8_t *ptr = table->ptr;
+
+    if (table->vq) {
+        ptr = vring_ptr(table->vq, pa);
+    } else if (ptr) {
+        ptr += i * sizeof(VRingDesc);
+    }
+    if (!ptr) {
+        address_space_rw(&address_space_memory, pa, buf, sizeof(VRingDesc),
+                         false);
+        ptr = buf;
+    }
+    return ptr;
+}
+
+static void vring_desc_read(VRingDescTable *table, unsigned int i,
+                            VRingDesc *desc)
+{
+    uint8_t buf[sizeof(VRingDesc)];
+    const uint8_t *ptr = vring_desc_fetch(table, i, buf);
+
+    desc->addr = ldq_p(ptr + offsetof(VRingDesc, addr));
+    desc->len = ldl_p(ptr + offsetof(VRingDesc, len));
+    desc->flags = lduw_p(ptr + offsetof(VRingDesc, flags));
+    desc->next = lduw_p(ptr + offsetof(VRingDesc, next));
+}
+
+static void vring_packed_desc_read(VRingDescTable *table, unsigned int i,
+                                   VRingPackedDesc *desc)
+{
+    uint8_t buf[sizeof(VRingPackedDesc)];
+    const uint8_t *ptr;
+
+    QEMU_BUILD_BUG_ON(sizeof(VRingPackedDesc) != sizeof(VRingDesc));
+    ptr = vring_desc_fetch(table, i, buf);
+    desc->addr = ldq_p(ptr + offsetof(VRingPackedDesc, addr));
+    desc->len = ldl_p(ptr + offsetof(VRingPackedDesc, len));
+    desc->id = lduw_p(ptr + offsetof(VRingPackedDesc, id));
+    desc->flags = lduw_p(ptr + offsetof(VRingPackedDesc, flags));
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(vq, vq->vring.avail + offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(vq, vq->vring.avail + offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(vq, vq->vring.avail + offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -157,62 +429,93 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(&address_space_memory, pa, val);
+    vring_stl(vq, vq->vring.used + offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(&address_space_memory, pa, val);
+    vring_stl(vq, vq->vring.used + offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(vq, vq->vring.used + offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(&address_space_memory, pa, val);
+    vring_stw(vq, vq->vring.used + offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(&address_space_memory,
-             pa, lduw_phys(&address_space_memory, pa) | mask);
+    hwaddr pa = vq->vring.used + offsetof(VRingUsed, flags);
+
+    vring_stw(vq, pa, vring_lduw(vq, pa) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(&address_space_memory,
-             pa, lduw_phys(&address_space_memory, pa) & ~mask);
+    hwaddr pa = vq->vring.used + offsetof(VRingUsed, flags);
+
+    vring_stw(vq, pa, vring_lduw(vq, pa) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    stw_phys(&address_space_memory, pa, val);
+    vring_stw(vq, vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]),
+              val);
+}
+
+static inline uint16_t vring_packed_desc_flags(VirtQueue *vq, unsigned int i)
+{
+    return vring_lduw(vq, vq->vring.desc + i * sizeof(VRingPackedDesc) +
+                          offsetof(VRingPackedDesc, flags));
+}
+
+static inline bool vring_packed_desc_is_avail(uint16_t flags, bool wrap)
+{
+    return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap &&
+           !!(flags & VRING_PACKED_DESC_F_USED) != wrap;
+}
+
+/* Where the driver should kick us next: our next avail descriptor */
+static inline void vring_packed_avail_event(VirtQueue *vq)
+{
+    if (!vq->notification) {
+        return;
+    }
+    vring_stw(vq, vq->vring.used + offsetof(VRingPackedDescEvent, off_wrap),
+              vq->last_avail_idx | (vq->avail_wrap_counter << 15));
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    uint16_t flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_avail_event(vq);
+        /* The event index must be visible before the mode */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    vring_stw(vq, vq->vring.used + offsetof(VRingPackedDescEvent, flags),
+              flags);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+    if (vq->packed) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -232,17 +535,20 @@ int virtio_queue_ready(VirtQueue *vq)
 
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (vq->packed) {
+        return !vring_packed_desc_is_avail(
+            vring_packed_desc_flags(vq, vq->last_avail_idx),
+            vq->avail_wrap_counter);
+    }
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
+                               unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -258,6 +564,49 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/*
+ * Gives back an element that was popped, but not used, so that the next
+ * virtqueue_pop() returns it again.  Elements must be discarded in the
+ * reverse order they were popped in.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len)
+{
+    if (vq->packed) {
+        unsigned int ndescs = vq->packed_ndescs[elem->index];
+
+        if (vq->last_avail_idx < ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= ndescs;
+    } else {
+        vq->last_avail_idx--;
+    }
+    vq->inuse--;
+    virtqueue_unmap_sg(vq, elem, len);
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
+
+    if (vq->packed) {
+        /* The entries are written in order by virtqueue_flush() */
+        assert(idx < vq->vring.num);
+        if (elem->index >= vq->vring.num) {
+            error_report("virtio: invalid buffer id %u", elem->index);
+            exit(1);
+        }
+        vq->used_elems[idx].id = elem->index;
+        vq->used_elems[idx].len = len;
+        return;
+    }
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
@@ -266,16 +615,92 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_ring_len(vq, idx, len);
 }
 
+static void vring_packed_used_write(VirtQueue *vq, unsigned int i,
+                                    const VirtQueueUsedElem *used)
+{
+    hwaddr pa = vq->vring.desc + i * sizeof(VRingPackedDesc);
+
+    vring_stl(vq, pa + offsetof(VRingPackedDesc, len), used->len);
+    vring_stw(vq, pa + offsetof(VRingPackedDesc, id), used->id);
+}
+
+static void vring_packed_used_flags_set(VirtQueue *vq, unsigned int i,
+                                        bool wrap)
+{
+    hwaddr pa = vq->vring.desc + i * sizeof(VRingPackedDesc);
+
+    vring_stw(vq, pa + offsetof(VRingPackedDesc, flags),
+              wrap ? VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0);
+}
+
+/*
+ * Writes the used entries in ring order.  Each one takes the place of the
+ * first descriptor of the buffer it returns and the next one follows the
+ * rest of the buffer's descriptors, whatever order the buffers were made
+ * available in.  The flags of the first entry are written last, so that
+ * the driver sees the whole batch at once.
+ */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, idx, first = vq->used_idx;
+    bool wrap, first_wrap = vq->used_wrap_counter;
+
+    if (!count) {
+        return;
+    }
+
+    idx = first;
+    for (i = 0; i < count; i++) {
+        VirtQueueUsedElem *used = &vq->used_elems[i];
+
+        vring_packed_used_write(vq, idx, used);
+        idx += vq->packed_ndescs[used->id];
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+        }
+    }
+
+    /* Make sure ids and lengths are written before the flags */
+    smp_wmb();
+    idx = first;
+    wrap = first_wrap;
+    for (i = 0; i < count; i++) {
+        if (i) {
+            vring_packed_used_flags_set(vq, idx, wrap);
+        }
+        idx += vq->packed_ndescs[vq->used_elems[i].id];
+        vq->used_count += vq->packed_ndescs[vq->used_elems[i].id];
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap ^= 1;
+        }
+    }
+    vq->used_idx = idx;
+    vq->used_wrap_counter = wrap;
+
+    smp_wmb();
+    vring_packed_used_flags_set(vq, first, first_wrap);
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
-    new = old + count;
-    vring_used_idx_set(vq, new);
+    if (vq->packed) {
+        old = vq->used_count;
+        virtqueue_packed_flush(vq, count);
+        new = vq->used_count;
+    } else {
+        old = vring_used_idx(vq);
+        new = old + count;
+        vring_used_idx_set(vq, new);
+    }
     vq->inuse -= count;
+    vq->completions += count;
+    vq->coalesce_completions += count;
+    vq->rate_window_completions += count;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
 }
@@ -323,19 +748,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
-    /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
+    /* Check they're not leading us off end of descriptors.  The descriptor
+     * is a private copy, so the guest can't change next after the check. */
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -345,6 +768,79 @@ static unsigned virtqueue_next_desc(hwaddr desc_pa,
     return next;
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_total,
+                                             unsigned int *out_total,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    unsigned int idx = vq->last_avail_idx, total_bufs = 0;
+    bool wrap = vq->avail_wrap_counter;
+
+    while (total_bufs < vq->vring.num &&
+           vring_packed_desc_is_avail(vring_packed_desc_flags(vq, idx), wrap)) {
+        unsigned int i = 0, max = 0, num_bufs = 0;
+        VRingDescTable table;
+        VRingPackedDesc desc;
+
+        /* Read the descriptor only after seeing its flags */
+        smp_rmb();
+        vring_desc_table_init(&table, vq);
+        vring_packed_desc_read(&table, idx, &desc);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+            max = desc.len / sizeof(VRingPackedDesc);
+            vring_desc_table_map_indirect(&table, desc.addr, desc.len);
+            vring_packed_desc_read(&table, 0, &desc);
+        }
+
+        for (;;) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                *in_total += desc.len;
+            } else {
+                *out_total += desc.len;
+            }
+            if (*in_total >= max_in_bytes && *out_total >= max_out_bytes) {
+                vring_desc_table_unmap(&table);
+                return;
+            }
+
+            if (max) {
+                /* Indirect tables are used in full, NEXT doesn't matter */
+                if (++i == max) {
+                    num_bufs = 1;
+                    break;
+                }
+                vring_packed_desc_read(&table, i, &desc);
+                continue;
+            }
+
+            num_bufs++;
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (total_bufs + num_bufs >= vq->vring.num) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            vring_packed_desc_read(&table, (idx + num_bufs) % vq->vring.num,
+                                   &desc);
+        }
+        vring_desc_table_unmap(&table);
+
+        total_bufs += num_bufs;
+        idx += num_bufs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap ^= 1;
+        }
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -352,21 +848,30 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
+    if (vq->packed) {
+        in_total = out_total = 0;
+        virtqueue_packed_get_avail_bytes(vq, &in_total, &out_total,
+                                         max_in_bytes, max_out_bytes);
+        goto done;
+    }
+
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
-        hwaddr desc_pa;
+        VRingDescTable table;
+        VRingDesc desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
+        vring_desc_table_init(&table, vq);
+        vring_desc_read(&table, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -379,27 +884,37 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            vring_desc_table_map_indirect(&table, desc.addr, desc.len);
             num_bufs = i = 0;
+            vring_desc_read(&table, i, &desc);
         }
 
         do {
             /* If we've got too many, that implies a descriptor loop. */
             if (++num_bufs > max) {
+                vring_desc_table_unmap(&table);
                 error_report("Looped descriptor");
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                vring_desc_table_unmap(&table);
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(&table, i, &desc);
+            }
+        } while (i != max);
+
+        vring_desc_table_unmap(&table);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -446,10 +961,136 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
+static void virtqueue_elem_add(VirtQueueElement *elem, hwaddr addr,
+                               uint32_t len, bool is_write)
+{
+    struct iovec *sg;
+
+    if (is_write) {
+        if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
+            error_report("Too many write descriptors in indirect table");
+            exit(1);
+        }
+        elem->in_addr[elem->in_num] = addr;
+        sg = &elem->in_sg[elem->in_num++];
+    } else {
+        if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
+            error_report("Too many read descriptors in indirect table");
+            exit(1);
+        }
+        elem->out_addr[elem->out_num] = addr;
+        sg = &elem->out_sg[elem->out_num++];
+    }
+
+    sg->iov_len = len;
+}
+
+/*
+ * Packed layout.  The driver makes a buffer available by writing its
+ * descriptors into consecutive ring slots, the flags of the first one
+ * last; the AVAIL and USED flag bits tell whether a slot is available in
+ * the current lap of the ring.  The buffer id is taken from the last
+ * descriptor of the chain and must be below the ring size, so that the
+ * number of slots of each buffer can be remembered for virtqueue_flush().
+ */
+static int virtqueue_packed_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    unsigned int i, max = 0, ndescs = 0, id;
+    VRingDescTable table;
+    VRingPackedDesc desc;
+
+    if (virtio_queue_empty(vq)) {
+        return 0;
+    }
+    /* Read the descriptor only after seeing its flags */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    elem->out_num = elem->in_num = 0;
+
+    i = vq->last_avail_idx;
+    vring_desc_table_init(&table, vq);
+    vring_packed_desc_read(&table, i, &desc);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* The table is used in full, NEXT doesn't matter */
+        ndescs = 1;
+        max = desc.len / sizeof(VRingPackedDesc);
+        vring_desc_table_map_indirect(&table, desc.addr, desc.len);
+        i = 0;
+        vring_packed_desc_read(&table, i, &desc);
+    }
+
+    /* Collect all the descriptors */
+    for (;;) {
+        virtqueue_elem_add(elem, desc.addr, desc.len,
+                           desc.flags & VRING_DESC_F_WRITE);
+
+        if (max) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            id = desc.id;
+            ndescs++;
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            /* A chain can't be longer than the ring */
+            if (ndescs >= vq->vring.num) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(&table, i, &desc);
+    }
+
+    vring_desc_table_unmap(&table);
+
+    if (id >= vq->vring.num) {
+        error_report("Guest says buffer id %u is available", id);
+        exit(1);
+    }
+    vq->packed_ndescs[id] = ndescs;
+
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->avail_wrap_counter ^= 1;
+    }
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_avail_event(vq);
+    }
+
+    /* Now map what we have collected */
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+
+    elem->index = id;
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem->in_num + elem->out_num;
+}
+
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    VRingDescTable table;
+    VRingDesc desc;
+
+    if (vq->packed) {
+        return virtqueue_packed_pop(vq, elem);
+    }
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -464,46 +1105,39 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_table_init(&table, vq);
+    vring_desc_read(&table, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        vring_desc_table_map_indirect(&table, desc.addr, desc.len);
         i = 0;
+        vring_desc_read(&table, i, &desc);
     }
 
     /* Collect all the descriptors */
     do {
-        struct iovec *sg;
-
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
-        } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
-                exit(1);
-            }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
-        }
-
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        virtqueue_elem_add(elem, desc.addr, desc.len,
+                           desc.flags & VRING_DESC_F_WRITE);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(&table, i, &desc);
+        }
+    } while (i != max);
+
+    vring_desc_table_unmap(&table);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -564,10 +1198,25 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].coalesce_timer) {
+            timer_del(vdev->vq[i].coalesce_timer);
+        }
+        vdev->vq[i].coalesce_pending = false;
+        vdev->vq[i].coalesce_completions = 0;
+        vdev->vq[i].coalesce_frames = 0;
+        vdev->vq[i].coalesce_usecs = 0;
+        vdev->vq[i].rate_window_completions = 0;
+        vdev->vq[i].completion_rate = 0;
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        virtqueue_unmap_ring(&vdev->vq[i]);
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].packed = false;
+        vdev->vq[i].avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
+        vdev->vq[i].used_idx = 0;
+        vdev->vq[i].used_count = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
@@ -726,6 +1375,7 @@ void virtio_queue_notify_vq(VirtQueue *vq)
     if (vq->vring.desc) {
         VirtIODevice *vdev = vq->vdev;
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        vq->kicks++;
         vq->handle_output(vdev, vq);
     }
 }
@@ -774,11 +1424,13 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_unmap_ring(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
+    vq->interrupts++;
     vq->vdev->isr |= 0x01;
     virtio_notify_vector(vq->vdev, vq->vector);
 }
@@ -796,40 +1448,221 @@ static inline int vring_need_event(uint16_t event, uint16_t new, uint16_t old)
 	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
 }
 
-static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
+/*
+ * The packed layout's event index is a ring position plus wrap counter.
+ * Turns it into a value of the free running used_count, @new being the
+ * value that corresponds to the current used position.
+ */
+static inline uint16_t vring_packed_used_event(VirtQueue *vq,
+                                               uint16_t off_wrap,
+                                               uint16_t new)
 {
-    uint16_t old, new;
+    unsigned int num = vq->vring.num;
+    unsigned int pos = off_wrap & ~(1 << 15);
+    unsigned int cur = vq->used_idx;
+
+    /* Count the positions over two laps, the first one with wrap set */
+    if (!(off_wrap >> 15)) {
+        pos += num;
+    }
+    if (!vq->used_wrap_counter) {
+        cur += num;
+    }
+    return new - (cur + 2 * num - pos) % (2 * num);
+}
+
+/*
+ * Whether the guest wants an interrupt for the used entries written since
+ * the last one.  Unless @peek is set, this starts a new round.
+ */
+static bool vring_interrupt_wanted(VirtIODevice *vdev, VirtQueue *vq,
+                                   bool peek)
+{
+    bool event_idx = vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX);
+    uint16_t old, new, event, off_wrap, flags = 0;
     bool v;
+
+    if (vq->packed) {
+        flags = vring_lduw(vq, vq->vring.avail +
+                               offsetof(VRingPackedDescEvent, flags));
+        new = vq->used_count;
+    } else if (!event_idx) {
+        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
+    } else {
+        new = vring_used_idx(vq);
+    }
+
+    v = vq->signalled_used_valid;
+    old = vq->signalled_used;
+    if (!peek) {
+        vq->signalled_used_valid = true;
+        vq->signalled_used = new;
+    }
+
+    if (vq->packed) {
+        if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+            return false;
+        }
+        if (flags != VRING_PACKED_EVENT_FLAG_DESC || !event_idx) {
+            return true;
+        }
+        /* Read the event index only after the mode */
+        smp_rmb();
+        off_wrap = vring_lduw(vq, vq->vring.avail +
+                                  offsetof(VRingPackedDescEvent, off_wrap));
+        event = vring_packed_used_event(vq, off_wrap, new);
+    } else {
+        event = vring_used_event(vq);
+    }
+    return !v || vring_need_event(event, new, old);
+}
+
+static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
     /* We need to expose used array entries before checking used event. */
     smp_mb();
     /* Always notify when queue is empty (when feature acknowledge) */
     if (((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
-         !vq->inuse && vring_avail_idx(vq) == vq->last_avail_idx)) {
+         !vq->inuse && virtio_queue_empty(vq))) {
         return true;
     }
 
-    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
-        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
-    }
-
-    v = vq->signalled_used_valid;
-    vq->signalled_used_valid = true;
-    old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
-    return !v || vring_need_event(vring_used_event(vq), new, old);
+    return vring_interrupt_wanted(vdev, vq, false);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_notify_now(VirtIODevice *vdev, VirtQueue *vq)
 {
+    if (vq->coalesce_pending) {
+        timer_del(vq->coalesce_timer);
+        vq->coalesce_pending = false;
+    }
+    vq->coalesce_completions = 0;
+
     if (!vring_notify(vdev, vq)) {
+        vq->suppressed++;
         return;
     }
 
     trace_virtio_notify(vdev, vq);
+    vq->interrupts++;
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
 
+static void virtqueue_coalesce_timer(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    virtio_notify_now(vq->vdev, vq);
+}
+
+/* Recomputes the coalescing thresholds once per sampling window */
+static void virtqueue_coalesce_update(VirtQueue *vq, int64_t now)
+{
+    VirtIODevice *vdev = vq->vdev;
+    int64_t elapsed = now - vq->rate_window_start;
+    uint64_t rate, frames;
+
+    if (elapsed < VIRTIO_COALESCE_WINDOW_NS) {
+        return;
+    }
+
+    rate = (uint64_t)vq->rate_window_completions * get_ticks_per_sec() /
+           elapsed;
+    if (elapsed > 8 * VIRTIO_COALESCE_WINDOW_NS) {
+        /* The queue was idle, forget about the old rate */
+        vq->completion_rate = rate;
+    } else {
+        vq->completion_rate = (vq->completion_rate * 3 + rate) / 4;
+    }
+    vq->rate_window_start = now;
+    vq->rate_window_completions = 0;
+
+    if (vq->completion_rate < VIRTIO_COALESCE_RATE_LOW) {
+        frames = 0;
+        vq->coalesce_usecs = 0;
+    } else {
+        frames = vq->completion_rate / VIRTIO_COALESCE_IRQ_RATE;
+        frames = MIN(MAX(frames, 2), vdev->coalesce_max_frames);
+        /* Long enough for the expected number of completions to arrive */
+        vq->coalesce_usecs = MIN(frames * 1000000 / vq->completion_rate,
+                                 vdev->coalesce_max_usecs);
+    }
+    if (frames != vq->coalesce_frames) {
+        trace_virtio_notify_coalesce(vq, vq->completion_rate, frames,
+                                     vq->coalesce_usecs);
+    }
+    vq->coalesce_frames = frames;
+}
+
+/*
+ * Decides whether the interrupt for the latest completions can be held
+ * back.  Only interrupts the guest asked for are delayed: if vring_notify()
+ * would suppress it anyway, going through it right away keeps the
+ * VRING_AVAIL_F_NO_INTERRUPT and used event index semantics untouched.  A
+ * delayed interrupt is injected through vring_notify() as well, which then
+ * looks at all completions since the last interrupt.
+ */
+static bool virtqueue_coalesce(VirtIODevice *vdev, VirtQueue *vq)
+{
+    int64_t now;
+
+    if (!vdev->coalesce_max_usecs || !vdev->coalesce_max_frames) {
+        return false;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    virtqueue_coalesce_update(vq, now);
+    if (!vq->coalesce_frames ||
+        vq->coalesce_completions >= vq->coalesce_frames) {
+        return false;
+    }
+
+    /* Nothing else is in flight, the guest is waiting for these */
+    if (!vq->inuse && virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    /* Expose used array entries before checking used event */
+    smp_mb();
+    if (!vring_interrupt_wanted(vdev, vq, true)) {
+        return false;
+    }
+
+    if (!vq->coalesce_pending) {
+        if (!vq->coalesce_timer) {
+            vq->coalesce_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                              virtqueue_coalesce_timer, vq);
+        }
+        timer_mod(vq->coalesce_timer, now + vq->coalesce_usecs * SCALE_US);
+        vq->coalesce_pending = true;
+    }
+    return true;
+}
+
+/* Injects the interrupts that are being held back, e.g. before migration */
+static void virtio_coalesce_flush(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].coalesce_pending) {
+            virtio_notify_now(vdev, &vdev->vq[i]);
+        }
+    }
+}
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    vq->notifications++;
+
+    if (virtqueue_coalesce(vdev, vq)) {
+        vq->coalesced++;
+        return;
+    }
+    virtio_notify_now(vdev, vq);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -839,12 +1672,55 @@ void virtio_notify_config(VirtIODevice *vdev)
     virtio_notify_vector(vdev, vdev->config_vector);
 }
 
+/* Ring state of the packed layout, which can't be read back from the ring */
+static void virtqueue_packed_save(VirtQueue *vq, QEMUFile *f)
+{
+    int i;
+
+    qemu_put_byte(f, vq->avail_wrap_counter);
+    qemu_put_byte(f, vq->used_wrap_counter);
+    qemu_put_be16s(f, &vq->used_idx);
+    qemu_put_be16s(f, &vq->used_count);
+    for (i = 0; i < vq->vring.num; i++) {
+        qemu_put_be16(f, vq->packed_ndescs ? vq->packed_ndescs[i] : 0);
+    }
+}
+
+static int virtqueue_packed_load(VirtQueue *vq, QEMUFile *f)
+{
+    int i;
+
+    if (vq->vring.num > VIRTQUEUE_MAX_SIZE) {
+        error_report("VQ size 0x%x too large", vq->vring.num);
+        return -1;
+    }
+    virtqueue_packed_alloc(vq);
+    vq->avail_wrap_counter = qemu_get_byte(f);
+    vq->used_wrap_counter = qemu_get_byte(f);
+    qemu_get_be16s(f, &vq->used_idx);
+    qemu_get_be16s(f, &vq->used_count);
+    for (i = 0; i < vq->vring.num; i++) {
+        vq->packed_ndescs[i] = qemu_get_be16(f);
+    }
+
+    if (vq->last_avail_idx >= vq->vring.num ||
+        vq->used_idx >= vq->vring.num) {
+        error_report("VQ size 0x%x inconsistent with avail index 0x%x "
+                     "and used index 0x%x", vq->vring.num,
+                     vq->last_avail_idx, vq->used_idx);
+        return -1;
+    }
+    return 0;
+}
+
 void virtio_save(VirtIODevice *vdev, QEMUFile *f)
 {
     BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     int i;
 
+    virtio_coalesce_flush(vdev);
+
     if (k->save_config) {
         k->save_config(qbus->parent, f);
     }
@@ -873,6 +1749,9 @@ void virtio_save(VirtIODevice *vdev, QEMUFile *f)
         }
         qemu_put_be64(f, vdev->vq[i].pa);
         qemu_put_be16s(f, &vdev->vq[i].last_avail_idx);
+        if (vdev->guest_features & (1U << VIRTIO_RING_F_PACKED)) {
+            virtqueue_packed_save(&vdev->vq[i], f);
+        }
         if (k->save_queue) {
             k->save_queue(qbus->parent, i, f);
         }
@@ -886,12 +1765,20 @@ int virtio_set_features(VirtIODevice *vdev, uint32_t val)
     VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(vdev);
     uint32_t supported_features = vbusk->get_features(qbus->parent);
     bool bad = (val & ~supported_features) != 0;
+    int i;
 
     val &= supported_features;
     if (k->set_features) {
         k->set_features(vdev, val);
     }
     vdev->guest_features = val;
+
+    /* The ring layout depends on the features */
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num && vdev->vq[i].pa) {
+            virtqueue_init(&vdev->vq[i]);
+        }
+    }
     return bad ? -1 : 0;
 }
 
@@ -950,7 +1837,14 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
 
-        if (vdev->vq[i].pa) {
+        if (vdev->guest_features & (1U << VIRTIO_RING_F_PACKED)) {
+            if (virtqueue_packed_load(&vdev->vq[i], f) < 0) {
+                return -1;
+            }
+            if (vdev->vq[i].pa) {
+                virtqueue_init(&vdev->vq[i]);
+            }
+        } else if (vdev->vq[i].pa) {
             uint16_t nheads;
             virtqueue_init(&vdev->vq[i]);
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
@@ -982,6 +1876,18 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].coalesce_timer) {
+            timer_del(vdev->vq[i].coalesce_timer);
+            timer_free(vdev->vq[i].coalesce_timer);
+        }
+        virtqueue_unmap_ring(&vdev->vq[i]);
+        g_free(vdev->vq[i].packed_ndescs);
+        g_free(vdev->vq[i].used_elems);
+    }
+    QTAILQ_REMOVE(&virtio_devices, vdev, next);
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -995,6 +1901,11 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     bool backend_run = running && (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK);
     vdev->vm_running = running;
 
+    if (!running) {
+        /* The timers don't run while stopped, and their state isn't saved */
+        virtio_coalesce_flush(vdev);
+    }
+
     if (backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
@@ -1011,7 +1922,15 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
+    static bool listener_registered;
     int i;
+
+    if (!listener_registered) {
+        memory_listener_register(&virtio_memory_listener,
+                                 &address_space_memory);
+        listener_registered = true;
+    }
+
     vdev->device_id = device_id;
     vdev->status = 0;
     vdev->isr = 0;
@@ -1023,6 +1942,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1034,6 +1955,7 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     }
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change,
                                                      vdev);
+    QTAILQ_INSERT_TAIL(&virtio_devices, vdev, next);
 }
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
@@ -1063,12 +1985,18 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (vdev->vq[n].packed) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint64_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (vdev->vq[n].packed) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -1212,6 +2140,74 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     }
 }
 
+static VirtioQueueInfoList *qmp_query_virtio_queues(VirtIODevice *vdev)
+{
+    VirtioQueueInfoList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        VirtioQueueInfoList *entry;
+        VirtioQueueInfo *info;
+
+        if (vq->vring.num == 0) {
+            continue;
+        }
+
+        info = g_new0(VirtioQueueInfo, 1);
+        info->index = i;
+        info->size = vq->vring.num;
+        info->kicks = vq->kicks;
+        info->completions = vq->completions;
+        info->notifications = vq->notifications;
+        info->interrupts = vq->interrupts;
+        info->suppressed = vq->suppressed;
+        info->coalesced = vq->coalesced;
+        info->completion_rate = vq->completion_rate;
+        info->coalesce_frames = vq->coalesce_frames;
+        info->coalesce_usecs = vq->coalesce_usecs;
+
+        entry = g_new0(VirtioQueueInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+VirtioInfoList *qmp_query_virtio(Error **errp)
+{
+    VirtioInfoList *head = NULL, **tail = &head;
+    VirtIODevice *vdev;
+
+    QTAILQ_FOREACH(vdev, &virtio_devices, next) {
+        VirtioInfoList *entry;
+        VirtioInfo *info;
+
+        info = g_new0(VirtioInfo, 1);
+        info->path = object_get_canonical_path(OBJECT(vdev));
+        info->name = g_strdup(vdev->name);
+        info->coalesce_max_usecs = vdev->coalesce_max_usecs;
+        info->coalesce_max_frames = vdev->coalesce_max_frames;
+        info->queues = qmp_query_virtio_queues(vdev);
+
+        entry = g_new0(VirtioInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+/* Interrupt coalescing is off unless both bounds are set */
+static Property virtio_properties[] = {
+    DEFINE_PROP_UINT32("x-coalesce-usecs", VirtIODevice,
+                       coalesce_max_usecs, 0),
+    DEFINE_PROP_UINT32("x-coalesce-frames", VirtIODevice,
+                       coalesce_max_frames, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void virtio_device_class_init(ObjectClass *klass, void *data)
 {
     /* Set the default value here. */
@@ -1220,6 +2216,7 @@ static void virtio_device_class_init(ObjectClass *klass, void *data)
     dc->realize = virtio_device_realize;
     dc->unrealize = virtio_device_unrealize;
     dc->bus_type = TYPE_VIRTIO_BUS;
+    dc->props = virtio_properties;
 }
 
 static const TypeInfo virtio_device_info = {
@@ -175,8 +175,11 @@ struct BlockDriver {
     bool has_variable_length;
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
 
-    int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors);
+    /* Called in coroutine context, possibly for several clusters at once */
+    int coroutine_fn (*bdrv_write_compressed)(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              const uint8_t *buf,
+                                              int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -194,6 +197,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -247,6 +251,21 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /* Batch requests submitted between plug and unplug (optional) */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
+    /*
+     * Set if the driver can be used in an AioContext other than the main
+     * loop's, see bdrv_set_aio_context().  Drivers that register handlers or
+     * BHs in the AioContext must move them in the two callbacks below, which
+     * are called while no requests are in flight.
+     */
+    bool supports_aio_context;
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -322,6 +341,12 @@ struct BlockDriverState {
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
 
+    /* Changes whenever the contents or the size of the device may change.
+     * The values are unique across all BlockDriverStates, so that users that
+     * cache information about other BlockDriverStates (like the qcow2 backing
+     * chain map) can detect that it's stale. */
+    uint64_t write_gen;
+
     /* I/O Limits */
     BlockLimits bl;
 
@@ -365,10 +390,15 @@ struct BlockDriverState {
 
     QDict *options;
     BlockdevDetectZeroesOptions detect_zeroes;
+
+    /* The AioContext in which requests are submitted and completed */
+    AioContext *aio_context;
 };
 
 int get_tmp_filename(char *filename, int size);
 
+void bdrv_bump_write_gen(BlockDriverState *bs);
+
 void bdrv_set_io_limits(BlockDriverState *bs,
                         ThrottleConfig *cfg);
 
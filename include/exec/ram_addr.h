@@ -63,7 +63,7 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
     assert(client < DIRTY_MEMORY_NUM);
-    set_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+    set_bit_atomic(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -73,9 +73,12 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION],
+                      page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_VGA],
+                      page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_CODE],
+                      page, end - page);
     xen_modified_memory(start, length);
 }
 
@@ -102,9 +105,12 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
             if (bitmap[k]) {
                 unsigned long temp = leul_to_cpu(bitmap[k]);
 
-                ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k] |= temp;
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k],
+                          temp);
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k],
+                          temp);
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k],
+                          temp);
             }
         }
         xen_modified_memory(start, pages);
@@ -140,11 +146,21 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     assert(client < DIRTY_MEMORY_NUM);
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_clear(ram_list.dirty_memory[client], page, end - page);
+    bitmap_test_and_clear_atomic(ram_list.dirty_memory[client],
+                                 page, end - page);
 }
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client);
 
+/*
+ * Move the migration dirty bits for [start, start + length) into @dest,
+ * clearing them in ram_list.  Returns the number of pages that were newly
+ * set in @dest.
+ */
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+                                               ram_addr_t start,
+                                               ram_addr_t length);
+
 #endif
 #endif
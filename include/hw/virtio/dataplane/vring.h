@@ -42,6 +42,13 @@ static inline bool vring_more_avail(Vring *vring)
     return vring->vr.avail->idx != vring->last_avail_idx;
 }
 
+/* Return the last @num popped and not yet pushed buffers to the ring, so that
+ * vring_pop() hands them out again.  The caller frees the elements. */
+static inline void vring_rewind(Vring *vring, unsigned int num)
+{
+    vring->last_avail_idx -= num;
+}
+
 /* Fail future vring_pop() and vring_push() calls until reset */
 static inline void vring_set_broken(Vring *vring)
 {
@@ -54,6 +61,9 @@ void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_enable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
 int vring_pop(VirtIODevice *vdev, Vring *vring, VirtQueueElement **elem);
+void vring_fill(Vring *vring, VirtQueueElement *elem, int len,
+                unsigned int idx);
+void vring_flush(Vring *vring, unsigned int count);
 void vring_push(Vring *vring, VirtQueueElement *elem, int len);
 void vring_free_element(VirtQueueElement *elem);
 
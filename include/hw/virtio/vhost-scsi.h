@@ -57,8 +57,6 @@ enum vhost_scsi_vq_list {
 typedef struct VHostSCSI {
     VirtIOSCSICommon parent_obj;
 
-    Error *migration_blocker;
-
     struct vhost_dev dev;
 } VHostSCSI;
 
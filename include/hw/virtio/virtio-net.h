@@ -65,11 +65,15 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Number of packets passed to the peer at once during a flush */
+#define VIRTIO_NET_TX_BATCH 32
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t data_plane;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -151,6 +155,9 @@ typedef struct VirtIONetQueue {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    /* Packets are passed to the peer in batches of VIRTIO_NET_TX_BATCH */
+    VirtQueueElement *tx_elems;
+    struct iovec (*tx_sg)[VIRTQUEUE_MAX_SIZE];
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -193,6 +200,11 @@ typedef struct VirtIONet {
     char *netclient_name;
     char *netclient_type;
     uint64_t curr_guest_offloads;
+    bool dataplane_started;     /* set and cleared by the dataplane */
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    Notifier migration_state_notifier;
+    struct VirtIONetDataPlane *dataplane;
+#endif
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -273,5 +285,7 @@ struct virtio_net_ctrl_mq {
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
+void virtio_net_receive_header(VirtIONet *n, const struct iovec *iov,
+                               int iov_cnt, const void *buf, size_t size);
 
 #endif
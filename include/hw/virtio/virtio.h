@@ -54,6 +54,10 @@
 #define VIRTIO_RING_F_EVENT_IDX         29
 /* A guest should never accept this.  It implies negotiation is broken. */
 #define VIRTIO_F_BAD_FEATURE		30
+/* Descriptors and used entries share a single ring (packed layout).  Stands
+ * in for VIRTIO_F_RING_PACKED (34), which the 32-bit feature words of the
+ * legacy transports can't carry; only offered when enabled explicitly. */
+#define VIRTIO_RING_F_PACKED            31
 
 /* from Linux's linux/virtio_ring.h */
 
@@ -69,6 +73,17 @@
 /* This means don't interrupt guest when buffer consumed. */
 #define VRING_AVAIL_F_NO_INTERRUPT      1
 
+/* Packed layout: the descriptor is available, respectively used, when the
+ * bit matches the wrap counter of the side that writes it. */
+#define VRING_PACKED_DESC_F_AVAIL       (1 << 7)
+#define VRING_PACKED_DESC_F_USED        (1 << 15)
+
+/* Packed layout: event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+/* Only with VIRTIO_RING_F_EVENT_IDX: notify at the given ring position */
+#define VRING_PACKED_EVENT_FLAG_DESC    0x2
+
 struct VirtQueue;
 
 static inline hwaddr vring_align(hwaddr addr,
@@ -121,6 +136,10 @@ struct VirtIODevice
     bool vm_running;
     VMChangeStateEntry *vmstate;
     char *bus_name;
+    /* Upper bounds for interrupt coalescing, 0 disables it */
+    uint32_t coalesce_max_usecs;
+    uint32_t coalesce_max_frames;
+    QTAILQ_ENTRY(VirtIODevice) next;
 };
 
 typedef struct VirtioDeviceClass {
@@ -170,6 +189,8 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len);
 
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
@@ -229,7 +250,9 @@ typedef struct VirtIORNGConf VirtIORNGConf;
 	DEFINE_PROP_BIT("indirect_desc", _state, _field, \
 			VIRTIO_RING_F_INDIRECT_DESC, true), \
 	DEFINE_PROP_BIT("event_idx", _state, _field, \
-			VIRTIO_RING_F_EVENT_IDX, true)
+			VIRTIO_RING_F_EVENT_IDX, true), \
+	DEFINE_PROP_BIT("x-packed-ring", _state, _field, \
+			VIRTIO_RING_F_PACKED, false)
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
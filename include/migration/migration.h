@@ -20,6 +20,7 @@
 #include "qemu/notify.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
+#include "migration/page_cache.h"
 #include "qapi-types.h"
 #include "exec/cpu-common.h"
 
@@ -125,6 +126,8 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+void xbzrle_mig_cache_stats(PageCacheStats *stats);
+int mig_throttle_get_percentage(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
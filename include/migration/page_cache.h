@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative table indexed by a hash of the page
+ * address, with LRU replacement inside each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +19,12 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+typedef struct PageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} PageCacheStats;
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -37,28 +44,31 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_is_cached: Checks to see if the page is cached, and accounts
+ * the lookup as a hit or a miss
  *
  * Returns %true if page is cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr, and mark the page
+ * as the most recently used one
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten,
+ * otherwise the least recently used page of the set is evicted
  *
  * Returns -1 on error
  *
@@ -68,6 +78,14 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  */
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
+/**
+ * cache_get_stats: get the hit, miss and eviction counts of the cache
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: filled with the statistics
+ */
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats);
+
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
@@ -22,6 +22,8 @@
 struct iovec;
 
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
+uint32_t net_checksum_copy_cont(int len, uint8_t *dst, const uint8_t *buf,
+                                int seq);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
@@ -39,6 +41,30 @@ net_raw_checksum(uint8_t *data, int length)
     return net_checksum_finish(net_checksum_add(length, data));
 }
 
+/**
+ * net_checksum_copy: copy data and return its checksum
+ *
+ * Like net_checksum_add(), but also copies @len bytes from @buf to @dst in
+ * the same pass over the data.  The buffers must not overlap.
+ */
+static inline uint32_t
+net_checksum_copy(int len, uint8_t *dst, const uint8_t *buf)
+{
+    return net_checksum_copy_cont(len, dst, buf, 0);
+}
+
+/**
+ * net_checksum_update: incremental checksum update (RFC 1624)
+ *
+ * @csum: the checksum as stored in the header, in host byte order
+ * @old_val: the 16-bit word covered by @csum before it was changed
+ * @new_val: the new value of that word
+ *
+ * Returns the checksum for the changed data.
+ */
+uint16_t net_checksum_update(uint16_t csum, uint16_t old_val,
+                             uint16_t new_val);
+
 /**
  * net_checksum_add_iov: scatter-gather vector checksumming
  *
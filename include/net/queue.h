@@ -29,6 +29,15 @@
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
 
+/* One packet of a batch */
+typedef struct NetBatchPacket {
+    const struct iovec *iov;
+    int iovcnt;
+} NetBatchPacket;
+
+/* Largest number of packets the net layer passes in one batch */
+#define NET_BATCH_MAX 64
+
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
@@ -52,6 +61,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetBatchPacket *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
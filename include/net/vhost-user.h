@@ -0,0 +1,16 @@
+/*
+ * vhost-user network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef NET_VHOST_USER_H
+#define NET_VHOST_USER_H
+
+#include "net/net.h"
+
+struct vhost_net;
+struct vhost_net *vhost_user_get_vhost_net(NetClientState *nc);
+
+#endif /* NET_VHOST_USER_H */
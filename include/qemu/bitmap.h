@@ -35,7 +35,12 @@
  * bitmap_empty(src, nbits)			Are all bits zero in *src?
  * bitmap_full(src, nbits)			Are all bits set in *src?
  * bitmap_set(dst, pos, nbits)			Set specified bit area
+ * bitmap_set_atomic(dst, pos, nbits)	Set specified bit area atomically
  * bitmap_clear(dst, pos, nbits)		Clear specified bit area
+ * bitmap_test_and_clear_atomic(dst, pos, nbits)	Atomically clear area,
+ *						return whether any bit was set
+ * bitmap_sync_and_clear_atomic(dst, src, pos, nbits, cleared)	Move area
+ *						of *src into *dst, return newly set bits
  * bitmap_find_next_zero_area(buf, len, pos, n, mask)	Find bit free area
  */
 
@@ -43,6 +48,7 @@
  * Also the following operations apply to bitmaps.
  *
  * set_bit(bit, addr)			*addr |= bit
+ * set_bit_atomic(bit, addr)		Set bit with an atomic operation
  * clear_bit(bit, addr)			*addr &= ~bit
  * change_bit(bit, addr)		*addr ^= bit
  * test_bit(bit, addr)			Is bit set in *addr?
@@ -213,7 +219,11 @@ static inline int bitmap_intersects(const unsigned long *src1,
 }
 
 void bitmap_set(unsigned long *map, long i, long len);
+void bitmap_set_atomic(unsigned long *map, long i, long len);
 void bitmap_clear(unsigned long *map, long start, long nr);
+bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr);
+long bitmap_sync_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                  long start, long nr, bool *cleared);
 unsigned long bitmap_find_next_zero_area(unsigned long *map,
                                          unsigned long size,
                                          unsigned long start,
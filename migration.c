@@ -167,7 +167,10 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
 
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
+    PageCacheStats stats;
+
     if (migrate_use_xbzrle()) {
+        xbzrle_mig_cache_stats(&stats);
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -176,6 +179,8 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = stats.hits;
+        info->xbzrle_cache->cache_eviction = stats.evictions;
     }
 }
 
@@ -204,6 +209,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->expected_downtime = s->expected_downtime;
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
+        info->cpu_throttle_percentage = mig_throttle_get_percentage();
+        info->has_cpu_throttle_percentage = info->cpu_throttle_percentage != 0;
 
         info->has_ram = true;
         info->ram = g_malloc0(sizeof(*info->ram));
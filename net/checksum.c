@@ -21,20 +21,201 @@
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The sum is built from 16-bit words in host byte order and swapped at the
+ * end, which gives the same result as summing big endian words (RFC 1071).
+ * The vector loops keep 32-bit partial sums per lane; each iteration adds
+ * less than 2^17 to a lane, so they are folded into the 64-bit total at
+ * least every CSUM_VEC_BATCH iterations.
+ */
+#define CSUM_VEC_BATCH 16384
+
+#if defined __AVX2__
+#include <immintrin.h>
+
+static uint64_t csum_vec(uint8_t *dst, const uint8_t **pbuf, size_t *plen)
 {
-    uint32_t sum = 0;
-    int i;
+    const uint8_t *buf = *pbuf;
+    size_t len = *plen;
+    uint64_t sum = 0;
+
+    while (len >= 32) {
+        __m256i zero = _mm256_setzero_si256();
+        __m256i acc = zero;
+        uint32_t lanes[8];
+        int i;
+
+        for (i = 0; i < CSUM_VEC_BATCH && len >= 32; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+            if (dst) {
+                _mm256_storeu_si256((__m256i *)dst, v);
+                dst += 32;
+            }
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            buf += 32;
+            len -= 32;
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (i = 0; i < 8; i++) {
+            sum += lanes[i];
+        }
+    }
+
+    *pbuf = buf;
+    *plen = len;
+    return sum;
+}
+#elif defined __SSE2__
+#include <emmintrin.h>
+
+static uint64_t csum_vec(uint8_t *dst, const uint8_t **pbuf, size_t *plen)
+{
+    const uint8_t *buf = *pbuf;
+    size_t len = *plen;
+    uint64_t sum = 0;
+
+    while (len >= 16) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        uint32_t lanes[4];
+        int i;
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+        for (i = 0; i < CSUM_VEC_BATCH && len >= 16; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+            if (dst) {
+                _mm_storeu_si128((__m128i *)dst, v);
+                dst += 16;
+            }
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            buf += 16;
+            len -= 16;
         }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
     }
+
+    *pbuf = buf;
+    *plen = len;
     return sum;
 }
+#elif defined __ARM_NEON__ || defined __aarch64__
+#include <arm_neon.h>
+
+static uint64_t csum_vec(uint8_t *dst, const uint8_t **pbuf, size_t *plen)
+{
+    const uint8_t *buf = *pbuf;
+    size_t len = *plen;
+    uint64_t sum = 0;
+
+    while (len >= 16) {
+        uint32x4_t acc = vdupq_n_u32(0);
+        int i;
+
+        for (i = 0; i < CSUM_VEC_BATCH && len >= 16; i++) {
+            uint8x16_t v = vld1q_u8(buf);
+            if (dst) {
+                vst1q_u8(dst, v);
+                dst += 16;
+            }
+            acc = vpadalq_u16(acc, vreinterpretq_u16_u8(v));
+            buf += 16;
+            len -= 16;
+        }
+        sum += (uint64_t)vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+               vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+    }
+
+    *pbuf = buf;
+    *plen = len;
+    return sum;
+}
+#else
+static uint64_t csum_vec(uint8_t *dst, const uint8_t **pbuf, size_t *plen)
+{
+    return 0;
+}
+#endif
+
+/*
+ * Returns the ones' complement sum of len bytes at buf, folded to 16 bits,
+ * as if the data was read as big endian words.  If dst isn't NULL, the data
+ * is copied there in the same pass.
+ */
+static uint32_t csum_partial(uint8_t *dst, const uint8_t *buf, size_t len)
+{
+    size_t vec_len = len;
+    uint64_t sum;
+    uint64_t q;
+    uint16_t w;
+
+    sum = csum_vec(dst, &buf, &len);
+    if (dst) {
+        dst += vec_len - len;
+    }
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        memcpy(&q, buf, 8);
+        if (dst) {
+            memcpy(dst, &q, 8);
+            dst += 8;
+        }
+        sum += (uint32_t)q;
+        sum += q >> 32;
+    }
+    for (; len >= 2; buf += 2, len -= 2) {
+        memcpy(&w, buf, 2);
+        if (dst) {
+            memcpy(dst, &w, 2);
+            dst += 2;
+        }
+        sum += w;
+    }
+    if (len) {
+        /* the odd byte is the first byte of a word padded with zero */
+        uint8_t odd[2] = { *buf, 0 };
+        if (dst) {
+            *dst = *buf;
+        }
+        memcpy(&w, odd, 2);
+        sum += w;
+    }
+
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return be16_to_cpu(sum);
+}
+
+/* Data that starts at an odd offset contributes with its bytes swapped */
+static inline uint32_t csum_seq(uint32_t sum, int seq)
+{
+    return (seq & 1) ? bswap16(sum) : sum;
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    return csum_seq(csum_partial(NULL, buf, len), seq);
+}
+
+uint32_t net_checksum_copy_cont(int len, uint8_t *dst, const uint8_t *buf,
+                                int seq)
+{
+    return csum_seq(csum_partial(dst, buf, len), seq);
+}
+
+uint16_t net_checksum_update(uint16_t csum, uint16_t old_val,
+                             uint16_t new_val)
+{
+    /* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m') */
+    uint32_t sum = (uint16_t)~csum + (uint16_t)~old_val + new_val;
+
+    return net_checksum_finish(sum);
+}
 
 uint16_t net_checksum_finish(uint32_t sum)
 {
@@ -57,4 +57,9 @@ int net_init_netmap(const NetClientOptions *opts, const char *name,
                     NetClientState *peer);
 #endif
 
+#ifdef CONFIG_VHOST_USER
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer);
+#endif
+
 #endif /* QEMU_NET_CLIENTS_H */
@@ -433,6 +433,21 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/*
+ * Services @nc from @ctx from now on, which is where its peer runs and where
+ * packets are sent to it.  A NULL @ctx moves it back to where it ran before.
+ *
+ * Context: QEMU global mutex held
+ */
+int qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return -ENOTSUP;
+    }
+
+    return nc->info->set_aio_context(nc, ctx);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     if (!sender->peer) {
@@ -585,6 +600,52 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const NetBatchPacket *pkts,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->info->receive_batch) {
+        ret = nc->info->receive_batch(nc, pkts, count);
+    } else {
+        for (ret = 0; ret < count; ret++) {
+            ssize_t size;
+
+            if (nc->info->receive_iov) {
+                size = nc->info->receive_iov(nc, pkts[ret].iov,
+                                             pkts[ret].iovcnt);
+            } else {
+                size = nc_sendv_compat(nc, pkts[ret].iov, pkts[ret].iovcnt);
+            }
+            if (size == 0) {
+                break;
+            }
+        }
+    }
+
+    if (ret > 0) {
+        nc->rx_batches++;
+        nc->rx_batch_packets += ret;
+    }
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -608,6 +669,28 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/*
+ * Sends up to NET_BATCH_MAX packets to the peer of sender in one go and
+ * returns the number of packets that were delivered.  When this is less
+ * than count, the next packet has been queued and sent_cb is called once
+ * it is delivered; the packets after it must be sent again after that.
+ */
+int qemu_send_batch_async(NetClientState *sender, const NetBatchPacket *pkts,
+                          int count, NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_batch(queue, sender,
+                                     QEMU_NET_PACKET_FLAG_NONE,
+                                     pkts, count, sent_cb);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -786,6 +869,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_VHOST_USER
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
 };
 
 
@@ -819,6 +905,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_VHOST_USER
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
             break;
 
         default:
@@ -1021,10 +1110,16 @@ void qmp_netdev_del(const char *id, Error **errp)
 
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
-    monitor_printf(mon, "%s: index=%d,type=%s,%s\n", nc->name,
+    monitor_printf(mon, "%s: index=%d,type=%s,%s", nc->name,
                    nc->queue_index,
                    NetClientOptionsKind_lookup[nc->info->type],
                    nc->info_str);
+    if (nc->rx_batches) {
+        monitor_printf(mon, ",rx batches=%" PRIu64 " (%.1f packets/batch)",
+                       nc->rx_batches,
+                       (double)nc->rx_batch_packets / nc->rx_batches);
+    }
+    monitor_printf(mon, "\n");
 }
 
 RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -40,20 +41,30 @@
  */
 
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    uint8_t *data;
+    int buf_size;   /* allocated size of data, which outlives the packet */
 };
 
+/*
+ * Packets are kept in a ring of slots that is allocated up front and only
+ * grows if more packets are queued.  A slot keeps its data buffer for the
+ * next packet unless the buffer is larger than NET_QUEUE_BUF_KEEP.
+ */
+#define NET_QUEUE_INITIAL_SLOTS 256
+#define NET_QUEUE_BUF_KEEP      2048
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
     uint32_t nq_count;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    NetPacket *slots;
+    uint32_t nq_size;       /* number of slots */
+    uint32_t nq_head;       /* slot of the oldest packet */
 
     unsigned delivering : 1;
 };
@@ -68,7 +79,9 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_maxlen = 10000;
     queue->nq_count = 0;
 
-    QTAILQ_INIT(&queue->packets);
+    queue->nq_size = NET_QUEUE_INITIAL_SLOTS;
+    queue->slots = g_new0(NetPacket, queue->nq_size);
+    queue->nq_head = 0;
 
     queue->delivering = 0;
 
@@ -77,16 +90,75 @@ NetQueue *qemu_new_net_queue(void *opaque)
 
 void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    uint32_t i;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    for (i = 0; i < queue->nq_size; i++) {
+        g_free(queue->slots[i].data);
     }
-
+    g_free(queue->slots);
     g_free(queue);
 }
 
+/* Returns the i-th queued packet, counting from the oldest one */
+static inline NetPacket *qemu_net_queue_slot(NetQueue *queue, uint32_t i)
+{
+    return &queue->slots[(queue->nq_head + i) % queue->nq_size];
+}
+
+static NetPacket *qemu_net_queue_alloc(NetQueue *queue,
+                                       NetClientState *sender,
+                                       unsigned flags,
+                                       size_t size,
+                                       NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (queue->nq_count == queue->nq_size) {
+        uint32_t old_size = queue->nq_size;
+        NetPacket *slots = g_new0(NetPacket, old_size * 2);
+        uint32_t tail = old_size - queue->nq_head;
+
+        /* Unwrap the ring, so the oldest packet lands in the first slot */
+        memcpy(slots, queue->slots + queue->nq_head, tail * sizeof(*slots));
+        memcpy(slots + tail, queue->slots, queue->nq_head * sizeof(*slots));
+        g_free(queue->slots);
+        queue->slots = slots;
+        queue->nq_size = old_size * 2;
+        queue->nq_head = 0;
+    }
+
+    packet = qemu_net_queue_slot(queue, queue->nq_count);
+    if (packet->buf_size < size) {
+        g_free(packet->data);
+        packet->data = g_malloc(MAX(size, NET_QUEUE_BUF_KEEP));
+        packet->buf_size = MAX(size, NET_QUEUE_BUF_KEEP);
+    }
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = size;
+    packet->sent_cb = sent_cb;
+
+    queue->nq_count++;
+    return packet;
+}
+
+static void qemu_net_queue_release(NetPacket *packet)
+{
+    if (packet->buf_size > NET_QUEUE_BUF_KEEP) {
+        g_free(packet->data);
+        packet->data = NULL;
+        packet->buf_size = 0;
+    }
+}
+
+/* Removes the oldest packet */
+static void qemu_net_queue_pop(NetQueue *queue)
+{
+    qemu_net_queue_release(qemu_net_queue_slot(queue, 0));
+    queue->nq_head = (queue->nq_head + 1) % queue->nq_size;
+    queue->nq_count--;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -99,15 +171,8 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
+    packet = qemu_net_queue_alloc(queue, sender, flags, size, sent_cb);
     memcpy(packet->data, buf, size);
-
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -118,31 +183,14 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
                                       NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    size_t size;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
-    }
-
-    packet = g_malloc(sizeof(NetPacket) + max_len);
-    packet->sender = sender;
-    packet->sent_cb = sent_cb;
-    packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
-
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    size = iov_size(iov, iovcnt);
+    packet = qemu_net_queue_alloc(queue, sender, flags, size, sent_cb);
+    iov_to_buf(iov, iovcnt, 0, packet->data, size);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -175,6 +223,21 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_batch(NetQueue *queue,
+                                        NetClientState *sender,
+                                        unsigned flags,
+                                        const NetBatchPacket *pkts,
+                                        int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_batch(sender, flags, pkts, count, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -225,45 +288,127 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Returns the number of packets that were delivered.  If it is less than
+ * count and a sent callback is provided, the first packet that wasn't
+ * delivered has been queued and the callback is invoked for it later; the
+ * caller must hold back the packets after it until then, like for a zero
+ * return of qemu_net_queue_send().  Without a callback, the packets that
+ * weren't delivered are queued or dropped and count is returned.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetBatchPacket *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int ret = 0;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        ret = qemu_net_queue_deliver_batch(queue, sender, flags, pkts, count);
+    }
+
+    if (ret < count) {
+        if (sent_cb) {
+            qemu_net_queue_append_iov(queue, sender, flags, pkts[ret].iov,
+                                      pkts[ret].iovcnt, sent_cb);
+            return ret;
+        }
+        for (; ret < count; ret++) {
+            qemu_net_queue_append_iov(queue, sender, flags, pkts[ret].iov,
+                                      pkts[ret].iovcnt, NULL);
+        }
+        return count;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
+    uint32_t i, kept = 0;
+
+    /* Move the packets that stay to the front, keeping their order */
+    for (i = 0; i < queue->nq_count; i++) {
+        NetPacket *packet = qemu_net_queue_slot(queue, i);
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            g_free(packet);
+            qemu_net_queue_release(packet);
+        } else {
+            NetPacket *dest = qemu_net_queue_slot(queue, kept++);
+            NetPacket tmp = *dest;
+
+            *dest = *packet;
+            *packet = tmp;
         }
     }
+    queue->nq_count = kept;
 }
 
 bool qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
-        int ret;
-
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+    while (queue->nq_count) {
+        NetPacket *packet = qemu_net_queue_slot(queue, 0);
+        struct iovec iov[NET_BATCH_MAX];
+        NetBatchPacket pkts[NET_BATCH_MAX];
+        struct {
+            NetClientState *sender;
+            NetPacketSent *sent_cb;
+            ssize_t ret;
+        } done[NET_BATCH_MAX];
+        int count, ret, i;
+
+        if (packet->flags & QEMU_NET_PACKET_FLAG_RAW) {
+            ssize_t size = qemu_net_queue_deliver(queue,
+                                                  packet->sender,
+                                                  packet->flags,
+                                                  packet->data,
+                                                  packet->size);
+            count = 1;
+            ret = size != 0;
+            done[0].ret = size;
+        } else {
+            /* Everything up to the next raw packet goes in one batch */
+            for (count = 0; count < queue->nq_count && count < NET_BATCH_MAX;
+                 count++) {
+                packet = qemu_net_queue_slot(queue, count);
+                if (packet->flags & QEMU_NET_PACKET_FLAG_RAW) {
+                    break;
+                }
+                iov[count].iov_base = packet->data;
+                iov[count].iov_len = packet->size;
+                pkts[count].iov = &iov[count];
+                pkts[count].iovcnt = 1;
+            }
+
+            packet = qemu_net_queue_slot(queue, 0);
+            ret = qemu_net_queue_deliver_batch(queue, packet->sender,
+                                               packet->flags, pkts, count);
+            for (i = 0; i < ret; i++) {
+                done[i].ret = iov[i].iov_len;
+            }
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        /* The callbacks may send more packets, so dequeue these first */
+        for (i = 0; i < ret; i++) {
+            packet = qemu_net_queue_slot(queue, 0);
+            done[i].sender = packet->sender;
+            done[i].sent_cb = packet->sent_cb;
+            qemu_net_queue_pop(queue);
         }
 
-        g_free(packet);
+        for (i = 0; i < ret; i++) {
+            if (done[i].sent_cb) {
+                done[i].sent_cb(done[i].sender, done[i].ret);
+            }
+        }
+
+        if (ret < count) {
+            return false;
+        }
     }
     return true;
 }
@@ -30,12 +30,17 @@
 #include <sys/wait.h>
 #endif
 #include "net/net.h"
+#include "net/tap.h"
 #include "clients.h"
 #include "hub.h"
 #include "monitor/monitor.h"
 #include "qemu/sockets.h"
 #include "slirp/libslirp.h"
 #include "sysemu/char.h"
+#include "sysemu/iothread.h"
+#include "qemu/iov.h"
+#include "qemu/bitmap.h"
+#include "net/eth.h"
 
 static int get_str_sep(char *buf, int buf_size, const char **pp, int sep)
 {
@@ -69,15 +74,64 @@ struct slirp_config_str {
     int legacy_format;
 };
 
+/*
+ * Frames handed over to another thread: by an IOThread to the main loop for
+ * delivery to the peer, or by one queue to the stack of another queue
+ */
+#define SLIRP_QUEUE_MAX 1024
+
+typedef struct SlirpFrame {
+    QSIMPLEQ_ENTRY(SlirpFrame) next;
+    int flags;              /* for slirp_input() */
+    size_t len;
+    uint8_t data[];
+} SlirpFrame;
+
+typedef struct SlirpQueues SlirpQueues;
+
 typedef struct SlirpState {
     NetClientState nc;
     QTAILQ_ENTRY(SlirpState) entry;
     Slirp *slirp;
+    SlirpQueues *queues;
+    bool vnet_hdr;          /* offer the virtio-net header to the peer */
+    bool using_vnet_hdr;
+    int vnet_hdr_len;
+    bool chr_fwd;           /* a guestfwd rule writes to a character device */
+
+    /* Set if the stack runs in an IOThread, or in the one of its peer */
+    IOThread *iothread;
+    AioContext *ctx;
+    bool peer_ctx;          /* ctx is the peer's, frames go to it directly */
+    QemuMutex tx_lock;
+    QSIMPLEQ_HEAD(, SlirpFrame) tx_queue;
+    int tx_queue_len;
+    QEMUBH *tx_bh;
+
+    /* Frames other queues steered to this stack, protected by queues->lock */
+    QSIMPLEQ_HEAD(, SlirpFrame) rx_queue;
+    int rx_queue_len;
+    QEMUBH *rx_bh;
 #ifndef _WIN32
     char smb_dir[128];
 #endif
 } SlirpState;
 
+/*
+ * With queues=N, every queue of the peer gets a stack of its own, all with
+ * the same configuration.  Frames from the guest are steered to a stack by
+ * flow, whatever queue the guest sent them on, so that each connection lives
+ * in exactly one stack.  The first stack owns the DHCP server and the host
+ * forwarding rules.
+ */
+struct SlirpQueues {
+    int num;
+    int live;                       /* stacks not cleaned up yet */
+    QemuMutex lock;                 /* stacks[] and their rx_queue */
+    unsigned long *fwd_ports[2];    /* guest ports of hostfwd, TCP and UDP */
+    SlirpState *stacks[];
+};
+
 static struct slirp_config_str *slirp_configs;
 const char *legacy_tftp_prefix;
 const char *legacy_bootp_filename;
@@ -99,36 +153,490 @@ static void slirp_smb_cleanup(SlirpState *s);
 static inline void slirp_smb_cleanup(SlirpState *s) { }
 #endif
 
-void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
+/*
+ * With an IOThread, everything that calls into s->slirp from elsewhere must
+ * hold its AioContext.
+ */
+static void slirp_state_lock(SlirpState *s)
+{
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+    }
+}
+
+static void slirp_state_unlock(SlirpState *s)
+{
+    if (s->ctx) {
+        aio_context_release(s->ctx);
+    }
+}
+
+/* Runs in the main loop and passes on frames queued by the IOThread */
+static void slirp_tx_bh(void *opaque)
+{
+    SlirpState *s = opaque;
+    SlirpFrame *frame;
+
+    for (;;) {
+        qemu_mutex_lock(&s->tx_lock);
+        frame = QSIMPLEQ_FIRST(&s->tx_queue);
+        if (frame) {
+            QSIMPLEQ_REMOVE_HEAD(&s->tx_queue, next);
+            s->tx_queue_len--;
+        }
+        qemu_mutex_unlock(&s->tx_lock);
+
+        if (!frame) {
+            break;
+        }
+        qemu_send_packet(&s->nc, frame->data, frame->len);
+        g_free(frame);
+    }
+}
+
+static SlirpFrame *slirp_frame_new(const struct iovec *iov, int iovcnt,
+                                   int flags)
+{
+    size_t len = iov_size(iov, iovcnt);
+    SlirpFrame *frame = g_malloc(sizeof(*frame) + len);
+
+    frame->flags = flags;
+    frame->len = len;
+    iov_to_buf(iov, iovcnt, 0, frame->data, len);
+    return frame;
+}
+
+static QEMUBH *slirp_bh_new(SlirpState *s, QEMUBHFunc *cb)
+{
+    return s->ctx ? aio_bh_new(s->ctx, cb, s) : qemu_bh_new(cb, s);
+}
+
+static void net_slirp_send(SlirpState *s, const struct iovec *iov, int iovcnt)
+{
+    SlirpFrame *frame;
+
+    if (!s->ctx || s->peer_ctx) {
+        qemu_sendv_packet(&s->nc, iov, iovcnt);
+        return;
+    }
+
+    /* The peer can only be called from the main loop */
+    frame = slirp_frame_new(iov, iovcnt, 0);
+
+    qemu_mutex_lock(&s->tx_lock);
+    if (s->tx_queue_len >= SLIRP_QUEUE_MAX) {
+        /* Like a full transmit ring, TCP will retransmit */
+        qemu_mutex_unlock(&s->tx_lock);
+        g_free(frame);
+        return;
+    }
+    QSIMPLEQ_INSERT_TAIL(&s->tx_queue, frame, next);
+    s->tx_queue_len++;
+    qemu_mutex_unlock(&s->tx_lock);
+
+    qemu_bh_schedule(s->tx_bh);
+}
+
+void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len,
+                  const SlirpOffload *offload)
+{
+    SlirpState *s = opaque;
+    struct virtio_net_hdr_mrg_rxbuf hdr = { };
+    struct iovec iov[2];
+
+    if (!s->using_vnet_hdr) {
+        iov[0].iov_base = (void *)pkt;
+        iov[0].iov_len = pkt_len;
+        net_slirp_send(s, iov, 1);
+        return;
+    }
+
+    if (offload && offload->csum_start) {
+        hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.hdr.csum_start = offload->csum_start;
+        hdr.hdr.csum_offset = offload->csum_offset;
+    }
+    if (offload && offload->gso_size) {
+        hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.hdr.gso_size = offload->gso_size;
+        hdr.hdr.hdr_len = offload->hdr_len;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = s->vnet_hdr_len;
+    iov[1].iov_base = (void *)pkt;
+    iov[1].iov_len = pkt_len;
+    net_slirp_send(s, iov, 2);
+}
+
+/* Runs in the AioContext of the stack, or the main loop */
+static void slirp_rx_bh(void *opaque)
 {
     SlirpState *s = opaque;
+    SlirpQueues *q = s->queues;
+    QSIMPLEQ_HEAD(, SlirpFrame) frames = QSIMPLEQ_HEAD_INITIALIZER(frames);
+    SlirpFrame *frame;
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_CONCAT(&frames, &s->rx_queue);
+    s->rx_queue_len = 0;
+    qemu_mutex_unlock(&q->lock);
+
+    slirp_state_lock(s);
+    while ((frame = QSIMPLEQ_FIRST(&frames)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&frames, next);
+        slirp_input(s->slirp, frame->data, frame->len, frame->flags);
+        g_free(frame);
+    }
+    slirp_state_unlock(s);
+}
+
+static int slirp_flow_hash(SlirpQueues *q, uint32_t hash)
+{
+    hash *= 0x9e3779b1;
+    return ((uint64_t)hash * q->num) >> 32;
+}
+
+/*
+ * Picks the stack for a frame from the guest, or returns -1 if every stack
+ * needs to see it.  TCP is spread by addresses and ports.  UDP and ICMP only
+ * by addresses, since fragments carry no ports and a TFTP transfer changes
+ * the server port.  What isn't IPv4, DHCP and replies from guest ports that
+ * a hostfwd rule connects to go to the first stack, and so do ARP requests.
+ * Every stack learns from ARP replies, since each resolves the guest itself.
+ */
+static int net_slirp_steer(SlirpQueues *q, const struct iovec *iov,
+                           int iovcnt)
+{
+    uint8_t buf[sizeof(struct eth_header) + ETH_MAX_IP4_HDR_LEN + 4];
+    const uint8_t *ip = buf + sizeof(struct eth_header);
+    size_t len;
+    uint32_t hash;
+    uint16_t sport, dport;
+    int hlen, proto;
+    bool frag;
+
+    if (q->num == 1) {
+        return 0;
+    }
+
+    len = iov_to_buf(iov, iovcnt, 0, buf, sizeof(buf));
+    if (len < sizeof(struct eth_header) + 20) {
+        return 0;
+    }
+
+    switch (lduw_be_p(buf + 12)) {
+    case 0x0806: /* ARP */
+        return lduw_be_p(ip + 6) == 2 ? -1 : 0;
+    case ETH_P_IP:
+        break;
+    default:
+        return 0;
+    }
+
+    hlen = (ip[0] & 0xf) * 4;
+    proto = ip[9];
+    frag = lduw_be_p(ip + 6) & 0x3fff;
+    hash = ldl_be_p(ip + 12) ^ ldl_be_p(ip + 16);
+
+    if ((proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) ||
+        hlen < 20 || len < sizeof(struct eth_header) + hlen + 4) {
+        return slirp_flow_hash(q, hash);
+    }
 
-    qemu_send_packet(&s->nc, pkt, pkt_len);
+    sport = lduw_be_p(ip + hlen);
+    dport = lduw_be_p(ip + hlen + 2);
+    if (!frag && ((proto == IP_PROTO_UDP && dport == 67) ||
+                  test_bit(sport, q->fwd_ports[proto == IP_PROTO_UDP]))) {
+        return 0;
+    }
+    if (proto == IP_PROTO_TCP && !frag) {
+        hash ^= (uint32_t)sport << 16 | dport;
+    }
+    return slirp_flow_hash(q, hash);
+}
+
+/* Called with the slirp state lock of s held */
+static void net_slirp_deliver(SlirpState *s, int index,
+                              const struct iovec *iov, int iovcnt, int flags)
+{
+    SlirpQueues *q = s->queues;
+    SlirpState *t;
+
+    if (index == s->nc.queue_index) {
+        slirp_input_iov(s->slirp, iov, iovcnt, flags);
+        return;
+    }
+
+    qemu_mutex_lock(&q->lock);
+    t = q->stacks[index];
+    if (t && t->ctx == s->ctx) {
+        /*
+         * Same thread, and t can't move away or go away while its
+         * AioContext is held, so no need to queue the frame
+         */
+        qemu_mutex_unlock(&q->lock);
+        slirp_input_iov(t->slirp, iov, iovcnt, flags);
+        return;
+    }
+    if (t && t->rx_bh && t->rx_queue_len < SLIRP_QUEUE_MAX) {
+        QSIMPLEQ_INSERT_TAIL(&t->rx_queue, slirp_frame_new(iov, iovcnt, flags),
+                             next);
+        t->rx_queue_len++;
+        qemu_bh_schedule(t->rx_bh);
+    }
+    qemu_mutex_unlock(&q->lock);
+}
+
+/* Must be called with the slirp state lock held */
+static void net_slirp_input(SlirpState *s, const struct iovec *iov, int iovcnt)
+{
+    struct iovec local_iov[iovcnt];
+    struct virtio_net_hdr hdr;
+    size_t size = iov_size(iov, iovcnt);
+    int flags = 0;
+    int index, i;
+
+    if (s->using_vnet_hdr) {
+        if (size < s->vnet_hdr_len) {
+            return;
+        }
+        iov_to_buf(iov, iovcnt, 0, &hdr, sizeof(hdr));
+        /*
+         * Partial checksums are never completed, slirp consumes the packet
+         * itself.  Large TCPv4 segments are handled like any other packet.
+         */
+        if (hdr.flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                         VIRTIO_NET_HDR_F_DATA_VALID)) {
+            flags |= SLIRP_INPUT_CSUM_VALID;
+        }
+        iovcnt = iov_copy(local_iov, iovcnt, iov, iovcnt, s->vnet_hdr_len,
+                          size - s->vnet_hdr_len);
+        iov = local_iov;
+    }
+
+    index = net_slirp_steer(s->queues, iov, iovcnt);
+    if (index >= 0) {
+        net_slirp_deliver(s, index, iov, iovcnt, flags);
+        return;
+    }
+    for (i = 0; i < s->queues->num; i++) {
+        net_slirp_deliver(s, i, iov, iovcnt, flags);
+    }
+}
+
+static ssize_t net_slirp_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    slirp_state_lock(s);
+    net_slirp_input(s, iov, iovcnt);
+    slirp_state_unlock(s);
+
+    return iov_size(iov, iovcnt);
+}
+
+/* slirp never refuses packets, a whole batch goes in under one lock */
+static int net_slirp_receive_batch(NetClientState *nc,
+                                   const NetBatchPacket *pkts, int count)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    int i;
+
+    slirp_state_lock(s);
+    for (i = 0; i < count; i++) {
+        net_slirp_input(s, pkts[i].iov, pkts[i].iovcnt);
+    }
+    slirp_state_unlock(s);
+
+    return count;
 }
 
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return net_slirp_receive_iov(nc, &iov, 1);
+}
+
+static bool net_slirp_has_vnet_hdr(NetClientState *nc)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    return s->vnet_hdr;
+}
+
+static bool net_slirp_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    return len == sizeof(struct virtio_net_hdr) ||
+           len == sizeof(struct virtio_net_hdr_mrg_rxbuf);
+}
+
+static void net_slirp_using_vnet_hdr(NetClientState *nc, bool enable)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    assert(s->vnet_hdr || !enable);
+    s->using_vnet_hdr = enable;
+    if (!enable) {
+        slirp_state_lock(s);
+        slirp_set_offload(s->slirp, false, false);
+        slirp_state_unlock(s);
+    }
+}
+
+static void net_slirp_set_vnet_hdr_len(NetClientState *nc, int len)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
-    slirp_input(s->slirp, buf, size);
+    assert(net_slirp_has_vnet_hdr_len(nc, len));
+    s->vnet_hdr_len = len;
+}
 
-    return size;
+/* The peer sets offloads through its first queue, they apply to all stacks */
+static void net_slirp_set_offload(NetClientState *nc, int csum, int tso4,
+                                  int tso6, int ecn, int ufo)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    SlirpQueues *q = s->queues;
+    int i;
+
+    for (i = 0; i < q->num; i++) {
+        SlirpState *t = q->stacks[i];
+
+        if (!t) {
+            continue;
+        }
+        /* slirp only talks IPv4 and doesn't produce large UDP datagrams */
+        slirp_state_lock(t);
+        slirp_set_offload(t->slirp, t->using_vnet_hdr && csum,
+                          t->using_vnet_hdr && tso4);
+        slirp_state_unlock(t);
+    }
+}
+
+/*
+ * Moves the stack to the AioContext its peer runs in, which the caller holds,
+ * or back to its IOThread or the main loop if ctx is NULL.
+ */
+static int net_slirp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    SlirpQueues *q = s->queues;
+    AioContext *old_ctx = s->ctx;
+    AioContext *new_ctx = ctx;
+
+    if (!s->slirp) {
+        return 0;
+    }
+    if (ctx && s->chr_fwd) {
+        return -ENOTSUP;
+    }
+    if (!new_ctx && s->iothread) {
+        new_ctx = iothread_get_aio_context(s->iothread);
+    }
+    if (new_ctx == old_ctx) {
+        s->peer_ctx = ctx != NULL;
+        return 0;
+    }
+
+    slirp_state_lock(s);
+    if (s->tx_bh) {
+        /* Frames queued for the peer go out before it moves */
+        qemu_bh_cancel(s->tx_bh);
+        slirp_tx_bh(s);
+    }
+    if (old_ctx) {
+        slirp_detach_aio_context(s->slirp);
+    }
+    if (new_ctx && slirp_attach_aio_context(s->slirp, new_ctx) < 0) {
+        if (old_ctx) {
+            slirp_attach_aio_context(s->slirp, old_ctx);
+        }
+        slirp_state_unlock(s);
+        return -ENOTSUP;
+    }
+    s->ctx = new_ctx;
+    s->peer_ctx = ctx != NULL;
+    if (old_ctx) {
+        aio_context_release(old_ctx);
+    }
+    if (!new_ctx) {
+        /* Back to slirp_pollfds_fill/poll() */
+        qemu_notify_event();
+    }
+
+    if (s->rx_bh) {
+        qemu_mutex_lock(&q->lock);
+        qemu_bh_delete(s->rx_bh);
+        s->rx_bh = slirp_bh_new(s, slirp_rx_bh);
+        if (s->rx_queue_len) {
+            qemu_bh_schedule(s->rx_bh);
+        }
+        qemu_mutex_unlock(&q->lock);
+    }
+    return 0;
 }
 
 static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    SlirpQueues *q = s->queues;
+    SlirpFrame *frame;
+
+    qemu_mutex_lock(&q->lock);
+    q->stacks[nc->queue_index] = NULL;
+    if (s->rx_bh) {
+        qemu_bh_delete(s->rx_bh);
+        s->rx_bh = NULL;
+    }
+    while ((frame = QSIMPLEQ_FIRST(&s->rx_queue)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->rx_queue, next);
+        g_free(frame);
+    }
+    qemu_mutex_unlock(&q->lock);
 
+    slirp_state_lock(s);
     slirp_cleanup(s->slirp);
+    slirp_state_unlock(s);
+    s->slirp = NULL;
     slirp_smb_cleanup(s);
     QTAILQ_REMOVE(&slirp_stacks, s, entry);
+
+    if (s->tx_bh) {
+        qemu_bh_delete(s->tx_bh);
+        while ((frame = QSIMPLEQ_FIRST(&s->tx_queue)) != NULL) {
+            QSIMPLEQ_REMOVE_HEAD(&s->tx_queue, next);
+            g_free(frame);
+        }
+        qemu_mutex_destroy(&s->tx_lock);
+    }
+
+    if (--q->live == 0) {
+        qemu_mutex_destroy(&q->lock);
+        g_free(q->fwd_ports[0]);
+        g_free(q->fwd_ports[1]);
+        g_free(q);
+    }
 }
 
 static NetClientInfo net_slirp_info = {
     .type = NET_CLIENT_OPTIONS_KIND_USER,
     .size = sizeof(SlirpState),
     .receive = net_slirp_receive,
+    .receive_iov = net_slirp_receive_iov,
+    .receive_batch = net_slirp_receive_batch,
     .cleanup = net_slirp_cleanup,
+    .has_vnet_hdr = net_slirp_has_vnet_hdr,
+    .has_vnet_hdr_len = net_slirp_has_vnet_hdr_len,
+    .using_vnet_hdr = net_slirp_using_vnet_hdr,
+    .set_offload = net_slirp_set_offload,
+    .set_vnet_hdr_len = net_slirp_set_vnet_hdr_len,
+    .set_aio_context = net_slirp_set_aio_context,
 };
 
 static int net_slirp_init(NetClientState *peer, const char *model,
@@ -137,7 +645,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *vhostname, const char *tftp_export,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *smb_export,
-                          const char *vsmbserver, const char **dnssearch)
+                          const char *vsmbserver, const char **dnssearch,
+                          bool vnet_hdr, const char *iothread, int queues)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -149,10 +658,12 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     struct in_addr smbsrv = { .s_addr = 0 };
 #endif
     NetClientState *nc;
+    SlirpQueues *q;
     SlirpState *s;
+    IOThread *it = NULL;
     char buf[20];
     uint32_t addr;
-    int shift;
+    int shift, i;
     char *end;
     struct slirp_config_str *config;
 
@@ -234,18 +745,55 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     }
 #endif
 
-    nc = qemu_new_net_client(&net_slirp_info, peer, model, name);
-
-    snprintf(nc->info_str, sizeof(nc->info_str),
-             "net=%s,restrict=%s", inet_ntoa(net),
-             restricted ? "on" : "off");
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("invalid number of queues %d", queues);
+        return -1;
+    }
+    if (queues > 1 && peer) {
+        error_report("Multiqueue user mode networking cannot be used with "
+                     "QEMU vlans");
+        return -1;
+    }
 
-    s = DO_UPCAST(SlirpState, nc, nc);
+    if (iothread) {
+        it = iothread_find(iothread);
+        if (!it) {
+            error_report("iothread '%s' not found", iothread);
+            return -1;
+        }
+    }
 
-    s->slirp = slirp_init(restricted, net, mask, host, vhostname,
-                          tftp_export, bootfile, dhcp, dns, dnssearch, s);
-    QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
+    q = g_malloc0(sizeof(*q) + queues * sizeof(q->stacks[0]));
+    q->num = queues;
+    qemu_mutex_init(&q->lock);
+    q->fwd_ports[0] = bitmap_new(65536);
+    q->fwd_ports[1] = bitmap_new(65536);
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_slirp_info, peer, model, name);
+        nc->queue_index = i;
+
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "net=%s,restrict=%s", inet_ntoa(net),
+                 restricted ? "on" : "off");
+
+        s = DO_UPCAST(SlirpState, nc, nc);
+        s->queues = q;
+        s->vnet_hdr = vnet_hdr;
+        s->vnet_hdr_len = sizeof(struct virtio_net_hdr);
+        s->iothread = it;
+        QSIMPLEQ_INIT(&s->tx_queue);
+        QSIMPLEQ_INIT(&s->rx_queue);
+
+        s->slirp = slirp_init(restricted, net, mask, host, vhostname,
+                              tftp_export, bootfile, dhcp, dns, dnssearch, s);
+        QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
+        q->stacks[i] = s;
+        q->live++;
+    }
 
+    /* Rules are set up through the first stack, see SlirpQueues */
+    s = q->stacks[0];
     for (config = slirp_configs; config; config = config->next) {
         if (config->flags & SLIRP_CFG_HOSTFWD) {
             if (slirp_hostfwd(s, config->str,
@@ -267,10 +815,30 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     }
 #endif
 
+    for (i = 0; i < queues; i++) {
+        s = q->stacks[i];
+        if (s->iothread) {
+            qemu_mutex_init(&s->tx_lock);
+            s->tx_bh = qemu_bh_new(slirp_tx_bh, s);
+            s->ctx = iothread_get_aio_context(s->iothread);
+            if (slirp_attach_aio_context(s->slirp, s->ctx) < 0) {
+                s->ctx = NULL;
+                error_report("iothread requires epoll support");
+                goto error;
+            }
+        } else {
+            /* Without epoll, every socket keeps being polled individually */
+            slirp_epoll_init(s->slirp);
+        }
+        if (queues > 1) {
+            s->rx_bh = slirp_bh_new(s, slirp_rx_bh);
+        }
+    }
+
     return 0;
 
 error:
-    qemu_del_net_client(nc);
+    qemu_del_net_client(&q->stacks[0]->nc);
     return -1;
 }
 
@@ -344,8 +912,9 @@ void net_slirp_hostfwd_remove(Monitor *mon, const QDict *qdict)
 
     host_port = atoi(p);
 
-    err = slirp_remove_hostfwd(QTAILQ_FIRST(&slirp_stacks)->slirp, is_udp,
-                               host_addr, host_port);
+    slirp_state_lock(s);
+    err = slirp_remove_hostfwd(s->slirp, is_udp, host_addr, host_port);
+    slirp_state_unlock(s);
 
     monitor_printf(mon, "host forwarding rule for %s %s\n", src_str,
                    err ? "not found" : "removed");
@@ -365,6 +934,7 @@ static int slirp_hostfwd(SlirpState *s, const char *redir_str,
     char buf[256];
     int is_udp;
     char *end;
+    int ret;
 
     p = redir_str;
     if (!p || get_str_sep(buf, sizeof(buf), &p, ':') < 0) {
@@ -407,12 +977,17 @@ static int slirp_hostfwd(SlirpState *s, const char *redir_str,
         goto fail_syntax;
     }
 
-    if (slirp_add_hostfwd(s->slirp, is_udp, host_addr, host_port, guest_addr,
-                          guest_port) < 0) {
+    slirp_state_lock(s);
+    ret = slirp_add_hostfwd(s->slirp, is_udp, host_addr, host_port,
+                            guest_addr, guest_port);
+    slirp_state_unlock(s);
+    if (ret < 0) {
         error_report("could not set up host forwarding rule '%s'",
                      redir_str);
         return -1;
     }
+    /* The guest answers from guest_port, steer that to this stack */
+    set_bit(guest_port, s->queues->fwd_ports[is_udp]);
     return 0;
 
  fail_syntax:
@@ -441,6 +1016,26 @@ void net_slirp_hostfwd_add(Monitor *mon, const QDict *qdict)
 
 }
 
+/*
+ * Services the guest reaches at addr:port, like the smb server, are offered
+ * by every stack since a connection can be steered to any of them.
+ */
+static int slirp_add_exec_all(SlirpState *s, int do_pty, const void *args,
+                              struct in_addr *addr, int port)
+{
+    SlirpQueues *q = s->queues;
+    int i, ret = 0;
+
+    for (i = 0; i < q->num && ret == 0; i++) {
+        SlirpState *t = q->stacks[i];
+
+        slirp_state_lock(t);
+        ret = slirp_add_exec(t->slirp, do_pty, args, addr, port);
+        slirp_state_unlock(t);
+    }
+    return ret;
+}
+
 int net_slirp_redir(const char *redir_str)
 {
     struct slirp_config_str *config;
@@ -486,6 +1081,7 @@ static int slirp_smb(SlirpState* s, const char *exported_dir,
     char smb_cmdline[128];
     struct passwd *passwd;
     FILE *f;
+    int ret;
 
     passwd = getpwuid(geteuid());
     if (!passwd) {
@@ -552,8 +1148,9 @@ static int slirp_smb(SlirpState* s, const char *exported_dir,
     snprintf(smb_cmdline, sizeof(smb_cmdline), "%s -s %s",
              CONFIG_SMBD_COMMAND, smb_conf);
 
-    if (slirp_add_exec(s->slirp, 0, smb_cmdline, &vserver_addr, 139) < 0 ||
-        slirp_add_exec(s->slirp, 0, smb_cmdline, &vserver_addr, 445) < 0) {
+    ret = slirp_add_exec_all(s, 0, smb_cmdline, &vserver_addr, 139) < 0 ||
+          slirp_add_exec_all(s, 0, smb_cmdline, &vserver_addr, 445) < 0;
+    if (ret) {
         slirp_smb_cleanup(s);
         error_report("conflicting/invalid smbserver address");
         return -1;
@@ -640,12 +1237,24 @@ static int slirp_guestfwd(SlirpState *s, const char *config_str,
     snprintf(buf, sizeof(buf), "guestfwd.tcp.%d", port);
 
     if ((strlen(p) > 4) && !strncmp(p, "cmd:", 4)) {
-        if (slirp_add_exec(s->slirp, 0, &p[4], &server, port) < 0) {
+        if (slirp_add_exec_all(s, 0, &p[4], &server, port) < 0) {
             error_report("conflicting/invalid host:port in guest forwarding "
                          "rule '%s'", config_str);
             g_free(fwd);
             return -1;
         }
+    } else if (s->iothread) {
+        /* The character device would be written from the IOThread */
+        error_report("guest forwarding to a character device is not "
+                     "supported with iothread");
+        g_free(fwd);
+        return -1;
+    } else if (s->queues->num > 1) {
+        /* Only one stack could be connected to it */
+        error_report("guest forwarding to a character device is not "
+                     "supported with queues");
+        g_free(fwd);
+        return -1;
     } else {
         fwd->hd = qemu_chr_new(buf, p, NULL);
         if (!fwd->hd) {
@@ -663,6 +1272,7 @@ static int slirp_guestfwd(SlirpState *s, const char *config_str,
         fwd->server = server;
         fwd->port = port;
         fwd->slirp = s->slirp;
+        s->chr_fwd = true;
 
         qemu_chr_fe_claim_no_fail(fwd->hd);
         qemu_chr_add_handlers(fwd->hd, guestfwd_can_read, guestfwd_read,
@@ -682,10 +1292,18 @@ void do_info_usernet(Monitor *mon, const QDict *qdict)
     QTAILQ_FOREACH(s, &slirp_stacks, entry) {
         int id;
         bool got_vlan_id = net_hub_id_for_client(&s->nc, &id) == 0;
-        monitor_printf(mon, "VLAN %d (%s):\n",
-                       got_vlan_id ? id : -1,
-                       s->nc.name);
+        if (s->queues->num > 1) {
+            monitor_printf(mon, "VLAN %d (%s, queue %u):\n",
+                           got_vlan_id ? id : -1,
+                           s->nc.name, s->nc.queue_index);
+        } else {
+            monitor_printf(mon, "VLAN %d (%s):\n",
+                           got_vlan_id ? id : -1,
+                           s->nc.name);
+        }
+        slirp_state_lock(s);
         slirp_connection_info(s->slirp, mon);
+        slirp_state_unlock(s);
     }
 }
 
@@ -756,7 +1374,10 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     ret = net_slirp_init(peer, "user", name, user->q_restrict, vnet,
                          user->host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart, user->dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch,
+                         user->has_vnet_hdr && user->vnet_hdr,
+                         user->has_iothread ? user->iothread : NULL,
+                         user->has_queues ? user->queues : 1);
 
     while (slirp_configs) {
         config = slirp_configs;
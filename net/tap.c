@@ -39,17 +39,25 @@
 #include "sysemu/sysemu.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Number of packets read from the tap device before passing them on */
+#define TAP_SEND_BATCH 32
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t *bufs[TAP_SEND_BATCH];  /* NET_BUFSIZE each, allocated on use */
+    struct iovec send_iov[TAP_SEND_BATCH];
+    NetBatchPacket send_pkts[TAP_SEND_BATCH];
+    int send_first;                 /* read, but not yet passed on */
+    int send_count;
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -57,6 +65,7 @@ typedef struct TAPState {
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    AioContext *ctx;                /* NULL for the main loop */
 } TAPState;
 
 static int launch_script(const char *setup_script, const char *ifname, int fd);
@@ -67,6 +76,14 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd,
+                           s->read_poll && s->enabled ? tap_send : NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           s);
+        return;
+    }
+
     qemu_set_fd_handler2(s->fd,
                          s->read_poll && s->enabled ? tap_can_send : NULL,
                          s->read_poll && s->enabled ? tap_send     : NULL,
@@ -130,6 +147,19 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+static int tap_receive_batch(NetClientState *nc, const NetBatchPacket *pkts,
+                             int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (tap_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -183,17 +213,27 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
     tap_read_poll(s, true);
+
+    /* Packets held back from the last batch don't wait for the fd */
+    if (s->send_count) {
+        tap_send(s);
+    }
 }
 
-static void tap_send(void *opaque)
+/* Reads up to TAP_SEND_BATCH packets, returns how many it got */
+static int tap_read_batch(TAPState *s)
 {
-    TAPState *s = opaque;
-    int size;
+    int n, size;
 
-    while (qemu_can_send_packet(&s->nc)) {
-        uint8_t *buf = s->buf;
+    for (n = 0; n < TAP_SEND_BATCH; n++) {
+        uint8_t *buf;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+        if (!s->bufs[n]) {
+            s->bufs[n] = g_malloc(NET_BUFSIZE);
+        }
+        buf = s->bufs[n];
+
+        size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
         if (size <= 0) {
             break;
         }
@@ -203,12 +243,42 @@ static void tap_send(void *opaque)
             size -= s->host_vnet_hdr_len;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        s->send_iov[n].iov_base = buf;
+        s->send_iov[n].iov_len = size;
+        s->send_pkts[n].iov = &s->send_iov[n];
+        s->send_pkts[n].iovcnt = 1;
+    }
+    return n;
+}
+
+static void tap_send(void *opaque)
+{
+    TAPState *s = opaque;
+    int sent;
+
+    /* An AioContext has no can_read hook, so the fd must be drained or the
+     * event loop spins; what the peer can't take yet is queued and reading
+     * stops until tap_send_completed(). */
+    while (s->send_count || s->ctx || qemu_can_send_packet(&s->nc)) {
+        if (!s->send_count) {
+            s->send_first = 0;
+            s->send_count = tap_read_batch(s);
+            if (!s->send_count) {
+                break;
+            }
+        }
+
+        sent = qemu_send_batch_async(&s->nc, &s->send_pkts[s->send_first],
+                                     s->send_count, tap_send_completed);
+        s->send_first += sent;
+        s->send_count -= sent;
+        if (s->send_count) {
+            /* The first packet left over was queued, the rest is sent
+             * from tap_send_completed() */
+            s->send_first++;
+            s->send_count--;
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
-            break;
         }
     }
 }
@@ -276,6 +346,7 @@ static void tap_set_offload(NetClientState *nc, int csum, int tso4,
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int i;
 
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
@@ -291,6 +362,12 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+
+    for (i = 0; i < TAP_SEND_BATCH; i++) {
+        g_free(s->bufs[i]);
+        s->bufs[i] = NULL;
+    }
+    s->send_count = 0;
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -300,6 +377,23 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static int tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    /* Unregister from the old event loop before moving to the new one */
+    s->read_poll = s->write_poll = false;
+    tap_update_fd_handler(s);
+
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
+    return 0;
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -315,6 +409,7 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_batch = tap_receive_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -323,6 +418,7 @@ static NetClientInfo net_tap_info = {
     .using_vnet_hdr = tap_using_vnet_hdr,
     .set_offload = tap_set_offload,
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -624,19 +720,29 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 
     if (tap->has_vhost ? tap->vhost :
         vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
+        VhostNetOptions options;
         int vhostfd;
 
+        options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
+        options.net_backend = &s->nc;
+        options.force = tap->has_vhostforce && tap->vhostforce;
+
         if (tap->has_vhostfd || tap->has_vhostfds) {
             vhostfd = monitor_handle_fd_param(cur_mon, vhostfdname);
             if (vhostfd == -1) {
                 return -1;
             }
         } else {
-            vhostfd = -1;
+            vhostfd = open("/dev/vhost-net", O_RDWR);
+            if (vhostfd < 0) {
+                error_report("tap: open vhost char device failed: %s",
+                             strerror(errno));
+                return -1;
+            }
         }
+        options.opaque = (void *)(uintptr_t)vhostfd;
 
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
-                                      tap->has_vhostforce && tap->vhostforce);
+        s->vhost_net = vhost_net_init(&options);
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
             return -1;
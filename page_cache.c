@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative table indexed by a hash of the page
+ * address, with LRU replacement inside each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,6 +34,12 @@
     do { } while (0)
 #endif
 
+/* Number of ways in each set of the cache.  A page can live in any of
+ * the ways of the set selected by its address; on a conflict the least
+ * recently used way is evicted.
+ */
+#define CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -45,8 +52,13 @@ struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -61,7 +73,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -75,8 +87,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%" PRId64 " sets of %u)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -111,43 +126,77 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first way of the set that @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_lookup(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    return (cache->page_cache[pos].it_addr == addr);
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns the way @addr should be stored in: the way already holding it,
+ * a free way, or the least recently used way of the set.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set, *victim = NULL;
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr || !set[i].it_data) {
+            return &set[i];
+        }
+        if (!victim || set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
+
+    return victim;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr)
+{
+    if (cache_lookup(cache, addr)) {
+        cache->hits++;
+        return true;
+    }
 
-    return &cache->page_cache[pos];
+    cache->misses++;
+    return false;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_lookup(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    /* accessing a page makes it the most recently used in its set */
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
@@ -159,7 +208,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
     g_assert(cache->page_cache);
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    it = cache_get_victim(cache, addr);
 
     /* allocate page */
     if (!it->it_data) {
@@ -169,6 +218,8 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
             return -1;
         }
         cache->num_items++;
+    } else if (it->it_addr != addr) {
+        cache->evictions++;
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
@@ -179,6 +230,15 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
     return 0;
 }
 
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats)
+{
+    g_assert(cache);
+
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
@@ -209,7 +269,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -228,6 +288,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
@@ -7,7 +7,11 @@
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* Guest pages are queued by reference with qemu_put_buffer_async(), so the
+ * iovec can batch far more data than IO_BUF_SIZE; let it grow to what a
+ * single writev() accepts to keep the syscall count down.
+ */
+#define MAX_IOV_SIZE IOV_MAX
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -455,6 +459,7 @@ void qemu_fflush(QEMUFile *f)
     if (f->ops->writev_buffer) {
         if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+            trace_qemu_file_fflush(f->iovcnt, ret);
         }
     } else {
         if (f->buf_index > 0) {
@@ -833,48 +838,55 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* The multi-byte accessors go through the buffer functions, so that each
+ * value costs a single copy and a single iovec update instead of one per
+ * byte.
+ */
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[2];
+
+    stw_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be32(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 24);
-    qemu_put_byte(f, v >> 16);
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[4];
+
+    stl_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be64(QEMUFile *f, uint64_t v)
 {
-    qemu_put_be32(f, v >> 32);
-    qemu_put_be32(f, v);
+    uint8_t buf[8];
+
+    stq_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
+/* On a short read the missing bytes read as zero, like qemu_get_byte() */
 unsigned int qemu_get_be16(QEMUFile *f)
 {
-    unsigned int v;
-    v = qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
+    uint8_t buf[2] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return lduw_be_p(buf);
 }
 
 unsigned int qemu_get_be32(QEMUFile *f)
 {
-    unsigned int v;
-    v = qemu_get_byte(f) << 24;
-    v |= qemu_get_byte(f) << 16;
-    v |= qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
+    uint8_t buf[4] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return (uint32_t)ldl_be_p(buf);
 }
 
 uint64_t qemu_get_be64(QEMUFile *f)
 {
-    uint64_t v;
-    v = (uint64_t)qemu_get_be32(f) << 32;
-    v |= qemu_get_be32(f);
-    return v;
+    uint8_t buf[8] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return ldq_be_p(buf);
 }
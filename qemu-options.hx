@@ -240,6 +240,18 @@ STEXI
 Preallocate memory when using -mem-path.
 ETEXI
 
+DEF("mem-share", 0, QEMU_OPTION_mem_share,
+    "-mem-share      share guest memory with other processes (use with -mem-path)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -mem-share
+@findex -mem-share
+Map the files created for @option{-mem-path} shared instead of private, so
+that other processes can map guest RAM through them.  This is required for
+@option{-netdev vhost-user}.  @var{path} does not need to be on hugetlbfs;
+@file{/dev/shm} works as well.
+ETEXI
+
 DEF("k", HAS_ARG, QEMU_OPTION_k,
     "-k language     use keyboard layout (for example 'fr' for French)\n",
     QEMU_ARCH_ALL)
@@ -1384,7 +1396,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #ifdef CONFIG_SLIRP
     "-net user[,vlan=n][,name=str][,net=addr[/mask]][,host=addr][,restrict=on|off]\n"
     "         [,hostname=host][,dhcpstart=addr][,dns=addr][,dnssearch=domain][,tftp=dir]\n"
-    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
+    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule][,vnet_hdr=on|off]\n"
+    "         [,iothread=id][,queues=n]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -1439,6 +1452,11 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_VHOST_USER
+    "-netdev vhost-user,id=str,path=socketpath[,vhostforce=on|off]\n"
+    "                let the process listening on unix socket 'socketpath' run\n"
+    "                the virtqueues of the attached virtio-net device\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1456,6 +1474,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_VHOST_USER
+    "vhost-user|"
 #endif
     "socket|"
     "hubport],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
@@ -1565,6 +1586,29 @@ Note that a SAMBA server must be installed on the host OS.
 QEMU was tested successfully with smbd versions from Red Hat 9,
 Fedora Core 3 and OpenSUSE 11.x.
 
+@item vnet_hdr=on|off
+Exchange packets with a virtio-net device together with the virtio-net
+header. This lets the guest hand large TCP segments with partial checksums to
+the user mode network stack, and lets the stack pass data read from host
+sockets to the guest in segments of up to 64 KB. Only takes effect with
+@option{-netdev}; the default is off because the guest visible features of
+virtio-net depend on it.
+
+@item iothread=@var{id}
+Run the user mode network stack in the IOThread @var{id} (created with
+@option{-object iothread,id=@var{id}}) instead of the main loop. Host sockets
+are then read and written without involving the main loop; only the frames for
+the guest are handed back to it. Requires epoll support in the host and can't
+be combined with @option{guestfwd} rules that connect to a character device.
+
+@item queues=@var{n}
+Create @var{n} network stacks for a multiqueue virtio-net device, one per
+queue, which can run in parallel in the IOThreads of the device (see the
+@option{x-data-plane} property of virtio-net). Connections are spread over the
+stacks by their addresses and ports. Host forwarding rules and the DHCP server
+belong to the first stack. Can't be used with @option{-net} and a VLAN, or
+with @option{guestfwd} rules that connect to a character device.
+
 @item hostfwd=[tcp|udp]:[@var{hostaddr}]:@var{hostport}-[@var{guestaddr}]:@var{guestport}
 Redirect incoming TCP or UDP connections to the host port @var{hostport} to
 the guest IP address @var{guestaddr} on guest port @var{guestport}. If
@@ -1788,6 +1832,23 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
+@item -netdev vhost-user,id=@var{id},path=@var{socketpath}[,vhostforce=on|off]
+
+Connect to a vhost-user backend listening on the unix socket @var{socketpath}.
+The backend is a separate process that runs the virtqueues of the virtio-net
+device attached to this netdev, using guest memory and eventfds passed over
+the socket.  No special privileges are needed.  Guest RAM must be shareable,
+so @option{-mem-path} and @option{-mem-share} are required.  Use
+@option{vhostforce=on} to use the backend even for guests without MSI-X.
+The protocol is described in @file{docs/specs/vhost-user.txt}.
+
+Example:
+@example
+qemu-system-x86_64 -m 512 -mem-path /dev/shm -mem-share \
+                   -netdev vhost-user,id=net0,path=/tmp/vhost-user.sock \
+                   -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
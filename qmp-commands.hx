@@ -2195,6 +2195,25 @@ Each json-object contain the following:
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Driver specific statistics (json-object, optional).
+    For qcow2 images it contains "l2-cache", "refcount-cache" and
+    "compressed-cache" (decompressed clusters), each with:
+    - "size": cache size in bytes (json-int)
+    - "hits": lookups served from the cache (json-int)
+    - "misses": lookups that had to read the table or cluster (json-int)
+    - "evictions": cached entries replaced by another one (json-int)
+    Images with a backing file also report "backing-map" once data was read
+    from the backing chain, with:
+    - "chain-depth": number of images in the backing chain (json-int)
+    - "lookups": requests routed through the map (json-int)
+    - "misses": areas whose owner had to be looked up (json-int)
+    - "zero-lookups": requests for areas no image has data for (json-int)
+    - "mixed-lookups": requests read through the whole chain (json-int)
+    - "total-depth": sum of the depths of the images read directly (json-int)
+    - "invalidations": times the map was discarded (json-int)
+    For files and host devices using aio=native it contains:
+    - "aio-submit-calls": number of io_submit() calls (json-int)
+    - "aio-submitted-requests": requests submitted by these calls (json-int)
 
 Example:
 
@@ -2585,6 +2604,75 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_pci,
     },
 
+SQMP
+query-virtio
+------------
+
+Show the notification and interrupt statistics of the virtio devices.
+
+Each device is represented by a json-object, the returned value is a
+json-array of all devices.
+
+Each json-object contains the following:
+
+- "path": QOM path of the device (json-string)
+- "name": virtio device type (json-string)
+- "coalesce-max-usecs": upper bound of the interrupt delay, 0 if coalescing
+                        is disabled (json-int)
+- "coalesce-max-frames": upper bound of the completions per interrupt, 0 if
+                         coalescing is disabled (json-int)
+- "queues": a json-array of json-objects, one per queue:
+     - "index": queue index (json-int)
+     - "size": number of descriptors (json-int)
+     - "kicks": notifications from the guest (json-int)
+     - "completions": buffers returned to the guest (json-int)
+     - "notifications": times completions were signalled (json-int)
+     - "interrupts": interrupts injected (json-int)
+     - "suppressed": notifications the guest needed no interrupt for
+                     (json-int)
+     - "coalesced": notifications merged with later ones (json-int)
+     - "completion-rate": smoothed completions per second (json-int)
+     - "coalesce-frames": current completions per interrupt, 0 if
+                          interrupts are not held back (json-int)
+     - "coalesce-usecs": current interrupt delay in microseconds (json-int)
+
+Example:
+
+-> { "execute": "query-virtio" }
+<- { "return": [
+        { "path": "/machine/peripheral/net0/virtio-backend",
+          "name": "virtio-net",
+          "coalesce-max-usecs": 50,
+          "coalesce-max-frames": 32,
+          "queues": [
+             { "index": 0, "size": 256, "kicks": 1893,
+               "completions": 1204566, "notifications": 57022,
+               "interrupts": 40213, "suppressed": 511, "coalesced": 16298,
+               "completion-rate": 141021, "coalesce-frames": 7,
+               "coalesce-usecs": 49 },
+             { "index": 1, "size": 256, "kicks": 41007,
+               "completions": 982113, "notifications": 41007,
+               "interrupts": 1022, "suppressed": 39985, "coalesced": 0,
+               "completion-rate": 3120, "coalesce-frames": 0,
+               "coalesce-usecs": 0 },
+             { "index": 2, "size": 64, "kicks": 3,
+               "completions": 3, "notifications": 3,
+               "interrupts": 3, "suppressed": 0, "coalesced": 0,
+               "completion-rate": 0, "coalesce-frames": 0,
+               "coalesce-usecs": 0 }
+          ]
+        }
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-virtio",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_virtio,
+    },
+
 SQMP
 query-kvm
 ---------
@@ -2955,6 +3043,9 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "cpu-throttle-percentage": only present while migration is active and
+                auto-converge is throttling the guest; percentage of
+                time the vcpus are kept out of the guest (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -2987,6 +3078,9 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-eviction": number of pages evicted from the XBZRLE
+           page cache to make room for others
 
 Examples:
 
@@ -3092,7 +3186,9 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":2442099,
+            "cache-eviction":1022
          }
       }
    }
@@ -3105,6 +3201,45 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate,
     },
 
+SQMP
+query-vmstate-sections
+----------------------
+
+Show how long saving and loading each device state section took during the
+last migration or snapshot.  RAM and block migration are sent incrementally
+and are not included.
+
+Each section is represented by a json-object, the returned value is a
+json-array of all sections.
+
+Each json-object contains the following:
+
+- "idstr": section identifier in the migration stream (json-string)
+- "instance-id": instance of the section (json-int)
+- "save-usecs": duration of the last save in microseconds, 0 if the
+                section was never saved (json-int)
+- "load-usecs": duration of the last load in microseconds, 0 if the
+                section was never loaded (json-int)
+
+Example:
+
+-> { "execute": "query-vmstate-sections" }
+<- { "return": [
+        { "idstr": "timer", "instance-id": 0,
+          "save-usecs": 1, "load-usecs": 0 },
+        { "idstr": "0000:00:02.0/vga", "instance-id": 0,
+          "save-usecs": 21, "load-usecs": 0 }
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-vmstate-sections",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_vmstate_sections,
+    },
+
 SQMP
 migrate-set-capabilities
 ------------------------
@@ -234,6 +234,9 @@ typedef struct SaveStateEntry {
     CompatEntry *compat;
     int no_migrate;
     int is_ram;
+    /* Duration of the last save and load, see query-vmstate-sections */
+    int64_t save_usecs;
+    int64_t load_usecs;
 } SaveStateEntry;
 
 
@@ -430,21 +433,62 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
 
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se, int version_id)
 {
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {         /* Old style */
-        return se->ops->load_state(f, se->opaque, version_id);
+        ret = se->ops->load_state(f, se->opaque, version_id);
+    } else {
+        ret = vmstate_load_state(f, se->vmsd, se->opaque, version_id);
     }
-    return vmstate_load_state(f, se->vmsd, se->opaque, version_id);
+    se->load_usecs = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) /
+                     SCALE_US;
+    trace_vmstate_load_done(se->idstr, ret, se->load_usecs);
+    return ret;
 }
 
 static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 {
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     trace_vmstate_save(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {         /* Old style */
         se->ops->save_state(f, se->opaque);
-        return;
+    } else {
+        vmstate_save_state(f, se->vmsd, se->opaque);
+    }
+    se->save_usecs = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) /
+                     SCALE_US;
+    trace_vmstate_save_done(se->idstr, se->save_usecs);
+}
+
+VMStateSectionInfoList *qmp_query_vmstate_sections(Error **errp)
+{
+    VMStateSectionInfoList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        VMStateSectionInfoList *entry;
+        VMStateSectionInfo *info;
+
+        /* Live sections are sent in chunks, not through vmstate_save() */
+        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+            continue;
+        }
+
+        info = g_new0(VMStateSectionInfo, 1);
+        info->idstr = g_strdup(se->idstr);
+        info->instance_id = se->instance_id;
+        info->save_usecs = se->save_usecs;
+        info->load_usecs = se->load_usecs;
+
+        entry = g_new0(VMStateSectionInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
     }
-    vmstate_save_state(f, se->vmsd, se->opaque);
+    return head;
 }
 
 bool qemu_savevm_state_blocked(Error **errp)
@@ -114,6 +114,7 @@ diddit:
 		/* Update *_queued */
 		so->so_queued++;
 		so->so_nqueued++;
+		slirp_socket_changed(so);
 		/*
 		 * Check if the interactive session should be downgraded to
 		 * the batchq.  A session is downgraded if it has queued 6
@@ -229,6 +230,9 @@ void if_start(Slirp *slirp)
             /* If there's no more queued, reset nqueued */
             ifm->ifq_so->so_nqueued = 0;
         }
+        if (ifm->ifq_so) {
+            slirp_socket_changed(ifm->ifq_so);
+        }
 
         m_free(ifm);
     }
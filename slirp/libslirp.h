@@ -20,10 +20,52 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
 
 void slirp_pollfds_poll(GArray *pollfds, int select_error);
 
-void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+/*
+ * Keep the host sockets of the instance registered with epoll, so that
+ * slirp_pollfds_fill/poll() only add one descriptor for it and only look at
+ * sockets that changed or are ready.  Returns -errno if epoll is unavailable.
+ */
+int slirp_epoll_init(Slirp *slirp);
+
+/*
+ * Poll the instance from the event loop of ctx rather than through
+ * slirp_pollfds_fill/poll().  Implies slirp_epoll_init().  All other calls
+ * into the instance must then be made with ctx acquired, and slirp_output()
+ * may be called from the thread that runs ctx.
+ */
+int slirp_attach_aio_context(Slirp *slirp, AioContext *ctx);
+
+/*
+ * Stop polling the instance from its AioContext, which must be held.  It
+ * can be attached to another one, or is polled by slirp_pollfds_fill/poll()
+ * again.
+ */
+void slirp_detach_aio_context(Slirp *slirp);
+
+/* Flags for slirp_input() */
+#define SLIRP_INPUT_CSUM_VALID 1 /* don't verify TCP/UDP checksums */
+
+void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len, int flags);
+void slirp_input_iov(Slirp *slirp, const struct iovec *iov, int iovcnt,
+                     int flags);
+
+/*
+ * Tell slirp which offloads the guest side can handle: partial TCP checksums
+ * (csum) and TCPv4 segments larger than the MTU (tso4, requires csum).
+ */
+void slirp_set_offload(Slirp *slirp, bool csum, bool tso4);
+
+/* Offload information for a frame passed to slirp_output() */
+typedef struct SlirpOffload {
+    int csum_start;     /* 0, or offset of the data whose checksum is missing */
+    int csum_offset;    /* where to store it, relative to csum_start */
+    int hdr_len;        /* length of all headers of the frame */
+    int gso_size;       /* 0, or payload size to split a large segment into */
+} SlirpOffload;
 
 /* you must provide the following functions: */
-void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len,
+                  const SlirpOffload *offload);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
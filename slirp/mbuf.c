@@ -25,16 +25,85 @@
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + offsetof(struct mbuf, m_dat) + 6)
 
+/*
+ * The largest class fits a 64 KB IP packet plus link header room, which is
+ * what TSO segments and reassembled fragments need.
+ */
+static const int m_ext_sizes[M_EXT_NCLASSES] = {
+    4096, 8192, 16384, 32768, IP_MAXPACKET + 1 + 2 * IF_MAXLINKHDR,
+};
+
 void
 m_init(Slirp *slirp)
 {
+    int i;
+
     slirp->m_freelist.m_next = slirp->m_freelist.m_prev = &slirp->m_freelist;
     slirp->m_usedlist.m_next = slirp->m_usedlist.m_prev = &slirp->m_usedlist;
+
+    for (i = 0; i < M_EXT_NCLASSES; i++) {
+        slirp->m_ext_classes[i].size = m_ext_sizes[i];
+    }
+}
+
+static MbufExtClass *m_ext_class(Slirp *slirp, int size)
+{
+    int i;
+
+    for (i = 0; i < M_EXT_NCLASSES; i++) {
+        if (size <= slirp->m_ext_classes[i].size) {
+            return &slirp->m_ext_classes[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Allocate a data buffer of at least *size bytes for an M_EXT mbuf and
+ * return its actual size in *size.
+ */
+static char *m_ext_alloc(Slirp *slirp, int *size)
+{
+    MbufExtClass *c = m_ext_class(slirp, *size);
+    char *buf;
+
+    if (!c) {
+        slirp->m_ext_large++;
+        return malloc(*size);
+    }
+
+    c->allocs++;
+    *size = c->size;
+    if (c->free) {
+        buf = c->free;
+        c->free = *(char **)buf;
+        c->nfree--;
+        c->hits++;
+        return buf;
+    }
+    return malloc(c->size);
+}
+
+static void m_ext_free(Slirp *slirp, char *buf, int size)
+{
+    MbufExtClass *c = m_ext_class(slirp, size);
+
+    /* Buffers that aren't from a class are larger than all of them */
+    if (!c || c->size != size || c->nfree >= M_EXT_CACHE_MAX) {
+        free(buf);
+        return;
+    }
+
+    *(char **)buf = c->free;
+    c->free = buf;
+    c->nfree++;
 }
 
 void m_cleanup(Slirp *slirp)
 {
     struct mbuf *m, *next;
+    char *buf;
+    int i;
 
     m = slirp->m_usedlist.m_next;
     while (m != &slirp->m_usedlist) {
@@ -51,6 +120,13 @@ void m_cleanup(Slirp *slirp)
         free(m);
         m = next;
     }
+    for (i = 0; i < M_EXT_NCLASSES; i++) {
+        while ((buf = slirp->m_ext_classes[i].free) != NULL) {
+            slirp->m_ext_classes[i].free = *(char **)buf;
+            free(buf);
+        }
+        slirp->m_ext_classes[i].nfree = 0;
+    }
 }
 
 /*
@@ -69,6 +145,7 @@ m_get(Slirp *slirp)
 
 	DEBUG_CALL("m_get");
 
+	slirp->m_gets++;
 	if (slirp->m_freelist.m_next == &slirp->m_freelist) {
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
@@ -79,6 +156,7 @@ m_get(Slirp *slirp)
 	} else {
 		m = slirp->m_freelist.m_next;
 		remque(m);
+		slirp->m_get_hits++;
 	}
 
 	/* Insert it in the used list */
@@ -93,6 +171,7 @@ m_get(Slirp *slirp)
         m->m_prevpkt = NULL;
         m->arp_requested = false;
         m->expiration_date = (uint64_t)-1;
+        m->m_gso_size = 0;
 end_error:
 	DEBUG_ARG("m = %lx", (long )m);
 	return m;
@@ -110,9 +189,9 @@ m_free(struct mbuf *m)
 	if (m->m_flags & M_USEDLIST)
 	   remque(m);
 
-	/* If it's M_EXT, free() it */
+	/* If it's M_EXT, return its buffer */
 	if (m->m_flags & M_EXT)
-	   free(m->m_ext);
+	   m_ext_free(m->slirp, m->m_ext, m->m_size);
 
 	/*
 	 * Either free() it or put it on the free list
@@ -148,34 +227,60 @@ m_cat(struct mbuf *m, struct mbuf *n)
 }
 
 
-/* make m size bytes large */
+/*
+ * make m at least size bytes large
+ *
+ * Only the data up to the end of m_data + m_len is preserved, and it stays at
+ * the same offset in the buffer.
+ */
 void
 m_inc(struct mbuf *m, int size)
 {
+	char *dat;
 	int datasize;
 
 	/* some compiles throw up on gotos.  This one we can fake. */
         if(m->m_size>size) return;
 
+        dat = m_ext_alloc(m->slirp, &size);
         if (m->m_flags & M_EXT) {
 	  datasize = m->m_data - m->m_ext;
-	  m->m_ext = (char *)realloc(m->m_ext,size);
-	  m->m_data = m->m_ext + datasize;
+	  memcpy(dat, m->m_ext, datasize + m->m_len);
+	  m_ext_free(m->slirp, m->m_ext, m->m_size);
         } else {
-	  char *dat;
 	  datasize = m->m_data - m->m_dat;
-	  dat = (char *)malloc(size);
-	  memcpy(dat, m->m_dat, m->m_size);
-
-	  m->m_ext = dat;
-	  m->m_data = m->m_ext + datasize;
-	  m->m_flags |= M_EXT;
+	  memcpy(dat, m->m_dat, datasize + m->m_len);
         }
+        m->slirp->m_inc_bytes += datasize + m->m_len;
 
+        m->m_ext = dat;
+        m->m_data = m->m_ext + datasize;
+        m->m_flags |= M_EXT;
         m->m_size = size;
 
 }
 
+/*
+ * Get an mbuf with room for size bytes after the usual link header space,
+ * taking the data buffer from a size class right away if it doesn't fit
+ * into the mbuf itself.
+ */
+struct mbuf *
+m_get_size(Slirp *slirp, int size)
+{
+	struct mbuf *m = m_get(slirp);
+
+	if (m && M_FREEROOM(m) < size) {
+		int ext_size = size;
+
+		m->m_ext = m_ext_alloc(slirp, &ext_size);
+		m->m_data = m->m_ext;
+		m->m_size = ext_size;
+		m->m_flags |= M_EXT;
+	}
+	return m;
+}
+
 
 
 void
@@ -63,6 +63,12 @@
 #define M_FREEROOM(m) (M_ROOM(m) - (m)->m_len)
 #define M_TRAILINGSPACE M_FREEROOM
 
+/*
+ * How much room there is in front of m_data
+ */
+#define M_LEADINGSPACE(m) ((m)->m_data - (((m)->m_flags & M_EXT) ? \
+			(m)->m_ext : (m)->m_dat))
+
 struct mbuf {
 	/* XXX should union some of these! */
 	/* header at beginning of each mbuf: */
@@ -81,6 +87,7 @@ struct mbuf {
 	Slirp *slirp;
 	bool	arp_requested;
 	uint64_t expiration_date;
+	int	m_gso_size;		/* TCP segment size if larger than the MTU */
 	/* start of dynamic buffer area, must be last element */
 	union {
 		char	m_dat[1]; /* ANSI don't like 0 sized arrays */
@@ -99,10 +106,29 @@ struct mbuf {
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
 #define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
 					 * it rather than putting it on the free list */
+#define M_CSUM_VALID		0x10	/* input: don't verify TCP/UDP checksum */
+#define M_CSUM_PARTIAL		0x20	/* output: TCP checksum only covers the
+					 * pseudo header, the guest adds the rest */
+
+/*
+ * Data buffers of M_EXT mbufs are taken from a few size classes, each with a
+ * cache of free buffers.
+ */
+#define M_EXT_NCLASSES		5
+#define M_EXT_CACHE_MAX		16	/* free buffers kept per class */
+
+typedef struct MbufExtClass {
+	int	size;			/* size of the buffers in this class */
+	int	nfree;			/* number of cached buffers */
+	char	*free;			/* linked through their first word */
+	uint64_t allocs;		/* buffers handed out */
+	uint64_t hits;			/* ...of which came from the cache */
+} MbufExtClass;
 
 void m_init(Slirp *);
 void m_cleanup(Slirp *slirp);
 struct mbuf * m_get(Slirp *);
+struct mbuf * m_get_size(Slirp *, int);
 void m_free(struct mbuf *);
 void m_cat(register struct mbuf *, register struct mbuf *);
 void m_inc(struct mbuf *, int);
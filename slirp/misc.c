@@ -264,6 +264,7 @@ void slirp_connection_info(Slirp *slirp, Monitor *mon)
     struct socket *so;
     const char *state;
     char buf[20];
+    int i;
 
     monitor_printf(mon, "  Protocol[State]    FD  Source Address  Port   "
                         "Dest. Address  Port RecvQ SendQ\n");
@@ -305,7 +306,7 @@ void slirp_connection_info(Slirp *slirp, Monitor *mon)
             dst_port = so->so_lport;
         } else {
             snprintf(buf, sizeof(buf), "  UDP[%d sec]",
-                         (so->so_expire - curtime) / 1000);
+                         (so->so_expire - slirp->curtime) / 1000);
             src.sin_addr = so->so_laddr;
             src.sin_port = so->so_lport;
             dst_addr = so->so_faddr;
@@ -321,7 +322,7 @@ void slirp_connection_info(Slirp *slirp, Monitor *mon)
 
     for (so = slirp->icmp.so_next; so != &slirp->icmp; so = so->so_next) {
         snprintf(buf, sizeof(buf), "  ICMP[%d sec]",
-                     (so->so_expire - curtime) / 1000);
+                     (so->so_expire - slirp->curtime) / 1000);
         src.sin_addr = so->so_laddr;
         dst_addr = so->so_faddr;
         monitor_printf(mon, "%-19s %3d %15s  -    ", buf, so->s,
@@ -329,4 +330,19 @@ void slirp_connection_info(Slirp *slirp, Monitor *mon)
         monitor_printf(mon, "%15s  -    %5d %5d\n", inet_ntoa(dst_addr),
                        so->so_rcv.sb_cc, so->so_snd.sb_cc);
     }
+
+    monitor_printf(mon, "  mbufs: %d allocated, %" PRIu64 " gets, %" PRIu64
+                   " from free list\n", slirp->mbuf_alloced, slirp->m_gets,
+                   slirp->m_get_hits);
+    for (i = 0; i < M_EXT_NCLASSES; i++) {
+        MbufExtClass *c = &slirp->m_ext_classes[i];
+
+        monitor_printf(mon, "  mbuf buffers %6d: %" PRIu64 " allocs, %" PRIu64
+                       " cached, %d free\n", c->size, c->allocs, c->hits,
+                       c->nfree);
+    }
+    monitor_printf(mon, "  mbuf buffers  large: %" PRIu64 " allocs\n",
+                   slirp->m_ext_large);
+    monitor_printf(mon, "  mbuf growth: %" PRIu64 " bytes copied\n",
+                   slirp->m_inc_bytes);
 }
@@ -7,6 +7,7 @@
 
 #include <slirp.h>
 #include <qemu/main-loop.h>
+#include "net/checksum.h"
 
 static void sbappendsb(struct sbuf *sb, struct mbuf *m);
 
@@ -185,3 +186,32 @@ sbcopy(struct sbuf *sb, int off, int len, char *to)
 		   memcpy(to+off,sb->sb_data,len);
 	}
 }
+
+/*
+ * Like sbcopy(), but also return the checksum of the copied data, computed
+ * in the same pass, in the form net_checksum_add() returns it
+ */
+uint32_t
+sbcopy_csum(struct sbuf *sb, int off, int len, char *to)
+{
+	char *from;
+	uint32_t sum;
+
+	from = sb->sb_rptr + off;
+	if (from >= sb->sb_data + sb->sb_datalen)
+		from -= sb->sb_datalen;
+
+	if (from < sb->sb_wptr) {
+		if (len > sb->sb_cc) len = sb->sb_cc;
+		return net_checksum_copy(len, (uint8_t *)to, (uint8_t *)from);
+	}
+
+	off = (sb->sb_data + sb->sb_datalen) - from;
+	if (off > len) off = len;
+	sum = net_checksum_copy(off, (uint8_t *)to, (uint8_t *)from);
+	len -= off;
+	if (len)
+	   sum += net_checksum_copy_cont(len, (uint8_t *)to + off,
+					 (uint8_t *)sb->sb_data, off);
+	return sum;
+}
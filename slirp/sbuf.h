@@ -26,5 +26,6 @@ void sbdrop(struct sbuf *, int);
 void sbreserve(struct sbuf *, int);
 void sbappend(struct socket *, struct mbuf *);
 void sbcopy(struct sbuf *, int, int, char *);
+uint32_t sbcopy_csum(struct sbuf *, int, int, char *);
 
 #endif
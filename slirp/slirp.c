@@ -26,6 +26,12 @@
 #include "sysemu/char.h"
 #include "slirp.h"
 #include "hw/hw.h"
+#include "block/aio.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 /* host loopback address */
 struct in_addr loopback_addr;
@@ -39,11 +45,11 @@ static const uint8_t special_ethaddr[ETH_ALEN] = {
 
 static const uint8_t zero_ethaddr[ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
 
-u_int curtime;
-
 static QTAILQ_HEAD(slirp_instances, Slirp) slirp_instances =
     QTAILQ_HEAD_INITIALIZER(slirp_instances);
 
+/* The host's DNS server is looked up for all instances, in any thread */
+static QemuMutex dns_addr_lock;
 static struct in_addr dns_addr;
 static u_int dns_addr_time;
 
@@ -52,9 +58,19 @@ static u_int dns_addr_time;
 /* for the aging of certain requests like DNS */
 #define TIMEOUT_DEFAULT 1000  /* milliseconds */
 
+/*
+ * Samples the clock for an instance that is about to run.  Each instance
+ * keeps its own sample: instances in different IOThreads run concurrently,
+ * and a shared sample could move backwards between two uses.
+ */
+static void slirp_update_clock(Slirp *slirp)
+{
+    slirp->curtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+}
+
 #ifdef _WIN32
 
-int get_dns_addr(struct in_addr *pdns_addr)
+static int do_get_dns_addr(struct in_addr *pdns_addr, u_int now)
 {
     FIXED_INFO *FixedInfo=NULL;
     ULONG    BufLen;
@@ -62,7 +78,7 @@ int get_dns_addr(struct in_addr *pdns_addr)
     IP_ADDR_STRING *pIPAddr;
     struct in_addr tmp_addr;
 
-    if (dns_addr.s_addr != 0 && (curtime - dns_addr_time) < TIMEOUT_DEFAULT) {
+    if (dns_addr.s_addr != 0 && (now - dns_addr_time) < TIMEOUT_DEFAULT) {
         *pdns_addr = dns_addr;
         return 0;
     }
@@ -91,7 +107,7 @@ int get_dns_addr(struct in_addr *pdns_addr)
     inet_aton(pIPAddr->IpAddress.String, &tmp_addr);
     *pdns_addr = tmp_addr;
     dns_addr = tmp_addr;
-    dns_addr_time = curtime;
+    dns_addr_time = now;
     if (FixedInfo) {
         GlobalFree(FixedInfo);
         FixedInfo = NULL;
@@ -108,7 +124,7 @@ static void winsock_cleanup(void)
 
 static struct stat dns_addr_stat;
 
-int get_dns_addr(struct in_addr *pdns_addr)
+static int do_get_dns_addr(struct in_addr *pdns_addr, u_int now)
 {
     char buff[512];
     char buff2[257];
@@ -118,7 +134,7 @@ int get_dns_addr(struct in_addr *pdns_addr)
 
     if (dns_addr.s_addr != 0) {
         struct stat old_stat;
-        if ((curtime - dns_addr_time) < TIMEOUT_DEFAULT) {
+        if ((now - dns_addr_time) < TIMEOUT_DEFAULT) {
             *pdns_addr = dns_addr;
             return 0;
         }
@@ -149,7 +165,7 @@ int get_dns_addr(struct in_addr *pdns_addr)
             if (!found) {
                 *pdns_addr = tmp_addr;
                 dns_addr = tmp_addr;
-                dns_addr_time = curtime;
+                dns_addr_time = now;
             }
 #ifdef DEBUG
             else
@@ -175,6 +191,17 @@ int get_dns_addr(struct in_addr *pdns_addr)
 
 #endif
 
+int get_dns_addr(struct in_addr *pdns_addr)
+{
+    int ret;
+
+    /* Sampled under the lock, so dns_addr_time never goes backwards */
+    qemu_mutex_lock(&dns_addr_lock);
+    ret = do_get_dns_addr(pdns_addr, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    qemu_mutex_unlock(&dns_addr_lock);
+    return ret;
+}
+
 static void slirp_init_once(void)
 {
     static int initialized;
@@ -194,6 +221,7 @@ static void slirp_init_once(void)
 
     loopback_addr.s_addr = htonl(INADDR_LOOPBACK);
     loopback_mask = htonl(IN_CLASSA_NET);
+    qemu_mutex_init(&dns_addr_lock);
 }
 
 static void slirp_state_save(QEMUFile *f, void *opaque);
@@ -211,6 +239,7 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
     slirp_init_once();
 
     slirp->restricted = restricted;
+    slirp_update_clock(slirp);
 
     if_init(slirp);
     ip_init(slirp);
@@ -236,6 +265,9 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->opaque = opaque;
 
+    slirp->epoll_fd = -1;
+    QTAILQ_INIT(&slirp->dirty_sockets);
+
     register_savevm(NULL, "slirp", 0, 3,
                     slirp_state_save, slirp_state_load, slirp);
 
@@ -250,9 +282,16 @@ void slirp_cleanup(Slirp *slirp)
 
     unregister_savevm(NULL, "slirp", slirp);
 
+    slirp_detach_aio_context(slirp);
+
     ip_cleanup(slirp);
     m_cleanup(slirp);
 
+    if (slirp->epoll_fd >= 0) {
+        close(slirp->epoll_fd);
+    }
+    g_free(slirp->epoll_events);
+
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
@@ -277,6 +316,9 @@ static void slirp_update_timeout(uint32_t *timeout)
      * more precise value.
      */
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        if (slirp->aio_context) {
+            continue;
+        }
         if (slirp->time_fasttimo) {
             *timeout = TIMEOUT_FAST;
             return;
@@ -288,101 +330,589 @@ static void slirp_update_timeout(uint32_t *timeout)
     *timeout = t;
 }
 
-void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
+/*
+ * Returns the events to poll for on the host socket of a TCP socket, or 0 if
+ * it doesn't need to be polled.
+ */
+static int slirp_tcp_events(struct socket *so)
 {
-    Slirp *slirp;
-    struct socket *so, *so_next;
+    Slirp *slirp = so->slirp;
+    int events = 0;
 
-    if (QTAILQ_EMPTY(&slirp_instances)) {
-        return;
+    /*
+     * See if we need a tcp_fasttimo
+     */
+    if (slirp->time_fasttimo == 0 &&
+        so->so_tcpcb->t_flags & TF_DELACK) {
+        /* Flag when want a fasttimo */
+        slirp->time_fasttimo = slirp->curtime;
     }
 
     /*
-     * First, TCP sockets
+     * NOFDREF can include still connecting to local-host,
+     * newly socreated() sockets etc. Don't want to select these.
      */
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return 0;
+    }
 
-    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
-        /*
-         * *_slowtimo needs calling if there are IP fragments
-         * in the fragment queue, or there are TCP connections active
-         */
-        slirp->do_slowtimo = ((slirp->tcb.so_next != &slirp->tcb) ||
-                (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
+    /*
+     * Set for reading sockets which are accepting
+     */
+    if (so->so_state & SS_FACCEPTCONN) {
+        return G_IO_IN | G_IO_HUP | G_IO_ERR;
+    }
 
-        for (so = slirp->tcb.so_next; so != &slirp->tcb;
-                so = so_next) {
-            int events = 0;
+    /*
+     * Set for writing sockets which are connecting
+     */
+    if (so->so_state & SS_ISFCONNECTING) {
+        return G_IO_OUT | G_IO_ERR;
+    }
 
-            so_next = so->so_next;
+    /*
+     * Set for writing if we are connected, can send more, and
+     * we have something to send
+     */
+    if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+        events |= G_IO_OUT | G_IO_ERR;
+    }
 
-            so->pollfds_idx = -1;
+    /*
+     * Set for reading (and urgent data) if we are connected, can
+     * receive more, and we have room for it XXX /2 ?
+     */
+    if (CONN_CANFRCV(so) &&
+        (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+        events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+    }
 
-            /*
-             * See if we need a tcp_fasttimo
-             */
-            if (slirp->time_fasttimo == 0 &&
-                so->so_tcpcb->t_flags & TF_DELACK) {
-                slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
-            }
+    return events;
+}
 
-            /*
-             * NOFDREF can include still connecting to local-host,
-             * newly socreated() sockets etc. Don't want to select these.
-             */
-            if (so->so_state & SS_NOFDREF || so->s == -1) {
-                continue;
+static int slirp_udp_events(struct socket *so)
+{
+    /*
+     * When UDP packets are received from over the
+     * link, they're sendto()'d straight away, so
+     * no need for setting for writing
+     * Limit the number of packets queued by this session
+     * to 4.  Note that even though we try and limit this
+     * to 4 packets, the session could have more queued
+     * if the packets needed to be fragmented
+     * (XXX <= 4 ?)
+     */
+    if (so->s != -1 && (so->so_state & SS_ISFCONNECTED) &&
+        so->so_queued <= 4) {
+        return G_IO_IN | G_IO_HUP | G_IO_ERR;
+    }
+    return 0;
+}
+
+static int slirp_icmp_events(struct socket *so)
+{
+    if (so->s != -1 && (so->so_state & SS_ISFCONNECTED)) {
+        return G_IO_IN | G_IO_HUP | G_IO_ERR;
+    }
+    return 0;
+}
+
+/*
+ * Detaches a UDP or ICMP socket if it has timed out.  Returns true if the
+ * socket is gone.
+ */
+static bool slirp_socket_expire(struct socket *so)
+{
+    if (so->so_expire) {
+        if (so->so_expire <= so->slirp->curtime) {
+            if (so->so_type == IPPROTO_ICMP) {
+                icmp_detach(so);
+            } else {
+                udp_detach(so);
             }
+            return true;
+        } else {
+            so->slirp->do_slowtimo = true; /* Let socket expire */
+        }
+    }
+    return false;
+}
 
-            /*
-             * Set for reading sockets which are accepting
-             */
-            if (so->so_state & SS_FACCEPTCONN) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
+static void slirp_pollfds_add(GArray *pollfds, struct socket *so, int events)
+{
+    GPollFD pfd = {
+        .fd = so->s,
+        .events = events,
+    };
+
+    so->pollfds_idx = pollfds->len;
+    g_array_append_val(pollfds, pfd);
+}
+
+static void slirp_tcp_dispatch(struct socket *so, int revents)
+{
+    int ret;
+
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return;
+    }
+
+    /*
+     * Check for URG data
+     * This will soread as well, so no need to
+     * test for G_IO_IN below if this succeeds
+     */
+    if (revents & G_IO_PRI) {
+        sorecvoob(so);
+    }
+    /*
+     * Check sockets for reading
+     */
+    else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+        /*
+         * Check for incoming connections
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            tcp_connect(so);
+            return;
+        } /* else */
+        ret = soread(so);
+
+        /* Output it if we read something */
+        if (ret > 0) {
+            tcp_output(sototcpcb(so));
+        }
+    }
+
+    /*
+     * Check sockets for writing
+     */
+    if (!(so->so_state & SS_NOFDREF) &&
+            (revents & (G_IO_OUT | G_IO_ERR))) {
+        /*
+         * Check for non-blocking, still-connecting sockets
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            /* Connected */
+            so->so_state &= ~SS_ISFCONNECTING;
+
+            ret = send(so->s, (const void *) &ret, 0, 0);
+            if (ret < 0) {
+                /* XXXXX Must fix, zero bytes is a NOP */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
             }
+            /* else so->so_state &= ~SS_ISFCONNECTING; */
 
             /*
-             * Set for writing sockets which are connecting
+             * Continue tcp_input
              */
-            if (so->so_state & SS_ISFCONNECTING) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_OUT | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+            /* continue; */
+        } else {
+            ret = sowrite(so);
+        }
+        /*
+         * XXXXX If we wrote something (a lot), there
+         * could be a need for a window update.
+         * In the worst case, the remote will send
+         * a window probe to get things going again
+         */
+    }
+
+    /*
+     * Probe a still-connecting, non-blocking socket
+     * to check if it's still alive
+     */
+#ifdef PROBE_CONN
+    if (so->so_state & SS_ISFCONNECTING) {
+        ret = qemu_recv(so->s, &ret, 0, 0);
+
+        if (ret < 0) {
+            /* XXX */
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINPROGRESS || errno == ENOTCONN) {
+                return; /* Still connecting, continue */
             }
 
-            /*
-             * Set for writing if we are connected, can send more, and
-             * we have something to send
-             */
-            if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-                events |= G_IO_OUT | G_IO_ERR;
+            /* else failed */
+            so->so_state &= SS_PERSISTENT_MASK;
+            so->so_state |= SS_NOFDREF;
+
+            /* tcp_input will take care of it */
+        } else {
+            ret = send(so->s, &ret, 0, 0);
+            if (ret < 0) {
+                /* XXX */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            } else {
+                so->so_state &= ~SS_ISFCONNECTING;
             }
 
-            /*
-             * Set for reading (and urgent data) if we are connected, can
-             * receive more, and we have room for it XXX /2 ?
-             */
-            if (CONN_CANFRCV(so) &&
-                (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-                events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+        }
+        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+    } /* SS_ISFCONNECTING */
+#endif
+}
+
+/*
+ * Incoming UDP packets are sent straight away, they're not buffered.
+ * Incoming UDP data isn't buffered either.
+ */
+static void slirp_udp_dispatch(struct socket *so, int revents)
+{
+    if (so->s != -1 &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        sorecvfrom(so);
+    }
+}
+
+static void slirp_icmp_dispatch(struct socket *so, int revents)
+{
+    if (so->s != -1 &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        icmp_receive(so);
+    }
+}
+
+/*
+ * Epoll mode
+ *
+ * Instead of rebuilding the pollfds array and scanning every socket on each
+ * iteration, host sockets stay registered with an epoll instance.  Code that
+ * may change what a socket needs to be polled for calls
+ * slirp_socket_changed(), and only those sockets are looked at again before
+ * the next poll.  Only ready sockets are dispatched.
+ */
+
+#ifdef CONFIG_EPOLL
+
+#define SLIRP_EPOLL_MAX_EVENTS 64
+
+static int gio_to_epoll(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_PRI ? EPOLLPRI : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0) |
+           (events & G_IO_ERR ? EPOLLERR : 0) |
+           (events & G_IO_HUP ? EPOLLHUP : 0);
+}
+
+static int epoll_to_gio(int events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLPRI ? G_IO_PRI : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0);
+}
+
+int slirp_epoll_init(Slirp *slirp)
+{
+    struct socket *head[] = { &slirp->tcb, &slirp->udb, &slirp->icmp };
+    struct socket *so;
+    int i;
+
+    if (slirp->epoll_fd >= 0) {
+        return 0;
+    }
+
+    slirp->epoll_fd = epoll_create(SLIRP_EPOLL_MAX_EVENTS);
+    if (slirp->epoll_fd < 0) {
+        return -errno;
+    }
+    qemu_set_cloexec(slirp->epoll_fd);
+    slirp->epoll_events = g_new(struct epoll_event, SLIRP_EPOLL_MAX_EVENTS);
+
+    /* Sockets that already exist (e.g. for hostfwd) are registered now */
+    for (i = 0; i < ARRAY_SIZE(head); i++) {
+        for (so = head[i]->so_next; so != head[i]; so = so->so_next) {
+            slirp_socket_changed(so);
+        }
+    }
+
+    return 0;
+}
+
+void slirp_socket_changed(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+
+    if (slirp->epoll_fd < 0 || so->so_dirty) {
+        return;
+    }
+
+    so->so_dirty = true;
+    QTAILQ_INSERT_TAIL(&slirp->dirty_sockets, so, so_dirty_entry);
+    if (slirp->aio_bh) {
+        qemu_bh_schedule(slirp->aio_bh);
+    }
+}
+
+void slirp_socket_removed(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+    int i;
+
+    if (slirp->epoll_fd < 0) {
+        return;
+    }
+
+    if (so->so_dirty) {
+        QTAILQ_REMOVE(&slirp->dirty_sockets, so, so_dirty_entry);
+        so->so_dirty = false;
+    }
+    if (so->so_events && so->so_epoll_fd == so->s) {
+        epoll_ctl(slirp->epoll_fd, EPOLL_CTL_DEL, so->s, NULL);
+    }
+
+    /* Don't dispatch events that are pending for this socket */
+    for (i = slirp->epoll_next; i < slirp->epoll_nevents; i++) {
+        if (slirp->epoll_events[i].data.ptr == so) {
+            slirp->epoll_events[i].data.ptr = NULL;
+        }
+    }
+}
+
+static void slirp_epoll_update_socket(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+    struct epoll_event ev;
+    int events, op;
+
+    if (so->so_type == IPPROTO_ICMP) {
+        events = slirp_icmp_events(so);
+    } else if (so->so_tcpcb) {
+        events = slirp_tcp_events(so);
+    } else {
+        events = slirp_udp_events(so);
+    }
+    if (so->so_expire) {
+        slirp->so_expiring = true;
+    }
+
+    if (so->so_events && so->so_epoll_fd != so->s) {
+        /* The old descriptor was closed, which unregistered it */
+        so->so_events = 0;
+    }
+    if (events == so->so_events) {
+        return;
+    }
+
+    if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else if (!so->so_events) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    ev.events = gio_to_epoll(events);
+    ev.data.ptr = so;
+    if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0) {
+        if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_MOD, so->s, &ev);
+        } else if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_ADD, so->s, &ev);
+        } else if (op != EPOLL_CTL_DEL) {
+            DEBUG_MISC((dfd, "epoll_ctl failed: %s\n", strerror(errno)));
+            events = 0;
+        }
+    }
+
+    so->so_events = events;
+    so->so_epoll_fd = so->s;
+}
+
+/*
+ * Brings the epoll interest list up to date with the sockets that changed
+ * since the last call and decides whether the slow timers are needed.
+ */
+static void slirp_epoll_update(Slirp *slirp)
+{
+    struct socket *so;
+
+    while ((so = QTAILQ_FIRST(&slirp->dirty_sockets)) != NULL) {
+        QTAILQ_REMOVE(&slirp->dirty_sockets, so, so_dirty_entry);
+        so->so_dirty = false;
+        slirp_epoll_update_socket(so);
+    }
+
+    /*
+     * *_slowtimo needs calling if there are IP fragments
+     * in the fragment queue, or there are TCP connections active.
+     * UDP and ICMP sockets are only checked for expiry from there.
+     */
+    slirp->do_slowtimo = ((slirp->tcb.so_next != &slirp->tcb) ||
+            (&slirp->ipq.ip_link != slirp->ipq.ip_link.next) ||
+            slirp->so_expiring);
+}
+
+/* Looks for timed out UDP and ICMP sockets, called from the slow timer */
+static void slirp_epoll_expire(Slirp *slirp)
+{
+    struct socket *head[] = { &slirp->udb, &slirp->icmp };
+    struct socket *so, *so_next;
+    int i;
+
+    slirp->so_expiring = false;
+    for (i = 0; i < ARRAY_SIZE(head); i++) {
+        for (so = head[i]->so_next; so != head[i]; so = so_next) {
+            so_next = so->so_next;
+            if (!slirp_socket_expire(so) && so->so_expire) {
+                slirp->so_expiring = true;
             }
+        }
+    }
+}
+
+static void slirp_epoll_dispatch(Slirp *slirp)
+{
+    struct epoll_event *ev;
+    struct socket *so;
+    int revents;
+
+    slirp->epoll_nevents = epoll_wait(slirp->epoll_fd, slirp->epoll_events,
+                                      SLIRP_EPOLL_MAX_EVENTS, 0);
+
+    /* slirp_socket_removed() clears the entries from epoll_next onwards */
+    for (slirp->epoll_next = 0; slirp->epoll_next < slirp->epoll_nevents;
+         slirp->epoll_next++)
+    {
+        ev = &slirp->epoll_events[slirp->epoll_next];
+        so = ev->data.ptr;
+        if (!so) {
+            continue;
+        }
+
+        revents = epoll_to_gio(ev->events);
+        if (so->so_type == IPPROTO_ICMP) {
+            slirp_icmp_dispatch(so, revents);
+        } else if (so->so_tcpcb) {
+            slirp_tcp_dispatch(so, revents);
+        } else {
+            slirp_udp_dispatch(so, revents);
+        }
+
+        /* Unless it's gone, the socket may need different events now */
+        if (ev->data.ptr) {
+            slirp_socket_changed(so);
+        }
+    }
+
+    slirp->epoll_nevents = 0;
+    slirp->epoll_next = 0;
+}
+
+#else
+
+int slirp_epoll_init(Slirp *slirp)
+{
+    return -ENOSYS;
+}
+
+void slirp_socket_changed(struct socket *so)
+{
+}
 
+void slirp_socket_removed(struct socket *so)
+{
+}
+
+static void slirp_epoll_update(Slirp *slirp)
+{
+}
+
+static void slirp_epoll_expire(Slirp *slirp)
+{
+}
+
+static void slirp_epoll_dispatch(Slirp *slirp)
+{
+}
+
+#endif
+
+static void slirp_timers(Slirp *slirp)
+{
+    /*
+     * See if anything has timed out
+     */
+    if (slirp->time_fasttimo &&
+        ((slirp->curtime - slirp->time_fasttimo) >= TIMEOUT_FAST)) {
+        tcp_fasttimo(slirp);
+        slirp->time_fasttimo = 0;
+    }
+    if (slirp->do_slowtimo &&
+        ((slirp->curtime - slirp->last_slowtimo) >= TIMEOUT_SLOW)) {
+        ip_slowtimo(slirp);
+        tcp_slowtimo(slirp);
+        if (slirp->epoll_fd >= 0) {
+            slirp_epoll_expire(slirp);
+        }
+        slirp->last_slowtimo = slirp->curtime;
+    }
+}
+
+void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
+{
+    Slirp *slirp;
+    struct socket *so, *so_next;
+    int events;
+
+    if (QTAILQ_EMPTY(&slirp_instances)) {
+        return;
+    }
+
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        if (slirp->aio_context) {
+            continue;
+        }
+
+        slirp_update_clock(slirp);
+
+        if (slirp->epoll_fd >= 0) {
+            GPollFD pfd = {
+                .fd = slirp->epoll_fd,
+                .events = G_IO_IN,
+            };
+
+            slirp_epoll_update(slirp);
+            slirp->epoll_pollfds_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
+            continue;
+        }
+
+        /*
+         * *_slowtimo needs calling if there are IP fragments
+         * in the fragment queue, or there are TCP connections active
+         */
+        slirp->do_slowtimo = ((slirp->tcb.so_next != &slirp->tcb) ||
+                (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
+
+        /*
+         * First, TCP sockets
+         */
+        for (so = slirp->tcb.so_next; so != &slirp->tcb;
+                so = so_next) {
+            so_next = so->so_next;
+
+            so->pollfds_idx = -1;
+            events = slirp_tcp_events(so);
             if (events) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = events,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_pollfds_add(pollfds, so, events);
             }
         }
 
@@ -394,36 +924,12 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
-
-            /*
-             * See if it's timed out
-             */
-            if (so->so_expire) {
-                if (so->so_expire <= curtime) {
-                    udp_detach(so);
-                    continue;
-                } else {
-                    slirp->do_slowtimo = true; /* Let socket expire */
-                }
+            if (slirp_socket_expire(so)) {
+                continue;
             }
-
-            /*
-             * When UDP packets are received from over the
-             * link, they're sendto()'d straight away, so
-             * no need for setting for writing
-             * Limit the number of packets queued by this session
-             * to 4.  Note that even though we try and limit this
-             * to 4 packets, the session could have more queued
-             * if the packets needed to be fragmented
-             * (XXX <= 4 ?)
-             */
-            if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+            events = slirp_udp_events(so);
+            if (events) {
+                slirp_pollfds_add(pollfds, so, events);
             }
         }
 
@@ -435,214 +941,70 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
-
-            /*
-             * See if it's timed out
-             */
-            if (so->so_expire) {
-                if (so->so_expire <= curtime) {
-                    icmp_detach(so);
-                    continue;
-                } else {
-                    slirp->do_slowtimo = true; /* Let socket expire */
-                }
+            if (slirp_socket_expire(so)) {
+                continue;
             }
-
-            if (so->so_state & SS_ISFCONNECTED) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+            events = slirp_icmp_events(so);
+            if (events) {
+                slirp_pollfds_add(pollfds, so, events);
             }
         }
     }
     slirp_update_timeout(timeout);
 }
 
+static int slirp_pollfds_revents(GArray *pollfds, struct socket *so)
+{
+    if (so->pollfds_idx == -1) {
+        return 0;
+    }
+    return g_array_index(pollfds, GPollFD, so->pollfds_idx).revents;
+}
+
 void slirp_pollfds_poll(GArray *pollfds, int select_error)
 {
     Slirp *slirp;
     struct socket *so, *so_next;
-    int ret;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
     }
 
-    curtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
-        /*
-         * See if anything has timed out
-         */
-        if (slirp->time_fasttimo &&
-            ((curtime - slirp->time_fasttimo) >= TIMEOUT_FAST)) {
-            tcp_fasttimo(slirp);
-            slirp->time_fasttimo = 0;
-        }
-        if (slirp->do_slowtimo &&
-            ((curtime - slirp->last_slowtimo) >= TIMEOUT_SLOW)) {
-            ip_slowtimo(slirp);
-            tcp_slowtimo(slirp);
-            slirp->last_slowtimo = curtime;
+        if (slirp->aio_context) {
+            continue;
         }
 
+        slirp_update_clock(slirp);
+        slirp_timers(slirp);
+
         /*
          * Check sockets
          */
-        if (!select_error) {
+        if (select_error) {
+            /* nothing */
+        } else if (slirp->epoll_fd >= 0) {
+            if (g_array_index(pollfds, GPollFD,
+                              slirp->epoll_pollfds_idx).revents & G_IO_IN) {
+                slirp_epoll_dispatch(slirp);
+            }
+        } else {
             /*
              * Check TCP sockets
              */
             for (so = slirp->tcb.so_next; so != &slirp->tcb;
                     so = so_next) {
-                int revents;
-
                 so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                                            so->pollfds_idx).revents;
-                }
-
-                if (so->so_state & SS_NOFDREF || so->s == -1) {
-                    continue;
-                }
-
-                /*
-                 * Check for URG data
-                 * This will soread as well, so no need to
-                 * test for G_IO_IN below if this succeeds
-                 */
-                if (revents & G_IO_PRI) {
-                    sorecvoob(so);
-                }
-                /*
-                 * Check sockets for reading
-                 */
-                else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
-                    /*
-                     * Check for incoming connections
-                     */
-                    if (so->so_state & SS_FACCEPTCONN) {
-                        tcp_connect(so);
-                        continue;
-                    } /* else */
-                    ret = soread(so);
-
-                    /* Output it if we read something */
-                    if (ret > 0) {
-                        tcp_output(sototcpcb(so));
-                    }
-                }
-
-                /*
-                 * Check sockets for writing
-                 */
-                if (!(so->so_state & SS_NOFDREF) &&
-                        (revents & (G_IO_OUT | G_IO_ERR))) {
-                    /*
-                     * Check for non-blocking, still-connecting sockets
-                     */
-                    if (so->so_state & SS_ISFCONNECTING) {
-                        /* Connected */
-                        so->so_state &= ~SS_ISFCONNECTING;
-
-                        ret = send(so->s, (const void *) &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXXXX Must fix, zero bytes is a NOP */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        }
-                        /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-                        /*
-                         * Continue tcp_input
-                         */
-                        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                        /* continue; */
-                    } else {
-                        ret = sowrite(so);
-                    }
-                    /*
-                     * XXXXX If we wrote something (a lot), there
-                     * could be a need for a window update.
-                     * In the worst case, the remote will send
-                     * a window probe to get things going again
-                     */
-                }
-
-                /*
-                 * Probe a still-connecting, non-blocking socket
-                 * to check if it's still alive
-                 */
-#ifdef PROBE_CONN
-                if (so->so_state & SS_ISFCONNECTING) {
-                    ret = qemu_recv(so->s, &ret, 0, 0);
-
-                    if (ret < 0) {
-                        /* XXX */
-                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                            errno == EINPROGRESS || errno == ENOTCONN) {
-                            continue; /* Still connecting, continue */
-                        }
-
-                        /* else failed */
-                        so->so_state &= SS_PERSISTENT_MASK;
-                        so->so_state |= SS_NOFDREF;
-
-                        /* tcp_input will take care of it */
-                    } else {
-                        ret = send(so->s, &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXX */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        } else {
-                            so->so_state &= ~SS_ISFCONNECTING;
-                        }
-
-                    }
-                    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                } /* SS_ISFCONNECTING */
-#endif
+                slirp_tcp_dispatch(so, slirp_pollfds_revents(pollfds, so));
             }
 
             /*
              * Now UDP sockets.
-             * Incoming packets are sent straight away, they're not buffered.
-             * Incoming UDP data isn't buffered either.
              */
             for (so = slirp->udb.so_next; so != &slirp->udb;
                     so = so_next) {
-                int revents;
-
                 so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                            so->pollfds_idx).revents;
-                }
-
-                if (so->s != -1 &&
-                    (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    sorecvfrom(so);
-                }
+                slirp_udp_dispatch(so, slirp_pollfds_revents(pollfds, so));
             }
 
             /*
@@ -650,20 +1012,8 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
              */
             for (so = slirp->icmp.so_next; so != &slirp->icmp;
                     so = so_next) {
-                    int revents;
-
-                    so_next = so->so_next;
-
-                    revents = 0;
-                    if (so->pollfds_idx != -1) {
-                        revents = g_array_index(pollfds, GPollFD,
-                                                so->pollfds_idx).revents;
-                    }
-
-                    if (so->s != -1 &&
-                        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    icmp_receive(so);
-                }
+                so_next = so->so_next;
+                slirp_icmp_dispatch(so, slirp_pollfds_revents(pollfds, so));
             }
         }
 
@@ -671,6 +1021,113 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
     }
 }
 
+/*
+ * AioContext mode
+ *
+ * The instance is polled by the event loop of an AioContext, typically
+ * running in an IOThread, instead of slirp_pollfds_fill/poll().  Everything
+ * else that calls into the instance must hold the AioContext.
+ */
+
+#ifdef CONFIG_EPOLL
+
+static void slirp_aio_schedule(Slirp *slirp)
+{
+    int64_t delay;
+
+    slirp_epoll_update(slirp);
+
+    if (slirp->time_fasttimo) {
+        delay = TIMEOUT_FAST;
+    } else if (slirp->do_slowtimo) {
+        delay = TIMEOUT_SLOW - MIN(TIMEOUT_SLOW,
+                                   slirp->curtime - slirp->last_slowtimo);
+    } else {
+        timer_del(slirp->aio_timer);
+        return;
+    }
+    timer_mod(slirp->aio_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + delay);
+}
+
+static void slirp_aio_read(void *opaque)
+{
+    Slirp *slirp = opaque;
+
+    slirp_update_clock(slirp);
+    slirp_epoll_dispatch(slirp);
+    slirp_timers(slirp);
+    if_start(slirp);
+    slirp_aio_schedule(slirp);
+}
+
+static void slirp_aio_timer(void *opaque)
+{
+    Slirp *slirp = opaque;
+
+    slirp_update_clock(slirp);
+    slirp_timers(slirp);
+    if_start(slirp);
+    slirp_aio_schedule(slirp);
+}
+
+static void slirp_aio_bh(void *opaque)
+{
+    Slirp *slirp = opaque;
+
+    slirp_update_clock(slirp);
+    slirp_aio_schedule(slirp);
+}
+
+int slirp_attach_aio_context(Slirp *slirp, AioContext *ctx)
+{
+    int ret;
+
+    assert(!slirp->aio_context);
+
+    ret = slirp_epoll_init(slirp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    slirp->aio_context = ctx;
+    slirp->aio_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_MS,
+                                     slirp_aio_timer, slirp);
+    slirp->aio_bh = aio_bh_new(ctx, slirp_aio_bh, slirp);
+    aio_set_fd_handler(ctx, slirp->epoll_fd, slirp_aio_read, NULL, slirp);
+    qemu_bh_schedule(slirp->aio_bh);
+
+    return 0;
+}
+
+void slirp_detach_aio_context(Slirp *slirp)
+{
+    if (!slirp->aio_context) {
+        return;
+    }
+
+    aio_set_fd_handler(slirp->aio_context, slirp->epoll_fd, NULL, NULL, NULL);
+    qemu_bh_delete(slirp->aio_bh);
+    timer_del(slirp->aio_timer);
+    timer_free(slirp->aio_timer);
+    slirp->aio_bh = NULL;
+    slirp->aio_timer = NULL;
+    slirp->aio_context = NULL;
+}
+
+#else
+
+int slirp_attach_aio_context(Slirp *slirp, AioContext *ctx)
+{
+    return -ENOSYS;
+}
+
+void slirp_detach_aio_context(Slirp *slirp)
+{
+}
+
+#endif
+
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 {
     struct arphdr *ah = (struct arphdr *)(pkt + ETH_HLEN);
@@ -719,7 +1176,7 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
             rah->ar_sip = ah->ar_tip;
             memcpy(rah->ar_tha, ah->ar_sha, ETH_ALEN);
             rah->ar_tip = ah->ar_sip;
-            slirp_output(slirp->opaque, arp_reply, sizeof(arp_reply));
+            slirp_output(slirp->opaque, arp_reply, sizeof(arp_reply), NULL);
         }
         break;
     case ARPOP_REPLY:
@@ -730,29 +1187,60 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
-void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+void slirp_set_offload(Slirp *slirp, bool csum, bool tso4)
 {
+    slirp->offload_csum = csum;
+    slirp->offload_tso4 = csum && tso4;
+}
+
+void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len, int flags)
+{
+    struct iovec iov = {
+        .iov_base = (void *)pkt,
+        .iov_len = pkt_len,
+    };
+
+    slirp_input_iov(slirp, &iov, 1, flags);
+}
+
+/*
+ * Like slirp_input(), but takes the frame as a scatter/gather list, which is
+ * copied once, straight into the mbuf that carries it through the stack.
+ * The mbuf can't point into the caller's buffers instead: the input path
+ * rewrites headers in place, and sockets may keep the data queued after
+ * this returns.
+ */
+void slirp_input_iov(Slirp *slirp, const struct iovec *iov, int iovcnt,
+                     int flags)
+{
+    uint8_t arp_pkt[max(ETH_HLEN + sizeof(struct arphdr), 64)] = { 0 };
     struct mbuf *m;
-    int proto;
+    size_t pkt_len;
+    uint16_t proto;
 
+    pkt_len = iov_size(iov, iovcnt);
     if (pkt_len < ETH_HLEN)
         return;
 
-    proto = ntohs(*(uint16_t *)(pkt + 12));
-    switch(proto) {
+    slirp_update_clock(slirp);
+
+    iov_to_buf(iov, iovcnt, 12, &proto, sizeof(proto));
+    switch (ntohs(proto)) {
     case ETH_P_ARP:
-        arp_input(slirp, pkt, pkt_len);
+        /* ARP frames are short, arp_input() wants them contiguous */
+        pkt_len = iov_to_buf(iov, iovcnt, 0, arp_pkt, sizeof(arp_pkt));
+        arp_input(slirp, arp_pkt, pkt_len);
         break;
     case ETH_P_IP:
-        m = m_get(slirp);
+        /* Note: we add to align the IP header */
+        m = m_get_size(slirp, pkt_len + 2);
         if (!m)
             return;
-        /* Note: we add to align the IP header */
-        if (M_FREEROOM(m) < pkt_len + 2) {
-            m_inc(m, pkt_len + 2);
-        }
         m->m_len = pkt_len + 2;
-        memcpy(m->m_data + 2, pkt, pkt_len);
+        iov_to_buf(iov, iovcnt, 0, m->m_data + 2, pkt_len);
+        if (flags & SLIRP_INPUT_CSUM_VALID) {
+            m->m_flags |= M_CSUM_VALID;
+        }
 
         m->m_data += 2 + ETH_HLEN;
         m->m_len -= 2 + ETH_HLEN;
@@ -770,11 +1258,17 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 int if_encap(Slirp *slirp, struct mbuf *ifm)
 {
     uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
+    uint8_t *frame = buf;
+    struct ethhdr *eh;
     uint8_t ethaddr[ETH_ALEN];
     const struct ip *iph = (const struct ip *)ifm->m_data;
+    SlirpOffload offload = { 0 };
 
-    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+    /* Frames are built in place where the producer left room for the link
+     * header, which all do except for some locally generated replies */
+    if (M_LEADINGSPACE(ifm) >= ETH_HLEN) {
+        frame = (uint8_t *)ifm->m_data - ETH_HLEN;
+    } else if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
         return 1;
     }
 
@@ -808,7 +1302,7 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
             /* target IP */
             rah->ar_tip = iph->ip_dst.s_addr;
             slirp->client_ipaddr = iph->ip_dst;
-            slirp_output(slirp->opaque, arp_req, sizeof(arp_req));
+            slirp_output(slirp->opaque, arp_req, sizeof(arp_req), NULL);
             ifm->arp_requested = true;
 
             /* Expire request and drop outgoing packet after 1 second */
@@ -816,13 +1310,26 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
         }
         return 0;
     } else {
+        if (frame == buf) {
+            memcpy(buf + ETH_HLEN, ifm->m_data, ifm->m_len);
+        }
+        eh = (struct ethhdr *)frame;
         memcpy(eh->h_dest, ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
-        slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+
+        if (ifm->m_flags & M_CSUM_PARTIAL) {
+            const struct tcphdr *th =
+                (const struct tcphdr *)((char *)iph + (iph->ip_hl << 2));
+
+            offload.csum_start = ETH_HLEN + (iph->ip_hl << 2);
+            offload.csum_offset = offsetof(struct tcphdr, th_sum);
+            offload.hdr_len = offload.csum_start + (th->th_off << 2);
+            offload.gso_size = ifm->m_gso_size;
+        }
+        slirp_output(slirp->opaque, frame, ifm->m_len + ETH_HLEN, &offload);
         return 1;
     }
 }
@@ -1031,7 +1538,7 @@ static void slirp_bootp_save(QEMUFile *f, Slirp *slirp)
     }
 }
 
-static void slirp_state_save(QEMUFile *f, void *opaque)
+static void slirp_do_state_save(QEMUFile *f, void *opaque)
 {
     Slirp *slirp = opaque;
     struct ex_list *ex_ptr;
@@ -1158,7 +1665,7 @@ static void slirp_bootp_load(QEMUFile *f, Slirp *slirp)
     }
 }
 
-static int slirp_state_load(QEMUFile *f, void *opaque, int version_id)
+static int slirp_do_state_load(QEMUFile *f, void *opaque, int version_id)
 {
     Slirp *slirp = opaque;
     struct ex_list *ex_ptr;
@@ -1202,3 +1709,34 @@ static int slirp_state_load(QEMUFile *f, void *opaque, int version_id)
 
     return 0;
 }
+
+/* Sockets may be in use by the thread that runs the AioContext */
+static void slirp_state_save(QEMUFile *f, void *opaque)
+{
+    Slirp *slirp = opaque;
+    AioContext *ctx = slirp->aio_context;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    slirp_do_state_save(f, opaque);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static int slirp_state_load(QEMUFile *f, void *opaque, int version_id)
+{
+    Slirp *slirp = opaque;
+    AioContext *ctx = slirp->aio_context;
+    int ret;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    ret = slirp_do_state_load(f, opaque, version_id);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+    return ret;
+}
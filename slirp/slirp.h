@@ -203,10 +203,25 @@ bool arp_table_search(Slirp *slirp, uint32_t ip_addr,
 
 struct Slirp {
     QTAILQ_ENTRY(Slirp) entry;
+    u_int curtime;  /* milliseconds, see slirp_update_clock() */
     u_int time_fasttimo;
     u_int last_slowtimo;
     bool do_slowtimo;
 
+    /* epoll mode, see slirp_epoll_init() */
+    int epoll_fd;
+    int epoll_pollfds_idx;
+    struct epoll_event *epoll_events;
+    int epoll_nevents;
+    int epoll_next;
+    QTAILQ_HEAD(, socket) dirty_sockets;
+    bool so_expiring;
+
+    /* AioContext mode, see slirp_attach_aio_context() */
+    AioContext *aio_context;
+    QEMUTimer *aio_timer;
+    QEMUBH *aio_bh;
+
     /* virtual network configuration */
     struct in_addr vnetwork_addr;
     struct in_addr vnetwork_mask;
@@ -223,6 +238,11 @@ struct Slirp {
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
+    MbufExtClass m_ext_classes[M_EXT_NCLASSES];
+    uint64_t m_gets;        /* statistics for "info usernet" */
+    uint64_t m_get_hits;
+    uint64_t m_ext_large;
+    uint64_t m_inc_bytes;
 
     /* if states */
     struct mbuf if_fastq;   /* fast queue (for interactive data) */
@@ -260,6 +280,10 @@ struct Slirp {
 
     ArpTable arp_table;
 
+    /* offloads of the guest side, see slirp_set_offload() */
+    bool offload_csum;
+    bool offload_tso4;
+
     void *opaque;
 };
 
@@ -302,6 +326,10 @@ int translate_dnssearch(Slirp *s, const char ** names);
 /* cksum.c */
 int cksum(struct mbuf *m, int len);
 
+/* slirp.c */
+void slirp_socket_changed(struct socket *so);
+void slirp_socket_removed(struct socket *so);
+
 /* if.c */
 void if_init(Slirp *);
 void if_output(struct socket *, struct mbuf *);
@@ -77,6 +77,8 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+  slirp_socket_removed(so);
+
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -518,9 +520,9 @@ sorecvfrom(struct socket *so)
 	   */
 	    if (so->so_expire) {
 	      if (so->so_fport == htons(53))
-		so->so_expire = curtime + SO_EXPIREFAST;
+		so->so_expire = so->slirp->curtime + SO_EXPIREFAST;
 	      else
-		so->so_expire = curtime + SO_EXPIRE;
+		so->so_expire = so->slirp->curtime + SO_EXPIRE;
 	    }
 
 	    /*
@@ -573,7 +575,7 @@ sosendto(struct socket *so, struct mbuf *m)
 	 * but only if it's an expirable socket
 	 */
 	if (so->so_expire)
-		so->so_expire = curtime + SO_EXPIRE;
+		so->so_expire = so->slirp->curtime + SO_EXPIRE;
 	so->so_state &= SS_PERSISTENT_MASK;
 	so->so_state |= SS_ISFCONNECTED; /* So that it gets select()ed */
 	return 0;
@@ -652,6 +654,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = addr.sin_addr;
 
 	so->s = s;
+	slirp_socket_changed(so);
 	return so;
 }
 
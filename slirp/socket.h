@@ -22,6 +22,11 @@ struct socket {
 
   int pollfds_idx;                 /* GPollFD GArray index */
 
+  int so_events;                   /* events registered with epoll, or 0 */
+  int so_epoll_fd;                 /* descriptor they are registered for */
+  bool so_dirty;                   /* on slirp->dirty_sockets */
+  QTAILQ_ENTRY(socket) so_dirty_entry;
+
   Slirp *slirp;			   /* managing slirp instance */
 
 			/* XXX union these with not-yet-used sbuf params */
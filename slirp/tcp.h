@@ -41,6 +41,9 @@ typedef	uint32_t tcp_seq;
 #define TCP_SNDSPACE 8192
 #define TCP_RCVSPACE 8192
 
+/* Socket buffer space if the guest takes large segments */
+#define TCP_GSO_SPACE 65536
+
 /*
  * TCP header.
  * Per RFC 793, September, 1981.
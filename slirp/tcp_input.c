@@ -282,7 +282,7 @@ tcp_input(struct mbuf *m, int iphlen, struct socket *inso)
 	ti->ti_x1 = 0;
 	ti->ti_len = htons((uint16_t)tlen);
 	len = sizeof(struct ip ) + tlen;
-	if(cksum(m, len)) {
+	if (!(m->m_flags & M_CSUM_VALID) && cksum(m, len)) {
 	  goto drop;
 	}
 
@@ -394,6 +394,9 @@ findso:
         if (so->so_state & SS_ISFCONNECTING)
                 goto drop;
 
+	/* The segment may change what the host socket is polled for */
+	slirp_socket_changed(so);
+
 	tp = sototcpcb(so);
 
 	/* XXX Should never fail */
@@ -1462,7 +1465,7 @@ int
 tcp_mss(struct tcpcb *tp, u_int offer)
 {
 	struct socket *so = tp->t_socket;
-	int mss;
+	int mss, sndspace, rcvspace;
 
 	DEBUG_CALL("tcp_mss");
 	DEBUG_ARG("tp = %lx", (long)tp);
@@ -1477,12 +1480,17 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+	/* Large segments only pay off if there is enough data for them */
+	if (so->slirp->offload_tso4) {
+		sndspace = rcvspace = TCP_GSO_SPACE;
+	} else {
+		sndspace = TCP_SNDSPACE;
+		rcvspace = TCP_RCVSPACE;
+	}
+	sbreserve(&so->so_snd, sndspace + ((sndspace % mss) ?
+                                           (mss - (sndspace % mss)) : 0));
+	sbreserve(&so->so_rcv, rcvspace + ((rcvspace % mss) ?
+                                           (mss - (rcvspace % mss)) : 0));
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
@@ -39,6 +39,7 @@
  */
 
 #include <slirp.h>
+#include "net/checksum.h"
 
 static const u_char  tcp_outflags[TCP_NSTATES] = {
 	TH_RST|TH_ACK, 0,      TH_SYN,        TH_SYN|TH_ACK,
@@ -50,6 +51,9 @@ static const u_char  tcp_outflags[TCP_NSTATES] = {
 #undef MAX_TCPOPTLEN
 #define MAX_TCPOPTLEN	32	/* max # bytes that go in options */
 
+/* Largest payload of a segment that the guest splits up itself */
+#define TCP_GSO_MAXLEN	(IP_MAXPACKET - sizeof(struct tcpiphdr) - MAX_TCPOPTLEN)
+
 /*
  * Tcp output routine: figure out what should be sent and send it.
  */
@@ -57,13 +61,14 @@ int
 tcp_output(struct tcpcb *tp)
 {
 	register struct socket *so = tp->t_socket;
-	register long len, win;
+	register long len, win, maxlen;
 	int off, flags, error;
 	register struct mbuf *m;
 	register struct tcpiphdr *ti;
 	u_char opt[MAX_TCPOPTLEN];
 	unsigned optlen, hdrlen;
 	int idle, sendalot;
+	uint32_t data_sum;
 
 	DEBUG_CALL("tcp_output");
 	DEBUG_ARG("tp = %lx", (long )tp);
@@ -84,6 +89,7 @@ tcp_output(struct tcpcb *tp)
 		tp->snd_cwnd = tp->t_maxseg;
 again:
 	sendalot = 0;
+	data_sum = 0;
 	off = tp->snd_nxt - tp->snd_una;
 	win = min(tp->snd_wnd, tp->snd_cwnd);
 
@@ -144,8 +150,16 @@ again:
 		}
 	}
 
-	if (len > tp->t_maxseg) {
-		len = tp->t_maxseg;
+	/*
+	 * If the guest takes large segments, send as many maximum size
+	 * segments at once as fit into one IP packet.
+	 */
+	maxlen = tp->t_maxseg;
+	if (so->slirp->offload_tso4) {
+		maxlen = max(maxlen, TCP_GSO_MAXLEN - TCP_GSO_MAXLEN % maxlen);
+	}
+	if (len > maxlen) {
+		len = maxlen;
 		sendalot = 1;
 	}
 	if (SEQ_LT(tp->snd_nxt + len, tp->snd_una + so->so_snd.sb_cc))
@@ -164,7 +178,7 @@ again:
 	 * to send into a small window), then must resend.
 	 */
 	if (len) {
-		if (len == tp->t_maxseg)
+		if (len >= tp->t_maxseg)
 			goto send;
 		if ((1 || idle || tp->t_flags & TF_NODELAY) &&
 		    len + off >= so->so_snd.sb_cc)
@@ -280,8 +294,8 @@ send:
 	 * Adjust data length if insertion of options will
 	 * bump the packet length beyond the t_maxseg length.
 	 */
-	 if (len > tp->t_maxseg - optlen) {
-		len = tp->t_maxseg - optlen;
+	 if (len > maxlen - optlen) {
+		len = maxlen - optlen;
 		sendalot = 1;
 	 }
 
@@ -298,8 +312,24 @@ send:
 		}
 		m->m_data += IF_MAXLINKHDR;
 		m->m_len = hdrlen;
+		if (M_FREEROOM(m) < len) {
+			m_inc(m, IF_MAXLINKHDR + hdrlen + len);
+		}
+		if (len > tp->t_maxseg) {
+			m->m_gso_size = tp->t_maxseg;
+		}
 
-		sbcopy(&so->so_snd, off, (int) len, mtod(m, caddr_t) + hdrlen);
+		/*
+		 * Without checksum offload, sum up the data while copying
+		 * it; hdrlen is even, so it starts a new 16-bit word
+		 */
+		if (so->slirp->offload_csum) {
+			sbcopy(&so->so_snd, off, (int) len,
+			       mtod(m, caddr_t) + hdrlen);
+		} else {
+			data_sum = sbcopy_csum(&so->so_snd, off, (int) len,
+					       mtod(m, caddr_t) + hdrlen);
+		}
 		m->m_len += len;
 
 		/*
@@ -386,7 +416,17 @@ send:
 	if (len + optlen)
 		ti->ti_len = htons((uint16_t)(sizeof (struct tcphdr) +
 		    optlen + len));
-	ti->ti_sum = cksum(m, (int)(hdrlen + len));
+	if (so->slirp->offload_csum) {
+		/*
+		 * The guest completes the checksum, so only sum up the
+		 * pseudo header (the overlay in front of the TCP header).
+		 */
+		ti->ti_sum = ~cksum(m, sizeof(struct ipovly));
+		m->m_flags |= M_CSUM_PARTIAL;
+	} else {
+		data_sum += net_checksum_add(hdrlen, mtod(m, uint8_t *));
+		ti->ti_sum = htons(net_checksum_finish(data_sum));
+	}
 
 	/*
 	 * In transmit state, time the transmission and arrange for
@@ -450,6 +450,7 @@ void tcp_connect(struct socket *inso)
     }
     so->s = s;
     so->so_state |= SS_INCOMING;
+    slirp_socket_changed(so);
 
     so->so_iptos = tcp_tos(so);
     tp = sototcpcb(so);
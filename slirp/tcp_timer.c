@@ -85,6 +85,7 @@ tcp_slowtimo(Slirp *slirp)
                 }
 		for (i = 0; i < TCPT_NTIMERS; i++) {
 			if (tp->t_timer[i] && --tp->t_timer[i] == 0) {
+				slirp_socket_changed(ip);
 				tcp_timers(tp,i);
 				if (ipnxt->so_prev != ip)
 					goto tpgone;
@@ -32,7 +32,7 @@ static inline int tftp_session_in_use(struct tftp_session *spt)
 
 static inline void tftp_session_update(struct tftp_session *spt)
 {
-    spt->timestamp = curtime;
+    spt->timestamp = spt->slirp->curtime;
 }
 
 static void tftp_session_terminate(struct tftp_session *spt)
@@ -57,7 +57,7 @@ static int tftp_session_allocate(Slirp *slirp, struct tftp_t *tp)
         goto found;
 
     /* sessions time out after 5 inactive seconds */
-    if ((int)(curtime - spt->timestamp) > 5000) {
+    if ((int)(slirp->curtime - spt->timestamp) > 5000) {
         tftp_session_terminate(spt);
         goto found;
     }
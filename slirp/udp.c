@@ -116,7 +116,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	/*
 	 * Checksum extended UDP header and data.
 	 */
-	if (uh->uh_sum) {
+	if (uh->uh_sum && !(m->m_flags & M_CSUM_VALID)) {
       memset(&((struct ipovly *)ip)->ih_mbuf, 0, sizeof(struct mbuf_ptr));
 	  ((struct ipovly *)ip)->ih_x1 = 0;
 	  ((struct ipovly *)ip)->ih_len = uh->uh_ulen;
@@ -212,6 +212,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	/*
 	 * Now we sendto() the packet.
 	 */
+	slirp_socket_changed(so);
 	if(sosendto(so,m) == -1) {
 	  m->m_len += iphlen;
 	  m->m_data -= iphlen;
@@ -313,8 +314,9 @@ int
 udp_attach(struct socket *so)
 {
   if((so->s = qemu_socket(AF_INET,SOCK_DGRAM,0)) != -1) {
-    so->so_expire = curtime + SO_EXPIRE;
+    so->so_expire = so->slirp->curtime + SO_EXPIRE;
     insque(so, &so->slirp->udb);
+    slirp_socket_changed(so);
   }
   return(so->s);
 }
@@ -361,8 +363,9 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	    return NULL;
 	}
 	so->s = qemu_socket(AF_INET,SOCK_DGRAM,0);
-	so->so_expire = curtime + SO_EXPIRE;
+	so->so_expire = slirp->curtime + SO_EXPIRE;
 	insque(so, &slirp->udb);
+	slirp_socket_changed(so);
 
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = haddr;
@@ -0,0 +1,129 @@
+/*
+ * Migration dirty bitmap sync benchmark
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Measures how long moving the migration dirty bits of one RAM block into
+ * the migration bitmap takes, for a range of guest RAM sizes and dirty
+ * page ratios.  "page" is the per-page loop that migration used for RAM
+ * blocks not aligned to a bitmap word, "word" is
+ * bitmap_sync_and_clear_atomic() as used by
+ * cpu_physical_memory_sync_dirty_bitmap().  The block starts one page
+ * into the bitmap, so it is not word aligned.
+ *
+ * Usage: bitmap-sync-bench [-r repetitions]
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/bitmap.h"
+
+#define BENCH_PAGE_BITS 12
+
+static const int ram_gb[] = { 1, 4, 16, 64 };
+static const int dirty_permille[] = { 0, 10, 1000 };
+
+/* What migration_bitmap_sync_range() did for unaligned blocks */
+static long sync_page(unsigned long *dst, unsigned long *src,
+                      long start, long nr)
+{
+    long count = 0;
+    long i;
+
+    for (i = start; i < start + nr; i++) {
+        if (test_bit(i, src)) {
+            clear_bit(i, src);
+            if (!test_and_set_bit(i, dst)) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+static long sync_word(unsigned long *dst, unsigned long *src,
+                      long start, long nr)
+{
+    bool cleared;
+
+    return bitmap_sync_and_clear_atomic(dst, src, start, nr, &cleared);
+}
+
+static void dirty(unsigned long *src, long start, long nr, int permille)
+{
+    long i;
+
+    if (permille == 1000) {
+        bitmap_set(src, start, nr);
+        return;
+    }
+    for (i = 0; i < nr * permille / 1000; i++) {
+        set_bit(start + g_random_int_range(0, nr), src);
+    }
+}
+
+/* Returns the fastest of @reps syncs in microseconds */
+static double run(long (*sync)(unsigned long *, unsigned long *, long, long),
+                  unsigned long *dst, unsigned long *src, long nr,
+                  int permille, int reps)
+{
+    int64_t best = INT64_MAX;
+    int i;
+
+    for (i = 0; i < reps; i++) {
+        int64_t start;
+
+        bitmap_zero(dst, nr + 1);
+        bitmap_zero(src, nr + 1);
+        dirty(src, 1, nr, permille);
+
+        start = get_clock();
+        sync(dst, src, 1, nr);
+        best = MIN(best, get_clock() - start);
+    }
+    return best / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long *src, *dst;
+    int reps = 5;
+    int i, j, c;
+
+    while ((c = getopt(argc, argv, "r:")) != -1) {
+        switch (c) {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r repetitions]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    g_random_set_seed(1);
+    printf("%8s %8s %12s %12s   (us)\n", "RAM", "dirty", "page", "word");
+    for (i = 0; i < ARRAY_SIZE(ram_gb); i++) {
+        long nr = (long)ram_gb[i] << (30 - BENCH_PAGE_BITS);
+
+        src = bitmap_new(nr + 1);
+        dst = bitmap_new(nr + 1);
+        for (j = 0; j < ARRAY_SIZE(dirty_permille); j++) {
+            printf("%6d G %7.1f%%", ram_gb[i], dirty_permille[j] / 10.0);
+            printf(" %12.0f", run(sync_page, dst, src, nr,
+                                  dirty_permille[j], reps));
+            printf(" %12.0f", run(sync_word, dst, src, nr,
+                                  dirty_permille[j], reps));
+            printf("\n");
+            fflush(stdout);
+        }
+        g_free(src);
+        g_free(dst);
+    }
+    return 0;
+}
@@ -0,0 +1,386 @@
+/*
+ * libqos virtio driver
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "hw/pci/pci_regs.h"
+#include "qemu-common.h"
+
+/* Legacy virtio-pci I/O registers, without MSI-X */
+#define VIRTIO_PCI_HOST_FEATURES        0
+#define VIRTIO_PCI_GUEST_FEATURES       4
+#define VIRTIO_PCI_QUEUE_PFN            8
+#define VIRTIO_PCI_QUEUE_NUM            12
+#define VIRTIO_PCI_QUEUE_SEL            14
+#define VIRTIO_PCI_QUEUE_NOTIFY         16
+#define VIRTIO_PCI_STATUS               18
+#define VIRTIO_PCI_CONFIG               20
+
+#define VIRTIO_PCI_VENDOR_ID            0x1af4
+
+#define VRING_DESC_F_NEXT               1
+#define VRING_DESC_F_WRITE              2
+#define VRING_DESC_F_INDIRECT           4
+#define VRING_PACKED_DESC_F_AVAIL       (1 << 7)
+#define VRING_PACKED_DESC_F_USED        (1 << 15)
+
+/* Both layouts use 16 byte descriptors */
+#define VRING_DESC_SIZE                 16
+#define VRING_DESC_ADDR                 0
+#define VRING_DESC_LEN                  8
+#define VRING_DESC_FLAGS                12      /* split */
+#define VRING_DESC_NEXT                 14      /* split */
+#define VRING_PACKED_DESC_ID            12
+#define VRING_PACKED_DESC_FLAGS         14
+
+#define QVIRTQUEUE_TIMEOUT_US           (5 * 1000 * 1000)
+
+QVirtioPCIDevice *qvirtio_pci_device_find(QPCIBus *bus, int devfn,
+                                          uint16_t device_id)
+{
+    QVirtioPCIDevice *d;
+    QPCIDevice *pdev;
+
+    pdev = qpci_device_find(bus, devfn);
+    if (!pdev) {
+        return NULL;
+    }
+    if (qpci_config_readw(pdev, PCI_VENDOR_ID) != VIRTIO_PCI_VENDOR_ID ||
+        qpci_config_readw(pdev, PCI_DEVICE_ID) != device_id) {
+        g_free(pdev);
+        return NULL;
+    }
+
+    d = g_new0(QVirtioPCIDevice, 1);
+    d->pdev = pdev;
+    d->addr = qpci_iomap(pdev, 0);
+    qpci_device_enable(pdev);
+    return d;
+}
+
+void qvirtio_pci_device_free(QVirtioPCIDevice *d)
+{
+    qpci_iounmap(d->pdev, d->addr);
+    g_free(d->pdev);
+    g_free(d);
+}
+
+uint32_t qvirtio_pci_get_features(QVirtioPCIDevice *d)
+{
+    return qpci_io_readl(d->pdev, d->addr + VIRTIO_PCI_HOST_FEATURES);
+}
+
+void qvirtio_pci_set_features(QVirtioPCIDevice *d, uint32_t features)
+{
+    qpci_io_writel(d->pdev, d->addr + VIRTIO_PCI_GUEST_FEATURES, features);
+}
+
+void qvirtio_pci_set_status(QVirtioPCIDevice *d, uint8_t status)
+{
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS, status);
+}
+
+void qvirtio_pci_reset(QVirtioPCIDevice *d)
+{
+    qvirtio_pci_set_status(d, 0);
+    g_assert_cmphex(qpci_io_readb(d->pdev, d->addr + VIRTIO_PCI_STATUS),
+                    ==, 0);
+}
+
+uint8_t qvirtio_pci_config_readb(QVirtioPCIDevice *d, int offset)
+{
+    return qpci_io_readb(d->pdev, d->addr + VIRTIO_PCI_CONFIG + offset);
+}
+
+uint32_t qvirtio_pci_config_readl(QVirtioPCIDevice *d, int offset)
+{
+    return qpci_io_readl(d->pdev, d->addr + VIRTIO_PCI_CONFIG + offset);
+}
+
+uint64_t qvirtio_pci_config_readq(QVirtioPCIDevice *d, int offset)
+{
+    return qvirtio_pci_config_readl(d, offset) |
+           (uint64_t)qvirtio_pci_config_readl(d, offset + 4) << 32;
+}
+
+static void qvirtqueue_clear(uint64_t addr, size_t len)
+{
+    void *zero = g_malloc0(len);
+
+    memwrite(addr, zero, len);
+    g_free(zero);
+}
+
+QVirtQueue *qvirtqueue_setup(QVirtioPCIDevice *d, QGuestAllocator *alloc,
+                             uint16_t index, uint32_t features)
+{
+    QVirtQueue *vq = g_new0(QVirtQueue, 1);
+    uint64_t ring, len;
+    int i;
+
+    vq->dev = d;
+    vq->index = index;
+    vq->packed = !!(features & (1u << QVIRTIO_F_RING_PACKED));
+
+    qpci_io_writew(d->pdev, d->addr + VIRTIO_PCI_QUEUE_SEL, index);
+    vq->size = qpci_io_readw(d->pdev, d->addr + VIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vq->size, >, 0);
+
+    /* Same layout as QEMU's virtqueue_init() */
+    vq->avail = vq->size * VRING_DESC_SIZE;
+    if (vq->packed) {
+        vq->used = QEMU_ALIGN_UP(vq->avail + 4, QVIRTIO_VRING_ALIGN);
+        len = vq->used + 4;
+    } else {
+        vq->used = QEMU_ALIGN_UP(vq->avail + 4 + 2 * vq->size,
+                                 QVIRTIO_VRING_ALIGN);
+        len = vq->used + 4 + 8 * vq->size + 2;
+    }
+    ring = guest_alloc(alloc, len + QVIRTIO_VRING_ALIGN);
+    ring = QEMU_ALIGN_UP(ring, QVIRTIO_VRING_ALIGN);
+    qvirtqueue_clear(ring, len);
+    vq->desc = ring;
+    vq->avail += ring;
+    vq->used += ring;
+
+    vq->num_free = vq->size;
+    vq->avail_wrap = vq->used_wrap = true;
+    vq->ndescs = g_new0(uint16_t, vq->size);
+    vq->next_id = g_new0(uint16_t, vq->size);
+    for (i = 0; i < vq->size; i++) {
+        vq->next_id[i] = i + 1;
+    }
+
+    qpci_io_writel(d->pdev, d->addr + VIRTIO_PCI_QUEUE_PFN,
+                   ring / QVIRTIO_VRING_ALIGN);
+    return vq;
+}
+
+void qvirtqueue_free(QVirtQueue *vq)
+{
+    g_free(vq->ndescs);
+    g_free(vq->next_id);
+    g_free(vq);
+}
+
+static void qvring_desc_write(uint64_t pa, uint64_t addr, uint32_t len)
+{
+    writeq(pa + VRING_DESC_ADDR, addr);
+    writel(pa + VRING_DESC_LEN, len);
+}
+
+/* An indirect table in the layout of @vq; the packed one ignores NEXT */
+static uint64_t qvirtqueue_indirect_table(QVirtQueue *vq,
+                                          QGuestAllocator *alloc,
+                                          const QVirtioSg *sg, int num)
+{
+    uint64_t table = guest_alloc(alloc, num * VRING_DESC_SIZE);
+    int i;
+
+    for (i = 0; i < num; i++) {
+        uint64_t pa = table + i * VRING_DESC_SIZE;
+        uint16_t flags = sg[i].write ? VRING_DESC_F_WRITE : 0;
+
+        qvring_desc_write(pa, sg[i].addr, sg[i].len);
+        if (vq->packed) {
+            writew(pa + VRING_PACKED_DESC_ID, 0);
+            writew(pa + VRING_PACKED_DESC_FLAGS, flags);
+        } else {
+            if (i + 1 < num) {
+                flags |= VRING_DESC_F_NEXT;
+            }
+            writew(pa + VRING_DESC_FLAGS, flags);
+            writew(pa + VRING_DESC_NEXT, i + 1);
+        }
+    }
+    return table;
+}
+
+/*
+ * The descriptors of the ring: one per element of @sg, or one for the
+ * indirect @table of @num elements.
+ */
+static uint16_t qvirtqueue_add_split(QVirtQueue *vq, const QVirtioSg *sg,
+                                     int num, uint64_t table)
+{
+    uint32_t table_len = num * VRING_DESC_SIZE;
+    uint16_t head = vq->free_head, i = head;
+    int n;
+
+    if (table) {
+        num = 1;
+    }
+    for (n = 0; n < num; n++) {
+        uint64_t pa = vq->desc + i * VRING_DESC_SIZE;
+        uint16_t flags;
+
+        if (table) {
+            qvring_desc_write(pa, table, table_len);
+            flags = VRING_DESC_F_INDIRECT;
+        } else {
+            qvring_desc_write(pa, sg[n].addr, sg[n].len);
+            flags = sg[n].write ? VRING_DESC_F_WRITE : 0;
+        }
+        if (n + 1 < num) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+        writew(pa + VRING_DESC_FLAGS, flags);
+        writew(pa + VRING_DESC_NEXT, vq->next_id[i]);
+        if (n + 1 < num) {
+            i = vq->next_id[i];
+        }
+    }
+    vq->free_head = vq->next_id[i];
+    vq->ndescs[head] = num;
+    vq->num_free -= num;
+
+    writew(vq->avail + 4 + 2 * (vq->avail_idx % vq->size), head);
+    /* qtest accesses are ordered, the entry is visible before the index */
+    writew(vq->avail + 2, ++vq->avail_idx);
+    return head;
+}
+
+static uint16_t qvirtqueue_add_packed(QVirtQueue *vq, const QVirtioSg *sg,
+                                      int num, uint64_t table)
+{
+    uint32_t table_len = num * VRING_DESC_SIZE;
+    uint16_t id = vq->free_id, head = vq->avail_idx, head_flags = 0;
+    int n;
+
+    vq->free_id = vq->next_id[id];
+    if (table) {
+        num = 1;
+    }
+    for (n = 0; n < num; n++) {
+        uint64_t pa = vq->desc + vq->avail_idx * VRING_DESC_SIZE;
+        uint16_t flags;
+
+        if (table) {
+            qvring_desc_write(pa, table, table_len);
+            flags = VRING_DESC_F_INDIRECT;
+        } else {
+            qvring_desc_write(pa, sg[n].addr, sg[n].len);
+            flags = sg[n].write ? VRING_DESC_F_WRITE : 0;
+        }
+        if (n + 1 < num) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+        flags |= vq->avail_wrap ? VRING_PACKED_DESC_F_AVAIL
+                                : VRING_PACKED_DESC_F_USED;
+        writew(pa + VRING_PACKED_DESC_ID, id);
+
+        /* The head goes last, it makes the whole chain available */
+        if (n) {
+            writew(pa + VRING_PACKED_DESC_FLAGS, flags);
+        } else {
+            head_flags = flags;
+        }
+        if (++vq->avail_idx == vq->size) {
+            vq->avail_idx = 0;
+            vq->avail_wrap = !vq->avail_wrap;
+        }
+    }
+    writew(vq->desc + head * VRING_DESC_SIZE + VRING_PACKED_DESC_FLAGS,
+           head_flags);
+
+    vq->ndescs[id] = num;
+    vq->num_free -= num;
+    return id;
+}
+
+/*
+ * Makes the buffers of a request available, in an indirect table if asked
+ * to, and returns the buffer id.  The device isn't notified.
+ */
+uint16_t qvirtqueue_add(QVirtQueue *vq, QGuestAllocator *alloc,
+                        const QVirtioSg *sg, int num, bool indirect)
+{
+    uint64_t table = 0;
+
+    g_assert_cmpint(num, >, 0);
+    g_assert_cmpint(vq->num_free, >=, indirect ? 1 : num);
+    if (indirect) {
+        table = qvirtqueue_indirect_table(vq, alloc, sg, num);
+    }
+
+    if (vq->packed) {
+        return qvirtqueue_add_packed(vq, sg, num, table);
+    }
+    return qvirtqueue_add_split(vq, sg, num, table);
+}
+
+void qvirtqueue_kick(QVirtQueue *vq)
+{
+    qpci_io_writew(vq->dev->pdev, vq->dev->addr + VIRTIO_PCI_QUEUE_NOTIFY,
+                   vq->index);
+}
+
+/* Returns the next used buffer, if there is one, and frees its descriptors */
+bool qvirtqueue_get_used(QVirtQueue *vq, uint16_t *id, uint32_t *len)
+{
+    uint16_t i;
+    int n;
+
+    if (vq->packed) {
+        uint64_t pa = vq->desc + vq->last_used_idx * VRING_DESC_SIZE;
+        uint16_t flags = readw(pa + VRING_PACKED_DESC_FLAGS);
+
+        if (!!(flags & VRING_PACKED_DESC_F_AVAIL) != vq->used_wrap ||
+            !!(flags & VRING_PACKED_DESC_F_USED) != vq->used_wrap) {
+            return false;
+        }
+        *id = readw(pa + VRING_PACKED_DESC_ID);
+        *len = readl(pa + VRING_DESC_LEN);
+        g_assert_cmpint(*id, <, vq->size);
+        g_assert_cmpint(vq->ndescs[*id], >, 0);
+
+        vq->last_used_idx += vq->ndescs[*id];
+        if (vq->last_used_idx >= vq->size) {
+            vq->last_used_idx -= vq->size;
+            vq->used_wrap = !vq->used_wrap;
+        }
+        vq->next_id[*id] = vq->free_id;
+        vq->free_id = *id;
+    } else {
+        uint64_t elem;
+
+        if (readw(vq->used + 2) == vq->last_used_idx) {
+            return false;
+        }
+        elem = vq->used + 4 + 8 * (vq->last_used_idx % vq->size);
+        *id = readl(elem);
+        *len = readl(elem + 4);
+        g_assert_cmpint(*id, <, vq->size);
+        g_assert_cmpint(vq->ndescs[*id], >, 0);
+        vq->last_used_idx++;
+
+        /* The chain is still linked through next_id */
+        for (i = *id, n = 1; n < vq->ndescs[*id]; n++) {
+            i = vq->next_id[i];
+        }
+        vq->next_id[i] = vq->free_head;
+        vq->free_head = *id;
+    }
+
+    vq->num_free += vq->ndescs[*id];
+    vq->ndescs[*id] = 0;
+    return true;
+}
+
+void qvirtqueue_wait_used(QVirtQueue *vq, uint16_t *id, uint32_t *len)
+{
+    gint64 end = g_get_monotonic_time() + QVIRTQUEUE_TIMEOUT_US;
+
+    while (!qvirtqueue_get_used(vq, id, len)) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(100);
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * libqos virtio driver
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_H
+#define LIBQOS_VIRTIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "libqos/malloc.h"
+#include "libqos/pci.h"
+
+#define QVIRTIO_F_NOTIFY_ON_EMPTY       24
+#define QVIRTIO_F_INDIRECT_DESC         28
+#define QVIRTIO_F_EVENT_IDX             29
+#define QVIRTIO_F_RING_PACKED           31
+
+#define QVIRTIO_STATUS_ACKNOWLEDGE      0x1
+#define QVIRTIO_STATUS_DRIVER           0x2
+#define QVIRTIO_STATUS_DRIVER_OK        0x4
+
+#define QVIRTIO_VRING_ALIGN             4096
+
+/* A legacy virtio-pci device, driven through its I/O BAR without MSI-X */
+typedef struct QVirtioPCIDevice {
+    QPCIDevice *pdev;
+    void *addr;
+} QVirtioPCIDevice;
+
+/* One guest buffer of a request */
+typedef struct QVirtioSg {
+    uint64_t addr;
+    uint32_t len;
+    bool write;                 /* written by the device */
+} QVirtioSg;
+
+/*
+ * A virtqueue in guest memory, in the split or in the packed layout as
+ * negotiated.  Buffers are identified by the id qvirtqueue_add() returns:
+ * the head descriptor for the split layout, a free id for the packed one.
+ */
+typedef struct QVirtQueue {
+    QVirtioPCIDevice *dev;
+    uint16_t index;
+    uint16_t size;
+    bool packed;
+    uint64_t desc;
+    uint64_t avail;             /* packed: driver event suppression */
+    uint64_t used;              /* packed: device event suppression */
+    uint16_t num_free;
+    uint16_t free_head;         /* split: first free descriptor */
+    uint16_t avail_idx;         /* packed: next slot, else free running */
+    uint16_t last_used_idx;     /* packed: next slot, else free running */
+    bool avail_wrap;
+    bool used_wrap;
+    uint16_t *ndescs;           /* descriptors taken by each buffer id */
+    uint16_t *next_id;          /* packed: list of free buffer ids */
+    uint16_t free_id;
+} QVirtQueue;
+
+QVirtioPCIDevice *qvirtio_pci_device_find(QPCIBus *bus, int devfn,
+                                          uint16_t device_id);
+void qvirtio_pci_device_free(QVirtioPCIDevice *d);
+
+uint32_t qvirtio_pci_get_features(QVirtioPCIDevice *d);
+void qvirtio_pci_set_features(QVirtioPCIDevice *d, uint32_t features);
+void qvirtio_pci_set_status(QVirtioPCIDevice *d, uint8_t status);
+void qvirtio_pci_reset(QVirtioPCIDevice *d);
+uint8_t qvirtio_pci_config_readb(QVirtioPCIDevice *d, int offset);
+uint32_t qvirtio_pci_config_readl(QVirtioPCIDevice *d, int offset);
+uint64_t qvirtio_pci_config_readq(QVirtioPCIDevice *d, int offset);
+
+QVirtQueue *qvirtqueue_setup(QVirtioPCIDevice *d, QGuestAllocator *alloc,
+                             uint16_t index, uint32_t features);
+void qvirtqueue_free(QVirtQueue *vq);
+
+uint16_t qvirtqueue_add(QVirtQueue *vq, QGuestAllocator *alloc,
+                        const QVirtioSg *sg, int num, bool indirect);
+void qvirtqueue_kick(QVirtQueue *vq);
+bool qvirtqueue_get_used(QVirtQueue *vq, uint16_t *id, uint32_t *len);
+void qvirtqueue_wait_used(QVirtQueue *vq, uint16_t *id, uint32_t *len);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * QEMUFile socket streaming benchmark
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Streams guest-page sized chunks over a unix socketpair the way RAM
+ * migration does: a small header through the buffer and the page itself
+ * by reference through the iovec.  A child process discards the data, so
+ * this measures the cost of the sending side.
+ *
+ * Usage: qemu-file-bench [-n pages]
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "migration/qemu-file.h"
+#include "block/coroutine.h"
+
+#define PAGE_SIZE_BENCH 4096
+
+/* Only the sending side is used, so this is never called */
+void yield_until_fd_readable(int fd)
+{
+    abort();
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t page[PAGE_SIZE_BENCH];
+    int64_t start, end;
+    long pages = 256 * 1024;
+    QEMUFile *f;
+    double secs;
+    pid_t pid;
+    int sv[2];
+    long i;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            pages = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n pages]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        char buf[65536];
+
+        close(sv[0]);
+        while (read(sv[1], buf, sizeof(buf)) > 0) {
+            /* discard */
+        }
+        _exit(0);
+    }
+    close(sv[1]);
+
+    memset(page, 0x5a, sizeof(page));
+    f = qemu_fopen_socket(sv[0], "wb");
+
+    start = get_clock();
+    for (i = 0; i < pages; i++) {
+        qemu_put_be64(f, (uint64_t)i * PAGE_SIZE_BENCH);
+        qemu_put_buffer_async(f, page, PAGE_SIZE_BENCH);
+    }
+    qemu_fflush(f);
+    end = get_clock();
+
+    if (qemu_file_get_error(f)) {
+        fprintf(stderr, "stream failed: %s\n",
+                strerror(-qemu_file_get_error(f)));
+        return 1;
+    }
+    qemu_fclose(f);
+    waitpid(pid, NULL, 0);
+
+    secs = (double)(end - start) / 1000000000;
+    printf("%ld pages in %.3f s, %.1f MB/s\n", pages, secs,
+           pages * (double)(PAGE_SIZE_BENCH + 8) / (1024 * 1024) / secs);
+    return 0;
+}
@@ -0,0 +1,460 @@
+/*
+ * TCP throughput benchmark for the user mode network stack
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The benchmark plays the guest side of a TCP connection through slirp to a
+ * socket on the host loopback interface and measures how much data gets
+ * across in either direction.  No guest and no network device is involved,
+ * so the result is the cost of slirp itself.
+ *
+ * Usage: slirp-bench [-o] [-r] [-t seconds]
+ *
+ *   -o  use offloads: the guest sends 64 KB segments without checksums and
+ *       slirp may send segments of up to 64 KB to the guest
+ *   -r  measure host to guest instead of guest to host throughput
+ *   -t  duration of the measurement (default: 5 seconds)
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "qemu/bswap.h"
+#include "net/checksum.h"
+#include "slirp/libslirp.h"
+#include "sysemu/char.h"
+#include "migration/vmstate.h"
+
+#define ETH_HLEN        14
+#define IP_HLEN         20
+#define TCP_HLEN        20
+#define HDR_LEN         (ETH_HLEN + IP_HLEN + TCP_HLEN)
+
+#define MSS             1460
+#define GSO_SIZE        (44 * MSS)
+#define GUEST_PORT      40000
+#define GUEST_WINDOW    65535
+
+#define TH_FIN  0x01
+#define TH_SYN  0x02
+#define TH_PUSH 0x08
+#define TH_ACK  0x10
+
+enum {
+    TCP_CLOSED,
+    TCP_SYN_SENT,
+    TCP_ESTABLISHED,
+};
+
+typedef struct Bench {
+    Slirp *slirp;
+    bool offload;
+    bool to_guest;
+
+    uint8_t guest_mac[6];
+    uint8_t host_mac[6];
+    struct in_addr guest_ip;
+    struct in_addr host_ip;
+    bool arp_reply_pending;
+
+    int listen_fd;
+    int host_fd;
+    int host_port;
+
+    /* guest TCP connection */
+    int state;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_wnd;
+    uint32_t rcv_nxt;
+    bool ack_pending;
+
+    /* statistics */
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t large_frames;
+
+    uint8_t frame[HDR_LEN + GSO_SIZE];
+    uint8_t host_buf[65536];
+} Bench;
+
+/* Stubs for what slirp needs from the rest of QEMU */
+
+int register_savevm(DeviceState *dev, const char *idstr, int instance_id,
+                    int version_id, SaveStateHandler *save_state,
+                    LoadStateHandler *load_state, void *opaque)
+{
+    return 0;
+}
+
+void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
+{
+}
+
+int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
+{
+    return len;
+}
+
+static void fill_eth(Bench *b, uint8_t *f, uint16_t proto)
+{
+    memcpy(f, b->host_mac, 6);
+    memcpy(f + 6, b->guest_mac, 6);
+    stw_be_p(f + 12, proto);
+}
+
+static void send_arp(Bench *b, uint16_t op, const uint8_t *tha,
+                     struct in_addr tip)
+{
+    uint8_t f[ETH_HLEN + 28];
+    uint8_t *arp = f + ETH_HLEN;
+
+    fill_eth(b, f, 0x0806);
+    if (op == 1) {
+        memset(f, 0xff, 6);
+    }
+    stw_be_p(arp, 1);
+    stw_be_p(arp + 2, 0x0800);
+    arp[4] = 6;
+    arp[5] = 4;
+    stw_be_p(arp + 6, op);
+    memcpy(arp + 8, b->guest_mac, 6);
+    memcpy(arp + 14, &b->guest_ip, 4);
+    memcpy(arp + 18, tha, 6);
+    memcpy(arp + 24, &tip, 4);
+
+    slirp_input(b->slirp, f, sizeof(f), 0);
+}
+
+/*
+ * Sends a TCP segment with the given flags and len bytes of payload, which
+ * is expected in b->frame already.
+ */
+static void send_tcp(Bench *b, uint8_t flags, int len)
+{
+    uint8_t *f = b->frame;
+    uint8_t *ip = f + ETH_HLEN;
+    uint8_t *tcp = ip + IP_HLEN;
+    int opt_len = (flags & TH_SYN) ? 4 : 0;
+    int tcp_len = TCP_HLEN + opt_len + len;
+
+    fill_eth(b, f, 0x0800);
+
+    ip[0] = 0x45;
+    ip[1] = 0;
+    stw_be_p(ip + 2, IP_HLEN + tcp_len);
+    stw_be_p(ip + 4, 0);
+    stw_be_p(ip + 6, 0x4000);
+    ip[8] = 64;
+    ip[9] = 6;
+    stw_be_p(ip + 10, 0);
+    memcpy(ip + 12, &b->guest_ip, 4);
+    memcpy(ip + 16, &b->host_ip, 4);
+    stw_be_p(ip + 10, net_raw_checksum(ip, IP_HLEN));
+
+    stw_be_p(tcp, GUEST_PORT);
+    stw_be_p(tcp + 2, b->host_port);
+    stl_be_p(tcp + 4, b->snd_nxt);
+    stl_be_p(tcp + 8, (flags & TH_ACK) ? b->rcv_nxt : 0);
+    tcp[12] = ((TCP_HLEN + opt_len) / 4) << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, GUEST_WINDOW);
+    stw_be_p(tcp + 16, 0);
+    stw_be_p(tcp + 18, 0);
+    if (opt_len) {
+        /* The payload of a SYN is empty, so the MSS option can go there */
+        tcp[20] = 2;
+        tcp[21] = 4;
+        stw_be_p(tcp + 22, MSS);
+    }
+
+    /* With offloads, the guest leaves the checksum to the device */
+    if (!b->offload) {
+        stw_be_p(tcp + 16, net_checksum_tcpudp(tcp_len, 6, ip + 12, tcp));
+    }
+
+    slirp_input(b->slirp, f, ETH_HLEN + IP_HLEN + tcp_len,
+                b->offload ? SLIRP_INPUT_CSUM_VALID : 0);
+
+    if (flags & TH_SYN) {
+        b->snd_nxt++;
+    }
+    b->snd_nxt += len;
+    b->ack_pending = false;
+}
+
+static void receive_tcp(Bench *b, const uint8_t *ip, int len)
+{
+    int ip_hlen = (ip[0] & 0xf) * 4;
+    const uint8_t *tcp = ip + ip_hlen;
+    int tcp_hlen, data_len;
+    uint32_t seq, ack;
+    uint8_t flags;
+
+    if (len < ip_hlen + TCP_HLEN || lduw_be_p(tcp + 2) != GUEST_PORT) {
+        return;
+    }
+    tcp_hlen = (tcp[12] >> 4) * 4;
+    data_len = MIN(lduw_be_p(ip + 2), len) - ip_hlen - tcp_hlen;
+    seq = ldl_be_p(tcp + 4);
+    ack = ldl_be_p(tcp + 8);
+    flags = tcp[13];
+
+    switch (b->state) {
+    case TCP_SYN_SENT:
+        if ((flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK) &&
+            ack == b->snd_nxt) {
+            b->rcv_nxt = seq + 1;
+            b->snd_una = ack;
+            b->snd_wnd = lduw_be_p(tcp + 14);
+            b->state = TCP_ESTABLISHED;
+            b->ack_pending = true;
+        }
+        break;
+    case TCP_ESTABLISHED:
+        if ((flags & TH_ACK) && (int32_t)(ack - b->snd_una) >= 0) {
+            b->snd_una = ack;
+            b->snd_wnd = lduw_be_p(tcp + 14);
+        }
+        if (data_len > 0) {
+            if (seq == b->rcv_nxt) {
+                b->rcv_nxt += data_len;
+                b->bytes += data_len;
+            }
+            b->ack_pending = true;
+        }
+        break;
+    }
+}
+
+void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len,
+                  const SlirpOffload *offload)
+{
+    Bench *b = opaque;
+
+    if (pkt_len < ETH_HLEN) {
+        return;
+    }
+
+    b->frames++;
+    if (offload && offload->gso_size) {
+        b->large_frames++;
+    }
+
+    switch (lduw_be_p(pkt + 12)) {
+    case 0x0806:
+        if (pkt_len >= ETH_HLEN + 28 &&
+            !memcmp(pkt + ETH_HLEN + 24, &b->guest_ip, 4)) {
+            memcpy(b->host_mac, pkt + ETH_HLEN + 8, 6);
+            /* Answered after slirp has returned */
+            b->arp_reply_pending = lduw_be_p(pkt + ETH_HLEN + 6) == 1;
+        }
+        break;
+    case 0x0800:
+        if (pkt_len >= ETH_HLEN + IP_HLEN && pkt[ETH_HLEN + 9] == 6) {
+            receive_tcp(b, pkt + ETH_HLEN, pkt_len - ETH_HLEN);
+        }
+        break;
+    }
+}
+
+static void guest_send(Bench *b)
+{
+    uint32_t in_flight, len;
+
+    if (b->arp_reply_pending) {
+        b->arp_reply_pending = false;
+        send_arp(b, 2, b->host_mac, b->host_ip);
+    }
+    if (b->state != TCP_ESTABLISHED) {
+        return;
+    }
+
+    if (!b->to_guest) {
+        for (;;) {
+            in_flight = b->snd_nxt - b->snd_una;
+            if (in_flight >= b->snd_wnd) {
+                break;
+            }
+            len = MIN(b->snd_wnd - in_flight, b->offload ? GSO_SIZE : MSS);
+            send_tcp(b, TH_ACK | TH_PUSH, len);
+        }
+    }
+
+    if (b->ack_pending) {
+        send_tcp(b, TH_ACK, 0);
+    }
+}
+
+static void host_io(Bench *b, GPollFD *pfd)
+{
+    ssize_t ret;
+
+    if (pfd->fd == b->listen_fd) {
+        if (pfd->revents & G_IO_IN) {
+            b->host_fd = qemu_accept(b->listen_fd, NULL, NULL);
+            if (b->host_fd >= 0) {
+                qemu_set_nonblock(b->host_fd);
+            }
+        }
+        return;
+    }
+
+    if (b->to_guest && (pfd->revents & G_IO_OUT)) {
+        do {
+            ret = write(b->host_fd, b->host_buf, sizeof(b->host_buf));
+        } while (ret > 0);
+    } else if (!b->to_guest && (pfd->revents & G_IO_IN)) {
+        do {
+            ret = read(b->host_fd, b->host_buf, sizeof(b->host_buf));
+            if (ret > 0) {
+                b->bytes += ret;
+            }
+        } while (ret > 0);
+    }
+}
+
+static void bench_poll(Bench *b)
+{
+    GArray *pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    uint32_t timeout = 100;
+    int host_idx = -1;
+    int ret;
+
+    slirp_pollfds_fill(pollfds, &timeout);
+
+    if (b->host_fd >= 0 || b->listen_fd >= 0) {
+        GPollFD pfd = {
+            .fd = b->host_fd >= 0 ? b->host_fd : b->listen_fd,
+            .events = b->host_fd < 0 ? G_IO_IN :
+                      b->to_guest ? G_IO_OUT : G_IO_IN,
+        };
+        host_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+
+    ret = g_poll((GPollFD *)pollfds->data, pollfds->len, timeout);
+    slirp_pollfds_poll(pollfds, ret < 0);
+
+    if (ret > 0 && host_idx >= 0) {
+        host_io(b, &g_array_index(pollfds, GPollFD, host_idx));
+    }
+
+    guest_send(b);
+
+    g_array_free(pollfds, TRUE);
+}
+
+static int host_listen(Bench *b)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+
+    b->listen_fd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+    if (b->listen_fd < 0 ||
+        bind(b->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(b->listen_fd, 1) < 0 ||
+        getsockname(b->listen_fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        return -errno;
+    }
+
+    b->host_port = ntohs(addr.sin_port);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static Bench bench;
+    Bench *b = &bench;
+    struct in_addr net = { .s_addr = htonl(0x0a000200) };
+    struct in_addr mask = { .s_addr = htonl(0xffffff00) };
+    struct in_addr dhcp = { .s_addr = htonl(0x0a00020f) };
+    struct in_addr dns = { .s_addr = htonl(0x0a000203) };
+    static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+    static const uint8_t zero_mac[6];
+    int64_t start, end, deadline;
+    int seconds = 5;
+    double secs;
+    int c;
+
+    while ((c = getopt(argc, argv, "ort:")) != -1) {
+        switch (c) {
+        case 'o':
+            b->offload = true;
+            break;
+        case 'r':
+            b->to_guest = true;
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o] [-r] [-t seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    socket_init();
+
+    memcpy(b->guest_mac, guest_mac, 6);
+    b->guest_ip = dhcp;
+    b->host_ip.s_addr = htonl(0x0a000202);
+    b->host_fd = -1;
+    memset(b->frame + HDR_LEN, 0x5a, GSO_SIZE);
+    memset(b->host_buf, 0xa5, sizeof(b->host_buf));
+
+    if (host_listen(b) < 0) {
+        perror("Could not listen on the loopback interface");
+        return 1;
+    }
+
+    b->slirp = slirp_init(0, net, mask, b->host_ip, NULL, NULL, NULL, dhcp,
+                          dns, NULL, b);
+    slirp_set_offload(b->slirp, b->offload, b->offload);
+
+    /* Let slirp know the guest's MAC address and learn its own */
+    send_arp(b, 1, zero_mac, b->host_ip);
+
+    b->snd_nxt = 1000;
+    b->state = TCP_SYN_SENT;
+    send_tcp(b, TH_SYN, 0);
+
+    deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 5000;
+    while (b->state != TCP_ESTABLISHED || b->host_fd < 0) {
+        if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+            fprintf(stderr, "Could not establish the connection\n");
+            return 1;
+        }
+        bench_poll(b);
+    }
+
+    b->bytes = b->frames = b->large_frames = 0;
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    deadline = start + seconds * 1000000000LL;
+    do {
+        bench_poll(b);
+        end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    } while (end < deadline);
+
+    secs = (end - start) / 1e9;
+    printf("%s, offloads %s: %" PRIu64 " bytes in %.2f s, %.1f Mbit/s\n",
+           b->to_guest ? "host -> guest" : "guest -> host",
+           b->offload ? "on" : "off", b->bytes, secs,
+           b->bytes * 8 / secs / 1e6);
+    printf("%" PRIu64 " frames to the guest, %" PRIu64 " of them large\n",
+           b->frames, b->large_frames);
+
+    closesocket(b->host_fd);
+    closesocket(b->listen_fd);
+    slirp_cleanup(b->slirp);
+
+    return 0;
+}
@@ -0,0 +1,572 @@
+/*
+ * Parallel TCP stream benchmark for multiqueue user mode networking
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Like slirp-bench, but the guest side runs several TCP connections at once,
+ * each to its own socket on the host loopback interface.  The streams are
+ * spread over a number of slirp instances, one per queue, the way -netdev
+ * user,queues=N steers flows; every instance is attached to an AioContext
+ * of its own that a separate thread polls, as the IOThread of a virtio-net
+ * queue pair with x-data-plane=on would.  Comparing -q 1 with -q N for the
+ * same number of streams shows how far the queues scale.
+ *
+ * Usage: slirp-mq-bench [-o] [-r] [-n streams] [-q queues] [-t seconds]
+ *
+ *   -o  use offloads: the guest sends 64 KB segments without checksums and
+ *       slirp may send segments of up to 64 KB to the guest
+ *   -r  measure host to guest instead of guest to host throughput
+ *   -n  number of parallel TCP streams (default: 4)
+ *   -q  number of queues, each with its own slirp instance and thread
+ *       (default: 4)
+ *   -t  duration of the measurement (default: 5 seconds)
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "qemu/bswap.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "block/aio.h"
+#include "net/checksum.h"
+#include "slirp/libslirp.h"
+#include "sysemu/char.h"
+#include "migration/vmstate.h"
+
+#define ETH_HLEN        14
+#define IP_HLEN         20
+#define TCP_HLEN        20
+#define HDR_LEN         (ETH_HLEN + IP_HLEN + TCP_HLEN)
+
+#define MSS             1460
+#define GSO_SIZE        (44 * MSS)
+#define GUEST_PORT      40000
+#define GUEST_WINDOW    65535
+#define MAX_STREAMS     256
+
+#define TH_FIN  0x01
+#define TH_SYN  0x02
+#define TH_PUSH 0x08
+#define TH_ACK  0x10
+
+enum {
+    TCP_CLOSED,
+    TCP_SYN_SENT,
+    TCP_ESTABLISHED,
+};
+
+typedef struct Queue Queue;
+
+typedef struct Stream {
+    Queue *q;
+    int guest_port;
+
+    int listen_fd;
+    int host_fd;
+    int host_port;
+
+    /* guest TCP connection */
+    int state;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_wnd;
+    uint32_t rcv_nxt;
+    bool ack_pending;
+
+    uint64_t bytes;             /* read by the main thread */
+
+    uint8_t frame[HDR_LEN + GSO_SIZE];
+    uint8_t host_buf[65536];
+} Stream;
+
+struct Queue {
+    Slirp *slirp;
+    AioContext *ctx;
+    QemuThread thread;
+    uint8_t host_mac[6];
+    bool arp_reply_pending;
+    Stream *streams[MAX_STREAMS];
+    int num_streams;
+};
+
+static bool offload;
+static bool to_guest;
+static bool stopping;
+static Stream *streams[MAX_STREAMS];
+static int num_streams = 4;
+
+static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+static struct in_addr guest_ip;
+static struct in_addr host_ip;
+
+/* Stubs for what slirp needs from the rest of QEMU */
+
+int register_savevm(DeviceState *dev, const char *idstr, int instance_id,
+                    int version_id, SaveStateHandler *save_state,
+                    LoadStateHandler *load_state, void *opaque)
+{
+    return 0;
+}
+
+void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
+{
+}
+
+int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
+{
+    return len;
+}
+
+static void fill_eth(Queue *q, uint8_t *f, uint16_t proto)
+{
+    memcpy(f, q->host_mac, 6);
+    memcpy(f + 6, guest_mac, 6);
+    stw_be_p(f + 12, proto);
+}
+
+static void send_arp(Queue *q, uint16_t op, const uint8_t *tha,
+                     struct in_addr tip)
+{
+    uint8_t f[ETH_HLEN + 28];
+    uint8_t *arp = f + ETH_HLEN;
+
+    fill_eth(q, f, 0x0806);
+    if (op == 1) {
+        memset(f, 0xff, 6);
+    }
+    stw_be_p(arp, 1);
+    stw_be_p(arp + 2, 0x0800);
+    arp[4] = 6;
+    arp[5] = 4;
+    stw_be_p(arp + 6, op);
+    memcpy(arp + 8, guest_mac, 6);
+    memcpy(arp + 14, &guest_ip, 4);
+    memcpy(arp + 18, tha, 6);
+    memcpy(arp + 24, &tip, 4);
+
+    slirp_input(q->slirp, f, sizeof(f), 0);
+}
+
+/*
+ * Sends a TCP segment with the given flags and len bytes of payload, which
+ * is expected in s->frame already.
+ */
+static void send_tcp(Stream *s, uint8_t flags, int len)
+{
+    uint8_t *f = s->frame;
+    uint8_t *ip = f + ETH_HLEN;
+    uint8_t *tcp = ip + IP_HLEN;
+    int opt_len = (flags & TH_SYN) ? 4 : 0;
+    int tcp_len = TCP_HLEN + opt_len + len;
+
+    fill_eth(s->q, f, 0x0800);
+
+    ip[0] = 0x45;
+    ip[1] = 0;
+    stw_be_p(ip + 2, IP_HLEN + tcp_len);
+    stw_be_p(ip + 4, 0);
+    stw_be_p(ip + 6, 0x4000);
+    ip[8] = 64;
+    ip[9] = 6;
+    stw_be_p(ip + 10, 0);
+    memcpy(ip + 12, &guest_ip, 4);
+    memcpy(ip + 16, &host_ip, 4);
+    stw_be_p(ip + 10, net_raw_checksum(ip, IP_HLEN));
+
+    stw_be_p(tcp, s->guest_port);
+    stw_be_p(tcp + 2, s->host_port);
+    stl_be_p(tcp + 4, s->snd_nxt);
+    stl_be_p(tcp + 8, (flags & TH_ACK) ? s->rcv_nxt : 0);
+    tcp[12] = ((TCP_HLEN + opt_len) / 4) << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, GUEST_WINDOW);
+    stw_be_p(tcp + 16, 0);
+    stw_be_p(tcp + 18, 0);
+    if (opt_len) {
+        /* The payload of a SYN is empty, so the MSS option can go there */
+        tcp[20] = 2;
+        tcp[21] = 4;
+        stw_be_p(tcp + 22, MSS);
+    }
+
+    /* With offloads, the guest leaves the checksum to the device */
+    if (!offload) {
+        stw_be_p(tcp + 16, net_checksum_tcpudp(tcp_len, 6, ip + 12, tcp));
+    }
+
+    slirp_input(s->q->slirp, f, ETH_HLEN + IP_HLEN + tcp_len,
+                offload ? SLIRP_INPUT_CSUM_VALID : 0);
+
+    if (flags & TH_SYN) {
+        s->snd_nxt++;
+    }
+    s->snd_nxt += len;
+    s->ack_pending = false;
+}
+
+static void receive_tcp(Queue *q, const uint8_t *ip, int len)
+{
+    int ip_hlen = (ip[0] & 0xf) * 4;
+    const uint8_t *tcp = ip + ip_hlen;
+    int tcp_hlen, data_len, port;
+    uint32_t seq, ack;
+    uint8_t flags;
+    Stream *s;
+
+    if (len < ip_hlen + TCP_HLEN) {
+        return;
+    }
+    port = lduw_be_p(tcp + 2);
+    if (port < GUEST_PORT || port >= GUEST_PORT + num_streams) {
+        return;
+    }
+    s = streams[port - GUEST_PORT];
+    if (s->q != q) {
+        fprintf(stderr, "Stream %d seen on the wrong queue\n",
+                port - GUEST_PORT);
+        abort();
+    }
+
+    tcp_hlen = (tcp[12] >> 4) * 4;
+    data_len = MIN(lduw_be_p(ip + 2), len) - ip_hlen - tcp_hlen;
+    seq = ldl_be_p(tcp + 4);
+    ack = ldl_be_p(tcp + 8);
+    flags = tcp[13];
+
+    switch (s->state) {
+    case TCP_SYN_SENT:
+        if ((flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK) &&
+            ack == s->snd_nxt) {
+            s->rcv_nxt = seq + 1;
+            s->snd_una = ack;
+            s->snd_wnd = lduw_be_p(tcp + 14);
+            atomic_mb_set(&s->state, TCP_ESTABLISHED);
+            s->ack_pending = true;
+        }
+        break;
+    case TCP_ESTABLISHED:
+        if ((flags & TH_ACK) && (int32_t)(ack - s->snd_una) >= 0) {
+            s->snd_una = ack;
+            s->snd_wnd = lduw_be_p(tcp + 14);
+        }
+        if (data_len > 0) {
+            if (seq == s->rcv_nxt) {
+                s->rcv_nxt += data_len;
+                atomic_set(&s->bytes, s->bytes + data_len);
+            }
+            s->ack_pending = true;
+        }
+        break;
+    }
+}
+
+void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len,
+                  const SlirpOffload *offload)
+{
+    Queue *q = opaque;
+
+    if (pkt_len < ETH_HLEN) {
+        return;
+    }
+
+    switch (lduw_be_p(pkt + 12)) {
+    case 0x0806:
+        if (pkt_len >= ETH_HLEN + 28 &&
+            !memcmp(pkt + ETH_HLEN + 24, &guest_ip, 4)) {
+            memcpy(q->host_mac, pkt + ETH_HLEN + 8, 6);
+            /* Answered after slirp has returned */
+            q->arp_reply_pending = lduw_be_p(pkt + ETH_HLEN + 6) == 1;
+        }
+        break;
+    case 0x0800:
+        if (pkt_len >= ETH_HLEN + IP_HLEN && pkt[ETH_HLEN + 9] == 6) {
+            receive_tcp(q, pkt + ETH_HLEN, pkt_len - ETH_HLEN);
+        }
+        break;
+    }
+}
+
+static void guest_send(Queue *q)
+{
+    uint32_t in_flight, len;
+    int i;
+
+    if (q->arp_reply_pending) {
+        q->arp_reply_pending = false;
+        send_arp(q, 2, q->host_mac, host_ip);
+    }
+
+    for (i = 0; i < q->num_streams; i++) {
+        Stream *s = q->streams[i];
+
+        if (s->state != TCP_ESTABLISHED) {
+            continue;
+        }
+
+        if (!to_guest) {
+            for (;;) {
+                in_flight = s->snd_nxt - s->snd_una;
+                if (in_flight >= s->snd_wnd) {
+                    break;
+                }
+                len = MIN(s->snd_wnd - in_flight, offload ? GSO_SIZE : MSS);
+                send_tcp(s, TH_ACK | TH_PUSH, len);
+            }
+        }
+
+        if (s->ack_pending) {
+            send_tcp(s, TH_ACK, 0);
+        }
+    }
+}
+
+static void host_read(void *opaque)
+{
+    Stream *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = read(s->host_fd, s->host_buf, sizeof(s->host_buf));
+        if (ret > 0) {
+            atomic_set(&s->bytes, s->bytes + ret);
+        }
+    } while (ret > 0);
+}
+
+static void host_write(void *opaque)
+{
+    Stream *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = write(s->host_fd, s->host_buf, sizeof(s->host_buf));
+    } while (ret > 0);
+}
+
+static void host_accept(void *opaque)
+{
+    Stream *s = opaque;
+    int fd;
+
+    fd = qemu_accept(s->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    qemu_set_nonblock(fd);
+    aio_set_fd_handler(s->q->ctx, s->listen_fd, NULL, NULL, NULL);
+    aio_set_fd_handler(s->q->ctx, fd, to_guest ? NULL : host_read,
+                       to_guest ? host_write : NULL, s);
+    atomic_mb_set(&s->host_fd, fd);
+}
+
+static int host_listen(Stream *s)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+
+    s->listen_fd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+    if (s->listen_fd < 0 ||
+        bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s->listen_fd, 1) < 0 ||
+        getsockname(s->listen_fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        return -errno;
+    }
+
+    qemu_set_nonblock(s->listen_fd);
+    s->host_port = ntohs(addr.sin_port);
+    return 0;
+}
+
+/* What the IOThread of one queue pair does, with the guest side added */
+static void *queue_thread(void *opaque)
+{
+    static const uint8_t zero_mac[6];
+    Queue *q = opaque;
+    int i;
+
+    aio_context_acquire(q->ctx);
+
+    /* Let slirp know the guest's MAC address and learn its own */
+    send_arp(q, 1, zero_mac, host_ip);
+
+    for (i = 0; i < q->num_streams; i++) {
+        Stream *s = q->streams[i];
+
+        aio_set_fd_handler(q->ctx, s->listen_fd, host_accept, NULL, s);
+        s->snd_nxt = 1000;
+        s->state = TCP_SYN_SENT;
+        send_tcp(s, TH_SYN, 0);
+    }
+
+    while (!atomic_mb_read(&stopping)) {
+        aio_poll(q->ctx, true);
+        guest_send(q);
+    }
+
+    aio_context_release(q->ctx);
+    return NULL;
+}
+
+static uint64_t total_bytes(uint64_t *bytes)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < num_streams; i++) {
+        bytes[i] = atomic_read(&streams[i]->bytes);
+        total += bytes[i];
+    }
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    struct in_addr net = { .s_addr = htonl(0x0a000200) };
+    struct in_addr mask = { .s_addr = htonl(0xffffff00) };
+    struct in_addr dns = { .s_addr = htonl(0x0a000203) };
+    static uint64_t start_bytes[MAX_STREAMS], end_bytes[MAX_STREAMS];
+    Queue *queues;
+    int num_queues = 4;
+    int64_t start, end, deadline;
+    int seconds = 5;
+    uint64_t total;
+    double secs;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "orn:q:t:")) != -1) {
+        switch (c) {
+        case 'o':
+            offload = true;
+            break;
+        case 'r':
+            to_guest = true;
+            break;
+        case 'n':
+            num_streams = atoi(optarg);
+            break;
+        case 'q':
+            num_queues = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (num_streams < 1 || num_streams > MAX_STREAMS ||
+        num_queues < 1 || num_queues > num_streams) {
+        goto usage;
+    }
+
+    socket_init();
+    init_clocks();
+
+    guest_ip.s_addr = htonl(0x0a00020f);
+    host_ip.s_addr = htonl(0x0a000202);
+
+    queues = g_new0(Queue, num_queues);
+    for (i = 0; i < num_queues; i++) {
+        Queue *q = &queues[i];
+
+        q->ctx = aio_context_new();
+        q->slirp = slirp_init(0, net, mask, host_ip, NULL, NULL, NULL,
+                              guest_ip, dns, NULL, q);
+        slirp_set_offload(q->slirp, offload, offload);
+        if (slirp_attach_aio_context(q->slirp, q->ctx) < 0) {
+            fprintf(stderr, "slirp needs epoll to run in an AioContext\n");
+            return 1;
+        }
+    }
+
+    /* Each flow stays on one queue; which one is up to the flow hash, here
+     * the streams are simply dealt out.
+     */
+    for (i = 0; i < num_streams; i++) {
+        Stream *s = g_new0(Stream, 1);
+        Queue *q = &queues[i % num_queues];
+
+        s->q = q;
+        s->guest_port = GUEST_PORT + i;
+        s->host_fd = -1;
+        memset(s->frame + HDR_LEN, 0x5a, GSO_SIZE);
+        memset(s->host_buf, 0xa5, sizeof(s->host_buf));
+        if (host_listen(s) < 0) {
+            perror("Could not listen on the loopback interface");
+            return 1;
+        }
+        q->streams[q->num_streams++] = s;
+        streams[i] = s;
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        qemu_thread_create(&queues[i].thread, "slirp-queue", queue_thread,
+                           &queues[i], QEMU_THREAD_JOINABLE);
+    }
+
+    deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 5000;
+    for (i = 0; i < num_streams; i++) {
+        while (atomic_mb_read(&streams[i]->state) != TCP_ESTABLISHED ||
+               atomic_mb_read(&streams[i]->host_fd) < 0) {
+            if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+                fprintf(stderr, "Could not establish stream %d\n", i);
+                return 1;
+            }
+            g_usleep(1000);
+        }
+    }
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    total_bytes(start_bytes);
+    g_usleep(seconds * G_USEC_PER_SEC);
+    total_bytes(end_bytes);
+    end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    atomic_mb_set(&stopping, true);
+    for (i = 0; i < num_queues; i++) {
+        aio_notify(queues[i].ctx);
+        qemu_thread_join(&queues[i].thread);
+    }
+
+    secs = (end - start) / 1e9;
+    total = 0;
+    for (i = 0; i < num_streams; i++) {
+        uint64_t bytes = end_bytes[i] - start_bytes[i];
+
+        printf("stream %d (queue %d): %.1f Mbit/s\n", i, i % num_queues,
+               bytes * 8 / secs / 1e6);
+        total += bytes;
+    }
+    printf("%s, offloads %s, %d streams on %d queues: "
+           "%" PRIu64 " bytes in %.2f s, %.1f Mbit/s\n",
+           to_guest ? "host -> guest" : "guest -> host",
+           offload ? "on" : "off", num_streams, num_queues,
+           total, secs, total * 8 / secs / 1e6);
+
+    for (i = 0; i < num_streams; i++) {
+        closesocket(streams[i]->host_fd);
+        closesocket(streams[i]->listen_fd);
+    }
+    for (i = 0; i < num_queues; i++) {
+        aio_context_acquire(queues[i].ctx);
+        slirp_cleanup(queues[i].slirp);
+        aio_context_release(queues[i].ctx);
+        aio_context_unref(queues[i].ctx);
+    }
+
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-o] [-r] [-n streams] [-q queues] "
+            "[-t seconds]\n", argv[0]);
+    return 1;
+}
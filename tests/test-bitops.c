@@ -9,6 +9,7 @@
 #include <glib.h>
 #include <stdint.h>
 #include "qemu/bitops.h"
+#include "qemu/bitmap.h"
 
 typedef struct {
     uint32_t value;
@@ -66,10 +67,130 @@ static void test_sextract64(void)
     }
 }
 
+#define BITMAP_TEST_BITS (BITS_PER_LONG * 4)
+
+static void check_bitmap_area(const unsigned long *map, long start, long nr)
+{
+    long i;
+
+    for (i = 0; i < BITMAP_TEST_BITS; i++) {
+        g_assert_cmpint(test_bit(i, map), ==, i >= start && i < start + nr);
+    }
+}
+
+static void test_bitmap_set_atomic(void)
+{
+    static const long ranges[][2] = {
+        { 0, 1 }, { 3, 7 }, { 0, BITS_PER_LONG }, { 5, BITS_PER_LONG - 5 },
+        { 7, BITS_PER_LONG }, { 1, 3 * BITS_PER_LONG },
+        { BITS_PER_LONG, 2 * BITS_PER_LONG }, { 0, BITMAP_TEST_BITS },
+    };
+    DECLARE_BITMAP(map, BITMAP_TEST_BITS);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        bitmap_zero(map, BITMAP_TEST_BITS);
+        bitmap_set_atomic(map, ranges[i][0], ranges[i][1]);
+        check_bitmap_area(map, ranges[i][0], ranges[i][1]);
+    }
+
+    bitmap_zero(map, BITMAP_TEST_BITS);
+    set_bit_atomic(BITS_PER_LONG + 3, map);
+    check_bitmap_area(map, BITS_PER_LONG + 3, 1);
+}
+
+static void test_bitmap_test_and_clear_atomic(void)
+{
+    static const long ranges[][2] = {
+        { 0, 1 }, { 3, 7 }, { 0, BITS_PER_LONG }, { 5, BITS_PER_LONG - 5 },
+        { 7, BITS_PER_LONG }, { 1, 3 * BITS_PER_LONG },
+        { BITS_PER_LONG, 2 * BITS_PER_LONG }, { 0, BITMAP_TEST_BITS },
+    };
+    DECLARE_BITMAP(map, BITMAP_TEST_BITS);
+    long start, nr;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        start = ranges[i][0];
+        nr = ranges[i][1];
+
+        /* Clearing the area leaves only the bits outside it */
+        bitmap_fill(map, BITMAP_TEST_BITS);
+        g_assert(bitmap_test_and_clear_atomic(map, start, nr));
+        bitmap_complement(map, map, BITMAP_TEST_BITS);
+        check_bitmap_area(map, start, nr);
+
+        /* Bits outside the area are not reported */
+        bitmap_fill(map, BITMAP_TEST_BITS);
+        bitmap_clear(map, start, nr);
+        g_assert(!bitmap_test_and_clear_atomic(map, start, nr));
+
+        /* A single bit inside the area is reported */
+        bitmap_zero(map, BITMAP_TEST_BITS);
+        set_bit(start + nr - 1, map);
+        g_assert(bitmap_test_and_clear_atomic(map, start, nr));
+        g_assert(bitmap_empty(map, BITMAP_TEST_BITS));
+    }
+}
+
+static void test_bitmap_sync_and_clear_atomic(void)
+{
+    static const long ranges[][2] = {
+        { 0, 1 }, { 3, 7 }, { 0, BITS_PER_LONG }, { 5, BITS_PER_LONG - 5 },
+        { 7, BITS_PER_LONG }, { 1, 3 * BITS_PER_LONG },
+        { BITS_PER_LONG, 2 * BITS_PER_LONG }, { 0, BITMAP_TEST_BITS },
+    };
+    DECLARE_BITMAP(src, BITMAP_TEST_BITS);
+    DECLARE_BITMAP(dst, BITMAP_TEST_BITS);
+    long start, nr;
+    bool cleared;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        start = ranges[i][0];
+        nr = ranges[i][1];
+
+        /* The area moves from src to dst, the rest of src stays */
+        bitmap_fill(src, BITMAP_TEST_BITS);
+        bitmap_zero(dst, BITMAP_TEST_BITS);
+        g_assert_cmpint(bitmap_sync_and_clear_atomic(dst, src, start, nr,
+                                                     &cleared), ==, nr);
+        g_assert(cleared);
+        check_bitmap_area(dst, start, nr);
+        bitmap_complement(src, src, BITMAP_TEST_BITS);
+        check_bitmap_area(src, start, nr);
+
+        /* Bits already set in dst are cleared in src but not counted */
+        bitmap_zero(src, BITMAP_TEST_BITS);
+        set_bit(start, src);
+        set_bit(start + nr - 1, src);
+        bitmap_zero(dst, BITMAP_TEST_BITS);
+        set_bit(start, dst);
+        g_assert_cmpint(bitmap_sync_and_clear_atomic(dst, src, start, nr,
+                                                     &cleared), ==, nr > 1);
+        g_assert(cleared);
+        g_assert(bitmap_empty(src, BITMAP_TEST_BITS));
+
+        /* Bits outside the area are left alone */
+        bitmap_fill(src, BITMAP_TEST_BITS);
+        bitmap_clear(src, start, nr);
+        bitmap_zero(dst, BITMAP_TEST_BITS);
+        g_assert_cmpint(bitmap_sync_and_clear_atomic(dst, src, start, nr,
+                                                     &cleared), ==, 0);
+        g_assert(!cleared);
+        g_assert(bitmap_empty(dst, BITMAP_TEST_BITS));
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/bitops/sextract32", test_sextract32);
     g_test_add_func("/bitops/sextract64", test_sextract64);
+    g_test_add_func("/bitops/bitmap_set_atomic", test_bitmap_set_atomic);
+    g_test_add_func("/bitops/bitmap_test_and_clear_atomic",
+                    test_bitmap_test_and_clear_atomic);
+    g_test_add_func("/bitops/bitmap_sync_and_clear_atomic",
+                    test_bitmap_sync_and_clear_atomic);
     return g_test_run();
 }
@@ -13,6 +13,7 @@
 
 #include <glib.h>
 #include "block/coroutine.h"
+#include "block/coroutine_int.h"
 
 /*
  * Check that qemu_in_coroutine() works
@@ -122,6 +123,42 @@ static void test_yield(void)
     g_assert_cmpint(i, ==, 5); /* coroutine must yield 5 times */
 }
 
+/*
+ * Check that a coroutine doesn't touch its former caller when it is entered
+ * again after the caller has terminated
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void coroutine_fn enter_and_exit(void *opaque)
+{
+    Coroutine *co = opaque;
+
+    qemu_coroutine_enter(co, NULL);
+}
+
+static void test_no_dangling_access(void)
+{
+    Coroutine *c1, *c2;
+    Coroutine tmp;
+
+    c2 = qemu_coroutine_create(yield_once);
+    c1 = qemu_coroutine_create(enter_and_exit);
+
+    qemu_coroutine_enter(c1, c2);
+
+    /* c1 has terminated, poison it so that any further access crashes */
+    tmp = *c1;
+    memset(c1, 0xff, sizeof(Coroutine));
+    qemu_coroutine_enter(c2, NULL);
+
+    /* c1 went back to the pool, which must stay intact */
+    *c1 = tmp;
+}
+
 /*
  * Check that creation, enter, and return work
  */
@@ -297,6 +334,7 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
     g_test_add_func("/basic/order", test_order);
+    g_test_add_func("/basic/no-dangling-access", test_no_dangling_access);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
@@ -0,0 +1,166 @@
+/*
+ * Internet checksum unit tests
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE 70000
+
+/* The straightforward byte-wise sum the optimized code must match */
+static uint16_t ref_checksum(const uint8_t *buf, int len, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        if (i & 1) {
+            sum += buf[i - seq];
+        } else {
+            sum += buf[i - seq] << 8;
+        }
+    }
+    return net_checksum_finish(sum);
+}
+
+static uint8_t *random_buf(size_t size)
+{
+    uint8_t *buf = g_malloc(size);
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = g_test_rand_int();
+    }
+    return buf;
+}
+
+static void test_add(void)
+{
+    uint8_t *buf = random_buf(BUF_SIZE);
+    int align, len, seq;
+
+    for (align = 0; align < 32; align++) {
+        for (len = 0; len < 300; len++) {
+            for (seq = 0; seq < 2; seq++) {
+                g_assert_cmpint(
+                    net_checksum_finish(net_checksum_add_cont(len, buf + align,
+                                                              seq)),
+                    ==, ref_checksum(buf + align, len, seq));
+            }
+        }
+    }
+
+    /* long enough to need several vector batches */
+    for (len = 60000; len < BUF_SIZE; len += 997) {
+        g_assert_cmpint(net_raw_checksum(buf + 1, len - 1),
+                        ==, ref_checksum(buf + 1, len - 1, 0));
+    }
+    g_free(buf);
+}
+
+static void test_all_ones(void)
+{
+    /* 0xffff words maximize the carries in the partial sums */
+    uint8_t *buf = g_malloc(BUF_SIZE);
+
+    memset(buf, 0xff, BUF_SIZE);
+    g_assert_cmpint(net_raw_checksum(buf, BUF_SIZE),
+                    ==, ref_checksum(buf, BUF_SIZE, 0));
+    g_assert_cmpint(net_raw_checksum(buf, BUF_SIZE - 1),
+                    ==, ref_checksum(buf, BUF_SIZE - 1, 0));
+    g_free(buf);
+}
+
+static void test_copy(void)
+{
+    uint8_t *src = random_buf(BUF_SIZE);
+    uint8_t *dst = g_malloc0(BUF_SIZE + 64);
+    int align, len, seq;
+
+    for (align = 0; align < 32; align++) {
+        for (len = 0; len < 300; len += 7) {
+            for (seq = 0; seq < 2; seq++) {
+                memset(dst, 0, len + 64);
+                g_assert_cmpint(
+                    net_checksum_finish(net_checksum_copy_cont(len,
+                                                               dst + align,
+                                                               src, seq)),
+                    ==, ref_checksum(src, len, seq));
+                g_assert(!memcmp(dst + align, src, len));
+                /* nothing is written past the end */
+                g_assert(buffer_is_zero(dst + align + len, 32));
+            }
+        }
+    }
+
+    g_assert_cmpint(net_checksum_finish(net_checksum_copy(BUF_SIZE - 3, dst,
+                                                          src + 3)),
+                    ==, ref_checksum(src + 3, BUF_SIZE - 3, 0));
+    g_assert(!memcmp(dst, src + 3, BUF_SIZE - 3));
+
+    g_free(src);
+    g_free(dst);
+}
+
+static void test_iov(void)
+{
+    uint8_t *buf = random_buf(4096);
+    struct iovec iov[4];
+    int i, off;
+
+    /* odd-sized elements make the parts start at odd offsets */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 7;
+    iov[1].iov_base = buf + 7;
+    iov[1].iov_len = 1500;
+    iov[2].iov_base = buf + 1507;
+    iov[2].iov_len = 1;
+    iov[3].iov_base = buf + 1508;
+    iov[3].iov_len = 4096 - 1508;
+
+    for (i = 0; i < 100; i++) {
+        off = g_test_rand_int_range(0, 4096);
+        g_assert_cmpint(
+            net_checksum_finish(net_checksum_add_iov(iov, 4, off, 4096 - off)),
+            ==, ref_checksum(buf + off, 4096 - off, 0));
+    }
+    g_free(buf);
+}
+
+static void test_update(void)
+{
+    uint8_t *buf = random_buf(64);
+    uint16_t csum, old_val, new_val;
+    int i, off;
+
+    for (i = 0; i < 1000; i++) {
+        off = g_test_rand_int_range(0, 32) * 2;
+        csum = net_raw_checksum(buf, 64);
+        old_val = lduw_be_p(buf + off);
+        new_val = g_test_rand_int();
+        stw_be_p(buf + off, new_val);
+        csum = net_checksum_update(csum, old_val, new_val);
+
+        /* 0x0000 and 0xffff are the same value in ones' complement */
+        g_assert_cmpint(csum % 0xffff, ==, net_raw_checksum(buf, 64) % 0xffff);
+    }
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/add", test_add);
+    g_test_add_func("/net/checksum/all-ones", test_all_ones);
+    g_test_add_func("/net/checksum/copy", test_copy);
+    g_test_add_func("/net/checksum/iov", test_iov);
+    g_test_add_func("/net/checksum/update", test_update);
+    return g_test_run();
+}
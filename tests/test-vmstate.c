@@ -332,6 +332,88 @@ static void test_load_skip(void)
     qemu_fclose(loading);
 }
 
+typedef struct TestArrays {
+    uint8_t u8[3];
+    uint16_t u16[3];
+    uint32_t u32[2];
+    int32_t i32[2];
+    uint64_t u64[2];
+} TestArrays;
+
+static const VMStateDescription vmstate_arrays = {
+    .name = "test/arrays",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(u8, TestArrays, 3),
+        VMSTATE_UINT16_ARRAY(u16, TestArrays, 3),
+        VMSTATE_UINT32_ARRAY(u32, TestArrays, 2),
+        VMSTATE_INT32_ARRAY(i32, TestArrays, 2),
+        VMSTATE_UINT64_ARRAY(u64, TestArrays, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static uint8_t arrays_wire[] = {
+    1, 2, 3,                                        /* u8 */
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06,             /* u16 */
+    0x0a, 0x0b, 0x0c, 0x0d, 0, 0, 0, 5,             /* u32 */
+    0xff, 0xff, 0xff, 0xfe, 0, 0, 0, 7,             /* i32 */
+    1, 2, 3, 4, 5, 6, 7, 8, 0, 0, 0, 0, 0, 0, 0, 9, /* u64 */
+};
+
+static void test_arrays_save(void)
+{
+    QEMUFile *fsave = qemu_fdopen(dup_temp_fd(true), "wb");
+    TestArrays obj = {
+        .u8 = { 1, 2, 3 },
+        .u16 = { 0x0102, 0x0304, 0x0506 },
+        .u32 = { 0x0a0b0c0d, 5 },
+        .i32 = { -2, 7 },
+        .u64 = { 0x0102030405060708ULL, 9 },
+    };
+    vmstate_save_state(fsave, &vmstate_arrays, &obj);
+    g_assert(!qemu_file_get_error(fsave));
+    qemu_fclose(fsave);
+
+    QEMUFile *loading = qemu_fdopen(dup_temp_fd(false), "rb");
+    uint8_t result[sizeof(arrays_wire)];
+    g_assert_cmpint(qemu_get_buffer(loading, result, sizeof(result)), ==,
+                    sizeof(result));
+    g_assert(!qemu_file_get_error(loading));
+    g_assert_cmpint(memcmp(result, arrays_wire, sizeof(result)), ==, 0);
+
+    /* Must reach EOF */
+    qemu_get_byte(loading);
+    g_assert_cmpint(qemu_file_get_error(loading), ==, -EIO);
+
+    qemu_fclose(loading);
+}
+
+static void test_arrays_load(void)
+{
+    QEMUFile *fsave = qemu_fdopen(dup_temp_fd(true), "wb");
+    qemu_put_buffer(fsave, arrays_wire, sizeof(arrays_wire));
+    qemu_put_byte(fsave, QEMU_VM_EOF);
+    qemu_fclose(fsave);
+
+    QEMUFile *loading = qemu_fdopen(dup_temp_fd(false), "rb");
+    TestArrays obj;
+    vmstate_load_state(loading, &vmstate_arrays, &obj, 1);
+    g_assert(!qemu_file_get_error(loading));
+    g_assert_cmpint(obj.u8[0], ==, 1);
+    g_assert_cmpint(obj.u8[2], ==, 3);
+    g_assert_cmphex(obj.u16[0], ==, 0x0102);
+    g_assert_cmphex(obj.u16[2], ==, 0x0506);
+    g_assert_cmphex(obj.u32[0], ==, 0x0a0b0c0d);
+    g_assert_cmpint(obj.u32[1], ==, 5);
+    g_assert_cmpint(obj.i32[0], ==, -2);
+    g_assert_cmpint(obj.i32[1], ==, 7);
+    g_assert_cmphex(obj.u64[0], ==, 0x0102030405060708ULL);
+    g_assert_cmpint(obj.u64[1], ==, 9);
+    qemu_fclose(loading);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -345,6 +427,8 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/arrays/save", test_arrays_save);
+    g_test_add_func("/vmstate/arrays/load", test_arrays_load);
     g_test_run();
 
     close(temp_fd);
@@ -19,6 +19,7 @@
 #include <assert.h>
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -179,6 +180,118 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_cache_lru(void)
+{
+    /* two sets of four ways */
+    PageCache *cache = cache_init(8, PAGE_SIZE);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    PageCacheStats stats;
+    uint64_t addr;
+    int i;
+
+    /* addresses that are a multiple of 2 pages apart share a set */
+    for (i = 0; i < 4; i++) {
+        page[0] = i;
+        g_assert(cache_insert(cache, i * 2 * PAGE_SIZE, page) == 0);
+    }
+    for (i = 0; i < 4; i++) {
+        addr = i * 2 * PAGE_SIZE;
+        g_assert(cache_is_cached(cache, addr));
+        g_assert_cmpint(get_cached_data(cache, addr)[0], ==, i);
+    }
+
+    /* touch page 0 so that page 1 becomes the least recently used */
+    g_assert(get_cached_data(cache, 0));
+    page[0] = 4;
+    g_assert(cache_insert(cache, 4 * 2 * PAGE_SIZE, page) == 0);
+
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(!cache_is_cached(cache, 1 * 2 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 2 * 2 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 3 * 2 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 4 * 2 * PAGE_SIZE));
+    g_assert_cmpint(get_cached_data(cache, 4 * 2 * PAGE_SIZE)[0], ==, 4);
+
+    /* the other set is untouched */
+    g_assert(!cache_is_cached(cache, PAGE_SIZE));
+    g_assert(get_cached_data(cache, PAGE_SIZE) == NULL);
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, 8);
+    g_assert_cmpint(stats.misses, ==, 2);
+    g_assert_cmpint(stats.evictions, ==, 1);
+
+    cache_fini(cache);
+    g_free(cache);
+    g_free(page);
+}
+
+static void test_cache_resize(void)
+{
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        page[0] = i;
+        g_assert(cache_insert(cache, i * PAGE_SIZE, page) == 0);
+    }
+
+    /* growing the cache keeps every page */
+    g_assert_cmpint(cache_resize(cache, 64), ==, 64);
+    for (i = 0; i < 16; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE));
+        g_assert_cmpint(get_cached_data(cache, i * PAGE_SIZE)[0], ==, i);
+    }
+
+    /* shrinking it keeps the most recently used pages */
+    g_assert_cmpint(cache_resize(cache, 4), ==, 4);
+    for (i = 0; i < 16; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE) == (i >= 12));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+    g_free(page);
+}
+
+static void perf_encode_decode(void)
+{
+    uint8_t *old_page = g_malloc0(PAGE_SIZE);
+    uint8_t *new_page = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    unsigned int i, max = 1000000;
+    int dlen = 0;
+    double duration;
+
+    /* a few small scattered changes, as with a typical dirty page */
+    for (i = 0; i < PAGE_SIZE; i += 512) {
+        new_page[i + 17] = 1;
+        new_page[i + 18] = 2;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        dlen = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                    compressed, PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("Encode %u pages: %f s, %f MB/s\n", max, duration,
+                   (double)max * PAGE_SIZE / duration / (1024 * 1024));
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        xbzrle_decode_buffer(compressed, dlen, old_page, PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("Decode %u pages: %f s, %f MB/s\n", max, duration,
+                   (double)max * PAGE_SIZE / duration / (1024 * 1024));
+
+    g_free(old_page);
+    g_free(new_page);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +304,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/cache_lru", test_cache_lru);
+    g_test_add_func("/xbzrle/cache_resize", test_cache_resize);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode_decode", perf_encode_decode);
+    }
 
     return g_test_run();
 }
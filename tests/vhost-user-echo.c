@@ -0,0 +1,662 @@
+/*
+ * Reference vhost-user backend for virtio-net
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Listens on a unix socket for QEMU's -netdev vhost-user and runs the
+ * virtqueues of the virtio-net device.  Packets the guest transmits are
+ * either copied back into its receive queue ("loop", the default) or
+ * discarded ("sink").  Packet rates are printed every second, so this can
+ * be used to measure the vhost-user path without a real network or any
+ * special privileges.
+ *
+ * Usage: vhost-user-echo [-s] [-q] socket-path
+ *   -s  discard transmitted packets instead of looping them back
+ *   -q  don't print statistics
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/virtio_ring.h>
+#include <linux/virtio_net.h>
+
+#include "hw/virtio/vhost-user.h"
+
+#define VHOST_USER_ECHO_RX      0
+#define VHOST_USER_ECHO_TX      1
+#define VHOST_USER_ECHO_NVQS    2
+
+/* Upper bound of work per ring and loop iteration, to keep rings fair */
+#define VHOST_USER_ECHO_BURST   256
+
+/* Largest ring, and so the longest descriptor chain, we accept */
+#define VIRTQUEUE_MAX_SIZE_ECHO 1024
+
+typedef struct EchoRegion {
+    uint64_t guest_phys_addr;
+    uint64_t size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+    uint8_t *mmap_addr;
+    uint8_t *host;          /* mmap_addr + mmap_offset */
+} EchoRegion;
+
+typedef struct EchoVring {
+    unsigned int num;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t last_avail_idx;
+    int kick_fd;
+    int call_fd;
+    bool poll;              /* no kick fd, poll the avail ring */
+    bool started;
+} EchoVring;
+
+typedef struct EchoDev {
+    int sock;
+    bool sink;
+    uint64_t features;
+    int nregions;
+    EchoRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    EchoVring vq[VHOST_USER_ECHO_NVQS];
+
+    uint64_t tx_packets, tx_bytes;
+    uint64_t rx_packets, rx_dropped;
+} EchoDev;
+
+static bool quiet;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *gpa_to_va(EchoDev *dev, uint64_t addr, uint32_t len)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        EchoRegion *r = &dev->regions[i];
+
+        if (addr >= r->guest_phys_addr &&
+            addr - r->guest_phys_addr + len <= r->size) {
+            return r->host + (addr - r->guest_phys_addr);
+        }
+    }
+    return NULL;
+}
+
+static void *uva_to_va(EchoDev *dev, uint64_t addr)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        EchoRegion *r = &dev->regions[i];
+
+        if (addr >= r->userspace_addr &&
+            addr - r->userspace_addr < r->size) {
+            return r->host + (addr - r->userspace_addr);
+        }
+    }
+    return NULL;
+}
+
+static void unmap_regions(EchoDev *dev)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        EchoRegion *r = &dev->regions[i];
+        munmap(r->mmap_addr, r->mmap_offset + r->size);
+    }
+    dev->nregions = 0;
+}
+
+static void vring_stop(EchoVring *vq)
+{
+    if (vq->kick_fd >= 0) {
+        close(vq->kick_fd);
+    }
+    vq->kick_fd = -1;
+    vq->poll = false;
+    vq->started = false;
+}
+
+static void reset_device(EchoDev *dev)
+{
+    int i;
+
+    for (i = 0; i < VHOST_USER_ECHO_NVQS; i++) {
+        vring_stop(&dev->vq[i]);
+        if (dev->vq[i].call_fd >= 0) {
+            close(dev->vq[i].call_fd);
+        }
+        memset(&dev->vq[i], 0, sizeof(dev->vq[i]));
+        dev->vq[i].kick_fd = dev->vq[i].call_fd = -1;
+    }
+    unmap_regions(dev);
+    dev->features = 0;
+}
+
+static void vring_notify(EchoVring *vq)
+{
+    uint64_t one = 1;
+
+    __sync_synchronize();
+    if (vq->call_fd < 0 || (vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+        return;
+    }
+    if (write(vq->call_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("vhost-user-echo: call");
+    }
+}
+
+static void vring_push(EchoVring *vq, uint16_t head, uint32_t len)
+{
+    struct vring_used_elem *elem = &vq->used->ring[vq->used->idx % vq->num];
+
+    elem->id = head;
+    elem->len = len;
+    __sync_synchronize();
+    vq->used->idx++;
+}
+
+static bool vring_has_avail(EchoVring *vq)
+{
+    return vq->started && vq->avail->idx != vq->last_avail_idx;
+}
+
+typedef struct EchoBuf {
+    uint8_t *addr;
+    uint32_t len;
+} EchoBuf;
+
+/*
+ * Maps the descriptor chain starting at head into bufs, which has room for
+ * vq->num entries; returns the number of buffers, or -1 if the chain is
+ * bad.  All buffers must be device-writable if write is true and
+ * device-readable otherwise.  *total is set to their total length.
+ */
+static int map_chain(EchoDev *dev, EchoVring *vq, uint16_t head, bool write,
+                     EchoBuf *bufs, size_t *total)
+{
+    unsigned int i = head, n = 0;
+
+    *total = 0;
+    for (;;) {
+        struct vring_desc *d;
+
+        if (i >= vq->num || n == vq->num) {
+            return -1;
+        }
+        d = &vq->desc[i];
+        if (!!(d->flags & VRING_DESC_F_WRITE) != write) {
+            return -1;
+        }
+        bufs[n].addr = gpa_to_va(dev, d->addr, d->len);
+        bufs[n].len = d->len;
+        if (!bufs[n].addr) {
+            return -1;
+        }
+        *total += d->len;
+        n++;
+        if (!(d->flags & VRING_DESC_F_NEXT)) {
+            return n;
+        }
+        i = d->next;
+    }
+}
+
+static void copy_bufs(EchoBuf *dst, int dst_cnt, EchoBuf *src, int src_cnt)
+{
+    uint32_t dst_off = 0, src_off = 0;
+
+    while (dst_cnt && src_cnt) {
+        uint32_t len = dst->len - dst_off;
+
+        if (src->len - src_off < len) {
+            len = src->len - src_off;
+        }
+        memcpy(dst->addr + dst_off, src->addr + src_off, len);
+        dst_off += len;
+        src_off += len;
+        if (dst_off == dst->len) {
+            dst++, dst_cnt--, dst_off = 0;
+        }
+        if (src_off == src->len) {
+            src++, src_cnt--, src_off = 0;
+        }
+    }
+}
+
+/* Loops one packet back into the RX ring; returns false if it was dropped */
+static bool loop_packet(EchoDev *dev, EchoBuf *out, int out_cnt, size_t len)
+{
+    EchoVring *rx = &dev->vq[VHOST_USER_ECHO_RX];
+    EchoBuf in[VIRTQUEUE_MAX_SIZE_ECHO];
+    size_t in_len;
+    uint16_t head;
+    int in_cnt;
+
+    if (!vring_has_avail(rx)) {
+        return false;
+    }
+    /* Read avail->ring only after avail->idx */
+    __sync_synchronize();
+    head = rx->avail->ring[rx->last_avail_idx % rx->num];
+    rx->last_avail_idx++;
+
+    in_cnt = map_chain(dev, rx, head, true, in, &in_len);
+    if (in_cnt < 0 || in_len < len) {
+        /* Can't use this buffer, give it back empty */
+        vring_push(rx, head, 0);
+        return false;
+    }
+
+    copy_bufs(in, in_cnt, out, out_cnt);
+    if (dev->features & (1ULL << VIRTIO_NET_F_MRG_RXBUF)) {
+        struct virtio_net_hdr_mrg_rxbuf *hdr = (void *)in[0].addr;
+
+        if (in[0].len >= sizeof(*hdr)) {
+            hdr->num_buffers = 1;
+        }
+    }
+    vring_push(rx, head, len);
+    dev->rx_packets++;
+    return true;
+}
+
+static void process_tx(EchoDev *dev)
+{
+    EchoVring *tx = &dev->vq[VHOST_USER_ECHO_TX];
+    EchoVring *rx = &dev->vq[VHOST_USER_ECHO_RX];
+    EchoBuf out[VIRTQUEUE_MAX_SIZE_ECHO];
+    uint16_t rx_used = rx->started ? rx->used->idx : 0;
+    int n = 0;
+
+    while (n < VHOST_USER_ECHO_BURST && vring_has_avail(tx)) {
+        uint16_t head;
+        size_t len;
+        int out_cnt;
+
+        __sync_synchronize();
+        head = tx->avail->ring[tx->last_avail_idx % tx->num];
+        out_cnt = map_chain(dev, tx, head, false, out, &len);
+        if (out_cnt >= 0) {
+            dev->tx_packets++;
+            dev->tx_bytes += len;
+            if (!dev->sink && !loop_packet(dev, out, out_cnt, len)) {
+                dev->rx_dropped++;
+            }
+        } else {
+            fprintf(stderr, "vhost-user-echo: bad TX descriptor chain\n");
+        }
+        tx->last_avail_idx++;
+        vring_push(tx, head, 0);
+        n++;
+    }
+
+    if (n) {
+        vring_notify(tx);
+    }
+    if (rx->started && rx->used->idx != rx_used) {
+        vring_notify(rx);
+    }
+}
+
+static int recv_msg(EchoDev *dev, VhostUserMsg *msg, int *fds, int *fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    *fd_num = 0;
+    r = recvmsg(dev->sock, &msgh, MSG_WAITALL);
+    if (r != VHOST_USER_HDR_SIZE) {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fd_num * sizeof(int));
+            break;
+        }
+    }
+
+    if (msg->size > sizeof(*msg) - VHOST_USER_HDR_SIZE) {
+        return -1;
+    }
+    if (msg->size &&
+        recv(dev->sock, &msg->u64, msg->size, MSG_WAITALL) != msg->size) {
+        return -1;
+    }
+    return 0;
+}
+
+static int send_reply(EchoDev *dev, VhostUserMsg *msg)
+{
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+
+    msg->flags = VHOST_USER_REPLY_MASK | VHOST_USER_VERSION;
+    return send(dev->sock, msg, size, 0) == size ? 0 : -1;
+}
+
+static int set_mem_table(EchoDev *dev, VhostUserMsg *msg, int *fds,
+                         int fd_num)
+{
+    VhostUserMemory mem;
+    int i;
+
+    /* The message is packed, copy the table out to access it aligned */
+    memcpy(&mem, &msg->memory, sizeof(mem));
+    if (mem.nregions != fd_num || fd_num > VHOST_MEMORY_MAX_NREGIONS) {
+        return -1;
+    }
+
+    unmap_regions(dev);
+    for (i = 0; i < fd_num; i++) {
+        VhostUserMemoryRegion *m = &mem.regions[i];
+        EchoRegion *r = &dev->regions[i];
+        void *addr;
+
+        addr = mmap(NULL, m->mmap_offset + m->memory_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        close(fds[i]);
+        if (addr == MAP_FAILED) {
+            perror("vhost-user-echo: mmap");
+            return -1;
+        }
+        r->guest_phys_addr = m->guest_phys_addr;
+        r->size = m->memory_size;
+        r->userspace_addr = m->userspace_addr;
+        r->mmap_offset = m->mmap_offset;
+        r->mmap_addr = addr;
+        r->host = (uint8_t *)addr + m->mmap_offset;
+        dev->nregions++;
+    }
+    return 0;
+}
+
+/* Returns -1 if the connection should be dropped */
+static int handle_msg(EchoDev *dev)
+{
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    VhostUserMsg msg;
+    EchoVring *vq;
+    int fd_num, i;
+    unsigned int idx;
+
+    if (recv_msg(dev, &msg, fds, &fd_num) < 0) {
+        return -1;
+    }
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        msg.u64 = (1ULL << VIRTIO_NET_F_MRG_RXBUF);
+        msg.size = sizeof(msg.u64);
+        return send_reply(dev, &msg);
+
+    case VHOST_USER_SET_FEATURES:
+        dev->features = msg.u64;
+        break;
+
+    case VHOST_USER_SET_OWNER:
+        break;
+
+    case VHOST_USER_RESET_OWNER:
+        reset_device(dev);
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        if (set_mem_table(dev, &msg, fds, fd_num) < 0) {
+            return -1;
+        }
+        fd_num = 0;
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+        if (msg.state.index >= VHOST_USER_ECHO_NVQS) {
+            return -1;
+        }
+        vq = &dev->vq[msg.state.index];
+        if (msg.request == VHOST_USER_SET_VRING_NUM) {
+            if (msg.state.num > VIRTQUEUE_MAX_SIZE_ECHO) {
+                return -1;
+            }
+            vq->num = msg.state.num;
+        } else if (msg.request == VHOST_USER_SET_VRING_BASE) {
+            vq->last_avail_idx = msg.state.num;
+        } else {
+            vring_stop(vq);
+            msg.state.num = vq->last_avail_idx;
+            return send_reply(dev, &msg);
+        }
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        if (msg.addr.index >= VHOST_USER_ECHO_NVQS) {
+            return -1;
+        }
+        vq = &dev->vq[msg.addr.index];
+        vq->desc = uva_to_va(dev, msg.addr.desc_user_addr);
+        vq->avail = uva_to_va(dev, msg.addr.avail_user_addr);
+        vq->used = uva_to_va(dev, msg.addr.used_user_addr);
+        if (!vq->desc || !vq->avail || !vq->used) {
+            fprintf(stderr, "vhost-user-echo: ring outside of guest memory\n");
+            return -1;
+        }
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        idx = msg.u64 & VHOST_USER_VRING_IDX_MASK;
+        if (idx >= VHOST_USER_ECHO_NVQS ||
+            !(msg.u64 & VHOST_USER_VRING_NOFD_MASK) != (fd_num == 1)) {
+            return -1;
+        }
+        vq = &dev->vq[idx];
+        if (msg.request == VHOST_USER_SET_VRING_KICK) {
+            vring_stop(vq);
+            vq->kick_fd = fd_num ? fds[0] : -1;
+            vq->poll = !fd_num;
+            vq->started = vq->num && vq->desc && vq->avail && vq->used;
+        } else if (msg.request == VHOST_USER_SET_VRING_CALL) {
+            if (vq->call_fd >= 0) {
+                close(vq->call_fd);
+            }
+            vq->call_fd = fd_num ? fds[0] : -1;
+        } else if (fd_num) {
+            close(fds[0]);
+        }
+        fd_num = 0;
+        break;
+
+    default:
+        fprintf(stderr, "vhost-user-echo: unknown request %u\n", msg.request);
+        return -1;
+    }
+
+    for (i = 0; i < fd_num; i++) {
+        close(fds[i]);
+    }
+    return 0;
+}
+
+static void print_stats(EchoDev *dev, uint64_t *last_ns, EchoDev *last)
+{
+    uint64_t now = now_ns();
+    double secs = (now - *last_ns) / 1e9;
+
+    if (quiet || secs < 1) {
+        return;
+    }
+    printf("tx %.0f pps %.1f Mbit/s, looped %.0f pps, dropped %.0f pps\n",
+           (dev->tx_packets - last->tx_packets) / secs,
+           (dev->tx_bytes - last->tx_bytes) * 8 / secs / 1e6,
+           (dev->rx_packets - last->rx_packets) / secs,
+           (dev->rx_dropped - last->rx_dropped) / secs);
+    fflush(stdout);
+    *last = *dev;
+    *last_ns = now;
+}
+
+static void serve(EchoDev *dev)
+{
+    uint64_t last_ns = now_ns();
+    EchoDev last = *dev;
+
+    for (;;) {
+        struct pollfd pfd[1 + VHOST_USER_ECHO_NVQS];
+        bool polling = false;
+        int i, n = 0, timeout;
+
+        pfd[n].fd = dev->sock;
+        pfd[n++].events = POLLIN;
+        for (i = 0; i < VHOST_USER_ECHO_NVQS; i++) {
+            EchoVring *vq = &dev->vq[i];
+
+            if (vq->started && vq->kick_fd >= 0) {
+                pfd[n].fd = vq->kick_fd;
+                pfd[n++].events = POLLIN;
+            }
+            polling |= vq->started && vq->poll;
+        }
+
+        /* Without kick fds the TX ring is polled, cheaply but not idly */
+        timeout = polling ? 1 : 1000;
+        if (poll(pfd, n, timeout) < 0 && errno != EINTR) {
+            perror("vhost-user-echo: poll");
+            return;
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (handle_msg(dev) < 0) {
+                return;
+            }
+        }
+        for (i = 1; i < n; i++) {
+            uint64_t count;
+
+            if (pfd[i].revents & POLLIN &&
+                read(pfd[i].fd, &count, sizeof(count)) < 0) {
+                perror("vhost-user-echo: kick");
+            }
+        }
+
+        /*
+         * RX kicks only mean new buffers, which are picked up with the
+         * next TX packet; everything happens on the TX side.
+         */
+        process_tx(dev);
+        print_stats(dev, &last_ns, &last);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-s] [-q] socket-path\n"
+            "  -s  discard transmitted packets instead of looping them back\n"
+            "  -q  don't print statistics\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un un = { .sun_family = AF_UNIX };
+    bool sink = false;
+    int listen_fd, c;
+
+    while ((c = getopt(argc, argv, "sqh")) != -1) {
+        switch (c) {
+        case 's':
+            sink = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || strlen(argv[optind]) >= sizeof(un.sun_path)) {
+        usage(argv[0]);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    strcpy(un.sun_path, argv[optind]);
+    unlink(un.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&un, sizeof(un)) < 0 ||
+        listen(listen_fd, 1) < 0) {
+        perror(un.sun_path);
+        return 1;
+    }
+
+    for (;;) {
+        EchoDev dev = { .sink = sink };
+        int i;
+
+        for (i = 0; i < VHOST_USER_ECHO_NVQS; i++) {
+            dev.vq[i].kick_fd = dev.vq[i].call_fd = -1;
+        }
+
+        dev.sock = accept(listen_fd, NULL, NULL);
+        if (dev.sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+        if (!quiet) {
+            printf("vhost-user-echo: connected (%s)\n",
+                   sink ? "sink" : "loop");
+        }
+
+        serve(&dev);
+
+        reset_device(&dev);
+        close(dev.sock);
+        if (!quiet) {
+            printf("vhost-user-echo: disconnected, %" PRIu64 " packets "
+                   "received, %" PRIu64 " looped back\n",
+                   dev.tx_packets, dev.rx_packets);
+        }
+    }
+}
@@ -9,26 +9,298 @@
 
 #include <glib.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/types.h"
+#include "hw/pci/pci.h"
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
+#define TEST_IMAGE_SIZE         (1024 * 1024)
+#define PCI_SLOT                4
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_HDR_LEN      16
+#define SECTOR_SIZE             512
+
+/* Requests in flight at a time, each taking three descriptors */
+#define BATCH                   5
+
+static char tmp_path[] = "/tmp/qtest.XXXXXX";
+
+typedef struct TestRequest {
+    uint64_t hdr;
+    uint64_t data;
+    uint64_t status;
+    uint16_t id;
+    bool done;
+} TestRequest;
+
+/* Tests only initialization */
 static void pci_nop(void)
 {
+    qtest_start("-drive id=drv0,if=none,file=/dev/null "
+                "-device virtio-blk-pci,drive=drv0 "
+                "-drive id=drv1,if=none,file=/dev/null "
+                "-device virtio-blk-pci,drive=drv1,num-queues=4");
+    qtest_end();
+}
+
+static void submit(QVirtQueue *vq, QGuestAllocator *alloc, TestRequest *req,
+                   uint32_t type, uint64_t sector, bool indirect)
+{
+    QVirtioSg sg[3] = {
+        { .addr = req->hdr, .len = VIRTIO_BLK_HDR_LEN },
+        { .addr = req->data, .len = SECTOR_SIZE,
+          .write = type == VIRTIO_BLK_T_IN },
+        { .addr = req->status, .len = 1, .write = true },
+    };
+
+    writel(req->hdr, type);
+    writel(req->hdr + 4, 0);
+    writeq(req->hdr + 8, sector);
+    writeb(req->status, 0xff);
+    req->done = false;
+    req->id = qvirtqueue_add(vq, alloc, sg, ARRAY_SIZE(sg), indirect);
+}
+
+/* Waits for all requests of the batch, which may complete in any order */
+static void complete(QVirtQueue *vq, TestRequest *reqs, int num)
+{
+    int done, i;
+
+    for (done = 0; done < num; done++) {
+        uint16_t id;
+        uint32_t len;
+
+        qvirtqueue_wait_used(vq, &id, &len);
+        for (i = 0; i < num; i++) {
+            if (!reqs[i].done && reqs[i].id == id) {
+                break;
+            }
+        }
+        g_assert_cmpint(i, <, num);
+        reqs[i].done = true;
+        g_assert_cmpint(readb(reqs[i].status), ==, VIRTIO_BLK_S_OK);
+    }
+}
+
+static void fill_pattern(uint8_t *buf, uint64_t sector, unsigned round)
+{
+    int i;
+
+    for (i = 0; i < SECTOR_SIZE; i++) {
+        buf[i] = sector * 7 + round * 13 + i;
+    }
+}
+
+/*
+ * Checks the query-virtio statistics of the only virtio device, a disk
+ * with a single queue that returned @completions buffers so far.
+ */
+static void check_query_virtio(int64_t completions, int64_t max_usecs,
+                               int64_t max_frames)
+{
+    QDict *response, *info, *queue;
+    const QListEntry *entry;
+    QList *list;
+
+    response = qmp("{ 'execute': 'query-virtio' }");
+    g_assert(response);
+    list = qdict_get_qlist(response, "return");
+    g_assert(list);
+    entry = qlist_first(list);
+    g_assert(entry && !qlist_next(entry));
+    info = qobject_to_qdict(qlist_entry_obj(entry));
+    g_assert(info);
+
+    g_assert_cmpstr(qdict_get_str(info, "name"), ==, "virtio-blk");
+    g_assert_cmpint(qdict_get_int(info, "coalesce-max-usecs"), ==, max_usecs);
+    g_assert_cmpint(qdict_get_int(info, "coalesce-max-frames"), ==,
+                    max_frames);
+
+    list = qdict_get_qlist(info, "queues");
+    g_assert(list);
+    entry = qlist_first(list);
+    g_assert(entry && !qlist_next(entry));
+    queue = qobject_to_qdict(qlist_entry_obj(entry));
+    g_assert(queue);
+
+    g_assert_cmpint(qdict_get_int(queue, "index"), ==, 0);
+    g_assert_cmpint(qdict_get_int(queue, "size"), ==, 128);
+    g_assert_cmpint(qdict_get_int(queue, "completions"), ==, completions);
+    g_assert_cmpint(qdict_get_int(queue, "kicks"), >=, completions ? 1 : 0);
+    g_assert_cmpint(qdict_get_int(queue, "notifications"), ==,
+                    qdict_get_int(queue, "interrupts") +
+                    qdict_get_int(queue, "suppressed") +
+                    qdict_get_int(queue, "coalesced"));
+    if (!max_usecs || !max_frames) {
+        g_assert_cmpint(qdict_get_int(queue, "coalesced"), ==, 0);
+    }
+
+    QDECREF(response);
+}
+
+/*
+ * Writes and reads back sectors in batches until the ring wrapped around
+ * a few times, with the feature bits in @features negotiated in addition
+ * to those of the device that don't change the ring layout.
+ */
+static void test_rw(uint32_t features, bool indirect, const char *props)
+{
+    QGuestAllocator *alloc;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    TestRequest reqs[BATCH];
+    uint8_t expected[SECTOR_SIZE], buf[SECTOR_SIZE];
+    uint32_t host_features;
+    unsigned round, rounds;
+    char *cmdline;
+    int i;
+
+    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
+                              "-device virtio-blk-pci,drive=drive0,"
+                              "addr=%02x.0%s", tmp_path, PCI_SLOT, props);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    alloc = pc_alloc_init();
+    dev = qvirtio_pci_device_find(qpci_init_pc(), QPCI_DEVFN(PCI_SLOT, 0),
+                                  PCI_DEVICE_ID_VIRTIO_BLOCK);
+    g_assert(dev != NULL);
+
+    qvirtio_pci_reset(dev);
+    qvirtio_pci_set_status(dev, QVIRTIO_STATUS_ACKNOWLEDGE |
+                                QVIRTIO_STATUS_DRIVER);
+    host_features = qvirtio_pci_get_features(dev);
+    if (indirect) {
+        features |= 1u << QVIRTIO_F_INDIRECT_DESC;
+    }
+    g_assert_cmphex(host_features & features, ==, features);
+    qvirtio_pci_set_features(dev, features);
+
+    /* capacity */
+    g_assert_cmpint(qvirtio_pci_config_readq(dev, 0), ==,
+                    TEST_IMAGE_SIZE / SECTOR_SIZE);
+
+    vq = qvirtqueue_setup(dev, alloc, 0, features);
+    qvirtio_pci_set_status(dev, QVIRTIO_STATUS_ACKNOWLEDGE |
+                                QVIRTIO_STATUS_DRIVER |
+                                QVIRTIO_STATUS_DRIVER_OK);
+
+    for (i = 0; i < BATCH; i++) {
+        reqs[i].hdr = guest_alloc(alloc, VIRTIO_BLK_HDR_LEN);
+        reqs[i].data = guest_alloc(alloc, SECTOR_SIZE);
+        reqs[i].status = guest_alloc(alloc, 1);
+    }
+
+    /* Each round takes two batches of descriptors */
+    rounds = 3 * vq->size / (2 * BATCH * (indirect ? 1 : 3)) + 1;
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < BATCH; i++) {
+            uint64_t sector = (round * BATCH + i) % 64;
+
+            fill_pattern(buf, sector, round);
+            memwrite(reqs[i].data, buf, SECTOR_SIZE);
+            submit(vq, alloc, &reqs[i], VIRTIO_BLK_T_OUT, sector, indirect);
+        }
+        qvirtqueue_kick(vq);
+        complete(vq, reqs, BATCH);
+
+        for (i = 0; i < BATCH; i++) {
+            uint64_t sector = (round * BATCH + i) % 64;
+
+            memset(buf, 0, SECTOR_SIZE);
+            memwrite(reqs[i].data, buf, SECTOR_SIZE);
+            submit(vq, alloc, &reqs[i], VIRTIO_BLK_T_IN, sector, indirect);
+        }
+        qvirtqueue_kick(vq);
+        complete(vq, reqs, BATCH);
+
+        for (i = 0; i < BATCH; i++) {
+            uint64_t sector = (round * BATCH + i) % 64;
+
+            fill_pattern(expected, sector, round);
+            memread(reqs[i].data, buf, SECTOR_SIZE);
+            g_assert(memcmp(buf, expected, SECTOR_SIZE) == 0);
+        }
+    }
+    g_assert_cmpint(vq->num_free, ==, vq->size);
+
+    /* Interrupt coalescing is off by default */
+    check_query_virtio(2 * BATCH * rounds, 0, 0);
+
+    qvirtqueue_free(vq);
+    qvirtio_pci_device_free(dev);
+    qtest_end();
+}
+
+static void pci_split_rw(void)
+{
+    test_rw(0, false, "");
+}
+
+static void pci_split_indirect_rw(void)
+{
+    test_rw(0, true, "");
+}
+
+static void pci_packed_rw(void)
+{
+    test_rw(1u << QVIRTIO_F_RING_PACKED, false, ",x-packed-ring=on");
+}
+
+static void pci_packed_indirect_rw(void)
+{
+    test_rw(1u << QVIRTIO_F_RING_PACKED, true, ",x-packed-ring=on");
+}
+
+static void pci_packed_event_idx_rw(void)
+{
+    test_rw(1u << QVIRTIO_F_RING_PACKED | 1u << QVIRTIO_F_EVENT_IDX, false,
+            ",x-packed-ring=on");
+}
+
+/* The coalescing bounds are properties of every virtio device */
+static void pci_coalesce_props(void)
+{
+    qtest_start("-drive if=none,id=drive0,file=/dev/null "
+                "-device virtio-blk-pci,drive=drive0 "
+                "-global virtio-device.x-coalesce-usecs=100 "
+                "-global virtio-device.x-coalesce-frames=8");
+    check_query_virtio(0, 100, 8);
+    qtest_end();
 }
 
 int main(int argc, char **argv)
 {
-    int ret;
+    int fd, ret;
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/blk/pci/nop", pci_nop);
+    qtest_add_func("/virtio/blk/pci/split/rw", pci_split_rw);
+    qtest_add_func("/virtio/blk/pci/split/indirect-rw", pci_split_indirect_rw);
+    qtest_add_func("/virtio/blk/pci/packed/rw", pci_packed_rw);
+    qtest_add_func("/virtio/blk/pci/packed/indirect-rw",
+                   pci_packed_indirect_rw);
+    qtest_add_func("/virtio/blk/pci/packed/event-idx-rw",
+                   pci_packed_event_idx_rw);
+    qtest_add_func("/virtio/blk/pci/coalesce-props", pci_coalesce_props);
 
-    qtest_start("-drive id=drv0,if=none,file=/dev/null "
-                "-device virtio-blk-pci,drive=drv0");
     ret = g_test_run();
 
-    qtest_end();
-
+    unlink(tmp_path);
     return ret;
 }
@@ -0,0 +1,625 @@
+/*
+ * Cache misses per request of the split and packed virtqueue layouts
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A driver and a device exchange requests of one or more descriptors over
+ * a ring in each layout, with notifications left out: both sides poll.
+ * The cost that differs between the layouts is the cache lines that move
+ * between the two CPUs, and it is measured in two ways:
+ *
+ *  - by default, driver and device take turns on one thread and every ring
+ *    access goes through a model of two private caches of unlimited size.
+ *    An access misses when the line was last written by the other side, or
+ *    has never been read by this one, so the counts are the coherence
+ *    misses per request, deterministic and independent of the host.
+ *
+ *  - with -t, driver and device run on two threads and the hardware cache
+ *    miss counters of each thread are read with perf_event_open(), when
+ *    the host has them.
+ *
+ * Only uses system headers.  Build with "make tests/virtio-ring-layout-bench".
+ *
+ * Usage: tests/virtio-ring-layout-bench [-t] [-n requests] [-q ring-size]
+ *                                       [-b batch] [-d descs-per-request]
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE              64
+#define RING_ALIGN              4096
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED (1 << 15)
+
+enum { DRIVER, DEVICE, SIDES };
+
+typedef struct VRingDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingUsedElem {
+    uint32_t id;
+    uint32_t len;
+} VRingUsedElem;
+
+/*
+ * Cache model.  Each line of the ring memory has one valid bit per side;
+ * a write leaves only the writer's copy valid.
+ */
+static bool model;
+static uint8_t *model_base;
+static uint8_t *model_valid;
+static uint64_t model_misses[SIDES];
+
+static void model_access(int side, const void *p, size_t size, bool write)
+{
+    size_t first = ((const uint8_t *)p - model_base) / CACHE_LINE;
+    size_t last = ((const uint8_t *)p + size - 1 - model_base) / CACHE_LINE;
+    size_t line;
+
+    for (line = first; line <= last; line++) {
+        if (!(model_valid[line] & (1 << side))) {
+            model_misses[side]++;
+        }
+        model_valid[line] = write ? 1 << side : model_valid[line] | 1 << side;
+    }
+}
+
+/* @p is evaluated twice */
+#define LOAD(side, p) ({                                                    \
+    if (model) {                                                            \
+        model_access(side, p, sizeof(*(p)), false);                         \
+    }                                                                       \
+    __atomic_load_n(p, __ATOMIC_ACQUIRE);                                   \
+})
+
+#define STORE(side, p, v) do {                                              \
+    if (model) {                                                            \
+        model_access(side, p, sizeof(*(p)), true);                          \
+    }                                                                       \
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);                               \
+} while (0)
+
+/* The state of both sides; each side only touches its own fields */
+typedef struct Ring {
+    bool packed;
+    unsigned int num;
+    uint8_t *mem;
+    size_t size;
+
+    /* split */
+    VRingDesc *desc;
+    uint16_t *avail_idx, *avail_ring;
+    uint16_t *used_idx;
+    VRingUsedElem *used_ring;
+
+    /* packed */
+    VRingPackedDesc *pdesc;
+
+    /* driver */
+    uint16_t drv_avail, drv_used;
+    bool drv_avail_wrap, drv_used_wrap;
+    uint16_t free_head, num_free;
+    uint16_t *next;                 /* free list of descriptors or ids */
+    uint16_t *ndescs;               /* per id */
+
+    /* device */
+    uint16_t dev_avail, dev_used, dev_pending;
+    bool dev_avail_wrap, dev_used_wrap;
+    uint16_t *pending_id;
+    uint16_t *dev_ndescs;           /* packed, per id */
+} Ring;
+
+static void ring_init(Ring *r, bool packed, unsigned int num)
+{
+    size_t used;
+    unsigned int i;
+
+    memset(r, 0, sizeof(*r));
+    r->packed = packed;
+    r->num = num;
+    if (packed) {
+        r->size = num * sizeof(VRingPackedDesc);
+    } else {
+        used = (num * sizeof(VRingDesc) + 4 + 2 * num + RING_ALIGN - 1) &
+               ~(size_t)(RING_ALIGN - 1);
+        r->size = used + 4 + num * sizeof(VRingUsedElem);
+    }
+    if (posix_memalign((void **)&r->mem, RING_ALIGN, r->size)) {
+        abort();
+    }
+    memset(r->mem, 0, r->size);
+
+    if (packed) {
+        r->pdesc = (VRingPackedDesc *)r->mem;
+    } else {
+        r->desc = (VRingDesc *)r->mem;
+        r->avail_idx = (uint16_t *)(r->mem + num * sizeof(VRingDesc) + 2);
+        r->avail_ring = r->avail_idx + 1;
+        r->used_idx = (uint16_t *)(r->mem + used + 2);
+        r->used_ring = (VRingUsedElem *)(r->mem + used + 4);
+    }
+
+    r->drv_avail_wrap = r->drv_used_wrap = true;
+    r->dev_avail_wrap = r->dev_used_wrap = true;
+    r->num_free = num;
+    r->next = calloc(num, sizeof(uint16_t));
+    r->ndescs = calloc(num, sizeof(uint16_t));
+    r->pending_id = calloc(num, sizeof(uint16_t));
+    r->dev_ndescs = calloc(num, sizeof(uint16_t));
+    for (i = 0; i < num; i++) {
+        r->next[i] = i + 1;
+    }
+
+    model_base = r->mem;
+    free(model_valid);
+    model_valid = calloc(r->size / CACHE_LINE + 1, 1);
+    memset(model_misses, 0, sizeof(model_misses));
+}
+
+static void ring_cleanup(Ring *r)
+{
+    free(r->mem);
+    free(r->next);
+    free(r->ndescs);
+    free(r->pending_id);
+    free(r->dev_ndescs);
+}
+
+/* Driver: makes a request of @n descriptors available */
+static bool driver_add(Ring *r, unsigned int n)
+{
+    uint16_t id, head_flags = 0;
+    unsigned int i;
+
+    if (r->num_free < n) {
+        return false;
+    }
+    id = r->free_head;
+
+    if (r->packed) {
+        unsigned int head = r->drv_avail;
+
+        r->free_head = r->next[id];
+        for (i = 0; i < n; i++) {
+            VRingPackedDesc *d = &r->pdesc[r->drv_avail];
+            uint16_t flags = (i + 1 < n ? VRING_DESC_F_NEXT : 0) |
+                             VRING_DESC_F_WRITE |
+                             (r->drv_avail_wrap ? VRING_PACKED_DESC_F_AVAIL
+                                                : VRING_PACKED_DESC_F_USED);
+
+            STORE(DRIVER, &d->addr, 0x100000 + id * 4096);
+            STORE(DRIVER, &d->len, 1500);
+            STORE(DRIVER, &d->id, id);
+            if (i) {
+                STORE(DRIVER, &d->flags, flags);
+            } else {
+                head_flags = flags;
+            }
+            if (++r->drv_avail == r->num) {
+                r->drv_avail = 0;
+                r->drv_avail_wrap = !r->drv_avail_wrap;
+            }
+        }
+        STORE(DRIVER, &r->pdesc[head].flags, head_flags);
+    } else {
+        uint16_t d = id;
+
+        for (i = 0; i < n; i++) {
+            STORE(DRIVER, &r->desc[d].addr, 0x100000 + d * 4096);
+            STORE(DRIVER, &r->desc[d].len, 1500);
+            STORE(DRIVER, &r->desc[d].flags, VRING_DESC_F_WRITE |
+                  (i + 1 < n ? VRING_DESC_F_NEXT : 0));
+            STORE(DRIVER, &r->desc[d].next, r->next[d]);
+            if (i + 1 < n) {
+                d = r->next[d];
+            }
+        }
+        r->free_head = r->next[d];
+        STORE(DRIVER, &r->avail_ring[r->drv_avail % r->num], id);
+        STORE(DRIVER, r->avail_idx, ++r->drv_avail);
+    }
+
+    r->ndescs[id] = n;
+    r->num_free -= n;
+    return true;
+}
+
+/* Driver: takes back a used request, returns false if there is none */
+static bool driver_get_used(Ring *r)
+{
+    uint16_t id;
+
+    if (r->packed) {
+        VRingPackedDesc *d = &r->pdesc[r->drv_used];
+        uint16_t flags = LOAD(DRIVER, &d->flags);
+
+        if (!!(flags & VRING_PACKED_DESC_F_AVAIL) != r->drv_used_wrap ||
+            !!(flags & VRING_PACKED_DESC_F_USED) != r->drv_used_wrap) {
+            return false;
+        }
+        id = LOAD(DRIVER, &d->id);
+        (void)LOAD(DRIVER, &d->len);
+        r->drv_used += r->ndescs[id];
+        if (r->drv_used >= r->num) {
+            r->drv_used -= r->num;
+            r->drv_used_wrap = !r->drv_used_wrap;
+        }
+        r->next[id] = r->free_head;
+        r->free_head = id;
+    } else {
+        VRingUsedElem *e;
+        uint16_t last;
+        unsigned int n;
+
+        if (LOAD(DRIVER, r->used_idx) == r->drv_used) {
+            return false;
+        }
+        e = &r->used_ring[r->drv_used % r->num];
+        r->drv_used++;
+        id = LOAD(DRIVER, &e->id);
+        (void)LOAD(DRIVER, &e->len);
+        /* The chain is still linked through next */
+        for (last = id, n = 1; n < r->ndescs[id]; n++) {
+            last = r->next[last];
+        }
+        r->next[last] = r->free_head;
+        r->free_head = id;
+    }
+    r->num_free += r->ndescs[id];
+    return true;
+}
+
+/* Device: reads the next available request, returns false if none */
+static bool device_pop(Ring *r)
+{
+    uint16_t id;
+
+    if (r->packed) {
+        VRingPackedDesc *d = &r->pdesc[r->dev_avail];
+        uint16_t flags = LOAD(DEVICE, &d->flags);
+        unsigned int n = 0;
+
+        if (!!(flags & VRING_PACKED_DESC_F_AVAIL) != r->dev_avail_wrap ||
+            !!(flags & VRING_PACKED_DESC_F_USED) == r->dev_avail_wrap) {
+            return false;
+        }
+        for (;;) {
+            d = &r->pdesc[r->dev_avail];
+            (void)LOAD(DEVICE, &d->addr);
+            (void)LOAD(DEVICE, &d->len);
+            id = LOAD(DEVICE, &d->id);
+            flags = LOAD(DEVICE, &d->flags);
+            n++;
+            if (++r->dev_avail == r->num) {
+                r->dev_avail = 0;
+                r->dev_avail_wrap = !r->dev_avail_wrap;
+            }
+            if (!(flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+        }
+        r->dev_ndescs[id] = n;
+    } else {
+        uint16_t i;
+
+        if (LOAD(DEVICE, r->avail_idx) == r->dev_avail) {
+            return false;
+        }
+        id = i = LOAD(DEVICE, &r->avail_ring[r->dev_avail % r->num]);
+        r->dev_avail++;
+        for (;;) {
+            uint16_t flags;
+
+            (void)LOAD(DEVICE, &r->desc[i].addr);
+            (void)LOAD(DEVICE, &r->desc[i].len);
+            flags = LOAD(DEVICE, &r->desc[i].flags);
+            if (!(flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            i = LOAD(DEVICE, &r->desc[i].next);
+        }
+    }
+    r->pending_id[r->dev_pending++] = id;
+    return true;
+}
+
+/* Device: returns all popped requests, like virtqueue_flush() */
+static void device_flush(Ring *r)
+{
+    unsigned int i;
+
+    if (!r->dev_pending) {
+        return;
+    }
+    if (r->packed) {
+        uint16_t first = r->dev_used, first_flags = 0;
+
+        for (i = 0; i < r->dev_pending; i++) {
+            VRingPackedDesc *d = &r->pdesc[r->dev_used];
+            uint16_t id = r->pending_id[i];
+            uint16_t flags = r->dev_used_wrap ?
+                VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+
+            STORE(DEVICE, &d->id, id);
+            STORE(DEVICE, &d->len, 1500);
+            if (i) {
+                STORE(DEVICE, &d->flags, flags);
+            } else {
+                first_flags = flags;
+            }
+            r->dev_used += r->dev_ndescs[id];
+            if (r->dev_used >= r->num) {
+                r->dev_used -= r->num;
+                r->dev_used_wrap = !r->dev_used_wrap;
+            }
+        }
+        STORE(DEVICE, &r->pdesc[first].flags, first_flags);
+    } else {
+        for (i = 0; i < r->dev_pending; i++) {
+            VRingUsedElem *e = &r->used_ring[(r->dev_used + i) % r->num];
+
+            STORE(DEVICE, &e->id, r->pending_id[i]);
+            STORE(DEVICE, &e->len, 1500);
+        }
+        r->dev_used += r->dev_pending;
+        STORE(DEVICE, r->used_idx, r->dev_used);
+    }
+    r->dev_pending = 0;
+}
+
+typedef struct Params {
+    uint64_t requests;
+    unsigned int num;
+    unsigned int batch;
+    unsigned int descs;
+} Params;
+
+/* Single thread, cache model: the sides take turns batch by batch */
+static void run_model(Ring *r, const Params *p, double misses[SIDES])
+{
+    uint64_t added = 0, done = 0;
+    unsigned int i;
+
+    model = true;
+    while (done < p->requests) {
+        for (i = 0; i < p->batch && added < p->requests; i++) {
+            if (!driver_add(r, p->descs)) {
+                break;
+            }
+            added++;
+        }
+        while (device_pop(r)) {
+            /* all that is there */
+        }
+        device_flush(r);
+        while (driver_get_used(r)) {
+            done++;
+        }
+    }
+    model = false;
+
+    for (i = 0; i < SIDES; i++) {
+        misses[i] = (double)model_misses[i] / p->requests;
+    }
+}
+
+/* Two threads, hardware counters */
+typedef struct Side {
+    Ring *r;
+    const Params *p;
+    pthread_barrier_t *barrier;
+    volatile bool *stop;
+    int fd;
+    uint64_t misses;
+} Side;
+
+static int perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void side_start(Side *s)
+{
+    s->fd = perf_open();
+    pthread_barrier_wait(s->barrier);
+    if (s->fd >= 0) {
+        ioctl(s->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void side_stop(Side *s)
+{
+    if (s->fd >= 0) {
+        ioctl(s->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(s->fd, &s->misses, sizeof(s->misses)) != sizeof(s->misses)) {
+            s->misses = 0;
+        }
+        close(s->fd);
+    }
+}
+
+static void *driver_thread(void *opaque)
+{
+    Side *s = opaque;
+    uint64_t added = 0, done = 0;
+    bool progress;
+
+    side_start(s);
+    while (done < s->p->requests) {
+        progress = false;
+        while (added < s->p->requests && driver_add(s->r, s->p->descs)) {
+            added++;
+            progress = true;
+        }
+        while (driver_get_used(s->r)) {
+            done++;
+            progress = true;
+        }
+        if (!progress) {
+            sched_yield();
+        }
+    }
+    *s->stop = true;
+    side_stop(s);
+    return NULL;
+}
+
+static void *device_thread(void *opaque)
+{
+    Side *s = opaque;
+    unsigned int i;
+
+    side_start(s);
+    while (!*s->stop) {
+        for (i = 0; i < s->p->batch && device_pop(s->r); i++) {
+            /* up to a batch */
+        }
+        if (i) {
+            device_flush(s->r);
+        } else {
+            sched_yield();
+        }
+    }
+    side_stop(s);
+    return NULL;
+}
+
+static bool run_threads(Ring *r, const Params *p, double misses[SIDES],
+                        double *ns)
+{
+    pthread_barrier_t barrier;
+    volatile bool stop = false;
+    Side sides[SIDES];
+    pthread_t threads[SIDES];
+    struct timespec start, end;
+    int i;
+
+    pthread_barrier_init(&barrier, NULL, SIDES + 1);
+    for (i = 0; i < SIDES; i++) {
+        sides[i] = (Side) { .r = r, .p = p, .barrier = &barrier,
+                            .stop = &stop, .fd = -1 };
+    }
+    pthread_create(&threads[DRIVER], NULL, driver_thread, &sides[DRIVER]);
+    pthread_create(&threads[DEVICE], NULL, device_thread, &sides[DEVICE]);
+    pthread_barrier_wait(&barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < SIDES; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&barrier);
+
+    *ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+           (end.tv_nsec - start.tv_nsec)) / p->requests;
+    for (i = 0; i < SIDES; i++) {
+        if (sides[i].fd < 0) {
+            return false;
+        }
+        misses[i] = (double)sides[i].misses / p->requests;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Params p = { .requests = 1000000, .num = 256, .batch = 32, .descs = 1 };
+    bool threads = false;
+    int c, layout;
+
+    while ((c = getopt(argc, argv, "tn:q:b:d:")) != -1) {
+        switch (c) {
+        case 't':
+            threads = true;
+            break;
+        case 'n':
+            p.requests = strtoull(optarg, NULL, 0);
+            break;
+        case 'q':
+            p.num = atoi(optarg);
+            break;
+        case 'b':
+            p.batch = atoi(optarg);
+            break;
+        case 'd':
+            p.descs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-n requests] [-q ring-size] "
+                    "[-b batch] [-d descs-per-request]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!p.requests || !p.batch || !p.descs || p.num < p.descs ||
+        p.num > 32768 || (p.num & (p.num - 1))) {
+        fprintf(stderr, "invalid parameters\n");
+        return 1;
+    }
+
+    printf("%s, ring size %u, batch %u, %u descriptor(s) per request\n",
+           threads ? "two threads, hardware cache misses" :
+                     "cache model, coherence misses",
+           p.num, p.batch, p.descs);
+    for (layout = 0; layout < 2; layout++) {
+        double misses[SIDES], ns = 0;
+        Ring r;
+
+        ring_init(&r, layout, p.num);
+        if (!threads) {
+            run_model(&r, &p, misses);
+        } else if (!run_threads(&r, &p, misses, &ns)) {
+            printf("%-7s %8.1f ns/request, no hardware cache miss counter\n",
+                   layout ? "packed" : "split", ns);
+            ring_cleanup(&r);
+            continue;
+        }
+        printf("%-7s driver %6.3f device %6.3f total %6.3f misses/request",
+               layout ? "packed" : "split", misses[DRIVER], misses[DEVICE],
+               misses[DRIVER] + misses[DEVICE]);
+        if (threads) {
+            printf(" %8.1f ns/request", ns);
+        }
+        printf("\n");
+        ring_cleanup(&r);
+    }
+    return 0;
+}
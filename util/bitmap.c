@@ -177,6 +177,43 @@ void bitmap_set(unsigned long *map, long start, long nr)
     }
 }
 
+void bitmap_set_atomic(unsigned long *map, long start, long nr)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    const long size = start + nr;
+    int bits_to_set = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask_to_set = BITMAP_FIRST_WORD_MASK(start);
+
+    /* First word */
+    if (nr - bits_to_set > 0) {
+        atomic_or(p, mask_to_set);
+        nr -= bits_to_set;
+        bits_to_set = BITS_PER_LONG;
+        mask_to_set = ~0UL;
+        p++;
+    }
+
+    /* Full words */
+    if (bits_to_set == BITS_PER_LONG) {
+        while (nr >= BITS_PER_LONG) {
+            *p = ~0UL;
+            nr -= BITS_PER_LONG;
+            p++;
+        }
+    }
+
+    /* Last word */
+    if (nr) {
+        mask_to_set &= BITMAP_LAST_WORD_MASK(size);
+        atomic_or(p, mask_to_set);
+    } else {
+        /* If we avoided the full barrier in atomic_or(), issue a
+         * barrier to account for the assignments in the while loop.
+         */
+        smp_mb();
+    }
+}
+
 void bitmap_clear(unsigned long *map, long start, long nr)
 {
     unsigned long *p = map + BIT_WORD(start);
@@ -197,6 +234,96 @@ void bitmap_clear(unsigned long *map, long start, long nr)
     }
 }
 
+bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    const long size = start + nr;
+    int bits_to_clear = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask_to_clear = BITMAP_FIRST_WORD_MASK(start);
+    unsigned long dirty = 0;
+    unsigned long old_bits;
+
+    /* First word */
+    if (nr - bits_to_clear > 0) {
+        old_bits = atomic_fetch_and(p, ~mask_to_clear);
+        dirty |= old_bits & mask_to_clear;
+        nr -= bits_to_clear;
+        bits_to_clear = BITS_PER_LONG;
+        mask_to_clear = ~0UL;
+        p++;
+    }
+
+    /* Full words */
+    if (bits_to_clear == BITS_PER_LONG) {
+        while (nr >= BITS_PER_LONG) {
+            if (*p) {
+                old_bits = atomic_xchg(p, 0);
+                dirty |= old_bits;
+            }
+            nr -= BITS_PER_LONG;
+            p++;
+        }
+    }
+
+    /* Last word */
+    if (nr) {
+        mask_to_clear &= BITMAP_LAST_WORD_MASK(size);
+        old_bits = atomic_fetch_and(p, ~mask_to_clear);
+        dirty |= old_bits & mask_to_clear;
+    } else {
+        if (!dirty) {
+            smp_mb();
+        }
+    }
+
+    return dirty != 0;
+}
+
+/*
+ * Ors the bits of @src in [@start, @start + @nr) into @dst and clears them
+ * in @src, a word at a time.  Only @src is accessed atomically, so other
+ * threads may keep setting bits in it.  Returns the number of bits that
+ * were not set in @dst before; *@cleared tells whether any bit was cleared
+ * in @src, even one that was already set in @dst.
+ */
+long bitmap_sync_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                  long start, long nr, bool *cleared)
+{
+    long first, last, k;
+    long count = 0;
+
+    *cleared = false;
+    if (nr <= 0) {
+        return 0;
+    }
+
+    first = BIT_WORD(start);
+    last = BIT_WORD(start + nr - 1);
+    for (k = first; k <= last; k++) {
+        unsigned long mask = ~0UL;
+        unsigned long bits;
+
+        if (k == first) {
+            mask &= BITMAP_FIRST_WORD_MASK(start);
+        }
+        if (k == last) {
+            mask &= BITMAP_LAST_WORD_MASK(start + nr);
+        }
+        if (!(atomic_read(&src[k]) & mask)) {
+            continue;
+        }
+        if (mask == ~0UL) {
+            bits = atomic_xchg(&src[k], 0);
+        } else {
+            bits = atomic_fetch_and(&src[k], ~mask) & mask;
+        }
+        count += ctpopl(bits & ~dst[k]);
+        dst[k] |= bits;
+        *cleared = true;
+    }
+    return count;
+}
+
 #define ALIGN_MASK(x,mask)      (((x)+(mask))&~(mask))
 
 /**
@@ -54,6 +54,99 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field)
     return base_addr;
 }
 
+/* Arrays of plain integers are transferred in bulk: one buffer copy and
+ * an in-place byte swap instead of a VMStateInfo callback per element.
+ * Returns the element size if @info is one of the plain integer types
+ * handled this way, or 0 otherwise.
+ */
+static size_t vmstate_bulk_elem_size(const VMStateInfo *info)
+{
+    if (info == &vmstate_info_int8 || info == &vmstate_info_uint8) {
+        return 1;
+    } else if (info == &vmstate_info_int16 || info == &vmstate_info_uint16) {
+        return 2;
+    } else if (info == &vmstate_info_int32 || info == &vmstate_info_uint32) {
+        return 4;
+    } else if (info == &vmstate_info_int64 || info == &vmstate_info_uint64) {
+        return 8;
+    }
+    return 0;
+}
+
+static bool vmstate_can_bulk(VMStateField *field, int n_elems, int size)
+{
+    return n_elems > 1 &&
+           !(field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER)) &&
+           vmstate_bulk_elem_size(field->info) == size;
+}
+
+static void vmstate_bulk_to_be(uint8_t *dst, const uint8_t *src, int n_elems,
+                               int size)
+{
+    int i;
+
+    for (i = 0; i < n_elems; i++) {
+        switch (size) {
+        case 2:
+            stw_be_p(dst + i * 2, *(uint16_t *)(src + i * 2));
+            break;
+        case 4:
+            stl_be_p(dst + i * 4, *(uint32_t *)(src + i * 4));
+            break;
+        case 8:
+            stq_be_p(dst + i * 8, *(uint64_t *)(src + i * 8));
+            break;
+        }
+    }
+}
+
+static void vmstate_bulk_from_be(uint8_t *buf, int n_elems, int size)
+{
+    int i;
+
+    for (i = 0; i < n_elems; i++) {
+        switch (size) {
+        case 2:
+            *(uint16_t *)(buf + i * 2) = lduw_be_p(buf + i * 2);
+            break;
+        case 4:
+            *(uint32_t *)(buf + i * 4) = ldl_be_p(buf + i * 4);
+            break;
+        case 8:
+            *(uint64_t *)(buf + i * 8) = ldq_be_p(buf + i * 8);
+            break;
+        }
+    }
+}
+
+static void vmstate_put_bulk(QEMUFile *f, void *base_addr, int n_elems,
+                             int size)
+{
+    uint8_t buf[512];
+    int chunk = sizeof(buf) / size;
+    int i, n;
+
+    if (size == 1) {
+        qemu_put_buffer(f, base_addr, n_elems);
+        return;
+    }
+
+    for (i = 0; i < n_elems; i += n) {
+        n = MIN(chunk, n_elems - i);
+        vmstate_bulk_to_be(buf, base_addr + i * size, n, size);
+        qemu_put_buffer(f, buf, n * size);
+    }
+}
+
+static void vmstate_get_bulk(QEMUFile *f, void *base_addr, int n_elems,
+                             int size)
+{
+    qemu_get_buffer(f, base_addr, n_elems * size);
+    if (size > 1) {
+        vmstate_bulk_from_be(base_addr, n_elems, size);
+    }
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
@@ -85,6 +178,11 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
 
+            if (vmstate_can_bulk(field, n_elems, size)) {
+                vmstate_get_bulk(f, base_addr, n_elems, size);
+                field++;
+                continue;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -135,6 +233,11 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
 
+            if (vmstate_can_bulk(field, n_elems, size)) {
+                vmstate_put_bulk(f, base_addr, n_elems, size);
+                field++;
+                continue;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -23,6 +23,10 @@
 
   length = uleb128 encoded integer
  */
+
+/* Unchanged data is skipped this many bytes at a time */
+#define XBZRLE_VECTOR_STRIDE ((int)(4 * sizeof(VECTYPE)))
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
@@ -48,6 +52,25 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             res--;
         }
 
+        /* several vectors at a time while both buffers are vector aligned */
+        if (!res && !(((uintptr_t)(old_buf + i) | (uintptr_t)(new_buf + i)) %
+                      sizeof(VECTYPE))) {
+            const VECTYPE zero = (VECTYPE){0};
+
+            while (slen - i >= XBZRLE_VECTOR_STRIDE) {
+                const VECTYPE *o = (const VECTYPE *)(old_buf + i);
+                const VECTYPE *n = (const VECTYPE *)(new_buf + i);
+                VECTYPE diff = (o[0] ^ n[0]) | (o[1] ^ n[1]) |
+                               (o[2] ^ n[2]) | (o[3] ^ n[3]);
+
+                if (!ALL_EQ(diff, zero)) {
+                    break;
+                }
+                i += XBZRLE_VECTOR_STRIDE;
+                zrun_len += XBZRLE_VECTOR_STRIDE;
+            }
+        }
+
         /* word at a time for speed */
         if (!res) {
             while (i < slen &&